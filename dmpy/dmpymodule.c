@@ -20,10 +20,19 @@
 
 #include "Python.h"
 #include "structmember.h"
+#include "pythread.h"
 #include "libdevmapper.h"
 #include "sys/types.h"
 #include "stdint.h"
 #include "string.h"
+#include "time.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "sys/eventfd.h"
+#include "sys/ioctl.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "pthread.h"
 
 /* DM_{NAME,UUID}_LEN */
 #include <linux/dm-ioctl.h>
@@ -38,6 +47,19 @@
 #define MINOR(dev)      ((dev & 0xff) | ((dev >> 12) & 0xfff00))
 #define MKDEV(ma,mi)    ((mi & 0xff) | (ma << 8) | ((mi & ~0xff) << 12))
 
+#if PY_VERSION_HEX < 0x030A0000
+#error "dmpy requires Python 3.10 or later."
+#endif
+
+/*
+ * Critical sections lock an object on free-threaded builds of CPython,
+ * and are no-ops where the GIL already serialises access.
+ */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
 #define DMPY_DEBUG 1
 
 #ifdef DMPY_DEBUG
@@ -46,12 +68,112 @@
     #define dmpy_debug(x...)
 #endif
 
+/*
+ * Call-site profiling.
+ *
+ * Building with -DDMPY_PROFILE (DMPY_PROFILE=1 python setup.py build)
+ * compiles in counters at the call sites of the region and area caches,
+ * the DmStatsRegion and DmStatsArea sequence checks and the area
+ * getters. DMPY_PROFILE_SCOPE(name), placed after the declarations of a
+ * function, counts each call and the clock ticks spent until it returns;
+ * DMPY_PROFILE_COUNT(name) counts an event. Without DMPY_PROFILE both
+ * expand to nothing.
+ *
+ * When built in, collection is started by dmpy.profile_enable() and the
+ * disabled cost is a flag test at each site. Each site is a static
+ * dmpy_profile_site that is linked into _dmpy_profile_sites the first
+ * time it records, and is never unlinked: counters are updated with
+ * relaxed atomics, so that sites may be reached without the GIL or on
+ * free-threaded builds, and are shared by every interpreter. Ticks are
+ * TSC cycles on x86, and nanoseconds elsewhere.
+ */
+#ifdef DMPY_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define DMPY_PROFILE_CLOCK "tsc"
+#define _dmpy_profile_clock() __rdtsc()
+#else
+#define DMPY_PROFILE_CLOCK "ns"
+static uint64_t
+_dmpy_profile_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+struct dmpy_profile_site {
+    const char *name;
+    uint64_t calls;
+    uint64_t cycles;
+    int linked;
+    struct dmpy_profile_site *next;
+};
+
+struct dmpy_profile_scope {
+    struct dmpy_profile_site *site;
+    uint64_t start;
+};
+
+static struct dmpy_profile_site *_dmpy_profile_sites = NULL;
+static int _dmpy_profile_enabled = 0;
+
+static void
+_dmpy_profile_record(struct dmpy_profile_site *site, uint64_t cycles)
+{
+    struct dmpy_profile_site *head;
+
+    if (!__atomic_exchange_n(&site->linked, 1, __ATOMIC_ACQ_REL)) {
+        head = __atomic_load_n(&_dmpy_profile_sites, __ATOMIC_RELAXED);
+        do {
+            site->next = head;
+        } while (!__atomic_compare_exchange_n(&_dmpy_profile_sites, &head,
+                                              site, 1, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+    }
+    __atomic_fetch_add(&site->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->cycles, cycles, __ATOMIC_RELAXED);
+}
+
+/* Cleanup handler for DMPY_PROFILE_SCOPE(): runs as the scope exits. */
+static inline void
+_dmpy_profile_scope_end(struct dmpy_profile_scope *scope)
+{
+    if (scope->start)
+        _dmpy_profile_record(scope->site,
+                             _dmpy_profile_clock() - scope->start);
+}
+
+#define DMPY_PROFILE_SCOPE(name)                                             \
+    static struct dmpy_profile_site _dmpy_profile_site = { name };           \
+    struct dmpy_profile_scope _dmpy_profile_scope                            \
+        __attribute__((cleanup(_dmpy_profile_scope_end))) = {                \
+        &_dmpy_profile_site,                                                 \
+        _dmpy_profile_enabled ? _dmpy_profile_clock() : 0                    \
+    }
+
+#define DMPY_PROFILE_COUNT(name)                                             \
+do {                                                                         \
+    static struct dmpy_profile_site _dmpy_profile_event = { name };          \
+    if (_dmpy_profile_enabled)                                               \
+        _dmpy_profile_record(&_dmpy_profile_event, 0);                       \
+} while (0)
+#else
+#define DMPY_PROFILE_SCOPE(name)
+#define DMPY_PROFILE_COUNT(name) do { } while (0)
+#endif
+
 #define NSEC_PER_USEC   1000L
 #define NSEC_PER_MSEC   1000000L
 #define NSEC_PER_SEC    1000000000L
 
 #define FMTu64 "%" PRIu64
 
+/* Default render_openmetrics() metric name prefix */
+#define DMPY_OPENMETRICS_PREFIX "dmstats_"
+
 PyDoc_STRVAR(dmpy__doc__,
 "dmpy is a set of Python bindings for the device-mapper library.\n");
 
@@ -78,24 +200,547 @@ static const char *_dm_task_type_names[] = {
     "DM_DEVICE_SET_GEOMETRY"
 };
 
-/* Dm objects */
+/*
+ * Per-interpreter module state.
+ *
+ * Every dmpy type is a heap type created by dmpy_exec() from the spec
+ * following its methods, so that each interpreter importing the module
+ * gets its own types, exception and caches. Code holding a dmpy object
+ * finds the state through the object's type with DMPY_STATE(); module
+ * level functions are passed the module itself.
+ */
+typedef struct {
+    PyObject *DmError;
+    PyTypeObject *DmTimestamp_Type;
+    PyTypeObject *DmCookie_Type;
+    PyTypeObject *DmInfo_Type;
+    PyTypeObject *DmTaskTargetIterator_Type;
+    PyTypeObject *DmTask_Type;
+    PyTypeObject *DmEventMonitor_Type;
+    PyTypeObject *DmDeviceList_Type;
+    PyTypeObject *DmStats_Type;
+    PyTypeObject *DmStatsRegion_Type;
+    PyTypeObject *DmStatsArea_Type;
+    PyTypeObject *DmStatsIterator_Type;
+    PyTypeObject *DmStatsCounters_Type;
+    PyTypeObject *DmStatsMetrics_Type;
+    PyTypeObject *DmStatsGroup_Type;
+    PyTypeObject *DmStatsSnapshot_Type;
+    PyTypeObject *DmStatsSnapshotRegion_Type;
+    PyTypeObject *DmStatsSnapshotArea_Type;
+    PyTypeObject *DmStatsSampler_Type;
+    PyTypeObject *DmStatsRing_Type;
+    PyTypeObject *DmHistogram_Type;
+    PyTypeObject *DmTransaction_Type;
+    PyTypeObject *DmTree_Type;
+    PyTypeObject *DmTreeNode_Type;
+    /* device resolution cache: see _dmpy_dev_cache_get() */
+    PyThread_type_lock dev_cache_lock;
+    PyObject *dev_cache;
+    uint64_t dev_cache_gen;
+    int dev_cache_fd;
+    /* event loops with outstanding DmCookie.wait_async() waits */
+    PyObject *udev_loops;
+} dmpy_state;
+
+static struct PyModuleDef dmpymodule;
+
+static dmpy_state *
+_dmpy_get_state(PyObject *module)
+{
+    return (dmpy_state *) PyModule_GetState(module);
+}
+
+/*
+ * Return the state of the module that created type or its nearest dmpy
+ * base class. Objects of dmpy types always have one.
+ */
+static dmpy_state *
+_dmpy_state_by_type(PyTypeObject *type)
+{
+    PyObject *module;
+#if PY_VERSION_HEX >= 0x030B0000
+    module = PyType_GetModuleByDef(type, &dmpymodule);
+#else
+    PyObject *mro = type->tp_mro;
+    Py_ssize_t i;
+
+    for (i = 0, module = NULL; !module && (i < PyTuple_GET_SIZE(mro)); i++) {
+        PyTypeObject *base = (PyTypeObject *) PyTuple_GET_ITEM(mro, i);
+
+        if (!(base->tp_flags & Py_TPFLAGS_HEAPTYPE))
+            continue;
+        module = ((PyHeapTypeObject *) base)->ht_module;
+        if (module && (PyModule_GetDef(module) != &dmpymodule))
+            module = NULL;
+    }
+    if (!module)
+        PyErr_Format(PyExc_TypeError, "'%s' is not a dmpy type.",
+                     type->tp_name);
+#endif
+    return module ? _dmpy_get_state(module) : NULL;
+}
+
+#define DMPY_STATE(o) _dmpy_state_by_type(Py_TYPE(o))
+
+/*
+ * Return a new reference to the referent of the weak reference ref, or
+ * NULL if it has expired. Unlike PyWeakref_GetObject() this is safe on
+ * free-threaded builds, where the referent may die in another thread.
+ */
+static PyObject *
+_dmpy_weakref_get(PyObject *ref)
+{
+    PyObject *obj;
+#if PY_VERSION_HEX >= 0x030D0000
+    if (PyWeakref_GetRef(ref, &obj) < 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+#else
+    obj = PyWeakref_GetObject(ref);
+    if (obj == Py_None)
+        return NULL;
+    Py_INCREF(obj);
+#endif
+    return obj;
+}
+
+/*
+ * A weak reference cache slot: return a new reference to the live object
+ * cached in *slot, or NULL (dropping any expired reference) if there is
+ * none. Must be called in a critical section on the owner of the cache.
+ */
+static PyObject *
+_dmpy_cache_get(PyObject **slot)
+{
+    PyObject *obj;
+
+    if (!*slot)
+        return NULL;
+    if (!(obj = _dmpy_weakref_get(*slot))) {
+        DMPY_PROFILE_COUNT("weakref.expired");
+        Py_CLEAR(*slot);
+    }
+    return obj;
+}
+
+/*
+ * Cache *obj, a new object created after a miss in _dmpy_cache_get(), in
+ * *slot. If another thread has cached a live object in the meantime that
+ * object is returned in *obj instead, so that all threads see the same
+ * one. Must be called in a critical section on the owner of the cache.
+ */
+static void
+_dmpy_cache_set(PyObject **slot, PyObject **obj)
+{
+    PyObject *cached;
+
+    if ((cached = _dmpy_cache_get(slot))) {
+        Py_SETREF(*obj, cached);
+        return;
+    }
+    if (!(*slot = PyWeakref_NewRef(*obj, NULL)))
+        PyErr_Clear();
+}
+
+static uint64_t
+_dmpy_monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * ioctl instrumentation.
+ *
+ * When enabled by dmpy.enable_ioctl_stats(), each library call that
+ * issues ioctls is timed and counted in _dmpy_ioctl_stats: DmTask runs
+ * are indexed by task type, following _dm_task_type_names, and the
+ * DmStats list, populate, create_region and delete_region calls have
+ * rows of their own after the task types. Each row records the number
+ * of calls and errors, the total time, and a log2 histogram of call
+ * latency: bin i counts calls taking [2^i, 2^(i+1)) ns, and the last bin
+ * also counts anything slower.
+ *
+ * Start times are taken with the GIL released and are zero when stats
+ * are disabled, so the disabled cost is a flag test on each side of the
+ * call. The table is shared by every interpreter in the process, and rows
+ * are only read or updated with _dmpy_ioctl_stats_lock held.
+ */
+#define DMPY_NR_TASK_TYPES \
+    ((int) (sizeof(_dm_task_type_names) / sizeof(_dm_task_type_names[0])))
+
+#define DMPY_IOCTL_STATS_LIST       (DMPY_NR_TASK_TYPES + 0)
+#define DMPY_IOCTL_STATS_POPULATE   (DMPY_NR_TASK_TYPES + 1)
+#define DMPY_IOCTL_STATS_CREATE     (DMPY_NR_TASK_TYPES + 2)
+#define DMPY_IOCTL_STATS_DELETE     (DMPY_NR_TASK_TYPES + 3)
+#define DMPY_NR_IOCTL_STATS         (DMPY_NR_TASK_TYPES + 4)
+
+static const char *_dmpy_ioctl_stats_names[] = {
+    "stats_list",
+    "stats_populate",
+    "stats_create_region",
+    "stats_delete_region"
+};
+
+#define DMPY_IOCTL_HIST_BINS 40
+
+struct dmpy_ioctl_stat {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t hist[DMPY_IOCTL_HIST_BINS];
+};
+
+static struct dmpy_ioctl_stat _dmpy_ioctl_stats[DMPY_NR_IOCTL_STATS];
+static int _dmpy_ioctl_stats_enabled = 0;
+static PyThread_type_lock _dmpy_ioctl_stats_lock = NULL;
+
+/*
+ * Return the start time of a call to be recorded, or 0 if ioctl stats
+ * are disabled. May be called without the GIL.
+ */
+static uint64_t
+_dmpy_ioctl_start(void)
+{
+    return _dmpy_ioctl_stats_enabled ? _dmpy_monotonic_ns() : 0;
+}
+
+/*
+ * Return the time elapsed since start_ns, or UINT64_MAX if the call was
+ * not timed. May be called without the GIL.
+ */
+static uint64_t
+_dmpy_ioctl_elapsed(uint64_t start_ns)
+{
+    return start_ns ? _dmpy_monotonic_ns() - start_ns : UINT64_MAX;
+}
+
+/*
+ * Record a call that took elapsed_ns in row index.
+ */
+static void
+_dmpy_ioctl_record(int index, uint64_t elapsed_ns, int ok)
+{
+    struct dmpy_ioctl_stat *stat = &_dmpy_ioctl_stats[index];
+    int bin = 0;
+
+    if (elapsed_ns == UINT64_MAX || index < 0 || index >= DMPY_NR_IOCTL_STATS)
+        return;
+
+    if (elapsed_ns)
+        bin = 63 - __builtin_clzll(elapsed_ns);
+    if (bin >= DMPY_IOCTL_HIST_BINS)
+        bin = DMPY_IOCTL_HIST_BINS - 1;
+
+    PyThread_acquire_lock(_dmpy_ioctl_stats_lock, WAIT_LOCK);
+    stat->calls++;
+    stat->errors += !ok;
+    stat->total_ns += elapsed_ns;
+    stat->hist[bin]++;
+    PyThread_release_lock(_dmpy_ioctl_stats_lock);
+}
+
+/*
+ * Blocking libdevmapper calls (ioctls, udev semaphore waits) are made with
+ * the interpreter lock released. The library itself keeps some global state
+ * that is not safe for concurrent use: the stack of pending /dev node
+ * operations that is modified by node-changing ioctls and drained by
+ * dm_udev_wait(), and the lazily opened control device. Calls that touch
+ * this state are serialised by `_dmpy_node_lock`; all other ioctls may run
+ * in parallel from different Python threads.
+ */
+static PyThread_type_lock _dmpy_node_lock = NULL;
+
+/* Set once the control device has been opened by a successful ioctl. */
+static int _dmpy_control_ready = 0;
+
+/* Acquire the node lock: must be called with the GIL released. */
+#define DMPY_NODE_LOCK(needed)                                  \
+do {                                                            \
+    if ((needed))                                               \
+        PyThread_acquire_lock(_dmpy_node_lock, WAIT_LOCK);      \
+} while (0)
+
+#define DMPY_NODE_UNLOCK(needed)                                \
+do {                                                            \
+    if ((needed))                                               \
+        PyThread_release_lock(_dmpy_node_lock);                 \
+} while (0)
+
+/*
+ * Objects that release the GIL around a blocking call are marked busy for
+ * its duration. Using a busy object from another thread raises RuntimeError
+ * rather than racing the library for the object's state.
+ */
+#define DMPY_BUSY_CHECK(busy, type_name, ret)                           \
+do {                                                                    \
+    if ((busy)) {                                                       \
+        PyErr_SetString(PyExc_RuntimeError, type_name " object is in "  \
+                        "use by another thread.");                      \
+        return ret;                                                     \
+    }                                                                   \
+} while (0)
+
+/*
+ * Set the busy flag of an object before releasing the GIL, raising
+ * RuntimeError if another thread has set it first. The flag is tested
+ * and set in one step: without a GIL two threads could otherwise both
+ * pass DMPY_BUSY_CHECK() and run the same object at once.
+ */
+static int
+_dmpy_busy_claim(int *busy, const char *type_name)
+{
+    if (__atomic_exchange_n(busy, 1, __ATOMIC_ACQUIRE)) {
+        PyErr_Format(PyExc_RuntimeError, "%s object is in use by another "
+                     "thread.", type_name);
+        return -1;
+    }
+    return 0;
+}
+
+#define DMPY_BUSY_CLAIM(busy, type_name, ret)                           \
+do {                                                                    \
+    if (_dmpy_busy_claim(&(busy), type_name))                           \
+        return ret;                                                     \
+} while (0)
+
+/*
+ * METH_FASTCALL argument parsing.
+ *
+ * The DmTask and DmStats methods are called once per device or region
+ * on every collection pass, and PyArg_ParseTuple() would build an
+ * argument tuple (and keyword dict) for each call. They are METH_O or
+ * METH_FASTCALL methods instead: _dmpy_parse_args() binds the vector of
+ * arguments to the parameters named in kwlist, and the converters below
+ * stand in for the PyArg_Parse*() format units of the same name.
+ */
+
+/*
+ * Bind the nargs positional arguments in args, and the keyword arguments
+ * named by kwnames that follow them, to the parameters of fname named in
+ * the NULL terminated kwlist. A borrowed reference to each argument is
+ * stored in argv, or NULL for an omitted parameter: the first nr_required
+ * parameters may not be omitted. Pass NULL kwnames for a method without
+ * METH_KEYWORDS. Returns 0 on success, or -1 with TypeError set.
+ */
+static int
+_dmpy_parse_args(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+                 PyObject *kwnames, const char *const *kwlist,
+                 Py_ssize_t nr_required, PyObject **argv)
+{
+    Py_ssize_t i, j, nr_params, nr_kwargs;
+    const char *name;
+
+    for (nr_params = 0; kwlist[nr_params]; nr_params++)
+        argv[nr_params] = NULL;
+
+    if (nargs > nr_params) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd argument%s "
+                     "(%zd given)", fname, nr_params,
+                     (nr_params == 1) ? "" : "s", nargs);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++)
+        argv[i] = args[i];
+
+    nr_kwargs = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (i = 0; i < nr_kwargs; i++) {
+        if (!(name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(kwnames, i))))
+            return -1;
+        for (j = 0; kwlist[j] && strcmp(kwlist[j], name); j++)
+            ;
+        if (!kwlist[j]) {
+            PyErr_Format(PyExc_TypeError, "'%s' is an invalid keyword "
+                         "argument for %s()", name, fname);
+            return -1;
+        }
+        if (argv[j]) {
+            PyErr_Format(PyExc_TypeError, "argument for %s() given by name "
+                         "('%s') and position (%zd)", fname, name, j + 1);
+            return -1;
+        }
+        argv[j] = args[nargs + i];
+    }
+
+    for (i = 0; i < nr_required; i++) {
+        if (!argv[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument "
+                         "'%s' (pos %zd)", fname, kwlist[i], i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Converters for the arguments bound by _dmpy_parse_args(), usable with
+ * the "O&" format unit. Each leaves the value unchanged and succeeds for
+ * a NULL (omitted) argument, so that optional parameters keep their
+ * defaults. They return 1 on success, or 0 with an exception set.
+ */
+
+/* "s": a str without embedded nulls, as UTF-8. */
+static int
+_dmpy_str_converter(PyObject *o, void *p)
+{
+    const char *str;
+    Py_ssize_t len;
+
+    if (!o)
+        return 1;
+    if (!PyUnicode_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "argument must be str, not %.50s",
+                     Py_TYPE(o)->tp_name);
+        return 0;
+    }
+    if (!(str = PyUnicode_AsUTF8AndSize(o, &len)))
+        return 0;
+    if (strlen(str) != (size_t) len) {
+        PyErr_SetString(PyExc_ValueError, "embedded null character");
+        return 0;
+    }
+    *(const char **) p = str;
+    return 1;
+}
+
+/* "z": as "s", or None for NULL. */
+static int
+_dmpy_str_or_none_converter(PyObject *o, void *p)
+{
+    if (o == Py_None) {
+        *(const char **) p = NULL;
+        return 1;
+    }
+    return _dmpy_str_converter(o, p);
+}
+
+/* "i": an int that fits a C int. */
+static int
+_dmpy_int_converter(PyObject *o, void *p)
+{
+    long value;
+
+    if (!o)
+        return 1;
+    if (((value = PyLong_AsLong(o)) == -1) && PyErr_Occurred())
+        return 0;
+    if ((value < INT_MIN) || (value > INT_MAX)) {
+        PyErr_SetString(PyExc_OverflowError, (value < 0)
+                        ? "signed integer is less than minimum"
+                        : "signed integer is greater than maximum");
+        return 0;
+    }
+    *(int *) p = (int) value;
+    return 1;
+}
+
+/* "l": an int that fits a C long. */
+static int
+_dmpy_long_converter(PyObject *o, void *p)
+{
+    long value;
+
+    if (!o)
+        return 1;
+    if (((value = PyLong_AsLong(o)) == -1) && PyErr_Occurred())
+        return 0;
+    *(long *) p = value;
+    return 1;
+}
+
+/* "L": an int that fits a C long long. */
+static int
+_dmpy_longlong_converter(PyObject *o, void *p)
+{
+    long long value;
+
+    if (!o)
+        return 1;
+    if (((value = PyLong_AsLongLong(o)) == -1) && PyErr_Occurred())
+        return 0;
+    *(long long *) p = value;
+    return 1;
+}
+
+/* "K": an int, truncated to an unsigned long long. */
+static int
+_dmpy_ulonglong_mask_converter(PyObject *o, void *p)
+{
+    unsigned long long value;
+
+    if (!o)
+        return 1;
+    if (!PyLong_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "argument must be int, not %.50s",
+                     Py_TYPE(o)->tp_name);
+        return 0;
+    }
+    value = PyLong_AsUnsignedLongLongMask(o);
+    if ((value == (unsigned long long) -1) && PyErr_Occurred())
+        return 0;
+    *(unsigned long long *) p = value;
+    return 1;
+}
+
+/* "n": an int that fits a Py_ssize_t. */
+static int
+_dmpy_ssize_converter(PyObject *o, void *p)
+{
+    Py_ssize_t value;
+
+    if (!o)
+        return 1;
+    if (((value = PyNumber_AsSsize_t(o, PyExc_OverflowError)) == -1)
+        && PyErr_Occurred())
+        return 0;
+    *(Py_ssize_t *) p = value;
+    return 1;
+}
+
+/* "d": a float, or any object with __float__() or __index__(). */
+static int
+_dmpy_double_converter(PyObject *o, void *p)
+{
+    double value;
+
+    if (!o)
+        return 1;
+    if (((value = PyFloat_AsDouble(o)) == -1.0) && PyErr_Occurred())
+        return 0;
+    *(double *) p = value;
+    return 1;
+}
 
-static PyObject *DmErrorObject;
+/* "p": the truth value of any object. */
+static int
+_dmpy_bool_converter(PyObject *o, void *p)
+{
+    int value;
 
+    if (!o)
+        return 1;
+    if ((value = PyObject_IsTrue(o)) < 0)
+        return 0;
+    *(int *) p = value;
+    return 1;
+}
 
 typedef struct {
     PyObject_HEAD
     struct dm_timestamp *ts_stamp;
 } DmTimestampObject;
 
-static PyTypeObject DmTimestamp_Type;
-
-#define DmTimestampObject_Check(v)      (Py_TYPE(v) == &DmTimestamp_Type)
+#define DmTimestampObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmTimestamp_Type)
 
 static DmTimestampObject *
-newDmTimestampObject(void)
+newDmTimestampObject(dmpy_state *st)
 {
-    return PyObject_New(DmTimestampObject, &DmTimestamp_Type);
+    return PyObject_New(DmTimestampObject, st->DmTimestamp_Type);
 }
 
 static int
@@ -115,11 +760,14 @@ DmTimestamp_init(DmTimestampObject *self, PyObject *args, PyObject *kwds)
 static void
 DmTimestamp_dealloc(DmTimestampObject *self)
 {
+    PyTypeObject *tp = Py_TYPE(self);
+
     if (self->ts_stamp)
         dm_timestamp_destroy(self->ts_stamp);
     self->ts_stamp = NULL;
 
-    PyObject_Del(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 /* DmTimestamp methods */
@@ -129,7 +777,7 @@ DmTimestamp_copy(DmTimestampObject *self, PyObject *args)
 {
     DmTimestampObject *copy;
 
-    if (!(copy = newDmTimestampObject()))
+    if (!(copy = newDmTimestampObject(DMPY_STATE(self))))
         return NULL;
 
     copy->ts_stamp = dm_timestamp_alloc();
@@ -159,7 +807,8 @@ DmTimestamp_compare(DmTimestampObject *self, PyObject *args)
 {
     DmTimestampObject *to;
 
-    if (!PyArg_ParseTuple(args, "O!:compare", &DmTimestamp_Type, &to))
+    if (!PyArg_ParseTuple(args, "O!:compare",
+                          DMPY_STATE(self)->DmTimestamp_Type, &to))
         return NULL;
 
     return Py_BuildValue("i", dm_timestamp_compare(self->ts_stamp, to->ts_stamp));
@@ -170,7 +819,8 @@ DmTimestamp_delta(DmTimestampObject *self, PyObject *args)
 {
     DmTimestampObject *to;
 
-    if (!PyArg_ParseTuple(args, "O!:compare", &DmTimestamp_Type, &to))
+    if (!PyArg_ParseTuple(args, "O!:compare",
+                          DMPY_STATE(self)->DmTimestamp_Type, &to))
         return NULL;
 
     return Py_BuildValue("i", dm_timestamp_delta(self->ts_stamp, to->ts_stamp));
@@ -201,50 +851,20 @@ static PyMethodDef DmTimestamp_methods[] = {
     {NULL, NULL}
 };
 
-static PyTypeObject DmTimestamp_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmTimestamp",             /*tp_name*/
-    sizeof(DmTimestampObject),          /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmTimestamp_dealloc, /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /*tp_flags*/
-    0,                          /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmTimestamp_methods,        /*tp_methods*/
-    0,           /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmTimestamp_init,    /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
+static PyType_Slot DmTimestamp_slots[] = {
+    {Py_tp_dealloc, DmTimestamp_dealloc},
+    {Py_tp_methods, DmTimestamp_methods},
+    {Py_tp_init, DmTimestamp_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmTimestamp_spec = {
+    "dmpy.DmTimestamp",         /*name*/
+    sizeof(DmTimestampObject),  /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*flags*/
+    DmTimestamp_slots,          /*slots*/
 };
  
 
@@ -254,11 +874,10 @@ typedef struct {
     uint16_t ck_val_prefix;
     uint16_t ck_val_base;
     PyObject *ck_ready; /* Py_True / Py_False */
+    int ck_busy; /* set while udev_wait() runs without the GIL */
 } DmCookieObject;
 
-static PyTypeObject DmCookie_Type;
-
-#define DmCookieObject_Check(v)      (Py_TYPE(v) == &DmCookie_Type)
+#define DmCookieObject_Check(st, v)         (Py_TYPE(v) == (st)->DmCookie_Type)
 
 static void
 _dmpy_set_cookie_values(DmCookieObject *self)
@@ -281,9 +900,12 @@ _dmpy_check_cookie_value(unsigned value)
 static void
 DmCookie_dealloc(DmCookieObject *self)
 {
+    PyTypeObject *tp = Py_TYPE(self);
+
     /* ck_ready may be NULL if __init__ failed, or was never called. */
     Py_XDECREF(self->ck_ready);
-    PyObject_Del(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 static int
@@ -297,6 +919,7 @@ _DmCookie_init(DmCookieObject *self, uint32_t value)
 
     Py_INCREF(Py_False);
     self->ck_ready = Py_False;
+    self->ck_busy = 0;
 
     return 0;
 }
@@ -386,29 +1009,76 @@ DmCookie_udev_complete(DmCookieObject *self, PyObject *args)
 {
     PyObject *ret;
     int r;
+
+    DMPY_BUSY_CHECK(self->ck_busy, "DmCookie", NULL);
+
     r = dm_udev_complete(self->ck_cookie);
     ret = (r) ? Py_True : Py_False;
     Py_INCREF(ret);
     return ret;
 }
 
+/*
+ * Wait for the transaction identified by cookie to complete. This must be
+ * called with the GIL released.
+ *
+ * Once the transaction is complete both dm_udev_wait() and
+ * dm_udev_wait_immediate() drain the library's node operation stack, so
+ * the node lock must be held when they return. Holding it across a
+ * blocking dm_udev_wait() would stall every other waiter and node-changing
+ * task behind the slowest udev transaction: instead poll the semaphore
+ * with dm_udev_wait_immediate(), taking the lock only for each poll (and
+ * the final drain), and sleep unlocked between polls.
+ */
+#define DMPY_UDEV_POLL_MIN_NS   (NSEC_PER_MSEC)
+#define DMPY_UDEV_POLL_MAX_NS   (32 * NSEC_PER_MSEC)
+static int
+_dmpy_udev_poll(uint32_t cookie, int immediate, int *ready)
+{
+    struct timespec delay = { 0, DMPY_UDEV_POLL_MIN_NS };
+    int r;
+
+    /* Without a semaphore to poll dm_udev_wait_immediate() never reports
+     * the cookie ready, and dm_udev_wait() does not block. */
+    if (!immediate && (!cookie || !dm_udev_get_sync_support())) {
+        DMPY_NODE_LOCK(1);
+        r = dm_udev_wait(cookie);
+        DMPY_NODE_UNLOCK(1);
+        *ready = r;
+        return r;
+    }
+
+    for (;;) {
+        DMPY_NODE_LOCK(1);
+        r = dm_udev_wait_immediate(cookie, ready);
+        DMPY_NODE_UNLOCK(1);
+        if (!r || *ready || immediate)
+            return r;
+        nanosleep(&delay, NULL);
+        if (delay.tv_nsec < DMPY_UDEV_POLL_MAX_NS)
+            delay.tv_nsec *= 2;
+    }
+}
+
 static PyObject *
 _DmCookie_udev_wait(DmCookieObject *self, int immediate)
 {
     PyObject *ret;
     int r, ready;
 
+    DMPY_BUSY_CHECK(self->ck_busy, "DmCookie", NULL);
+
     if (self->ck_ready == Py_True) {
         PyErr_SetString(PyExc_ValueError, "Cannot udev_wait() on a "
                         "completed DmCookie.");
         return NULL;
     }
 
-    if (!immediate) {
-        r = dm_udev_wait(self->ck_cookie);
-        ready = r;
-    } else
-        r = dm_udev_wait_immediate(self->ck_cookie, &ready);
+    DMPY_BUSY_CLAIM(self->ck_busy, "DmCookie", NULL);
+    Py_BEGIN_ALLOW_THREADS
+    r = _dmpy_udev_poll(self->ck_cookie, immediate, &ready);
+    Py_END_ALLOW_THREADS
+    self->ck_busy = 0;
 
     ret = (r) ? Py_True : Py_False;
     Py_INCREF(ret);
@@ -435,13 +1105,453 @@ DmCookie_udev_wait(DmCookieObject *self, PyObject *args, PyObject *kwds)
     return _DmCookie_udev_wait(self, immediate);
 }
 
-#define DMCOOKIE_set_value__doc__ \
-"Set the value of this DmCookie to the given integer. The cookie is "   \
-"stored internally as a 32-bit value by the kernel and device-mapper: " \
-"attempting to store a larger value will raise a ValueError."
+/*
+ * Asynchronous udev waits.
+ *
+ * DmCookie.wait_async() registers the cookie with a single native waiter
+ * thread that polls every outstanding cookie with dm_udev_wait_immediate()
+ * (as _dmpy_udev_poll() does for one) and backs off while none complete,
+ * so that any number of cookies are waited on without a thread each.
+ *
+ * The waiter thread never takes the GIL: when a cookie completes it moves
+ * the wait to the done list and signals the eventfd of the event loop
+ * that owns the wait's future. Each loop watches its eventfd with
+ * add_reader(), and the reader callback completes the futures on the loop
+ * thread. The eventfd is closed and unregistered once the loop has no
+ * outstanding waits. The reader of a loop that is closed with waits
+ * outstanding never runs: its waits are released, and the loop dropped,
+ * by the next call to wait_async().
+ */
 
-#define DMCOOKIE_set_prefix__doc__ \
-"Set the prefix of this DmCookie to the given integer. The prefix is "   \
+struct dmpy_udev_wait {
+    struct dmpy_udev_wait *next;
+    uint32_t cookie;
+    int efd; /* eventfd of the owning event loop */
+    int ok; /* dm_udev_wait_immediate() return value */
+    /* Touched only with the GIL held. */
+    DmCookieObject *ck;
+    PyObject *future;
+};
+
+/* Protects the lists below and _dmpy_udev_waiter_running. */
+static PyThread_type_lock _dmpy_udev_waiter_lock = NULL;
+/* Held except to wake the waiter thread early. */
+static PyThread_type_lock _dmpy_udev_waiter_wake = NULL;
+static struct dmpy_udev_wait *_dmpy_udev_pending = NULL;
+static struct dmpy_udev_wait *_dmpy_udev_done = NULL;
+static int _dmpy_udev_waiter_running = 0;
+static int _dmpy_udev_waiter_woken = 0;
+
+static void
+_dmpy_udev_waiter_thread(void *arg)
+{
+    struct dmpy_udev_wait *polling, *e, *next, *still = NULL, *done = NULL;
+    long long delay_us = DMPY_UDEV_POLL_MIN_NS / 1000;
+    uint64_t one = 1;
+    int ready;
+
+    for (;;) {
+        PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+        /* Return the waits still outstanding from the last pass. */
+        for (e = still; e; e = next) {
+            next = e->next;
+            e->next = _dmpy_udev_pending;
+            _dmpy_udev_pending = e;
+        }
+        if (!_dmpy_udev_pending) {
+            _dmpy_udev_waiter_running = 0;
+            PyThread_release_lock(_dmpy_udev_waiter_lock);
+            break;
+        }
+        polling = _dmpy_udev_pending;
+        _dmpy_udev_pending = NULL;
+        PyThread_release_lock(_dmpy_udev_waiter_lock);
+
+        still = done = NULL;
+        for (e = polling; e; e = next) {
+            next = e->next;
+            DMPY_NODE_LOCK(1);
+            e->ok = dm_udev_wait_immediate(e->cookie, &ready);
+            DMPY_NODE_UNLOCK(1);
+            if (!e->ok || ready) {
+                e->next = done;
+                done = e;
+            } else {
+                e->next = still;
+                still = e;
+            }
+        }
+
+        if (done) {
+            PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+            for (e = done; e; e = next) {
+                next = e->next;
+                e->next = _dmpy_udev_done;
+                _dmpy_udev_done = e;
+                /* This can only fail if the counter would overflow, and
+                 * then the eventfd is already readable. */
+                (void) !write(e->efd, &one, sizeof(one));
+            }
+            PyThread_release_lock(_dmpy_udev_waiter_lock);
+            delay_us = DMPY_UDEV_POLL_MIN_NS / 1000;
+        }
+
+        if (!still)
+            continue;
+
+        if (PyThread_acquire_lock_timed(_dmpy_udev_waiter_wake, delay_us, 0)
+            == PY_LOCK_ACQUIRED) {
+            PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+            _dmpy_udev_waiter_woken = 0;
+            PyThread_release_lock(_dmpy_udev_waiter_lock);
+            delay_us = DMPY_UDEV_POLL_MIN_NS / 1000;
+        } else if (delay_us < DMPY_UDEV_POLL_MAX_NS / 1000)
+            delay_us *= 2;
+    }
+}
+
+/*
+ * Complete the future of e if set_future is non-zero, and release the
+ * cookie and future references held by the wait. The future of a wait
+ * whose loop has been closed is released without being completed. Must
+ * be called with the GIL held.
+ */
+static void
+_dmpy_udev_wait_complete(struct dmpy_udev_wait *e, int set_future)
+{
+    PyObject *done, *r;
+
+    e->ck->ck_busy = 0;
+    if (e->ok) {
+        Py_INCREF(Py_True);
+        Py_XSETREF(e->ck->ck_ready, Py_True);
+    }
+
+    /* The future may have been cancelled while the wait was polled. */
+    if (set_future
+        && (done = PyObject_CallMethod(e->future, "done", NULL))) {
+        if (!PyObject_IsTrue(done)) {
+            if (e->ok)
+                r = PyObject_CallMethod(e->future, "set_result", "O",
+                                        Py_True);
+            else
+                r = PyObject_CallMethod(e->future, "set_exception", "N",
+                                        PyObject_CallFunction(
+                                            PyExc_OSError, "s", "Failed to "
+                                            "wait for udev cookie."));
+            Py_XDECREF(r);
+        }
+        Py_DECREF(done);
+    }
+    if (PyErr_Occurred())
+        PyErr_WriteUnraisable(e->future);
+
+    Py_DECREF(e->ck);
+    Py_DECREF(e->future);
+    PyMem_RawFree(e);
+}
+
+/*
+ * Complete every finished wait of the loop whose eventfd is efd, passing
+ * set_future to _dmpy_udev_wait_complete(), and return the number of
+ * waits completed. Must be called with the GIL held.
+ */
+static long
+_dmpy_udev_loop_complete(int efd, int set_future)
+{
+    struct dmpy_udev_wait *e, *next, **prev, *done = NULL;
+    long nr_done = 0;
+
+    PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+    for (prev = &_dmpy_udev_done; (e = *prev); ) {
+        if (e->efd == efd) {
+            *prev = e->next;
+            e->next = done;
+            done = e;
+        } else
+            prev = &e->next;
+    }
+    PyThread_release_lock(_dmpy_udev_waiter_lock);
+
+    for (e = done; e; e = next) {
+        next = e->next;
+        _dmpy_udev_wait_complete(e, set_future);
+        nr_done++;
+    }
+    return nr_done;
+}
+
+/*
+ * The add_reader() callback of an event loop's eventfd: self is the
+ * (loops, loop, efd) tuple the reader was registered with, where loops
+ * is the udev_loops dict of the module state.
+ */
+static PyObject *
+_dmpy_udev_loop_ready(PyObject *self, PyObject *args)
+{
+    PyObject *loops = PyTuple_GET_ITEM(self, 0), *entry, *value, *r;
+    PyObject *loop = PyTuple_GET_ITEM(self, 1);
+    int efd = (int) PyLong_AsLong(PyTuple_GET_ITEM(self, 2));
+    long nr_done, nr_waits;
+    uint64_t count;
+
+    /* EAGAIN is a spurious wakeup: the done list is checked anyway. */
+    (void) !read(efd, &count, sizeof(count));
+
+    nr_done = _dmpy_udev_loop_complete(efd, 1);
+
+    if (!(entry = PyDict_GetItemWithError(loops, loop)))
+        return PyErr_Occurred() ? NULL : (Py_INCREF(Py_None), Py_None);
+
+    nr_waits = PyLong_AsLong(PyList_GET_ITEM(entry, 1)) - nr_done;
+    if (nr_waits > 0) {
+        if (!(value = PyLong_FromLong(nr_waits)))
+            return NULL;
+        PyList_SetItem(entry, 1, value);
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    /* No waits are outstanding for this loop: retire its eventfd. */
+    if (!(r = PyObject_CallMethod(loop, "remove_reader", "i", efd)))
+        return NULL;
+    Py_DECREF(r);
+    close(efd);
+    if (PyDict_DelItem(loops, loop))
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyMethodDef _dmpy_udev_loop_ready_def = {
+    "_udev_loop_ready", (PyCFunction)_dmpy_udev_loop_ready, METH_NOARGS,
+    NULL
+};
+
+/*
+ * Release the finished waits of event loops in st->udev_loops that have
+ * been closed, whose readers will never run, and drop each closed loop
+ * with its eventfd once it has no outstanding waits. Returns 0 on success
+ * or -1 with an exception set.
+ */
+static int
+_dmpy_udev_reap_closed_loops(dmpy_state *st)
+{
+    PyObject *loops, *loop, *entry, *closed, *value;
+    long nr_waits;
+    Py_ssize_t i;
+    int efd, r = -1;
+
+    if (!(loops = PyDict_Keys(st->udev_loops)))
+        return -1;
+
+    for (i = 0; i < PyList_GET_SIZE(loops); i++) {
+        loop = PyList_GET_ITEM(loops, i);
+        if (!(closed = PyObject_CallMethod(loop, "is_closed", NULL)))
+            goto out;
+        if (!PyObject_IsTrue(closed)) {
+            Py_DECREF(closed);
+            continue;
+        }
+        Py_DECREF(closed);
+
+        if (!(entry = PyDict_GetItemWithError(st->udev_loops, loop))) {
+            if (PyErr_Occurred())
+                goto out;
+            continue;
+        }
+        efd = (int) PyLong_AsLong(PyList_GET_ITEM(entry, 0));
+        nr_waits = PyLong_AsLong(PyList_GET_ITEM(entry, 1))
+                   - _dmpy_udev_loop_complete(efd, 0);
+        if (nr_waits > 0) {
+            if (!(value = PyLong_FromLong(nr_waits)))
+                goto out;
+            PyList_SetItem(entry, 1, value);
+            continue;
+        }
+
+        /* No wait refers to efd any more: the waiter cannot write it. */
+        close(efd);
+        if (PyDict_DelItem(st->udev_loops, loop))
+            goto out;
+    }
+    r = 0;
+out:
+    Py_DECREF(loops);
+    return r;
+}
+
+/*
+ * Return the eventfd for loop, creating and registering it in the
+ * udev_loops dict of st if needed, and count one more outstanding wait
+ * for it.
+ */
+static int
+_dmpy_udev_loop_efd(dmpy_state *st, PyObject *loop)
+{
+    PyObject *entry, *value, *cb_self, *callback, *r;
+    int efd;
+
+    if (!st->udev_loops && !(st->udev_loops = PyDict_New()))
+        return -1;
+
+    if (_dmpy_udev_reap_closed_loops(st))
+        return -1;
+
+    if ((entry = PyDict_GetItemWithError(st->udev_loops, loop))) {
+        value = PyLong_FromLong(PyLong_AsLong(PyList_GET_ITEM(entry, 1))
+                                + 1);
+        if (!value)
+            return -1;
+        PyList_SetItem(entry, 1, value);
+        return (int) PyLong_AsLong(PyList_GET_ITEM(entry, 0));
+    }
+    if (PyErr_Occurred())
+        return -1;
+
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    if (!(cb_self = Py_BuildValue("(OOi)", st->udev_loops, loop, efd)))
+        goto fail;
+    callback = PyCFunction_New(&_dmpy_udev_loop_ready_def, cb_self);
+    Py_DECREF(cb_self);
+    if (!callback)
+        goto fail;
+
+    r = PyObject_CallMethod(loop, "add_reader", "iO", efd, callback);
+    Py_DECREF(callback);
+    if (!r)
+        goto fail;
+    Py_DECREF(r);
+
+    if (!(entry = Py_BuildValue("[ii]", efd, 1))
+        || PyDict_SetItem(st->udev_loops, loop, entry)) {
+        Py_XDECREF(entry);
+        r = PyObject_CallMethod(loop, "remove_reader", "i", efd);
+        Py_XDECREF(r);
+        goto fail;
+    }
+    Py_DECREF(entry);
+    return efd;
+
+fail:
+    close(efd);
+    return -1;
+}
+
+static PyObject *
+DmCookie_wait_async(DmCookieObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"loop", NULL};
+    PyObject *loop = NULL, *asyncio = NULL, *future = NULL, *r;
+    struct dmpy_udev_wait *e, *next;
+    uint64_t one = 1;
+    int efd, start;
+
+    DMPY_BUSY_CHECK(self->ck_busy, "DmCookie", NULL);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:wait_async", kwlist,
+                                     &loop))
+        return NULL;
+
+    if (self->ck_ready == Py_True) {
+        PyErr_SetString(PyExc_ValueError, "Cannot wait_async() on a "
+                        "completed DmCookie.");
+        return NULL;
+    }
+
+    if (!loop || (loop == Py_None)) {
+        if (!(asyncio = PyImport_ImportModule("asyncio")))
+            return NULL;
+        loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+        Py_DECREF(asyncio);
+        if (!loop)
+            return NULL;
+    } else
+        Py_INCREF(loop);
+
+    if (!(future = PyObject_CallMethod(loop, "create_future", NULL)))
+        goto out;
+
+    /* Without a semaphore there is nothing to wait for. */
+    if (!self->ck_cookie || !dm_udev_get_sync_support()) {
+        if (!(r = _DmCookie_udev_wait(self, 0)))
+            goto fail;
+        Py_DECREF(r);
+        if (!(r = PyObject_CallMethod(future, "set_result", "O", Py_True)))
+            goto fail;
+        Py_DECREF(r);
+        goto out;
+    }
+
+    if (_dmpy_busy_claim(&self->ck_busy, "DmCookie"))
+        goto fail;
+
+    if ((efd = _dmpy_udev_loop_efd(DMPY_STATE(self), loop)) < 0)
+        goto unclaim;
+
+    if (!(e = PyMem_RawCalloc(1, sizeof(*e)))) {
+        PyErr_NoMemory();
+        goto unclaim;
+    }
+    e->cookie = self->ck_cookie;
+    e->efd = efd;
+    Py_INCREF(self);
+    e->ck = self;
+    Py_INCREF(future);
+    e->future = future;
+
+    PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+    e->next = _dmpy_udev_pending;
+    _dmpy_udev_pending = e;
+    start = !_dmpy_udev_waiter_running;
+    _dmpy_udev_waiter_running = 1;
+    if (!start && !_dmpy_udev_waiter_woken) {
+        _dmpy_udev_waiter_woken = 1;
+        PyThread_release_lock(_dmpy_udev_waiter_wake);
+    }
+    PyThread_release_lock(_dmpy_udev_waiter_lock);
+
+    if (start && (PyThread_start_new_thread(_dmpy_udev_waiter_thread, NULL)
+                  == PYTHREAD_INVALID_THREAD_ID)) {
+        /* Nothing will poll the pending waits, including any queued by
+         * other threads since this one: fail them all, so that their
+         * futures' exceptions are set to OSError. The event loop must not
+         * be blocked polling them here instead. */
+        PyThread_acquire_lock(_dmpy_udev_waiter_lock, WAIT_LOCK);
+        for (e = _dmpy_udev_pending; e; e = next) {
+            next = e->next;
+            e->ok = 0;
+            e->next = _dmpy_udev_done;
+            _dmpy_udev_done = e;
+            (void) !write(e->efd, &one, sizeof(one));
+        }
+        _dmpy_udev_pending = NULL;
+        _dmpy_udev_waiter_running = 0;
+        PyThread_release_lock(_dmpy_udev_waiter_lock);
+    }
+    goto out;
+
+unclaim:
+    self->ck_busy = 0;
+fail:
+    Py_CLEAR(future);
+out:
+    Py_DECREF(loop);
+    return future;
+}
+
+#define DMCOOKIE_set_value__doc__ \
+"Set the value of this DmCookie to the given integer. The cookie is "   \
+"stored internally as a 32-bit value by the kernel and device-mapper: " \
+"attempting to store a larger value will raise a ValueError."
+
+#define DMCOOKIE_set_prefix__doc__ \
+"Set the prefix of this DmCookie to the given integer. The prefix is "   \
 "stored internally as a 16-bit value by the kernel and device-mapper: " \
 "attempting to store a larger prefix will raise a ValueError."
 
@@ -464,6 +1574,19 @@ DmCookie_udev_wait(DmCookieObject *self, PyObject *args, PyObject *kwds)
 "resources are released and no further calls to `udev_wait()`,\n"          \
 "or `udev_complete() should be made."
 
+#define DMCOOKIE_wait_async__doc__ \
+"Return an `asyncio.Future` that completes when the transaction\n"        \
+"represented by this `DmCookie` is ready.\n\n"                             \
+"The future is created on `loop`, or on the running event loop if no\n"  \
+"loop is given, and its result is `True`. If the wait fails the\n"       \
+"future's exception is set to an OSError.\n\n"                           \
+"The cookie semaphores are polled by a single background thread that\n" \
+"is shared by all outstanding waits: the event loop is not blocked\n"    \
+"and no thread is started per cookie. If that thread cannot be\n"      \
+"started, the future's exception is set to an OSError. The cookie is\n" \
+"busy until the future completes, and its resources are released as\n" \
+"for `udev_wait()`."
+
 static PyMethodDef DmCookie_methods[] = {
     {"set_value", (PyCFunction)DmCookie_set_value, METH_VARARGS,
         PyDoc_STR(DMCOOKIE_set_value__doc__)},
@@ -475,6 +1598,8 @@ static PyMethodDef DmCookie_methods[] = {
         PyDoc_STR(DMCOOKIE_udev_complete__doc__)},
     {"udev_wait", (PyCFunction)DmCookie_udev_wait,
         METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMCOOKIE_udev_wait__doc__)},
+    {"wait_async", (PyCFunction)DmCookie_wait_async,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMCOOKIE_wait_async__doc__)},
     {NULL, NULL}
 };
 
@@ -492,50 +1617,21 @@ static PyMemberDef DmCookie_members[] = {
     {NULL}
 };
 
-static PyTypeObject DmCookie_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmCookie",             /*tp_name*/
-    sizeof(DmCookieObject),          /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmCookie_dealloc, /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /*tp_flags*/
-    0,                          /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmCookie_methods,           /*tp_methods*/
-    DmCookie_members,           /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmCookie_init,    /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
+static PyType_Slot DmCookie_slots[] = {
+    {Py_tp_dealloc, DmCookie_dealloc},
+    {Py_tp_methods, DmCookie_methods},
+    {Py_tp_members, DmCookie_members},
+    {Py_tp_init, DmCookie_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmCookie_spec = {
+    "dmpy.DmCookie",            /*name*/
+    sizeof(DmCookieObject),     /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*flags*/
+    DmCookie_slots,             /*slots*/
 };
 
 
@@ -544,14 +1640,12 @@ typedef struct {
     struct dm_info in_info;
 } DmInfoObject;
 
-static PyTypeObject DmInfo_Type;
-
-#define DmInfoObject_Check(v)      (Py_TYPE(v) == &DmInfo_Type)
+#define DmInfoObject_Check(st, v)           (Py_TYPE(v) == (st)->DmInfo_Type)
 
 static DmInfoObject *
-newDmInfoObject(void)
+newDmInfoObject(dmpy_state *st)
 {
-    return PyObject_New(DmInfoObject, &DmInfo_Type);
+    return PyObject_New(DmInfoObject, st->DmInfo_Type);
 }
 
 static int
@@ -597,50 +1691,19 @@ static PyMemberDef DmInfo_members[] = {
     {NULL}
 };
 
-static PyTypeObject DmInfo_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmInfo",             /*tp_name*/
-    sizeof(DmInfoObject),          /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    0,                          /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /*tp_flags*/
-    0,                          /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    0,                          /*tp_methods*/
-    DmInfo_members,             /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmInfo_init,      /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
+static PyType_Slot DmInfo_slots[] = {
+    {Py_tp_members, DmInfo_members},
+    {Py_tp_init, DmInfo_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmInfo_spec = {
+    "dmpy.DmInfo",              /*name*/
+    sizeof(DmInfoObject),       /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*flags*/
+    DmInfo_slots,               /*slots*/
 };
 
 /* dm_task state flags: since `struct dm_task` is not exposed in
@@ -678,7 +1741,7 @@ static const uint32_t _DmTask_task_type_flags[] = {
     (DMT_HAVE_IDENTITY | DMT_HAVE_DEPS),  /*DEPS */
     DMT_HAVE_IDENTITY,  /* RENAME */
     0,  /* VERSION */
-    DMT_HAVE_IDENTITY,  /* STATUS */
+    (DMT_HAVE_IDENTITY | DMT_HAVE_STATUS),  /* STATUS */
     (DMT_HAVE_IDENTITY | DMT_HAVE_TABLE),  /* TABLE */
     DMT_HAVE_IDENTITY,  /* WAITEVENT */
     DMT_HAVE_NAME_LIST,  /* LIST */
@@ -707,17 +1770,124 @@ static const char * const _DmTask_flag_strings[] = {
     "target versions"
 };
 
+/*
+ * Table digests.
+ *
+ * A table digest is a 64-bit FNV-1a hash of the target list of a table:
+ * the start and length of each target as little-endian 64-bit values,
+ * then its target type and parameters, each terminated by a null. Runs of
+ * whitespace in the parameters hash as a single space and leading and
+ * trailing whitespace is ignored, so that a table digests the same as
+ * the kernel's copy of it when its parameters are written in the form
+ * that a TABLE query reports (for example, devices as major:minor).
+ *
+ * The digest of a table being loaded is folded in as each target is
+ * added to a DmTask, since libdevmapper gives no access to the targets
+ * of a task before it is run.
+ */
+
+#define DMPY_DIGEST_INIT 0xcbf29ce484222325ULL
+#define DMPY_DIGEST_PRIME 0x100000001b3ULL
+
+static uint64_t
+_dmpy_digest_byte(uint64_t digest, unsigned char c)
+{
+    return (digest ^ c) * DMPY_DIGEST_PRIME;
+}
+
+static int
+_dmpy_digest_space(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\n');
+}
+
+static uint64_t
+_dmpy_digest_uint64(uint64_t digest, uint64_t value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++, value >>= 8)
+        digest = _dmpy_digest_byte(digest, (unsigned char) (value & 0xff));
+    return digest;
+}
+
+/* Fold the target (start, length, ttype, params) into digest. */
+static uint64_t
+_dmpy_digest_target(uint64_t digest, uint64_t start, uint64_t length,
+                    const char *ttype, const char *params)
+{
+    int space = 0;
+
+    digest = _dmpy_digest_uint64(digest, start);
+    digest = _dmpy_digest_uint64(digest, length);
+
+    for (; *ttype; ttype++)
+        digest = _dmpy_digest_byte(digest, (unsigned char) *ttype);
+    digest = _dmpy_digest_byte(digest, 0);
+
+    for (; params && _dmpy_digest_space(*params); params++)
+        ;
+    for (; params && *params; params++) {
+        if (_dmpy_digest_space(*params)) {
+            space = 1;
+            continue;
+        }
+        if (space)
+            digest = _dmpy_digest_byte(digest, ' ');
+        space = 0;
+        digest = _dmpy_digest_byte(digest, (unsigned char) *params);
+    }
+    return _dmpy_digest_byte(digest, 0);
+}
+
+/* Return the digest of the table returned by dmt, a TABLE task. */
+static uint64_t
+_dmpy_table_digest(struct dm_task *dmt)
+{
+    uint64_t digest = DMPY_DIGEST_INIT, start, length;
+    char *ttype, *params;
+    void *next = NULL;
+
+    do {
+        next = dm_get_next_target(dmt, next, &start, &length, &ttype,
+                                  &params);
+        /* An empty table returns a NULL target type. */
+        if (!ttype)
+            break;
+        digest = _dmpy_digest_target(digest, start, length, ttype, params);
+    } while (next);
+
+    return digest;
+}
+
+/* Return a digest as the 16 digit hex string used by table_digest(). */
+static PyObject *
+_dmpy_digest_to_object(uint64_t digest)
+{
+    char buf[17];
+
+    snprintf(buf, sizeof(buf), "%016" PRIx64, digest);
+    return PyUnicode_FromString(buf);
+}
+
 typedef struct {
     PyObject_HEAD
     struct dm_task *tk_dmt;
     DmCookieObject *ck_cookie;
     uint32_t tk_flags; /* dm_task state flags */
     int tk_type; /* DM_DEVICE_* type at instantiation. */
+    int tk_busy; /* set while run() is in progress without the GIL */
+    uint64_t tk_sequence; /* incremented each time the task is run */
+    uint64_t tk_digest; /* table digest of the targets added */
+    PyObject *tk_name; /* device name, uuid and numbers set on the task, */
+    PyObject *tk_uuid; /* for the queries made by apply_if_changed() */
+    int tk_major;
+    int tk_minor;
 } DmTaskObject;
 
-static PyTypeObject DmTask_Type;
+#define DmTaskObject_Check(st, v)           (Py_TYPE(v) == (st)->DmTask_Type)
 
-#define DmTaskObject_Check(v)      (Py_TYPE(v) == &DmTask_Type)
+#define DmTask_BusyCheck(o) DMPY_BUSY_CHECK((o)->tk_busy, "DmTask", NULL)
 
 /*
  * Check whether an ioctl has been performed, and whether `flag` is present
@@ -746,15 +1916,13 @@ _DmTask_check_data_flags(DmTaskObject *self, uint32_t flag, char *method)
 }
 
 static int
-DmTask_init(DmTaskObject *self, PyObject *args, PyObject *kwds)
+_DmTask_init(DmTaskObject *self, int type)
 {
-    int type;
-
-    if (!PyArg_ParseTuple(args, "i:__init__", &type))
-        return -1;
-
     self->ck_cookie = NULL;
     self->tk_flags = 0;
+    self->tk_sequence = 0;
+    self->tk_digest = DMPY_DIGEST_INIT;
+    self->tk_major = self->tk_minor = -1;
 
     if (type < 0 || type > DM_DEVICE_SET_GEOMETRY) {
         PyErr_Format(PyExc_TypeError, "Invalid DmTask type: %d", type);
@@ -787,69 +1955,179 @@ DmTask_init(DmTaskObject *self, PyObject *args, PyObject *kwds)
     return 0;
 }
 
+static int
+DmTask_init(DmTaskObject *self, PyObject *args, PyObject *kwds)
+{
+    int type;
+
+    if (!PyArg_ParseTuple(args, "i:__init__", &type))
+        return -1;
+
+    return _DmTask_init(self, type);
+}
+
+/*
+ * DmTask(type) for the exact DmTask type, without building an argument
+ * tuple. tp_vectorcall is not inherited: subclasses are created through
+ * tp_new and tp_init as before.
+ */
+static PyObject *
+DmTask_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                  PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"type", NULL};
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject *self, *argv[1];
+    int task_type = 0;
+
+    if (kwnames && PyTuple_GET_SIZE(kwnames)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "DmTask() takes no keyword arguments");
+        return NULL;
+    }
+    if (_dmpy_parse_args("__init__", args, nargs, NULL, kwlist, 1, argv)
+        || !_dmpy_int_converter(argv[0], &task_type))
+        return NULL;
+
+    if (!(self = ((PyTypeObject *) type)->tp_alloc((PyTypeObject *) type,
+                                                   0)))
+        return NULL;
+    if (_DmTask_init((DmTaskObject *) self, task_type)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
 static void
 DmTask_dealloc(DmTaskObject *self)
 {
+    PyTypeObject *tp = Py_TYPE(self);
+
     if (self->tk_dmt)
         dm_task_destroy(self->tk_dmt);
     self->tk_dmt = NULL;
 
     Py_XDECREF(self->ck_cookie);
+    Py_XDECREF(self->tk_name);
+    Py_XDECREF(self->tk_uuid);
 
-    PyObject_Del(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
 /* DmTask methods */
 
 static PyObject *
-DmTask_set_name(DmTaskObject *self, PyObject *args)
+DmTask_set_name(DmTaskObject *self, PyObject *arg)
 {
-    char *name;
+    const char *name;
+
+    DmTask_BusyCheck(self);
 
-    if (!PyArg_ParseTuple(args, "s:set_name", &name))
+    if (!_dmpy_str_converter(arg, &name))
         return NULL;
 
     if (!dm_task_set_name(self->tk_dmt, name)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask name.");
         return NULL;
     }
+    Py_INCREF(arg);
+    Py_XSETREF(self->tk_name, arg);
         
     Py_INCREF(Py_None);
     return Py_None;
 }
 
 static PyObject *
-DmTask_set_uuid(DmTaskObject *self, PyObject *args)
+DmTask_set_uuid(DmTaskObject *self, PyObject *arg)
 {
-    char *uuid;
+    const char *uuid;
+
+    DmTask_BusyCheck(self);
 
-    if (!PyArg_ParseTuple(args, "s:set_uuid", &uuid))
+    if (!_dmpy_str_converter(arg, &uuid))
         return NULL;
 
     if (!dm_task_set_uuid(self->tk_dmt, uuid)) {
         PyErr_SetString(PyExc_OSError, "failed to set DmTask name.");
         return NULL;
     }
+    Py_INCREF(arg);
+    Py_XSETREF(self->tk_uuid, arg);
         
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+/*
+ * Return non-zero if a task of type `type` may modify the library's global
+ * node operation state and must be run holding `_dmpy_node_lock`. SUSPEND
+ * and RESUME also update the library's count of suspended devices. Until
+ * the control device has been opened all tasks are serialised, since the
+ * first ioctl opens it and checks the driver version.
+ */
+static int
+_DmTask_needs_node_lock(int type)
+{
+    if (!_dmpy_control_ready)
+        return 1;
+
+    switch (type) {
+    case DM_DEVICE_CREATE:
+    case DM_DEVICE_REMOVE:
+    case DM_DEVICE_REMOVE_ALL:
+    case DM_DEVICE_SUSPEND:
+    case DM_DEVICE_RESUME:
+    case DM_DEVICE_RENAME:
+    case DM_DEVICE_MKNODES:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void _dmpy_dev_cache_task_done(int type);
+
 static PyObject *
 DmTask_run(DmTaskObject *self, PyObject *args)
 {
+    uint64_t start, elapsed;
+    int node_lock, r;
+
+    /* Claiming the task also serialises the flag updates below. */
+    DMPY_BUSY_CLAIM(self->tk_busy, "DmTask", NULL);
+
     /* DMT_DID_IOCTL does not imply success. */
     self->tk_flags |= DMT_DID_IOCTL;
+    self->tk_sequence++;
+
+    node_lock = _DmTask_needs_node_lock(self->tk_type);
 
-    if (!(dm_task_run(self->tk_dmt))) {
+    Py_BEGIN_ALLOW_THREADS
+    DMPY_NODE_LOCK(node_lock);
+    start = _dmpy_ioctl_start();
+    r = dm_task_run(self->tk_dmt);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMPY_NODE_UNLOCK(node_lock);
+    Py_END_ALLOW_THREADS
+
+    _dmpy_ioctl_record(self->tk_type, elapsed, r);
+
+    if (!r) {
         self->tk_flags |= DMT_DID_ERROR;
         errno = dm_task_get_errno(self->tk_dmt);
+        self->tk_busy = 0;
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
     }
 
     /* set data flags from task type */
     self->tk_flags |= _DmTask_task_type_flags[self->tk_type];
+    self->tk_busy = 0;
+
+    _dmpy_control_ready = 1;
+    _dmpy_dev_cache_task_done(self->tk_type);
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -859,6 +2137,8 @@ static PyObject *DmTask_get_driver_version(DmTaskObject *self, PyObject *args)
 {
     char version[DMPY_VERSION_BUF_LEN];
 
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, -1, "get_driver_version"))
         return NULL;
 
@@ -875,10 +2155,12 @@ DmTask_get_info(DmTaskObject *self, PyObject *args)
 {
     DmInfoObject *info;
 
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, DMT_HAVE_INFO, "get_info"))
         return NULL;
 
-    info = newDmInfoObject();
+    info = newDmInfoObject(DMPY_STATE(self));
     if (!info)
         return NULL;
 
@@ -891,17 +2173,21 @@ DmTask_get_info(DmTaskObject *self, PyObject *args)
     return (PyObject *)info;
 }
 
-static PyObject *DmTask_get_uuid(DmTaskObject *self, PyObject *args, PyObject *kwds)
+static PyObject *DmTask_get_uuid(DmTaskObject *self, PyObject *const *args,
+                                 Py_ssize_t nargs, PyObject *kwnames)
 {
-    static char *kwlist[] = {"mangled", NULL};
+    static const char *const kwlist[] = {"mangled", NULL};
     int mangled = -1; /* use name_mangling_mode */
     const char *uuid;
+    PyObject *argv[1];
+
+    DmTask_BusyCheck(self);
 
     if (_DmTask_check_data_flags(self, DMT_HAVE_UUID, "get_uuid"))
         return NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:get_uuid",
-                                     kwlist, &mangled))
+    if (_dmpy_parse_args("get_uuid", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_int_converter(argv[0], &mangled))
         return NULL;
 
     if (mangled < 0)
@@ -950,6 +2236,8 @@ DmTask_get_deps(DmTaskObject *self, PyObject *args)
 {
     struct dm_deps *deps = NULL;
 
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, DMT_HAVE_DEPS, "get_deps"))
         return NULL;
 
@@ -1017,6 +2305,8 @@ DmTask_get_versions(DmTaskObject *self, PyObject *args)
 {
     struct dm_versions *versions;
 
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, DMT_HAVE_TARGET_VERSIONS,
                                  "get_versions"))
         return NULL;
@@ -1033,6 +2323,8 @@ DmTask_get_versions(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_get_message_response(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, DMT_HAVE_MESSAGE,
                                  "get_message_response"))
         return NULL;
@@ -1041,17 +2333,21 @@ DmTask_get_message_response(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_get_name(DmTaskObject *self, PyObject *args, PyObject *kwds)
+DmTask_get_name(DmTaskObject *self, PyObject *const *args, Py_ssize_t nargs,
+                PyObject *kwnames)
 {
-    static char *kwlist[] = {"mangled", NULL};
+    static const char *const kwlist[] = {"mangled", NULL};
     int mangled = -1; /* use name_mangling_mode */
     const char *name;
+    PyObject *argv[1];
+
+    DmTask_BusyCheck(self);
 
     if (_DmTask_check_data_flags(self, DMT_HAVE_NAME, "name"))
         return NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:get_name",
-                                     kwlist, &mangled))
+    if (_dmpy_parse_args("get_name", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_int_converter(argv[0], &mangled))
         return NULL;
 
     if (mangled < 0)
@@ -1080,17 +2376,24 @@ _DmTask_build_name_list(struct dm_names *names)
         return NULL;
 
     do {
+        PyObject *name;
+        int r;
+
         names = (struct dm_names *)((char *) names + next);
-        PyList_Append(name_list, Py_BuildValue("(sii)", names->name,
-                                               MAJOR(names->dev),
-                                               MINOR(names->dev)));
+        if (!(name = Py_BuildValue("(sii)", names->name, MAJOR(names->dev),
+                                   MINOR(names->dev))))
+            goto fail;
+        r = PyList_Append(name_list, name);
+        Py_DECREF(name);
+        if (r)
+            goto fail;
         next = names->next;
     } while (next);
 
-    return name_list;        
+    return name_list;
 
 fail:
-    Py_DECREF(name_list);
+    Py_XDECREF(name_list);
     return NULL;
 }
 
@@ -1099,6 +2402,8 @@ DmTask_get_names(DmTaskObject *self, PyObject *args)
 {
     struct dm_names *names = NULL;
 
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, DMT_HAVE_NAME_LIST, "get_names"))
         return NULL;
 
@@ -1113,17 +2418,21 @@ DmTask_get_names(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_set_ro(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     dm_task_set_ro(self->tk_dmt);
     Py_INCREF(Py_True);
     return Py_True;
 }
 
 static PyObject *
-DmTask_set_newname(DmTaskObject *self, PyObject *args)
+DmTask_set_newname(DmTaskObject *self, PyObject *arg)
 {
-    char *newname;
+    const char *newname;
 
-    if (!PyArg_ParseTuple(args, "s:set_newname", &newname))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_str_converter(arg, &newname))
         goto fail;
 
     /* repeat the libdm validation so that a meaningful error is given. */
@@ -1156,11 +2465,13 @@ fail:
 }
 
 static PyObject *
-DmTask_set_newuuid(DmTaskObject *self, PyObject *args)
+DmTask_set_newuuid(DmTaskObject *self, PyObject *arg)
 {
-    char *newuuid;
+    const char *newuuid;
+
+    DmTask_BusyCheck(self);
 
-    if (!PyArg_ParseTuple(args, "s:set_newuuid", &newuuid))
+    if (!_dmpy_str_converter(arg, &newuuid))
         goto fail;
 
     if (strlen(newuuid) >= DM_UUID_LEN) {
@@ -1181,17 +2492,20 @@ fail:
 }
 
 static PyObject *
-DmTask_set_major(DmTaskObject *self, PyObject *args)
+DmTask_set_major(DmTaskObject *self, PyObject *arg)
 {
     int major;
 
-    if (!PyArg_ParseTuple(args, "i:set_major", &major))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &major))
         goto fail;
 
     if (!dm_task_set_major(self->tk_dmt, major)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask major number.");
         goto fail;
     }
+    self->tk_major = major;
 
     Py_INCREF(Py_True);
     return Py_True;
@@ -1201,17 +2515,20 @@ fail:
 }
 
 static PyObject *
-DmTask_set_minor(DmTaskObject *self, PyObject *args)
+DmTask_set_minor(DmTaskObject *self, PyObject *arg)
 {
     int minor;
 
-    if (!PyArg_ParseTuple(args, "i:set_minor", &minor))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &minor))
         goto fail;
 
     if (!dm_task_set_minor(self->tk_dmt, minor)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask minor number.");
         goto fail;
     }
+    self->tk_minor = minor;
 
     Py_INCREF(Py_True);
     return Py_True;
@@ -1221,13 +2538,21 @@ fail:
 }
 
 static PyObject *
-DmTask_set_major_minor(DmTaskObject *self, PyObject *args, PyObject *kwds)
+DmTask_set_major_minor(DmTaskObject *self, PyObject *const *args,
+                       Py_ssize_t nargs, PyObject *kwnames)
 {
-    static char *kwlist[] = {"major", "minor", "allow_fallback", NULL};
+    static const char *const kwlist[] = {"major", "minor", "allow_fallback",
+                                         NULL};
     int major, minor, allow_fallback = 0;
+    PyObject *argv[3];
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|i:set_major_minor", kwlist,
-        &major, &minor, &allow_fallback))
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("set_major_minor", args, nargs, kwnames, kwlist, 2,
+                         argv)
+        || !_dmpy_int_converter(argv[0], &major)
+        || !_dmpy_int_converter(argv[1], &minor)
+        || !_dmpy_int_converter(argv[2], &allow_fallback))
         goto fail;
 
     if (!dm_task_set_major_minor(self->tk_dmt, major, minor, allow_fallback)) {
@@ -1235,6 +2560,8 @@ DmTask_set_major_minor(DmTaskObject *self, PyObject *args, PyObject *kwds)
                         "minor numbers.");
         goto fail;
     }
+    self->tk_major = major;
+    self->tk_minor = minor;
 
     Py_INCREF(Py_True);
     return Py_True;
@@ -1244,11 +2571,13 @@ fail:
 }
 
 static PyObject *
-DmTask_set_uid(DmTaskObject *self, PyObject *args)
+DmTask_set_uid(DmTaskObject *self, PyObject *arg)
 {
     uid_t uid;
 
-    if (!PyArg_ParseTuple(args, "i:set_uid", &uid))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &uid))
         goto fail;
 
     if (!dm_task_set_uid(self->tk_dmt, uid)) {
@@ -1264,11 +2593,13 @@ fail:
 }
 
 static PyObject *
-DmTask_set_gid(DmTaskObject *self, PyObject *args)
+DmTask_set_gid(DmTaskObject *self, PyObject *arg)
 {
     gid_t gid;
 
-    if (!PyArg_ParseTuple(args, "i:set_gid", &gid))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &gid))
         goto fail;
 
     if (!dm_task_set_gid(self->tk_dmt, gid)) {
@@ -1284,11 +2615,13 @@ fail:
 }
 
 static PyObject *
-DmTask_set_mode(DmTaskObject *self, PyObject *args)
+DmTask_set_mode(DmTaskObject *self, PyObject *arg)
 {
     mode_t mode;
 
-    if (!PyArg_ParseTuple(args, "i:set_mode", &mode))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &mode))
         goto fail;
 
     if (!dm_task_set_mode(self->tk_dmt, mode)) {
@@ -1304,13 +2637,21 @@ fail:
 }
 
 static PyObject *
-DmTask_set_cookie(DmTaskObject *self, PyObject *args)
+DmTask_set_cookie(DmTaskObject *self, PyObject *arg)
 {
     DmCookieObject *cookie = NULL;
     uint16_t flags = 0;
 
-    if (!PyArg_ParseTuple(args, "O!:set_cookie", &DmCookie_Type, &cookie))
+    DmTask_BusyCheck(self);
+
+    if (!PyObject_TypeCheck(arg, DMPY_STATE(self)->DmCookie_Type)) {
+        PyErr_Format(PyExc_TypeError, "set_cookie() argument must be "
+                     "dmpy.DmCookie, not %.50s", Py_TYPE(arg)->tp_name);
         return NULL;
+    }
+    cookie = (DmCookieObject *) arg;
+
+    DMPY_BUSY_CHECK(cookie->ck_busy, "DmCookie", NULL);
 
     /* The DmTask holds a reference to the cookie object. */
     Py_INCREF(cookie);
@@ -1330,11 +2671,13 @@ fail:
 }
 
 static PyObject *
-DmTask_set_event_nr(DmTaskObject *self, PyObject *args)
+DmTask_set_event_nr(DmTaskObject *self, PyObject *arg)
 {
     int event_nr;
 
-    if (!PyArg_ParseTuple(args, "i:set_event_nr", &event_nr))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &event_nr))
         return NULL;
 
     if (!dm_task_set_event_nr(self->tk_dmt, event_nr)) {
@@ -1347,12 +2690,22 @@ DmTask_set_event_nr(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_set_geometry(DmTaskObject *self, PyObject *args)
+DmTask_set_geometry(DmTaskObject *self, PyObject *const *args,
+                    Py_ssize_t nargs)
 {
-    char *cylinders, *heads, *sectors, *start;
-
-    if (!PyArg_ParseTuple(args, "ssss:set_geometry", &cylinders, &sectors,
-                          &heads, &start))
+    static const char *const kwlist[] = {"cylinders", "heads", "sectors",
+                                         "start", NULL};
+    const char *cylinders, *heads, *sectors, *start;
+    PyObject *argv[4];
+
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("set_geometry", args, nargs, NULL, kwlist, 4, argv)
+        || !_dmpy_str_converter(argv[0], &cylinders)
+        || !_dmpy_str_converter(argv[1], &sectors)
+        || !_dmpy_str_converter(argv[2], &heads)
+        || !_dmpy_str_converter(argv[3], &start))
+        return NULL;
 
     if (!dm_task_set_geometry(self->tk_dmt, cylinders, sectors, heads, start)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask geometry,");
@@ -1364,11 +2717,13 @@ DmTask_set_geometry(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_set_message(DmTaskObject *self, PyObject *args)
+DmTask_set_message(DmTaskObject *self, PyObject *arg)
 {
-    char *message;
+    const char *message;
 
-    if (!PyArg_ParseTuple(args, "s:set_message", &message))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_str_converter(arg, &message))
         return NULL;
 
     if (!dm_task_set_message(self->tk_dmt, message)) {
@@ -1380,11 +2735,13 @@ DmTask_set_message(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_set_sector(DmTaskObject *self, PyObject *args)
+DmTask_set_sector(DmTaskObject *self, PyObject *arg)
 {
     int sector;
 
-    if (!PyArg_ParseTuple(args, "i:set_sector", &sector))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &sector))
         return NULL;
 
     if (!dm_task_set_sector(self->tk_dmt, sector)) {
@@ -1399,6 +2756,8 @@ DmTask_set_sector(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_no_flush(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_no_flush(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask no_flush.");
         return NULL;
@@ -1411,6 +2770,8 @@ DmTask_no_flush(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_no_open_count(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_no_open_count(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask no_open_count.");
         return NULL;
@@ -1423,6 +2784,8 @@ DmTask_no_open_count(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_skip_lockfs(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_skip_lockfs(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask skip_lockfs.");
         return NULL;
@@ -1435,6 +2798,8 @@ DmTask_skip_lockfs(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_query_inactive_table(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_query_inactive_table(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask "
                         "query_inactive_table.");
@@ -1448,6 +2813,8 @@ DmTask_query_inactive_table(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_suppress_identical_reload(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_suppress_identical_reload(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask "
                         "suppress_identical_reload.");
@@ -1461,6 +2828,8 @@ DmTask_suppress_identical_reload(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_secure_data(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_secure_data(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask secure_data.");
         return NULL;
@@ -1473,6 +2842,8 @@ DmTask_secure_data(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_retry_remove(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_retry_remove(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask retry_remove.");
         return NULL;
@@ -1485,6 +2856,8 @@ DmTask_retry_remove(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_deferred_remove(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_deferred_remove(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask deferred_remove.");
         return NULL;
@@ -1497,6 +2870,8 @@ DmTask_deferred_remove(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_set_record_timestamp(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_set_record_timestamp(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to set DmTask record_timestamp.");
         return NULL;
@@ -1514,6 +2889,8 @@ DmTask_get_ioctl_timestamp(DmTaskObject *self, PyObject *args)
     struct dm_timestamp *ts;
     DmTimestampObject *new_ts;
 
+    DmTask_BusyCheck(self);
+
     /* Timestamps can be enabled for any task type (if the device-mapper
      * library supports them), so test first whether an ioctl has been run,
      * and then test for the DMT_HAVE_TIMESTAMP flag separately.
@@ -1532,7 +2909,7 @@ DmTask_get_ioctl_timestamp(DmTaskObject *self, PyObject *args)
         return NULL;
     }
 
-    new_ts = newDmTimestampObject();
+    new_ts = newDmTimestampObject(DMPY_STATE(self));
     if (!new_ts)
         return NULL;
 
@@ -1545,6 +2922,8 @@ DmTask_get_ioctl_timestamp(DmTaskObject *self, PyObject *args)
 static PyObject *
 DmTask_enable_checks(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (!dm_task_enable_checks(self->tk_dmt)) {
         PyErr_SetString(PyExc_OSError, "Failed to enable device-mapper "
                         "task checks.");
@@ -1555,11 +2934,13 @@ DmTask_enable_checks(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_set_add_node(DmTaskObject *self, PyObject *args)
+DmTask_set_add_node(DmTaskObject *self, PyObject *arg)
 {
     int add_node;
 
-    if (!PyArg_ParseTuple(args, "i:set_add_node", &add_node))
+    DmTask_BusyCheck(self);
+
+    if (!_dmpy_int_converter(arg, &add_node))
         return NULL;
 
     if (!dm_task_set_add_node(self->tk_dmt, (dm_add_node_t) add_node)) {
@@ -1572,12 +2953,19 @@ DmTask_set_add_node(DmTaskObject *self, PyObject *args)
 }
 
 static PyObject *
-DmTask_set_read_ahead(DmTaskObject *self, PyObject *args)
+DmTask_set_read_ahead(DmTaskObject *self, PyObject *const *args,
+                      Py_ssize_t nargs)
 {
+    static const char *const kwlist[] = {"read_ahead", "read_ahead_flags",
+                                         NULL};
     unsigned read_ahead, read_ahead_flags;
+    PyObject *argv[2];
 
-    if (!PyArg_ParseTuple(args, "ii:set_read_ahead",
-                         &read_ahead, &read_ahead_flags))
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("set_read_ahead", args, nargs, NULL, kwlist, 2, argv)
+        || !_dmpy_int_converter(argv[0], &read_ahead)
+        || !_dmpy_int_converter(argv[1], &read_ahead_flags))
         goto fail;
 
     if (read_ahead > UINT32_MAX) {
@@ -1603,28 +2991,261 @@ fail:
     return NULL;
 }
 
+/*
+ * PyArg_Parse* "O&" converter for uint64_t sector values: unlike "l" or
+ * "K", values that are negative or do not fit in 64 bits raise
+ * OverflowError rather than being truncated.
+ */
+static int
+_dmpy_uint64_converter(PyObject *o, void *p)
+{
+    unsigned long long value;
+
+    if (!PyLong_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "an integer is required (got type %s)",
+                     Py_TYPE(o)->tp_name);
+        return 0;
+    }
+    value = PyLong_AsUnsignedLongLong(o);
+    if (PyErr_Occurred())
+        return 0;
+    *(uint64_t *) p = (uint64_t) value;
+    return 1;
+}
+
 static PyObject *
-DmTask_add_target(DmTaskObject *self, PyObject *args)
+DmTask_add_target(DmTaskObject *self, PyObject *const *args,
+                  Py_ssize_t nargs)
 {
+    static const char *const kwlist[] = {"start", "size", "ttype", "params",
+                                         NULL};
     uint64_t start, size;
     const char *ttype, *params;
+    PyObject *argv[4];
+
+    DmTask_BusyCheck(self);
 
-    if (!PyArg_ParseTuple(args, "llss:add_target", &start, &size,
-                          &ttype, &params))
+    if (_dmpy_parse_args("add_target", args, nargs, NULL, kwlist, 4, argv)
+        || !_dmpy_uint64_converter(argv[0], &start)
+        || !_dmpy_uint64_converter(argv[1], &size)
+        || !_dmpy_str_converter(argv[2], &ttype)
+        || !_dmpy_str_converter(argv[3], &params))
         return NULL;
 
     if (!dm_task_add_target(self->tk_dmt, start, size, ttype, params)) {
         PyErr_SetString(PyExc_OSError, "Failed to add target to DmTask.");
         return NULL;
     }
+    self->tk_digest = _dmpy_digest_target(self->tk_digest, start, size,
+                                          ttype, params);
 
     Py_INCREF(Py_True);
     return Py_True;
 }
 
+/*
+ * Add every (start, length, target_type, params) tuple in the iterable
+ * targets to dmt, storing the number of targets added in *nr_targets.
+ * Each target added is folded into *digest unless digest is NULL.
+ */
+static int
+_dmpy_task_add_targets(struct dm_task *dmt, PyObject *targets,
+                       uint64_t *nr_targets, uint64_t *digest)
+{
+    PyObject *iter, *item, *tuple;
+    const char *ttype, *params;
+    uint64_t start, size;
+    int r;
+
+    *nr_targets = 0;
+
+    if (!(iter = PyObject_GetIter(targets)))
+        return -1;
+
+    while ((item = PyIter_Next(iter))) {
+        tuple = PyTuple_Check(item) ? (Py_INCREF(item), item)
+                                    : PySequence_Tuple(item);
+        Py_DECREF(item);
+        if (!tuple)
+            goto fail;
+
+        r = PyArg_ParseTuple(tuple, "O&O&ss;targets must be (start, length, "
+                             "target_type, params) tuples",
+                             _dmpy_uint64_converter, &start,
+                             _dmpy_uint64_converter, &size, &ttype, &params)
+            && dm_task_add_target(dmt, start, size, ttype, params);
+
+        if (!r) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_OSError, "Failed to add target " FMTu64
+                             " to DmTask.", *nr_targets);
+            Py_DECREF(tuple);
+            goto fail;
+        }
+        if (digest)
+            *digest = _dmpy_digest_target(*digest, start, size, ttype,
+                                          params);
+        Py_DECREF(tuple);
+        (*nr_targets)++;
+    }
+    Py_DECREF(iter);
+
+    return PyErr_Occurred() ? -1 : 0;
+
+fail:
+    Py_DECREF(iter);
+    return -1;
+}
+
+static PyObject *
+DmTask_add_targets(DmTaskObject *self, PyObject *targets)
+{
+    uint64_t nr_targets;
+
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_task_add_targets(self->tk_dmt, targets, &nr_targets,
+                               &self->tk_digest))
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(nr_targets);
+}
+
+/*
+ * Get a C-contiguous buffer of native uint64_t values from o: either
+ * raw bytes, or an array of 8-byte unsigned integers ("Q", or "L" on
+ * LP64 platforms).
+ */
+static int
+_dmpy_get_uint64_buffer(PyObject *o, Py_buffer *view, const char *what)
+{
+    const char *format;
+
+    if (PyObject_GetBuffer(o, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT))
+        return -1;
+
+    format = view->format ? view->format : "B";
+    if (*format == '@' || *format == '=')
+        format++;
+
+    if ((view->itemsize != 1)
+        && !((view->itemsize == sizeof(uint64_t))
+             && (!strcmp(format, "Q") || !strcmp(format, "L")))) {
+        PyErr_Format(PyExc_TypeError, "%s must be bytes or an array of "
+                     "unsigned 64-bit integers.", what);
+        goto fail;
+    }
+
+    if (view->len % sizeof(uint64_t)) {
+        PyErr_Format(PyExc_ValueError, "%s length is not a multiple of %d "
+                     "bytes.", what, (int) sizeof(uint64_t));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    PyBuffer_Release(view);
+    return -1;
+}
+
+/* The placeholder in add_targets_packed() params for each segment's arg. */
+#define DMPY_TARGET_ARG "{}"
+
+static PyObject *
+DmTask_add_targets_packed(DmTaskObject *self, PyObject *const *args,
+                          Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"segments", "target_type", "params",
+                                         "args", NULL};
+    PyObject *argv[4], *segments, *arg_values, *ret = NULL;
+    Py_buffer seg_view, arg_view = {NULL};
+    uint64_t i, nr_segments, seg[2], arg;
+    const char *ttype, *params, *hole;
+    char *buf = NULL, *p;
+    size_t head_len, tail_len;
+
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("add_targets_packed", args, nargs, kwnames, kwlist,
+                         3, argv)
+        || !_dmpy_str_converter(argv[1], &ttype)
+        || !_dmpy_str_converter(argv[2], &params))
+        return NULL;
+    segments = argv[0];
+    arg_values = argv[3];
+
+    if (_dmpy_get_uint64_buffer(segments, &seg_view, "segments"))
+        return NULL;
+
+    if (seg_view.len % (2 * sizeof(uint64_t))) {
+        PyErr_SetString(PyExc_ValueError, "segments must hold (start, "
+                        "length) pairs.");
+        goto out;
+    }
+    nr_segments = (uint64_t) seg_view.len / (2 * sizeof(uint64_t));
+
+    hole = strstr(params, DMPY_TARGET_ARG);
+    if (arg_values == Py_None)
+        arg_values = NULL;
+    if (!hole != !arg_values) {
+        PyErr_SetString(PyExc_ValueError, "args must be given if and only if "
+                        "params contains \"" DMPY_TARGET_ARG "\".");
+        goto out;
+    }
+
+    if (arg_values) {
+        if (_dmpy_get_uint64_buffer(arg_values, &arg_view, "args"))
+            goto out;
+        if ((uint64_t) arg_view.len / sizeof(uint64_t) != nr_segments) {
+            PyErr_SetString(PyExc_ValueError, "args must hold one value for "
+                            "each segment.");
+            goto out;
+        }
+
+        /* params with the placeholder replaced by a 20-digit value. */
+        head_len = (size_t) (hole - params);
+        tail_len = strlen(hole + strlen(DMPY_TARGET_ARG));
+        if (!(buf = PyMem_Malloc(head_len + tail_len + 21))) {
+            PyErr_NoMemory();
+            goto out;
+        }
+        memcpy(buf, params, head_len);
+    }
+
+    for (i = 0; i < nr_segments; i++) {
+        memcpy(seg, (char *) seg_view.buf + i * sizeof(seg), sizeof(seg));
+        if (buf) {
+            memcpy(&arg, (char *) arg_view.buf + i * sizeof(arg), sizeof(arg));
+            p = buf + head_len;
+            p += sprintf(p, FMTu64, arg);
+            memcpy(p, hole + strlen(DMPY_TARGET_ARG), tail_len + 1);
+        }
+        if (!dm_task_add_target(self->tk_dmt, seg[0], seg[1], ttype,
+                                buf ? buf : params)) {
+            PyErr_Format(PyExc_OSError, "Failed to add target " FMTu64
+                         " to DmTask.", i);
+            goto out;
+        }
+        self->tk_digest = _dmpy_digest_target(self->tk_digest, seg[0],
+                                              seg[1], ttype,
+                                              buf ? buf : params);
+    }
+
+    ret = PyLong_FromUnsignedLongLong(nr_segments);
+
+out:
+    PyMem_Free(buf);
+    if (arg_view.obj)
+        PyBuffer_Release(&arg_view);
+    PyBuffer_Release(&seg_view);
+    return ret;
+}
+
 static PyObject *
 DmTask_get_errno(DmTaskObject *self, PyObject *args)
 {
+    DmTask_BusyCheck(self);
+
     if (_DmTask_check_data_flags(self, -1, "get_errno"))
         return NULL;
 
@@ -1634,6 +3255,356 @@ DmTask_get_errno(DmTaskObject *self, PyObject *args)
     return Py_BuildValue("i", dm_task_get_errno(self->tk_dmt));
 }
 
+/*
+ * DmTaskTargetIterator objects.
+ *
+ * A DmTaskTargetIterator walks the target list of a TABLE or STATUS task
+ * with dm_get_next_target(), producing one (start, length, target_type,
+ * params) tuple per step directly from the task's ioctl buffer. It holds
+ * a reference to its DmTask and is invalidated if the task is run again,
+ * since that replaces the buffer.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    DmTaskObject *ti_task;
+    uint64_t ti_sequence; /* tk_sequence of the task when created */
+    void *ti_next; /* dm_get_next_target() cursor */
+    int ti_done;
+    int ti_raw; /* return params as bytes rather than str */
+} DmTaskTargetIteratorObject;
+
+
+static void
+DmTaskTargetIterator_dealloc(DmTaskTargetIteratorObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    Py_XDECREF(self->ti_task);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+DmTaskTargetIterator_next(DmTaskTargetIteratorObject *self)
+{
+    DmTaskObject *task = self->ti_task;
+    uint64_t start, length;
+    char *target_type, *params;
+    PyObject *value;
+
+    if (self->ti_done)
+        return NULL;
+
+    DmTask_BusyCheck(task);
+
+    if (self->ti_sequence != task->tk_sequence) {
+        PyErr_SetString(PyExc_LookupError, "Attempt to access targets in "
+                        "a DmTask that has been run again.");
+        return NULL;
+    }
+
+    self->ti_next = dm_get_next_target(task->tk_dmt, self->ti_next, &start,
+                                       &length, &target_type, &params);
+
+    /* An empty table returns a NULL target type from the first call. */
+    if (!target_type) {
+        self->ti_done = 1;
+        return NULL;
+    }
+    if (!self->ti_next)
+        self->ti_done = 1;
+
+    if (self->ti_raw)
+        value = Py_BuildValue("(KKsy)", (unsigned long long) start,
+                              (unsigned long long) length, target_type,
+                              params ? params : "");
+    else
+        value = Py_BuildValue("(KKss)", (unsigned long long) start,
+                              (unsigned long long) length, target_type,
+                              params ? params : "");
+    return value;
+}
+
+#define DMTASKTARGETITER__doc__ \
+"Iterator over the targets of a TABLE or STATUS DmTask."
+
+static PyType_Slot DmTaskTargetIterator_slots[] = {
+    {Py_tp_dealloc, DmTaskTargetIterator_dealloc},
+    {Py_tp_doc, DMTASKTARGETITER__doc__},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, DmTaskTargetIterator_next},
+    {0, NULL}
+};
+
+static PyType_Spec DmTaskTargetIterator_spec = {
+    "dmpy.DmTaskTargetIterator", /*name*/
+    sizeof(DmTaskTargetIteratorObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmTaskTargetIterator_slots, /*slots*/
+};
+
+static PyObject *
+DmTask_targets(DmTaskObject *self, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"raw", NULL};
+    DmTaskTargetIteratorObject *iter;
+    PyObject *argv[1];
+    uint32_t flag;
+    int raw = 0;
+
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("targets", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_bool_converter(argv[0], &raw))
+        return NULL;
+
+    flag = (self->tk_flags & DMT_HAVE_TABLE) ? DMT_HAVE_TABLE
+                                             : DMT_HAVE_STATUS;
+    if (_DmTask_check_data_flags(self, flag, "targets"))
+        return NULL;
+
+    if (!(iter = PyObject_New(DmTaskTargetIteratorObject,
+                              DMPY_STATE(self)->DmTaskTargetIterator_Type)))
+        return NULL;
+
+    Py_INCREF(self);
+    iter->ti_task = self;
+    iter->ti_sequence = self->tk_sequence;
+    iter->ti_next = NULL;
+    iter->ti_done = (self->tk_flags & DMT_DID_ERROR) ? 1 : 0;
+    iter->ti_raw = raw;
+    return (PyObject *) iter;
+}
+
+static PyObject *
+DmTask_table_digest(DmTaskObject *self, PyObject *args)
+{
+    DmTask_BusyCheck(self);
+
+    /* The targets of a load are only known to the library once added. */
+    if (self->tk_type == DM_DEVICE_RELOAD)
+        return _dmpy_digest_to_object(self->tk_digest);
+
+    if (_DmTask_check_data_flags(self, DMT_HAVE_TABLE, "table_digest"))
+        return NULL;
+
+    return _dmpy_digest_to_object(_dmpy_table_digest(self->tk_dmt));
+}
+
+/*
+ * Return the apply_if_changed() cache key for task: its uuid, name, or
+ * (major, minor), or NULL with ValueError set if none is set.
+ */
+static PyObject *
+_DmTask_device_key(DmTaskObject *self)
+{
+    if (self->tk_uuid) {
+        Py_INCREF(self->tk_uuid);
+        return self->tk_uuid;
+    }
+    if (self->tk_name) {
+        Py_INCREF(self->tk_name);
+        return self->tk_name;
+    }
+    if ((self->tk_major >= 0) && (self->tk_minor >= 0))
+        return Py_BuildValue("(ii)", self->tk_major, self->tk_minor);
+
+    PyErr_SetString(PyExc_ValueError, "apply_if_changed() needs a name, "
+                    "uuid or major and minor number to be set.");
+    return NULL;
+}
+
+/*
+ * Run a query of DM_DEVICE_* type for the device of self with the GIL
+ * released, storing the device's event_nr in *event_nr, and its table
+ * digest in *digest for a TABLE query. Returns 0 on success, 1 if the
+ * device or its live table does not exist, or -1 with an exception set.
+ */
+static int
+_DmTask_query_device(DmTaskObject *self, int type, uint32_t *event_nr,
+                     uint64_t *digest)
+{
+    struct dm_task *dmt;
+    struct dm_info info;
+    uint64_t start, elapsed;
+    int node_lock, r;
+
+    if (!(dmt = dm_task_create(type))
+        || (self->tk_uuid
+            && !dm_task_set_uuid(dmt, PyUnicode_AsUTF8(self->tk_uuid)))
+        || (!self->tk_uuid && self->tk_name
+            && !dm_task_set_name(dmt, PyUnicode_AsUTF8(self->tk_name)))
+        || (!self->tk_uuid && !self->tk_name
+            && !dm_task_set_major_minor(dmt, self->tk_major,
+                                        self->tk_minor, 0))) {
+        PyErr_SetString(PyExc_OSError, "Failed to create DmTask query.");
+        goto fail;
+    }
+
+    node_lock = _DmTask_needs_node_lock(type);
+
+    Py_BEGIN_ALLOW_THREADS
+    DMPY_NODE_LOCK(node_lock);
+    start = _dmpy_ioctl_start();
+    r = dm_task_run(dmt);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMPY_NODE_UNLOCK(node_lock);
+    Py_END_ALLOW_THREADS
+
+    _dmpy_ioctl_record(type, elapsed, r);
+
+    if (r)
+        _dmpy_control_ready = 1;
+
+    /* A table query of a missing device fails: the load will report it. */
+    if (!r || !dm_task_get_info(dmt, &info) || !info.exists
+        || !info.live_table) {
+        dm_task_destroy(dmt);
+        return 1;
+    }
+
+    *event_nr = info.event_nr;
+    if (digest)
+        *digest = _dmpy_table_digest(dmt);
+    dm_task_destroy(dmt);
+    return 0;
+
+fail:
+    if (dmt)
+        dm_task_destroy(dmt);
+    return -1;
+}
+
+/*
+ * Read a (event_nr, digest) apply_if_changed() cache entry. Returns 1 if
+ * entry is valid, or 0 if it is not and should be replaced.
+ */
+static int
+_dmpy_digest_cache_entry(PyObject *entry, uint32_t *event_nr,
+                         uint64_t *digest)
+{
+    unsigned long long value;
+    unsigned long nr;
+    const char *str;
+    char *end;
+
+    if (!PyTuple_Check(entry) || (PyTuple_GET_SIZE(entry) != 2)
+        || !PyLong_Check(PyTuple_GET_ITEM(entry, 0))
+        || !PyUnicode_Check(PyTuple_GET_ITEM(entry, 1)))
+        return 0;
+
+    nr = PyLong_AsUnsignedLong(PyTuple_GET_ITEM(entry, 0));
+    if (PyErr_Occurred() || (nr > UINT32_MAX)
+        || !(str = PyUnicode_AsUTF8(PyTuple_GET_ITEM(entry, 1)))) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    errno = 0;
+    value = strtoull(str, &end, 16);
+    if (errno || (end == str) || *end)
+        return 0;
+
+    *event_nr = (uint32_t) nr;
+    *digest = (uint64_t) value;
+    return 1;
+}
+
+static PyObject *DmTask_run(DmTaskObject *self, PyObject *args);
+
+static PyObject *
+DmTask_apply_if_changed(DmTaskObject *self, PyObject *const *args,
+                        Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"cache", NULL};
+    PyObject *argv[1], *cache, *key, *entry = NULL, *ret = NULL;
+    uint32_t event_nr = 0, cached_event_nr = 0;
+    uint64_t digest = 0, cached_digest = 0;
+    int cached = 0, hit = 0, r = 0;
+
+    DmTask_BusyCheck(self);
+
+    if (_dmpy_parse_args("apply_if_changed", args, nargs, kwnames, kwlist, 0,
+                         argv))
+        return NULL;
+    cache = (argv[0] == Py_None) ? NULL : argv[0];
+
+    if (self->tk_type != DM_DEVICE_RELOAD) {
+        PyErr_SetString(PyExc_TypeError, "apply_if_changed() requires a "
+                        "DmTask(DM_DEVICE_RELOAD).");
+        return NULL;
+    }
+
+    if (cache && !PyDict_Check(cache)) {
+        PyErr_SetString(PyExc_TypeError, "cache must be a dict.");
+        return NULL;
+    }
+
+    if (!(key = _DmTask_device_key(self)))
+        return NULL;
+
+    if (cache && !(entry = PyDict_GetItemWithError(cache, key))
+        && PyErr_Occurred())
+        goto out;
+    if (entry)
+        cached = _dmpy_digest_cache_entry(entry, &cached_event_nr,
+                                          &cached_digest);
+
+    /* Claim the task while the queries run without the GIL. */
+    if (_dmpy_busy_claim(&self->tk_busy, "DmTask"))
+        goto out;
+
+    /* A cached digest is valid while the device's event_nr is unchanged:
+     * an INFO query avoids reading back the whole table. */
+    if (cached) {
+        r = _DmTask_query_device(self, DM_DEVICE_INFO, &event_nr, NULL);
+        hit = !r && (event_nr == cached_event_nr);
+        digest = cached_digest;
+    }
+    if (!r && !hit)
+        r = _DmTask_query_device(self, DM_DEVICE_TABLE, &event_nr, &digest);
+
+    self->tk_busy = 0;
+    if (r < 0)
+        goto out;
+
+    if (!r && (digest == self->tk_digest)) {
+        if (cache && !hit) {
+            if (!(entry = Py_BuildValue("(IN)", (unsigned int) event_nr,
+                                        _dmpy_digest_to_object(digest))))
+                goto out;
+            r = PyDict_SetItem(cache, key, entry);
+            Py_DECREF(entry);
+            if (r)
+                goto out;
+        }
+        Py_INCREF(Py_False);
+        ret = Py_False;
+        goto out;
+    }
+
+    /* The live table changes when the new table is resumed, which need
+     * not change event_nr: drop the entry for the device. */
+    if (cache && entry && PyDict_DelItem(cache, key)) {
+        if (!PyErr_ExceptionMatches(PyExc_KeyError))
+            goto out;
+        PyErr_Clear();
+    }
+
+    if (!(ret = DmTask_run(self, NULL)))
+        goto out;
+    Py_DECREF(ret);
+    Py_INCREF(Py_True);
+    ret = Py_True;
+
+out:
+    Py_DECREF(key);
+    return ret;
+}
+
 #define DMTASK_set_name__doc__ \
 "Set the device-mapper name of this `DmTask`."
 
@@ -1764,24 +3735,72 @@ DmTask_get_errno(DmTaskObject *self, PyObject *args)
 "Add a target to this DmTask in preparation for a DM_DEVICE_CREATE " \
 "or DM_DEVICE_RELOAD command."
 
+#define DMTASK_add_targets__doc__ \
+"Add every (start, length, target_type, params) tuple in the iterable\n" \
+"targets to this DmTask, as for add_target(), in a single call. Returns\n" \
+"the number of targets added. If an error occurs the targets before the\n" \
+"failing one have already been added and the task should be discarded."
+
+#define DMTASK_add_targets_packed__doc__ \
+"Add one target of type target_type for each (start, length) pair in\n"  \
+"segments, a buffer of native unsigned 64-bit integers (bytes, or an\n"   \
+"array.array('Q')). Every target uses the params template: if args,\n"    \
+"a buffer of one unsigned 64-bit value for each segment, is given, the\n" \
+"first \"{}\" in params is replaced by that segment's value, e.g.\n\n"       \
+"    dmt.add_targets_packed(segs, \"linear\", \"/dev/sda {}\", offsets)\n\n" \
+"Returns the number of targets added. If an error occurs the targets\n"  \
+"before the failing one have already been added and the task should be\n" \
+"discarded."
+
 #define DMTASK_get_errno__doc__ \
 "The `errno` from the last device-mapper ioctl performed by `DmTask.run`."
 
+#define DMTASK_targets__doc__ \
+"Return an iterator over the targets of a DM_DEVICE_TABLE or\n"          \
+"DM_DEVICE_STATUS task yielding (start, length, target_type, params)\n" \
+"tuples. If `raw=True`, params are returned as bytes copied directly\n"  \
+"from the ioctl buffer rather than decoded to str. Running the task\n"   \
+"again invalidates any outstanding iterators."
+
+#define DMTASK_table_digest__doc__ \
+"Return a stable digest of a table as a 16 digit hex string: of the\n"      \
+"targets added to a DM_DEVICE_RELOAD task, or of the table returned by\n"   \
+"a DM_DEVICE_TABLE task that has been run. Runs of whitespace in target\n"  \
+"params are not significant, so a table digests the same as the table\n"    \
+"read back from the kernel when its params are written in the form a\n"     \
+"TABLE query reports (for example, devices as major:minor)."
+
+#define DMTASK_apply_if_changed__doc__ \
+"Run this DM_DEVICE_RELOAD task only if its table_digest() differs from\n"  \
+"the digest of the device's live table, and return True if the table\n"     \
+"was loaded or False if the device already has this table.\n\n"             \
+"The device is the one named by set_uuid(), set_name() or the major and\n"  \
+"minor numbers set on the task, and its live table is read with a\n"        \
+"DM_DEVICE_TABLE query. A device with no live table is always loaded.\n\n"  \
+"cache - An optional dict of (event_nr, digest) tuples keyed by device\n"   \
+"        uuid, name or (major, minor). A cached digest is trusted while\n"  \
+"        the device's event_nr is unchanged, so that an unchanged device\n" \
+"        costs a DM_DEVICE_INFO query rather than reading back its\n"       \
+"        table. The kernel does not change event_nr for every table\n"      \
+"        swap: the entry of each device loaded is dropped, and a cache\n"   \
+"        should only be kept while this process is the one reloading\n"     \
+"        the devices in it."
+
 #define DMTASK___doc__ \
 ""
 
 static PyMethodDef DmTask_methods[] = {
-    {"set_name", (PyCFunction)DmTask_set_name, METH_VARARGS,
+    {"set_name", (PyCFunction)DmTask_set_name, METH_O,
         PyDoc_STR(DMTASK_set_name__doc__)},
-    {"set_uuid", (PyCFunction)DmTask_set_uuid, METH_VARARGS,
+    {"set_uuid", (PyCFunction)DmTask_set_uuid, METH_O,
         PyDoc_STR(DMTASK_set_uuid__doc__)},
-    {"run", (PyCFunction)DmTask_run, METH_VARARGS,
+    {"run", (PyCFunction)DmTask_run, METH_NOARGS,
         PyDoc_STR(DMTASK_run__doc__)},
     {"get_driver_version", (PyCFunction)DmTask_get_driver_version, METH_NOARGS,
         PyDoc_STR(DMTASK_get_driver_version__doc__)},
     {"get_info", (PyCFunction)DmTask_get_info, METH_NOARGS,
         PyDoc_STR(DMTASK_get_info__doc__)},
-    {"get_uuid", (PyCFunction)DmTask_get_uuid, METH_VARARGS | METH_KEYWORDS,
+    {"get_uuid", (PyCFunction)DmTask_get_uuid, METH_FASTCALL | METH_KEYWORDS,
         PyDoc_STR(DMTASK_get_uuid__doc__)},
     {"get_deps", (PyCFunction)DmTask_get_deps, METH_NOARGS,
         PyDoc_STR(DMTASK_get_deps__doc__)},
@@ -1789,37 +3808,38 @@ static PyMethodDef DmTask_methods[] = {
         PyDoc_STR(DMTASK_get_versions__doc__)},
     {"get_message_response", (PyCFunction)DmTask_get_message_response,
         METH_NOARGS, PyDoc_STR(DMTASK_get_message_response__doc__)},
-    {"get_name", (PyCFunction)DmTask_get_name, METH_VARARGS | METH_KEYWORDS,
+    {"get_name", (PyCFunction)DmTask_get_name, METH_FASTCALL | METH_KEYWORDS,
         PyDoc_STR(DMTASK_get_name__doc__)},
     {"get_names", (PyCFunction)DmTask_get_names, METH_NOARGS,
         PyDoc_STR(DMTASK_get_names__doc__)},
     {"set_ro", (PyCFunction)DmTask_set_ro, METH_NOARGS,
         PyDoc_STR(DMTASK_set_ro__doc__)},
-    {"set_newname", (PyCFunction)DmTask_set_newname, METH_VARARGS,
+    {"set_newname", (PyCFunction)DmTask_set_newname, METH_O,
         PyDoc_STR(DMTASK_set_newname__doc__)},
-    {"set_newuuid", (PyCFunction)DmTask_set_newuuid, METH_VARARGS,
+    {"set_newuuid", (PyCFunction)DmTask_set_newuuid, METH_O,
         PyDoc_STR(DMTASK_set_newuuid__doc__)},
-    {"set_major", (PyCFunction)DmTask_set_major, METH_VARARGS,
+    {"set_major", (PyCFunction)DmTask_set_major, METH_O,
         PyDoc_STR(DMTASK_set_major__doc__)},
-    {"set_minor", (PyCFunction)DmTask_set_minor, METH_VARARGS,
+    {"set_minor", (PyCFunction)DmTask_set_minor, METH_O,
         PyDoc_STR(DMTASK_set_minor__doc__)},
     {"set_major_minor", (PyCFunction)DmTask_set_major_minor,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMTASK_set_major_minor__doc__)},
-    {"set_uid", (PyCFunction)DmTask_set_uid, METH_VARARGS,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMTASK_set_major_minor__doc__)},
+    {"set_uid", (PyCFunction)DmTask_set_uid, METH_O,
         PyDoc_STR(DMTASK_set_uid__doc__)},
-    {"set_gid", (PyCFunction)DmTask_set_gid, METH_VARARGS,
+    {"set_gid", (PyCFunction)DmTask_set_gid, METH_O,
         PyDoc_STR(DMTASK_set_gid__doc__)},
-    {"set_mode", (PyCFunction)DmTask_set_mode, METH_VARARGS,
+    {"set_mode", (PyCFunction)DmTask_set_mode, METH_O,
         PyDoc_STR(DMTASK_set_mode__doc__)},
-    {"set_cookie", (PyCFunction)DmTask_set_cookie, METH_VARARGS,
+    {"set_cookie", (PyCFunction)DmTask_set_cookie, METH_O,
         PyDoc_STR(DMTASK_set_cookie__doc__)},
-    {"set_event_nr", (PyCFunction)DmTask_set_event_nr, METH_VARARGS,
+    {"set_event_nr", (PyCFunction)DmTask_set_event_nr, METH_O,
         PyDoc_STR(DMTASK_set_event_nr__doc__)},
-    {"set_geometry", (PyCFunction)DmTask_set_geometry, METH_VARARGS,
+    {"set_geometry", (PyCFunction)DmTask_set_geometry, METH_FASTCALL,
         PyDoc_STR(DMTASK_set_geometry__doc__)},
-    {"set_message", (PyCFunction)DmTask_set_message, METH_VARARGS,
+    {"set_message", (PyCFunction)DmTask_set_message, METH_O,
         PyDoc_STR(DMTASK_set_message__doc__)},
-    {"set_sector", (PyCFunction)DmTask_set_sector, METH_VARARGS,
+    {"set_sector", (PyCFunction)DmTask_set_sector, METH_O,
         PyDoc_STR(DMTASK_set_sector__doc__)},
     {"no_flush", (PyCFunction)DmTask_no_flush, METH_NOARGS,
         PyDoc_STR(DMTASK_no_flush__doc__)},
@@ -1843,1997 +3863,12570 @@ static PyMethodDef DmTask_methods[] = {
         PyDoc_STR(DMTASK_get_ioctl_timestamp__doc__)},
     {"enable_checks", (PyCFunction)DmTask_enable_checks, METH_NOARGS,
         PyDoc_STR(DMTASK_enable_checks__doc__)},
-    {"set_add_node", (PyCFunction)DmTask_set_add_node, METH_VARARGS,
+    {"set_add_node", (PyCFunction)DmTask_set_add_node, METH_O,
         PyDoc_STR(DMTASK_set_add_node__doc__)},
-    {"set_read_ahead", (PyCFunction)DmTask_set_read_ahead, METH_VARARGS,
+    {"set_read_ahead", (PyCFunction)DmTask_set_read_ahead, METH_FASTCALL,
         PyDoc_STR(DMTASK_set_read_ahead__doc__)},
-    {"add_target", (PyCFunction)DmTask_add_target, METH_VARARGS,
+    {"add_target", (PyCFunction)DmTask_add_target, METH_FASTCALL,
         PyDoc_STR(DMTASK_add_target__doc__)},
-    {"get_errno", (PyCFunction)DmTask_get_errno, METH_VARARGS,
+    {"add_targets", (PyCFunction)DmTask_add_targets, METH_O,
+        PyDoc_STR(DMTASK_add_targets__doc__)},
+    {"add_targets_packed", (PyCFunction)DmTask_add_targets_packed,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMTASK_add_targets_packed__doc__)},
+    {"targets", (PyCFunction)DmTask_targets, METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMTASK_targets__doc__)},
+    {"table_digest", (PyCFunction)DmTask_table_digest, METH_NOARGS,
+        PyDoc_STR(DMTASK_table_digest__doc__)},
+    {"apply_if_changed", (PyCFunction)DmTask_apply_if_changed,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMTASK_apply_if_changed__doc__)},
+    {"get_errno", (PyCFunction)DmTask_get_errno, METH_NOARGS,
         PyDoc_STR(DMTASK_get_errno__doc__)},
     {NULL, NULL}           /* sentinel */
 };
 
-static PyTypeObject DmTask_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmTask",             /*tp_name*/
-    sizeof(DmTaskObject),          /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmTask_dealloc,    /*tp_dealloc*/
-    0,                             /*tp_print*/
-    0,                             /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,         /*tp_flags*/
-    0,                          /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmTask_methods,                /*tp_methods*/
-    0,                          /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmTask_init,      /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
+static PyType_Slot DmTask_slots[] = {
+    {Py_tp_dealloc, DmTask_dealloc},
+    {Py_tp_methods, DmTask_methods},
+    {Py_tp_init, DmTask_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmTask_spec = {
+    "dmpy.DmTask",              /*name*/
+    sizeof(DmTaskObject),       /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*flags*/
+    DmTask_slots,               /*slots*/
 };
 
 
 /*
- * DmStats objects.
+ * DmEventMonitor objects.
+ *
+ * A DmEventMonitor watches every device-mapper device for events using
+ * the control device poll interface (DM_DEV_ARM_POLL): the monitor holds
+ * its own file descriptor for the control device, which becomes readable
+ * once any device event, or a device create, remove or rename, has
+ * occurred since the descriptor was last armed.
+ *
+ * The monitor keeps an index of the event_nr of each device from the
+ * DM_DEVICE_LIST results, which carry the event number of every device
+ * since interface version 4.37 (the version that introduced ARM_POLL).
+ * changes() re-arms the descriptor, lists the devices, and reports the
+ * difference from the previous index.
  */
 
 typedef struct {
     PyObject_HEAD
-    struct dm_stats *ds_dms;
-    uint64_t ds_sequence; /* sequence number protecting ds_dms */
-    PyObject **ds_regions; /* region cache */
-    Py_ssize_t ds_regions_len; /* length of the region cache in regions. */
-} DmStatsObject;
-
-static PyTypeObject DmStats_Type;
+    int em_fd; /* control device file descriptor, or -1 */
+    PyObject *em_index; /* dict mapping device name to event_nr */
+    int em_busy; /* set while an ioctl or poll is in progress */
+} DmEventMonitorObject;
 
-#define DmStatsObject_Check(v)      (Py_TYPE(v) == &DmStats_Type)
 
-typedef struct {
-    PyObject_HEAD
-    PyObject *dr_stats;
-    uint64_t dr_sequence;
-    uint64_t dr_region_id;
-    PyObject *dr_weakreflist;
-    PyObject **dr_areas;
-    Py_ssize_t dr_areas_len;
-} DmStatsRegionObject;
+#define DmEventMonitor_BusyCheck(o, ret) \
+    DMPY_BUSY_CHECK((o)->em_busy, "DmEventMonitor", ret)
 
-static PyTypeObject DmStatsRegion_Type;
+static void
+_DmEventMonitor_close(DmEventMonitorObject *self)
+{
+    if (self->em_fd >= 0)
+        close(self->em_fd);
+    self->em_fd = -1;
+    Py_CLEAR(self->em_index);
+}
 
-#define DmStatsRegionObject_Check(v)      (Py_TYPE(v) == &DmStatsRegion_Type)
+static void
+DmEventMonitor_dealloc(DmEventMonitorObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
 
-#define DMSTATS_FROM_REGION(r) ((DmStatsObject *)((r)->dr_stats))
-#define DMS_FROM_REGION(r) (DMSTATS_FROM_REGION((r))->ds_dms)
+    _DmEventMonitor_close(self);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
 
-typedef struct {
-    PyObject_HEAD
-    PyObject *da_stats;
-    uint64_t da_sequence;
-    PyObject *da_weakreflist;
-    uint64_t da_region_id;
-    uint64_t da_area_id;
-} DmStatsAreaObject;
+#define DmEventMonitor_ClosedCheck(o, ret)                              \
+do {                                                                    \
+    if ((o)->em_fd < 0) {                                               \
+        PyErr_SetString(PyExc_ValueError, "DmEventMonitor is closed."); \
+        return ret;                                                     \
+    }                                                                   \
+} while (0)
 
-static PyTypeObject DmStatsArea_Type;
+/*
+ * Arm the monitor's control device descriptor: it becomes readable on the
+ * next event. Must be called with the GIL released.
+ */
+static int
+_dmpy_arm_poll(int fd)
+{
+    struct dm_ioctl dmi;
 
-#define DmStatsAreaObject_Check(v)      (Py_TYPE(v) == &DmStatsArea_Type)
+    memset(&dmi, 0, sizeof(dmi));
+    dmi.version[0] = DM_VERSION_MAJOR;
+    dmi.version[1] = DM_VERSION_MINOR;
+    dmi.version[2] = DM_VERSION_PATCHLEVEL;
+    dmi.data_size = sizeof(dmi);
+    dmi.data_start = sizeof(dmi);
 
-#define DMSTATS_FROM_AREA(a) ((DmStatsObject *)((a)->da_stats))
-#define DMS_FROM_AREA(a) (DMSTATS_FROM_AREA((a))->ds_dms)
+    return ioctl(fd, DM_DEV_ARM_POLL, &dmi);
+}
 
-static void
-DmStats_dealloc(DmStatsObject *self)
+/*
+ * Return a pointer to the event number that follows the name of a
+ * DM_DEVICE_LIST entry.
+ */
+static const uint32_t *
+_dmpy_names_event_nr(const struct dm_names *names)
 {
-    if (self->ds_dms)
-        dm_stats_destroy(self->ds_dms);
-    self->ds_dms = NULL;
-    if (self->ds_regions) {
-        PyMem_Free(self->ds_regions);
-        self->ds_regions = NULL;
-        self->ds_regions_len = 0;
-    }
-    self->ds_sequence = UINT64_MAX;
-    Py_TYPE(self)->tp_free(self);
+    uintptr_t p = (uintptr_t) (names->name + strlen(names->name) + 1);
+
+    return (const uint32_t *) ((p + 7) & ~(uintptr_t) 7);
 }
 
+/*
+ * Arm the monitor and build a new index of the event_nr of each device.
+ * Returns a new dict, or NULL with an exception set.
+ */
 static PyObject *
-DmStats_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+_DmEventMonitor_scan(DmEventMonitorObject *self)
 {
-    DmStatsObject *obj;
-
-    if (type == &DmStats_Type) {
-        PyErr_BadInternalCall();
-        return NULL;
-    }
-
-    if (!(obj = (DmStatsObject *) type->tp_alloc(&DmStats_Type, 0)))
-        return NULL;
+    struct dm_task *dmt;
+    struct dm_names *names;
+    PyObject *index = NULL, *event_nr;
+    int node_lock, r, err = 0;
+    uint64_t start, elapsed = UINT64_MAX;
+    unsigned next = 0;
 
-    obj->ds_dms = NULL;
-    obj->ds_sequence = 0;
-    obj->ds_regions = NULL;
-    obj->ds_regions_len = 0;
+    DMPY_BUSY_CLAIM(self->em_busy, "DmEventMonitor", NULL);
 
-    return (PyObject *) obj;
-}
+    if (!(dmt = dm_task_create(DM_DEVICE_LIST))) {
+        self->em_busy = 0;
+        return PyErr_NoMemory();
+    }
 
-#define DMSTATS__init__KWARG_ERR "Please specify one of name=, uuid=, or " \
-"major= and minor= keyword arguments."
-static int
-DmStats_init(DmStatsObject *self, PyObject *args, PyObject *kwds)
-{
-    static char *kwlist[] = {"program_id",
-                             "name", "uuid", "major", "minor", NULL};
-    const char *program_id = NULL, *name = NULL, *uuid = NULL;
-    int major = 0, minor = 0;
+    node_lock = _DmTask_needs_node_lock(DM_DEVICE_LIST);
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "z|ssii:__init__", kwlist,
-                                     &program_id, &name, &uuid, &major, &minor))
-        return -1;
+    /* Arm before listing so that an event racing with the scan is
+     * reported by the next poll rather than lost. */
+    Py_BEGIN_ALLOW_THREADS
+    if (_dmpy_arm_poll(self->em_fd) < 0) {
+        err = errno;
+        r = 0;
+    } else {
+        DMPY_NODE_LOCK(node_lock);
+        start = _dmpy_ioctl_start();
+        r = dm_task_run(dmt);
+        elapsed = _dmpy_ioctl_elapsed(start);
+        if (r)
+            _dmpy_control_ready = 1;
+        DMPY_NODE_UNLOCK(node_lock);
+    }
+    Py_END_ALLOW_THREADS
+    _dmpy_ioctl_record(DM_DEVICE_LIST, elapsed, r);
+    self->em_busy = 0;
 
-    if (name) {
-        if (uuid || major || minor) {
-            PyErr_SetString(PyExc_TypeError, DMSTATS__init__KWARG_ERR);
-            return -1;
-        }
+    if (err) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto out;
     }
 
-    if (uuid) {
-        if (major || minor) {
-            PyErr_SetString(PyExc_TypeError, DMSTATS__init__KWARG_ERR);
-            return -1;
-        }
+    if (!r) {
+        PyErr_SetString(PyExc_OSError, "Failed to list device-mapper "
+                        "devices.");
+        goto out;
     }
 
-    self->ds_dms = dm_stats_create(program_id);
+    if (!(index = PyDict_New()))
+        goto out;
 
-    if (!self->ds_dms) {
-        PyErr_SetString(PyExc_MemoryError, "Failed to allocated "
-                        "DmStats handle.");
-        return -1;
-    }
+    /* An empty list has a single entry with a zero dev. */
+    if (!(names = dm_task_get_names(dmt)) || !names->dev)
+        goto out;
 
-    if (name) {
-        if (!dm_stats_bind_name(self->ds_dms, name)) {
-            PyErr_SetString(PyExc_OSError, "Failed to bind name to "
-                            "DmStatst handle.");
-            goto fail;
-        }
-    } else if (uuid) {
-        if (!dm_stats_bind_uuid(self->ds_dms, uuid)) {
-            PyErr_SetString(PyExc_OSError, "Failed to bind uuid to "
-                            "DmStatst handle.");
-            goto fail;
-        }
-    } else if (major) {
-        if (!minor) {
-            PyErr_SetString(PyExc_ValueError,"Missing minor= keyword "
-                                             "argument.");
+    do {
+        names = (struct dm_names *)((char *) names + next);
+        if (!(event_nr = PyLong_FromUnsignedLong(
+                            *_dmpy_names_event_nr(names))))
             goto fail;
-        }
-        if (!dm_stats_bind_devno(self->ds_dms, major, minor)) {
-            PyErr_SetString(PyExc_OSError, "Failed to bind devno to "
-                            "DmStatst handle.");
+        if (PyDict_SetItemString(index, names->name, event_nr)) {
+            Py_DECREF(event_nr);
             goto fail;
         }
-    } else if (minor) {
-            PyErr_SetString(PyExc_ValueError,"Missing major= keyword "
-                                             "argument.");
-            goto fail;
-    }
-
-    return 0;
-fail:
-    dm_stats_destroy(self->ds_dms);
-    return -1;
-}
-
-static int
-DmStats_traverse(DmStatsObject *self, visitproc visit, void *arg)
-{
-    int i;
+        Py_DECREF(event_nr);
+        next = names->next;
+    } while (next);
 
-    if (!self->ds_regions)
-        return 0;
+out:
+    dm_task_destroy(dmt);
+    return index;
 
-    for (i = 0; i < self->ds_regions_len; i++)
-        Py_VISIT(self->ds_regions[i]);
-    return 0;
+fail:
+    Py_CLEAR(index);
+    goto out;
 }
 
 static int
-DmStats_clear(DmStatsObject *self)
-{
-    int i;
-
-    if (!self->ds_regions)
-        return 0;
-
-    for (i = 0; i < self->ds_regions_len; i++)
-        Py_CLEAR(self->ds_regions[i]);
-    return 0;
-}
-
-/*
- * DmStats Sequence Methods.
- */
-
-Py_ssize_t
-DmStats_len(PyObject *o)
+DmEventMonitor_init(DmEventMonitorObject *self, PyObject *args,
+                    PyObject *kwds)
 {
-    DmStatsObject *self = (DmStatsObject *) o;
+    char path[PATH_MAX];
 
-    if (!DmStatsObject_Check(o))
+    if (!PyArg_ParseTuple(args, ":__init__"))
         return -1;
 
-    if (!self->ds_dms)
-        return 0;
-
-    return (Py_ssize_t) dm_stats_get_nr_regions(self->ds_dms);
-}
-
-static DmStatsRegionObject *
-newDmStatsRegionObject(PyObject *stats, uint64_t region_id);
+    _DmEventMonitor_close(self);
 
-static void
-_DmStatsRegion_clear_area_cache(DmStatsRegionObject *self)
-{
-    int64_t i;
+    if (snprintf(path, sizeof(path), "%s/control", dm_dir())
+        >= (int) sizeof(path)) {
+        PyErr_SetString(PyExc_ValueError, "Device-mapper directory path "
+                        "is too long.");
+        return -1;
+    }
 
-    if (!self->dr_areas)
-        return;
+    if ((self->em_fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
 
-    /* If an area is in the cache, we are holding a reference
-     * to the Weakref object that represents it.
-     */
-    if (self->dr_areas_len) {
-        for (i = 0; i < self->dr_areas_len; i++)
-            Py_XDECREF(self->dr_areas[i]);
+    if (!(self->em_index = _DmEventMonitor_scan(self))) {
+        _DmEventMonitor_close(self);
+        return -1;
     }
-    PyMem_Free(self->dr_areas);
-    self->dr_areas = NULL;
-    self->dr_areas_len = 0;
+    return 0;
 }
 
-static void
-_DmStatsRegion_set_area_cache(DmStatsRegionObject *self)
+static PyObject *
+DmEventMonitor_fileno(DmEventMonitorObject *self, PyObject *args)
 {
-    struct dm_stats *dms = DMS_FROM_REGION(self);
-    uint64_t nr_slots;
-
-    nr_slots = dm_stats_get_region_nr_areas(dms, self->dr_region_id);
-    if (nr_slots) {
-        self->dr_areas = PyMem_Malloc(sizeof(PyObject *) * nr_slots);
-        self->dr_areas_len = nr_slots;
-        memset(self->dr_areas, 0, nr_slots * sizeof(PyObject *));
-    }
+    DmEventMonitor_ClosedCheck(self, NULL);
+    return PyLong_FromLong(self->em_fd);
 }
 
 static PyObject *
-DmStats_get_item(PyObject *o, Py_ssize_t i)
+DmEventMonitor_wait(DmEventMonitorObject *self, PyObject *args,
+                    PyObject *kwds)
 {
-    DmStatsObject *self = (DmStatsObject *) o;
-    PyObject *region;
+    static char *kwlist[] = {"timeout", NULL};
+    PyObject *timeout_obj = Py_None;
+    struct pollfd pfd;
+    double timeout;
+    int timeout_ms = -1, r, err = 0;
 
-    if (!DmStatsObject_Check(o))
-        return NULL;
+    DmEventMonitor_BusyCheck(self, NULL);
+    DmEventMonitor_ClosedCheck(self, NULL);
 
-    if ((i < 0) || (i >= self->ds_regions_len)) {
-        PyErr_SetString(PyExc_IndexError, "DmStats region_id out of range");
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:wait", kwlist,
+                                     &timeout_obj))
         return NULL;
-    }
 
-    if (!dm_stats_region_present(self->ds_dms, i)) {
-        Py_INCREF(Py_None);
-        return Py_None;
+    if (timeout_obj != Py_None) {
+        timeout = PyFloat_AsDouble(timeout_obj);
+        if ((timeout == -1.0) && PyErr_Occurred())
+            return NULL;
+        if (timeout < 0.0) {
+            PyErr_SetString(PyExc_ValueError, "timeout must be "
+                            "non-negative.");
+            return NULL;
+        }
+        timeout_ms = (timeout * 1000.0 > (double) INT_MAX)
+                     ? INT_MAX : (int) (timeout * 1000.0);
     }
 
-    if (!self->ds_regions[i]) {
-cache_new:
-        /* cache miss */
-        region = (PyObject *) newDmStatsRegionObject(o, i);
-        self->ds_regions[i] = PyWeakref_NewRef(region, NULL);
-        _DmStatsRegion_set_area_cache((DmStatsRegionObject *) region);
-    } else {
-        region = PyWeakref_GetObject(self->ds_regions[i]);
-        if (region == Py_None) {
-            /* cache hit but referent expired */
-            Py_DECREF(self->ds_regions[i]);
-            self->ds_regions[i] = NULL;
-            goto cache_new;
+    pfd.fd = self->em_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    DMPY_BUSY_CLAIM(self->em_busy, "DmEventMonitor", NULL);
+    Py_BEGIN_ALLOW_THREADS
+    r = poll(&pfd, 1, timeout_ms);
+    if (r < 0)
+        err = errno;
+    Py_END_ALLOW_THREADS
+    self->em_busy = 0;
+
+    if (r < 0) {
+        /* An interrupted wait is reported as a timeout unless a signal
+         * handler raises. */
+        if ((err == EINTR) && !PyErr_CheckSignals())
+            Py_RETURN_FALSE;
+        if (err != EINTR) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
         }
-        /* cache hit */
-        Py_INCREF(region);
+        return NULL;
     }
 
-    return region;
+    if (r && (pfd.revents & POLLIN))
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
 }
 
-static PySequenceMethods DmStats_sequence_methods = {
-    DmStats_len,
-    0,
-    0,
-    DmStats_get_item
-};
-
-static PyObject *
-DmStats_bind_devno(DmStatsObject *self, PyObject *args)
+/*
+ * Append a (name, old_event_nr, new_event_nr) tuple to list.
+ */
+static int
+_dmpy_append_change(PyObject *list, PyObject *name, PyObject *old_nr,
+                    PyObject *new_nr)
 {
-    int major, minor;
-
-    if (!PyArg_ParseTuple(args, "ii:bind_devno", &major, &minor))
-        return NULL;
-
-    if (!dm_stats_bind_devno(self->ds_dms, major, minor)) {
-        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to devno.");
-        return NULL;
-    }
+    PyObject *change;
+    int r;
 
-    self->ds_sequence++;
-    Py_INCREF(Py_True);
-    return Py_True;
+    if (!(change = PyTuple_Pack(3, name, old_nr, new_nr)))
+        return -1;
+    r = PyList_Append(list, change);
+    Py_DECREF(change);
+    return r;
 }
 
 static PyObject *
-DmStats_bind_name(DmStatsObject *self, PyObject *args)
+DmEventMonitor_changes(DmEventMonitorObject *self, PyObject *args)
 {
-    char *name;
-
-    if (!PyArg_ParseTuple(args, "s:bind_name", &name))
-        return NULL;
+    PyObject *index, *changes, *name, *new_nr, *old_nr;
+    Py_ssize_t pos = 0;
+    int r;
 
-    if (!name || !strlen(name)) {
-        PyErr_SetString(PyExc_ValueError, "DmStats name cannot be empty "
-                        "or None.");
-        return NULL;
-    }
+    DmEventMonitor_BusyCheck(self, NULL);
+    DmEventMonitor_ClosedCheck(self, NULL);
 
-    if (!dm_stats_bind_name(self->ds_dms, name)) {
-        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to name.");
+    if (!(index = _DmEventMonitor_scan(self)))
         return NULL;
-    }
-
-    self->ds_sequence++;
-    Py_INCREF(Py_True);
-    return Py_True;
-}
-
-static PyObject *
-DmStats_bind_uuid(DmStatsObject *self, PyObject *args)
-{
-    char *uuid;
 
-    if (!PyArg_ParseTuple(args, "s:bind_uuid", &uuid))
-        return NULL;
+    if (!(changes = PyList_New(0)))
+        goto fail;
 
-    if (!uuid || !strlen(uuid)) {
-        PyErr_SetString(PyExc_ValueError, "DmStats uuid cannot be empty "
-                        "or None.");
-        return NULL;
+    /* Devices with a new event_nr, and devices that have appeared. */
+    while (PyDict_Next(index, &pos, &name, &new_nr)) {
+        old_nr = PyDict_GetItem(self->em_index, name);
+        if (old_nr) {
+            if ((r = PyObject_RichCompareBool(old_nr, new_nr, Py_EQ)) < 0)
+                goto fail;
+            if (r)
+                continue;
+        }
+        if (_dmpy_append_change(changes, name, old_nr ? old_nr : Py_None,
+                                new_nr))
+            goto fail;
     }
 
-    if (!dm_stats_bind_uuid(self->ds_dms, uuid)) {
-        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to uuid.");
-        return NULL;
+    /* Devices that have been removed. */
+    pos = 0;
+    while (PyDict_Next(self->em_index, &pos, &name, &old_nr)) {
+        if (PyDict_Contains(index, name))
+            continue;
+        if (_dmpy_append_change(changes, name, old_nr, Py_None))
+            goto fail;
     }
 
-    self->ds_sequence++;
-    Py_INCREF(Py_True);
-    return Py_True;
-}
+    Py_DECREF(self->em_index);
+    self->em_index = index;
+    return changes;
 
-/*
- * DmStats property methods
- * FIXME: expose these via the object's __dict__
- */
+fail:
+    Py_XDECREF(changes);
+    Py_DECREF(index);
+    return NULL;
+}
 
 static PyObject *
-DmStats_nr_regions(DmStatsObject *self, PyObject *args)
+DmEventMonitor_close(DmEventMonitorObject *self, PyObject *args)
 {
-    return Py_BuildValue("i", dm_stats_get_nr_regions(self->ds_dms));
+    DmEventMonitor_BusyCheck(self, NULL);
+    _DmEventMonitor_close(self);
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
 static PyObject *
-DmStats_nr_groups(DmStatsObject *self, PyObject *args)
+DmEventMonitor_event_nrs(DmEventMonitorObject *self, PyObject *args)
 {
-    return Py_BuildValue("i", dm_stats_get_nr_groups(self->ds_dms));
+    DmEventMonitor_ClosedCheck(self, NULL);
+    return PyDict_Copy(self->em_index);
 }
 
-static PyObject *
-DmStats_region_present(DmStatsObject *self, PyObject *args)
-{
-    int region_id;
+#define DMEVENTMONITOR_fileno__doc__ \
+"Return the file descriptor of the monitor's control device handle. The\n" \
+"descriptor becomes readable when an event has occurred, and may be\n"     \
+"registered with select, selectors or asyncio."
+
+#define DMEVENTMONITOR_wait__doc__ \
+"Wait for an event. Returns True if an event is pending, or False if\n"   \
+"the timeout, in seconds, expired first. With no timeout, wait blocks\n" \
+"until an event occurs. Call changes() to re-arm the monitor."
+
+#define DMEVENTMONITOR_changes__doc__ \
+"Re-arm the monitor and return a list of the devices that have changed\n" \
+"since the last call, as (name, old_event_nr, new_event_nr) tuples.\n\n"  \
+"Devices created since the last call have an old_event_nr of None, and\n" \
+"devices that have been removed have a new_event_nr of None. A rename\n"  \
+"is reported as the removal of the old name and creation of the new."
+
+#define DMEVENTMONITOR_close__doc__ \
+"Close the monitor's control device handle."
+
+#define DMEVENTMONITOR_event_nrs__doc__ \
+"Return a dictionary mapping the name of each device to its event_nr\n" \
+"as of the last call to changes()."
+
+static PyMethodDef DmEventMonitor_methods[] = {
+    {"fileno", (PyCFunction)DmEventMonitor_fileno, METH_NOARGS,
+        PyDoc_STR(DMEVENTMONITOR_fileno__doc__)},
+    {"wait", (PyCFunction)DmEventMonitor_wait, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(DMEVENTMONITOR_wait__doc__)},
+    {"changes", (PyCFunction)DmEventMonitor_changes, METH_NOARGS,
+        PyDoc_STR(DMEVENTMONITOR_changes__doc__)},
+    {"event_nrs", (PyCFunction)DmEventMonitor_event_nrs, METH_NOARGS,
+        PyDoc_STR(DMEVENTMONITOR_event_nrs__doc__)},
+    {"close", (PyCFunction)DmEventMonitor_close, METH_NOARGS,
+        PyDoc_STR(DMEVENTMONITOR_close__doc__)},
+    {NULL, NULL}
+};
 
-    if (!PyArg_ParseTuple(args, "i:region_present", &region_id))
-        return NULL;
+#define DMEVENTMONITOR__doc__ \
+"Watch all device-mapper devices for events from a single thread.\n\n"    \
+"A DmEventMonitor uses the control device poll interface rather than a\n" \
+"DM_DEVICE_WAITEVENT task per device. Wait for the file descriptor\n"     \
+"returned by fileno() to become readable (or call wait()), then call\n"   \
+"changes() to obtain the devices whose event_nr has changed.\n\n"         \
+"Requires device-mapper interface version 4.37 or later."
+
+static PyType_Slot DmEventMonitor_slots[] = {
+    {Py_tp_dealloc, DmEventMonitor_dealloc},
+    {Py_tp_doc, DMEVENTMONITOR__doc__},
+    {Py_tp_methods, DmEventMonitor_methods},
+    {Py_tp_init, DmEventMonitor_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
 
-    return Py_BuildValue("i", dm_stats_region_present(self->ds_dms,
-                                                      region_id));
-}
+static PyType_Spec DmEventMonitor_spec = {
+    "dmpy.DmEventMonitor",      /*name*/
+    sizeof(DmEventMonitorObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmEventMonitor_slots,       /*slots*/
+};
 
-static PyObject *
-DmStats_region_nr_areas(DmStatsObject *self, PyObject *args)
-{
-    int region_id, val;
+/*
+ * DmDeviceList objects.
+ *
+ * A DmDeviceList is an immutable snapshot of the device-mapper devices
+ * present at the time of a single DM_DEVICE_LIST ioctl. The data is held
+ * as parallel columns (names, uuids, majors, minors, event_nrs) with
+ * dictionaries mapping each name, uuid and device number to its row, so
+ * that an inventory refresh needs no per-device INFO tasks.
+ *
+ * Drivers older than 4.37 do not report event_nr in the name list, and
+ * drivers older than 4.45 do not report uuids: the affected columns then
+ * contain None.
+ */
 
-    if (!PyArg_ParseTuple(args, "i:region_nr_areas", &region_id))
-        return NULL;
+#define DMPY_LIST_EVENT_NR_MINOR 37
+#define DMPY_LIST_UUID_MINOR 45
 
-    /* FIXME: dm_stats_get_region_nr_areas segfaults on an un-listed handle */
-    if (dm_stats_get_nr_areas(self->ds_dms))
-        val = dm_stats_get_region_nr_areas(self->ds_dms, region_id);
-    else
-        val = 0;
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t dl_nr_devices;
+    PyObject *dl_names; /* tuple of str */
+    PyObject *dl_uuids; /* tuple of str or None */
+    PyObject *dl_majors; /* tuple of int */
+    PyObject *dl_minors; /* tuple of int */
+    PyObject *dl_event_nrs; /* tuple of int or None */
+    PyObject *dl_by_name; /* dict name -> row */
+    PyObject *dl_by_uuid; /* dict uuid -> row */
+    PyObject *dl_by_devno; /* dict (major, minor) -> row */
+} DmDeviceListObject;
 
-    return Py_BuildValue("i", val);
+
+static void
+DmDeviceList_dealloc(DmDeviceListObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    Py_XDECREF(self->dl_names);
+    Py_XDECREF(self->dl_uuids);
+    Py_XDECREF(self->dl_majors);
+    Py_XDECREF(self->dl_minors);
+    Py_XDECREF(self->dl_event_nrs);
+    Py_XDECREF(self->dl_by_name);
+    Py_XDECREF(self->dl_by_uuid);
+    Py_XDECREF(self->dl_by_devno);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
-static PyObject *
-DmStats_nr_areas(DmStatsObject *self, PyObject *args)
+/*
+ * Store value at row i of column and, if index is not NULL, map key to
+ * the row in index. Steals the reference to value.
+ */
+static int
+_DmDeviceList_set(PyObject *column, PyObject *index, PyObject *key,
+                  PyObject *row, Py_ssize_t i, PyObject *value)
 {
-    return Py_BuildValue("i", dm_stats_get_nr_areas(self->ds_dms));
+    if (!value)
+        return -1;
+    PyTuple_SET_ITEM(column, i, value);
+    if (index && key && PyDict_SetItem(index, key, row))
+        return -1;
+    return 0;
 }
 
+/*
+ * Build a new DmDeviceList from the names returned by a DM_DEVICE_LIST
+ * task. The driver_minor is the minor version of the dm ioctl interface
+ * that produced the list, and determines which of the extended fields
+ * are present.
+ */
 static PyObject *
-DmStats_group_present(DmStatsObject *self, PyObject *args)
+newDmDeviceListObject(dmpy_state *st, struct dm_names *names,
+                      unsigned driver_minor)
 {
-    int group_id, val;
+    int has_event_nr = driver_minor >= DMPY_LIST_EVENT_NR_MINOR;
+    int has_uuid = driver_minor >= DMPY_LIST_UUID_MINOR;
+    DmDeviceListObject *self;
+    Py_ssize_t nr_devices = 0, i;
+    struct dm_names *n;
+    unsigned next = 0;
+
+    /* An empty list has a single entry with a zero dev. */
+    if (names && names->dev) {
+        n = names;
+        do {
+            n = (struct dm_names *)((char *) n + next);
+            nr_devices++;
+            next = n->next;
+        } while (next);
+    }
 
-    if (!PyArg_ParseTuple(args, "i:group_present", &group_id))
+    if (!(self = PyObject_New(DmDeviceListObject, st->DmDeviceList_Type)))
         return NULL;
 
-    val = dm_stats_group_present(self->ds_dms, group_id);
-    return Py_BuildValue("i", val);
-}
+    self->dl_nr_devices = nr_devices;
+    self->dl_names = PyTuple_New(nr_devices);
+    self->dl_uuids = PyTuple_New(nr_devices);
+    self->dl_majors = PyTuple_New(nr_devices);
+    self->dl_minors = PyTuple_New(nr_devices);
+    self->dl_event_nrs = PyTuple_New(nr_devices);
+    self->dl_by_name = PyDict_New();
+    self->dl_by_uuid = PyDict_New();
+    self->dl_by_devno = PyDict_New();
+
+    if (!self->dl_names || !self->dl_uuids || !self->dl_majors
+        || !self->dl_minors || !self->dl_event_nrs || !self->dl_by_name
+        || !self->dl_by_uuid || !self->dl_by_devno)
+        goto fail;
 
-static PyObject *
-DmStats_set_sampling_interval(DmStatsObject *self, PyObject *args)
-{
-    uint64_t interval_ns;
-    double interval;
+    for (i = 0, n = names, next = 0; i < nr_devices; i++) {
+        const uint32_t *event_nr;
+        PyObject *row, *devno = NULL, *value;
+        const char *uuid = NULL;
+        int r;
 
-    if (!PyArg_ParseTuple(args, "d:set_sampling_interval", &interval))
-        return NULL;
+        n = (struct dm_names *)((char *) n + next);
+        next = n->next;
 
-    interval_ns = (uint64_t)(interval * (double) NSEC_PER_SEC);
-    dm_stats_set_sampling_interval_ns(self->ds_dms, interval_ns);
+        if (!(row = PyLong_FromSsize_t(i)))
+            goto fail;
 
-    Py_INCREF(Py_True);
-    return Py_True;
-}
+        event_nr = _dmpy_names_event_nr(n);
+        if (has_uuid && (event_nr[1] & DM_NAME_LIST_FLAG_HAS_UUID))
+            uuid = (const char *) (event_nr + 2);
 
-static PyObject *
-DmStats_get_sampling_interval(DmStatsObject *self, PyObject *args)
-{
-    uint64_t interval_ns;
-    double interval;
+        if (!(value = PyUnicode_FromString(n->name))) {
+            Py_DECREF(row);
+            goto fail;
+        }
+        r = _DmDeviceList_set(self->dl_names, self->dl_by_name, value,
+                              row, i, value);
+
+        if (!r) {
+            if (uuid) {
+                value = PyUnicode_FromString(uuid);
+            } else {
+                Py_INCREF(Py_None);
+                value = Py_None;
+            }
+            r = _DmDeviceList_set(self->dl_uuids,
+                                  (uuid && *uuid) ? self->dl_by_uuid : NULL,
+                                  value, row, i, value);
+        }
 
-    interval_ns = dm_stats_get_sampling_interval_ns(self->ds_dms);
-    interval = ((double) interval_ns / (double) NSEC_PER_SEC);
+        if (!r && !(devno = Py_BuildValue("(II)", MAJOR(n->dev),
+                                          MINOR(n->dev))))
+            r = -1;
+        if (!r)
+            r = _DmDeviceList_set(self->dl_majors, self->dl_by_devno,
+                                  devno, row, i,
+                                  PyLong_FromUnsignedLong(MAJOR(n->dev)));
+        if (!r)
+            r = _DmDeviceList_set(self->dl_minors, NULL, NULL, row, i,
+                                  PyLong_FromUnsignedLong(MINOR(n->dev)));
+        if (!r) {
+            if (has_event_nr) {
+                value = PyLong_FromUnsignedLong(*event_nr);
+            } else {
+                Py_INCREF(Py_None);
+                value = Py_None;
+            }
+            r = _DmDeviceList_set(self->dl_event_nrs, NULL, NULL, row, i,
+                                  value);
+        }
 
-    return Py_BuildValue("d", interval);
+        Py_XDECREF(devno);
+        Py_DECREF(row);
+        if (r)
+            goto fail;
+    }
+
+    return (PyObject *) self;
+
+fail:
+    /* Unfilled tuple slots are NULL and are skipped by tuple dealloc. */
+    Py_DECREF(self);
+    return NULL;
+}
+
+static Py_ssize_t
+DmDeviceList_len(PyObject *o)
+{
+    return ((DmDeviceListObject *) o)->dl_nr_devices;
 }
 
 static PyObject *
-DmStats_set_program_id(DmStatsObject *self, PyObject *args, PyObject *kwds)
+_DmDeviceList_row(DmDeviceListObject *self, Py_ssize_t i)
 {
-    static char *kwlist[] = {"program_id", "allow_empty", NULL};
-    int allow_empty = 0;
-    char *program_id;
+    return PyTuple_Pack(5, PyTuple_GET_ITEM(self->dl_names, i),
+                        PyTuple_GET_ITEM(self->dl_uuids, i),
+                        PyTuple_GET_ITEM(self->dl_majors, i),
+                        PyTuple_GET_ITEM(self->dl_minors, i),
+                        PyTuple_GET_ITEM(self->dl_event_nrs, i));
+}
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "z|i:set_program_id", kwlist,
-                                     &program_id, &allow_empty))
-        return NULL;
+static PyObject *
+DmDeviceList_get_item(PyObject *o, Py_ssize_t i)
+{
+    DmDeviceListObject *self = (DmDeviceListObject *) o;
 
-    if (!allow_empty && (!program_id || !strlen(program_id))) {
-        PyErr_SetString(PyExc_ValueError, "Empty program_id not permitted "
-                        "without allow_empty=True.");
-        return NULL;
-    }
-    if (!dm_stats_set_program_id(self->ds_dms, allow_empty, program_id)) {
-        PyErr_SetString(PyExc_OSError, "Failed to set program_id.");
+    if (i < 0 || i >= self->dl_nr_devices) {
+        PyErr_SetString(PyExc_IndexError, "DmDeviceList index out of "
+                        "range.");
         return NULL;
     }
-    Py_INCREF(Py_True);
-    return Py_True;
+    return _DmDeviceList_row(self, i);
 }
 
-static void
-_DmStats_clear_region_cache(DmStatsObject *self)
+static int
+DmDeviceList_contains(PyObject *o, PyObject *name)
 {
-    PyObject *region;
-    int64_t i;
-
-    if (!self->ds_regions)
-        return;
-
-    /* If a region is in the cache, we are holding a reference
-     * to the Weakref object that represents it: if the reference is
-     * still alive, retrive the object and clear its area cache.
-     */
-    if (self->ds_regions_len) {
-        for (i = 0; i < self->ds_regions_len; i++) {
-            if (self->ds_regions[i]) {
-                region = PyWeakref_GetObject(self->ds_regions[i]);
-                if (region == Py_None)
-                    continue;
-                Py_INCREF(region);
-                _DmStatsRegion_clear_area_cache((DmStatsRegionObject *) region);
-                Py_DECREF(region);
-            }
-            Py_XDECREF(self->ds_regions[i]);
-        }
-    }
-    PyMem_Free(self->ds_regions);
-    self->ds_regions = NULL;
-    self->ds_regions_len = 0;
+    return PyDict_Contains(((DmDeviceListObject *) o)->dl_by_name, name);
 }
 
-static void
-_DmStats_set_region_cache(DmStatsObject *self)
-{
-    struct dm_stats *dms;
-    uint64_t nr_slots, region_id, max_region = 0;
 
-    dms = self->ds_dms;
+/*
+ * Look up key in index and return the corresponding row, or raise
+ * KeyError.
+ */
+static PyObject *
+_DmDeviceList_lookup(DmDeviceListObject *self, PyObject *index,
+                     PyObject *key)
+{
+    PyObject *row;
 
-    if (dm_stats_get_nr_areas(dms)) {
-        dm_stats_foreach_region(dms) {
-            region_id = dm_stats_get_current_region(dms);
-            max_region = (region_id > max_region) ? region_id : max_region;
-        }
-        nr_slots = max_region + 1;
-        self->ds_regions = PyMem_Malloc(sizeof(PyObject *) * nr_slots);
-        self->ds_regions_len = nr_slots;
-        memset(self->ds_regions, 0, nr_slots * sizeof(PyObject *));
+    if (!(row = PyDict_GetItemWithError(index, key))) {
+        if (!PyErr_Occurred())
+            PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
     }
+    return _DmDeviceList_row(self, PyLong_AsSsize_t(row));
 }
 
 static PyObject *
-DmStats_list(DmStatsObject *self, PyObject *args, PyObject *kwds)
+DmDeviceList_by_name(DmDeviceListObject *self, PyObject *args)
 {
-    static char *kwlist[] = {"program_id", NULL};
-    char *program_id = NULL;
+    PyObject *name;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|z:list",
-                                     kwlist, &program_id))
+    if (!PyArg_ParseTuple(args, "U:by_name", &name))
         return NULL;
+    return _DmDeviceList_lookup(self, self->dl_by_name, name);
+}
 
-    _DmStats_clear_region_cache(self);
+static PyObject *
+DmDeviceList_by_uuid(DmDeviceListObject *self, PyObject *args)
+{
+    PyObject *uuid;
 
-    if (!dm_stats_list(self->ds_dms, program_id)) {
-        PyErr_SetString(PyExc_OSError, "Failed to get region list from "
-                        "device-mapper.");
+    if (!PyArg_ParseTuple(args, "U:by_uuid", &uuid))
         return NULL;
-    }
-    self->ds_sequence++;
-    _DmStats_set_region_cache(self);
-
-    Py_INCREF(self);
-    return (PyObject *) self;
+    return _DmDeviceList_lookup(self, self->dl_by_uuid, uuid);
 }
 
 static PyObject *
-DmStats_populate(DmStatsObject *self, PyObject *args, PyObject *kwds)
+DmDeviceList_by_devno(DmDeviceListObject *self, PyObject *args)
 {
-    static char *kwlist[] = {"program_id", "region_id", NULL};
-    uint64_t region_id = DM_STATS_REGIONS_ALL;
-    char *program_id = NULL;
+    unsigned int major, minor;
+    PyObject *devno, *row;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zl:list",
-                                     kwlist, &program_id, &region_id))
+    if (!PyArg_ParseTuple(args, "II:by_devno", &major, &minor))
         return NULL;
-
-    _DmStats_clear_region_cache(self);
-    if (!dm_stats_populate(self->ds_dms, program_id, region_id)) {
-        PyErr_SetString(PyExc_OSError, "Failed to get region data from "
-                        "device-mapper.");
+    if (!(devno = Py_BuildValue("(II)", major, minor)))
         return NULL;
-    }
-    self->ds_sequence++;
-    _DmStats_set_region_cache(self);
-
-    Py_INCREF(self);
-    return (PyObject *) self;
+    row = _DmDeviceList_lookup(self, self->dl_by_devno, devno);
+    Py_DECREF(devno);
+    return row;
 }
 
+#define DMDEVICELIST_by_name__doc__ \
+"Return the (name, uuid, major, minor, event_nr) row for the device\n"  \
+"with the given name, or raise KeyError."
+
+#define DMDEVICELIST_by_uuid__doc__ \
+"Return the (name, uuid, major, minor, event_nr) row for the device\n"  \
+"with the given uuid, or raise KeyError."
+
+#define DMDEVICELIST_by_devno__doc__ \
+"Return the (name, uuid, major, minor, event_nr) row for the device\n"  \
+"with the given major and minor numbers, or raise KeyError."
+
+static PyMethodDef DmDeviceList_methods[] = {
+    {"by_name", (PyCFunction)DmDeviceList_by_name, METH_VARARGS,
+        PyDoc_STR(DMDEVICELIST_by_name__doc__)},
+    {"by_uuid", (PyCFunction)DmDeviceList_by_uuid, METH_VARARGS,
+        PyDoc_STR(DMDEVICELIST_by_uuid__doc__)},
+    {"by_devno", (PyCFunction)DmDeviceList_by_devno, METH_VARARGS,
+        PyDoc_STR(DMDEVICELIST_by_devno__doc__)},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmDeviceList_members[] = {
+    {"names", T_OBJECT, offsetof(DmDeviceListObject, dl_names), READONLY,
+        PyDoc_STR("A tuple of the name of each device.")},
+    {"uuids", T_OBJECT, offsetof(DmDeviceListObject, dl_uuids), READONLY,
+        PyDoc_STR("A tuple of the uuid of each device, or None.")},
+    {"majors", T_OBJECT, offsetof(DmDeviceListObject, dl_majors), READONLY,
+        PyDoc_STR("A tuple of the major number of each device.")},
+    {"minors", T_OBJECT, offsetof(DmDeviceListObject, dl_minors), READONLY,
+        PyDoc_STR("A tuple of the minor number of each device.")},
+    {"event_nrs", T_OBJECT, offsetof(DmDeviceListObject, dl_event_nrs),
+        READONLY,
+        PyDoc_STR("A tuple of the event counter of each device, or None.")},
+    {NULL}
+};
+
+#define DMDEVICELIST__doc__ \
+"A snapshot of the device-mapper devices present at the time of a call\n" \
+"to dmpy.list_devices(). Indexing a DmDeviceList returns a\n"            \
+"(name, uuid, major, minor, event_nr) tuple; the names, uuids, majors,\n" \
+"minors and event_nrs attributes give each column as a tuple, and\n"     \
+"by_name(), by_uuid() and by_devno() look up a row in constant time.\n"  \
+"The `in` operator tests for the presence of a device name.\n\n"         \
+"The uuid and event_nr columns contain None where the running kernel\n"  \
+"does not report them in the device list."
+
+static PyType_Slot DmDeviceList_slots[] = {
+    {Py_tp_dealloc, DmDeviceList_dealloc},
+    {Py_tp_doc, DMDEVICELIST__doc__},
+    {Py_sq_length, DmDeviceList_len},
+    {Py_sq_item, DmDeviceList_get_item},
+    {Py_sq_contains, DmDeviceList_contains},
+    {Py_tp_methods, DmDeviceList_methods},
+    {Py_tp_members, DmDeviceList_members},
+    {0, NULL}
+};
+
+static PyType_Spec DmDeviceList_spec = {
+    "dmpy.DmDeviceList",        /*name*/
+    sizeof(DmDeviceListObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmDeviceList_slots,         /*slots*/
+};
+
+
+/*
+ * Run a DM_DEVICE_LIST and return a new DmDeviceList, or NULL with an
+ * exception set. If arm_fd is not -1 the control device descriptor is
+ * armed before listing, so that any event racing with the list makes
+ * the descriptor readable.
+ */
 static PyObject *
-DmStats_create_region(DmStatsObject *self, PyObject *args, PyObject *kwds)
+_dmpy_list_device_snapshot(dmpy_state *st, int arm_fd)
 {
-    static char *kwlist[] = {"start", "len", "step", "precise", "bounds",
-                             "program_id", "user_data", NULL};
-    char *program_id = NULL, *user_data = NULL;
-    uint64_t start = 0, len = 0, region_id;
-	struct dm_histogram *bounds = NULL;
-    int r, precise;
-    int64_t step;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|LLKiOzz:create_region",
-                                     kwlist, &start, &len, &step, &precise,
-                                     &bounds, &program_id, &user_data))
-        return NULL;
+    char version[DMPY_VERSION_BUF_LEN];
+    unsigned major = 0, minor = 0;
+    uint64_t start, elapsed = UINT64_MAX;
+    struct dm_task *dmt;
+    PyObject *list = NULL;
+    int node_lock, r, err = 0;
 
-    errno = 0;
-    r = dm_stats_create_region(self->ds_dms, &region_id, start, len, step,
-                               precise, bounds, program_id, user_data);
+    if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+        return PyErr_NoMemory();
+
+    node_lock = _DmTask_needs_node_lock(DM_DEVICE_LIST);
+
+    Py_BEGIN_ALLOW_THREADS
+    if (arm_fd >= 0 && _dmpy_arm_poll(arm_fd) < 0) {
+        err = errno;
+        r = 0;
+    } else {
+        DMPY_NODE_LOCK(node_lock);
+        start = _dmpy_ioctl_start();
+        r = dm_task_run(dmt);
+        elapsed = _dmpy_ioctl_elapsed(start);
+        if (r)
+            _dmpy_control_ready = 1;
+        DMPY_NODE_UNLOCK(node_lock);
+    }
+    Py_END_ALLOW_THREADS
+    _dmpy_ioctl_record(DM_DEVICE_LIST, elapsed, r);
+
+    if (err) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto out;
+    }
 
     if (!r) {
-        if (errno)
-            PyErr_SetFromErrno(PyExc_OSError);
-        else
-            PyErr_SetString(PyExc_OSError, "Failed to create new region.");
-        return NULL;
+        PyErr_SetString(PyExc_OSError, "Failed to list device-mapper "
+                        "devices.");
+        goto out;
     }
 
-    Py_INCREF(self);
-    return (PyObject *) self;
+    /* The version reported with the list decides which fields exist. */
+    if (!dm_task_get_driver_version(dmt, version, sizeof(version))
+        || sscanf(version, "%u.%u", &major, &minor) != 2 || major != 4)
+        minor = 0;
+
+    list = newDmDeviceListObject(st, dm_task_get_names(dmt), minor);
+
+out:
+    dm_task_destroy(dmt);
+    return list;
 }
 
-static int _DmStats_delete_region(DmStatsObject *self, uint64_t region_id)
+/*
+ * Device resolution cache.
+ *
+ * The module keeps the most recent DmDeviceList snapshot for resolving
+ * names, uuids and device numbers without a lookup ioctl. The cache holds
+ * its own control device descriptor, armed for DM_DEV_ARM_POLL whenever
+ * the snapshot is taken: any device event (including create, remove and
+ * rename, and any change to a device's event_nr) makes the descriptor
+ * readable, and the next lookup then takes a new snapshot. Checking the
+ * cache costs one zero-timeout poll() rather than an ioctl per device.
+ *
+ * Removing or renaming a device through a DmTask also drops the snapshot
+ * directly, by advancing the process-wide _dmpy_dev_cache_gen: a snapshot
+ * taken at an older generation is not used again. If the control device
+ * cannot be opened every lookup takes a new snapshot.
+ *
+ * Each interpreter has its own snapshot and descriptor in its module
+ * state, guarded by dev_cache_lock. The lock is only held to read or
+ * install the snapshot: concurrent refreshes may each list the devices,
+ * and the last one to finish installs its snapshot.
+ */
+static PyThread_type_lock _dmpy_dev_cache_gen_lock = NULL;
+static uint64_t _dmpy_dev_cache_gen = 0;
+
+static uint64_t
+_dmpy_dev_cache_generation(void)
 {
-    if (!dm_stats_region_present(self->ds_dms, region_id)) {
-        PyErr_Format(PyExc_IndexError, "mStats region_id " FMTu64
-                     " does not exist.", region_id);
-        goto fail;
-    }
+    uint64_t gen;
 
-    errno = 0;
+    PyThread_acquire_lock(_dmpy_dev_cache_gen_lock, WAIT_LOCK);
+    gen = _dmpy_dev_cache_gen;
+    PyThread_release_lock(_dmpy_dev_cache_gen_lock);
+    return gen;
+}
 
-    if (!dm_stats_delete_region(self->ds_dms, region_id)) {
-        if (errno)
-            PyErr_SetFromErrno(PyExc_OSError);
-        else
-            PyErr_SetString(PyExc_OSError, "Failed to delete region " FMTu64
-                            ".");
-        goto fail;
+static void
+_dmpy_dev_cache_invalidate(void)
+{
+    PyThread_acquire_lock(_dmpy_dev_cache_gen_lock, WAIT_LOCK);
+    _dmpy_dev_cache_gen++;
+    PyThread_release_lock(_dmpy_dev_cache_gen_lock);
+}
+
+/*
+ * Return a new reference to a current device snapshot, or NULL with an
+ * exception set.
+ */
+static DmDeviceListObject *
+_dmpy_dev_cache_get(dmpy_state *st)
+{
+    PyObject *list = NULL, *old = NULL;
+    uint64_t gen = _dmpy_dev_cache_generation();
+    struct pollfd pfd;
+    char path[PATH_MAX];
+    int fd;
+
+    PyThread_acquire_lock(st->dev_cache_lock, WAIT_LOCK);
+    if (st->dev_cache_fd < 0) {
+        if (snprintf(path, sizeof(path), "%s/control", dm_dir())
+            < (int) sizeof(path))
+            st->dev_cache_fd = open(path, O_RDWR | O_CLOEXEC);
+        old = st->dev_cache;
+        st->dev_cache = NULL;
     }
+    fd = st->dev_cache_fd;
+
+    if (st->dev_cache && (fd >= 0) && (st->dev_cache_gen == gen)) {
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) == 0) {
+            list = st->dev_cache;
+            Py_INCREF(list);
+        }
+    }
+    PyThread_release_lock(st->dev_cache_lock);
+    Py_XDECREF(old);
 
-    return 0;
-fail:
-    return -1;
+    if (list)
+        return (DmDeviceListObject *) list;
+
+    if (!(list = _dmpy_list_device_snapshot(st, fd)))
+        return NULL;
+
+    if (fd >= 0) {
+        Py_INCREF(list);
+        PyThread_acquire_lock(st->dev_cache_lock, WAIT_LOCK);
+        old = st->dev_cache;
+        st->dev_cache = list;
+        st->dev_cache_gen = gen;
+        PyThread_release_lock(st->dev_cache_lock);
+        Py_XDECREF(old);
+    }
+    return (DmDeviceListObject *) list;
 }
 
+/*
+ * Resolve a device by name, uuid or, if both are NULL, by major and
+ * minor number. Returns a new reference to the device's DmDeviceList row,
+ * Py_None if no such device exists, or NULL with an exception set.
+ */
 static PyObject *
-DmStats_delete_region(DmStatsObject *self, PyObject *args)
+_dmpy_dev_cache_resolve(dmpy_state *st, const char *name, const char *uuid,
+                        unsigned major, unsigned minor)
 {
-    uint64_t region_id;
-    if (!PyArg_ParseTuple(args, "K:delete_region", &region_id))
+    DmDeviceListObject *list;
+    PyObject *key, *index, *row;
+
+    if (!(list = _dmpy_dev_cache_get(st)))
         return NULL;
-    if (_DmStats_delete_region(self, region_id))
+
+    if (name) {
+        key = PyUnicode_FromString(name);
+        index = list->dl_by_name;
+    } else if (uuid) {
+        key = PyUnicode_FromString(uuid);
+        index = list->dl_by_uuid;
+    } else {
+        key = Py_BuildValue("(II)", major, minor);
+        index = list->dl_by_devno;
+    }
+
+    if (!key) {
+        Py_DECREF(list);
         return NULL;
-    Py_INCREF(self);
-    return (PyObject *) self;
-}
+    }
 
-#define DMSTATS_bind_devno__doc__ \
-"Bind a DmStats object to the specified device major and minor values.\n" \
-"Any previous binding is cleared and any preexisting counter data\n"      \
-"contained in the object is released."
+    if ((row = PyDict_GetItemWithError(index, key)))
+        row = _DmDeviceList_row(list, PyLong_AsSsize_t(row));
+    else if (!PyErr_Occurred()) {
+        Py_INCREF(Py_None);
+        row = Py_None;
+    }
 
-#define DMSTATS_bind_name__doc__ \
-"Bind a DmStats object to the specified device name. Any previous\n" \
-"binding is cleared and any preexisting counter data contained in\n" \
-"the object is released."
+    Py_DECREF(key);
+    Py_DECREF(list);
+    return row;
+}
 
-#define DMSTATS_bind_uuid__doc__ \
-"Bind a DmStats object to the specified device UUID. Any previous\n" \
-"binding is cleared and any preexisting counter data contained in\n" \
-"the object is released."
+/*
+ * Drop the device cache following a successful task of the given type
+ * that changes the set of device names or uuids.
+ */
+static void
+_dmpy_dev_cache_task_done(int type)
+{
+    switch (type) {
+    case DM_DEVICE_CREATE:
+    case DM_DEVICE_REMOVE:
+    case DM_DEVICE_REMOVE_ALL:
+    case DM_DEVICE_RENAME:
+        _dmpy_dev_cache_invalidate();
+        break;
+    default:
+        break;
+    }
+}
 
-#define DMSTATS_nr_regions__doc__ \
-"Return the number of regions present in this DmStats object."
 
-#define DMSTATS_nr_groups__doc__ \
+/*
+ * DmStats objects.
+ */
+
+/*
+ * A counter snapshot taken by DmStats.sample(). The layout array holds
+ * DMSTATS_SAMPLE_LAYOUT values for each region in the snapshot: the
+ * region_id, area count, start and length. These identify regions that
+ * were deleted and re-created with the same region_id between samples.
+ */
+#define DMSTATS_SAMPLE_LAYOUT 4
+
+struct dmpy_stats_sample {
+    uint64_t *counters;
+    size_t counters_len; /* allocated length of counters in values */
+    uint64_t *layout;
+    size_t layout_len; /* allocated length of layout in values */
+    uint64_t nr_regions;
+    uint64_t max_areas;
+    uint64_t timestamp; /* CLOCK_MONOTONIC time of the sample in ns */
+};
+
+/*
+ * Per-region_id state kept alongside the region cache: the generation of
+ * the slot, and the layout of the region it held when last listed. A
+ * region or area object is valid while its generation matches the slot.
+ */
+struct dmpy_region_slot {
+    uint64_t gen;
+    uint64_t start;
+    uint64_t len;
+    uint64_t nr_areas;
+    uint64_t counters_seq; /* ds_table_seq when populated by region_ids= */
+    int present;
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct dm_stats *ds_dms;
+    uint64_t ds_sequence; /* sequence number protecting ds_dms */
+    PyObject **ds_regions; /* region cache */
+    struct dmpy_region_slot *ds_region_slots; /* per-region generations */
+    Py_ssize_t ds_regions_len; /* length of the region cache in regions. */
+    uint64_t ds_generation; /* last region generation number handed out */
+    uint64_t ds_table_seq; /* incremented when the region table is read */
+    int ds_busy; /* set while an ioctl is in progress without the GIL */
+    uint64_t ds_counters_seq; /* ds_table_seq at the last populate() */
+    uint64_t ds_counters_region; /* region_id of the last populate() */
+    double ds_populate_time; /* duration of the last populate() ioctls */
+    unsigned long long ds_populate_nr_regions; /* regions it read */
+    struct dmpy_stats_sample ds_samples[2]; /* sample() double buffer */
+    int ds_sample; /* index of the last sample in ds_samples, or -1 */
+    PyObject *ds_binding; /* (name, uuid, major, minor) bound, or NULL */
+} DmStatsObject;
+
+#define DmStatsObject_Check(st, v)          (Py_TYPE(v) == (st)->DmStats_Type)
+
+#define DmStats_BusyCheck(o, ret) DMPY_BUSY_CHECK((o)->ds_busy, "DmStats", ret)
+
+/*
+ * Bracket a blocking dm_stats_*() call: mark the handle busy and release
+ * the GIL. If another thread has claimed the handle the fail statement is
+ * run with RuntimeError set. All @stats_* messages are DM_DEVICE_TARGET_MSG
+ * ioctls and do not modify node state, so the node lock is only needed
+ * until the control device has been opened.
+ */
+#define DMSTATS_BEGIN_IOCTL(o, fail)                            \
+do {                                                            \
+    int _node_lock = !_dmpy_control_ready;                      \
+    if (_dmpy_busy_claim(&(o)->ds_busy, "DmStats"))             \
+        fail;                                                   \
+    Py_BEGIN_ALLOW_THREADS                                      \
+    DMPY_NODE_LOCK(_node_lock);
+
+#define DMSTATS_END_IOCTL(o, r)                                 \
+    DMPY_NODE_UNLOCK(_node_lock);                               \
+    Py_END_ALLOW_THREADS                                        \
+    (o)->ds_busy = 0;                                           \
+    if ((r))                                                    \
+        _dmpy_control_ready = 1;                                \
+} while (0)
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *dr_stats;
+    uint64_t dr_sequence;
+    uint64_t dr_generation; /* generation of the region_id slot */
+    uint64_t dr_region_id;
+    PyObject *dr_weakreflist;
+    PyObject **dr_areas;
+    Py_ssize_t dr_areas_len;
+} DmStatsRegionObject;
+
+#define DmStatsRegionObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmStatsRegion_Type)
+
+#define DMSTATS_FROM_REGION(r) ((DmStatsObject *)((r)->dr_stats))
+#define DMS_FROM_REGION(r) (DMSTATS_FROM_REGION((r))->ds_dms)
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *da_stats;
+    uint64_t da_sequence;
+    uint64_t da_generation; /* generation of the region_id slot */
+    PyObject *da_weakreflist;
+    uint64_t da_region_id;
+    uint64_t da_area_id;
+} DmStatsAreaObject;
+
+#define DmStatsAreaObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmStatsArea_Type)
+
+#define DMSTATS_FROM_AREA(a) ((DmStatsObject *)((a)->da_stats))
+#define DMS_FROM_AREA(a) (DMSTATS_FROM_AREA((a))->ds_dms)
+
+/*
+ * Discard the snapshots held for DmStats.sample(): the next sample has
+ * nothing to be compared with.
+ */
+static void
+_DmStats_clear_samples(DmStatsObject *self)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        PyMem_Free(self->ds_samples[i].counters);
+        PyMem_Free(self->ds_samples[i].layout);
+        memset(&self->ds_samples[i], 0, sizeof(self->ds_samples[i]));
+    }
+    self->ds_sample = -1;
+}
+
+static void
+_DmStats_clear_region_cache(DmStatsObject *self);
+
+static void
+DmStats_dealloc(DmStatsObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+
+    if (self->ds_dms)
+        dm_stats_destroy(self->ds_dms);
+    self->ds_dms = NULL;
+    _DmStats_clear_samples(self);
+    Py_CLEAR(self->ds_binding);
+    _DmStats_clear_region_cache(self);
+    self->ds_sequence = UINT64_MAX;
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+/*
+ * Return a new (name, uuid, major, minor) binding key for the device bound
+ * to a handle, or NULL with an exception set. The key is built before the
+ * handle is bound, so that a failure leaves the old binding in place, and
+ * is only resolved in the module device cache when the device attribute
+ * is read.
+ */
+static PyObject *
+_dmpy_stats_binding(const char *name, const char *uuid, int major,
+                    int minor)
+{
+    return Py_BuildValue("(zzii)", name, uuid, major, minor);
+}
+
+/*
+ * Replace the binding key of self with binding, stealing the reference.
+ */
+static void
+_DmStats_set_binding(DmStatsObject *self, PyObject *binding)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    Py_XSETREF(self->ds_binding, binding);
+    Py_END_CRITICAL_SECTION();
+}
+
+#define DMSTATS__init__KWARG_ERR "Please specify one of name=, uuid=, or " \
+"major= and minor= keyword arguments."
+static int
+_DmStats_init(DmStatsObject *self, const char *program_id, const char *name,
+              const char *uuid, int major, int minor)
+{
+    PyObject *binding = NULL;
+
+    if (name) {
+        if (uuid || major || minor) {
+            PyErr_SetString(PyExc_TypeError, DMSTATS__init__KWARG_ERR);
+            return -1;
+        }
+    }
+
+    if (uuid) {
+        if (major || minor) {
+            PyErr_SetString(PyExc_TypeError, DMSTATS__init__KWARG_ERR);
+            return -1;
+        }
+    }
+
+    /* DmStats_Type uses PyType_GenericNew(): set non-zero defaults here. */
+    self->ds_counters_seq = UINT64_MAX;
+    self->ds_counters_region = DM_STATS_REGIONS_ALL;
+    _DmStats_clear_samples(self);
+
+    if ((name || uuid || major)
+        && !(binding = _dmpy_stats_binding(name, uuid, major, minor)))
+        return -1;
+
+    self->ds_dms = dm_stats_create(program_id);
+
+    if (!self->ds_dms) {
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocated "
+                        "DmStats handle.");
+        Py_XDECREF(binding);
+        return -1;
+    }
+
+    if (name) {
+        if (!dm_stats_bind_name(self->ds_dms, name)) {
+            PyErr_SetString(PyExc_OSError, "Failed to bind name to "
+                            "DmStatst handle.");
+            goto fail;
+        }
+    } else if (uuid) {
+        if (!dm_stats_bind_uuid(self->ds_dms, uuid)) {
+            PyErr_SetString(PyExc_OSError, "Failed to bind uuid to "
+                            "DmStatst handle.");
+            goto fail;
+        }
+    } else if (major) {
+        if (!minor) {
+            PyErr_SetString(PyExc_ValueError,"Missing minor= keyword "
+                                             "argument.");
+            goto fail;
+        }
+        if (!dm_stats_bind_devno(self->ds_dms, major, minor)) {
+            PyErr_SetString(PyExc_OSError, "Failed to bind devno to "
+                            "DmStatst handle.");
+            goto fail;
+        }
+    } else if (minor) {
+        PyErr_SetString(PyExc_ValueError,"Missing major= keyword "
+                                         "argument.");
+        goto fail;
+    }
+
+    _DmStats_set_binding(self, binding);
+    return 0;
+fail:
+    Py_XDECREF(binding);
+    dm_stats_destroy(self->ds_dms);
+    self->ds_dms = NULL;
+    return -1;
+}
+
+static int
+DmStats_init(DmStatsObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"program_id",
+                             "name", "uuid", "major", "minor", NULL};
+    const char *program_id = NULL, *name = NULL, *uuid = NULL;
+    int major = 0, minor = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "z|ssii:__init__", kwlist,
+                                     &program_id, &name, &uuid, &major, &minor))
+        return -1;
+
+    return _DmStats_init(self, program_id, name, uuid, major, minor);
+}
+
+/* DmStats(...) for the exact DmStats type: see DmTask_vectorcall(). */
+static PyObject *
+DmStats_vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+                   PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"program_id",
+                                         "name", "uuid", "major", "minor",
+                                         NULL};
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    const char *program_id = NULL, *name = NULL, *uuid = NULL;
+    int major = 0, minor = 0;
+    PyObject *self, *argv[5];
+
+    if (_dmpy_parse_args("__init__", args, nargs, kwnames, kwlist, 1, argv)
+        || !_dmpy_str_or_none_converter(argv[0], &program_id)
+        || !_dmpy_str_converter(argv[1], &name)
+        || !_dmpy_str_converter(argv[2], &uuid)
+        || !_dmpy_int_converter(argv[3], &major)
+        || !_dmpy_int_converter(argv[4], &minor))
+        return NULL;
+
+    if (!(self = ((PyTypeObject *) type)->tp_alloc((PyTypeObject *) type,
+                                                   0)))
+        return NULL;
+    if (_DmStats_init((DmStatsObject *) self, program_id, name, uuid,
+                      major, minor)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+static int
+DmStats_traverse(DmStatsObject *self, visitproc visit, void *arg)
+{
+    int i;
+
+    Py_VISIT(Py_TYPE(self));
+
+    if (!self->ds_regions)
+        return 0;
+
+    for (i = 0; i < self->ds_regions_len; i++)
+        Py_VISIT(self->ds_regions[i]);
+    return 0;
+}
+
+static int
+DmStats_clear(DmStatsObject *self)
+{
+    int i;
+
+    if (!self->ds_regions)
+        return 0;
+
+    for (i = 0; i < self->ds_regions_len; i++)
+        Py_CLEAR(self->ds_regions[i]);
+    return 0;
+}
+
+/*
+ * DmStats Sequence Methods.
+ */
+
+Py_ssize_t
+DmStats_len(PyObject *o)
+{
+    DmStatsObject *self = (DmStatsObject *) o;
+
+    if (!DmStatsObject_Check(DMPY_STATE(o), o))
+        return -1;
+
+    DmStats_BusyCheck(self, -1);
+
+    if (!self->ds_dms)
+        return 0;
+
+    return (Py_ssize_t) dm_stats_get_nr_regions(self->ds_dms);
+}
+
+static DmStatsRegionObject *
+newDmStatsRegionObject(PyObject *stats, uint64_t region_id);
+
+static PyObject *
+newDmHistogramFromStats(DmStatsObject *stats, uint64_t region_id,
+                        uint64_t area_id);
+
+static PyObject *
+newDmHistogramFromGroup(DmStatsObject *stats, const uint64_t *members,
+                        uint64_t nr_members);
+
+static struct dm_histogram *
+_DmHistogram_bounds_from_object(dmpy_state *st, PyObject *bounds);
+
+static PyObject *
+DmStats_iter(PyObject *o);
+
+static PyObject *
+DmStatsRegion_iter(PyObject *o);
+
+static PyObject *
+newDmStatsCountersObject(DmStatsObject *stats, uint64_t region_id);
+
+static PyObject *
+newDmStatsMetricsObject(DmStatsObject *stats, uint64_t region_id,
+                        PyObject *names);
+
+/*
+ * ds_counters_region value following a populate() of a list of regions:
+ * the populated regions are marked by the counters_seq of their slot.
+ */
+#define DMSTATS_REGIONS_SELECTED (DM_STATS_REGIONS_ALL - 1)
+
+/*
+ * Return non-zero if the handle holds counter data for region_id. The
+ * library only allocates counter storage for regions that have been read
+ * by dm_stats_populate(): accessing the counters of a region that is
+ * present in the table but was never populated dereferences NULL.
+ */
+static int
+_DmStats_have_counters(DmStatsObject *self, uint64_t region_id)
+{
+    if (self->ds_counters_seq != self->ds_table_seq)
+        return 0;
+    if (self->ds_counters_region == DM_STATS_REGIONS_ALL)
+        return 1;
+    if (self->ds_counters_region == DMSTATS_REGIONS_SELECTED)
+        return (region_id < (uint64_t) self->ds_regions_len)
+               && (self->ds_region_slots[region_id].counters_seq
+                   == self->ds_table_seq);
+    return self->ds_counters_region == region_id;
+}
+
+/*
+ * Return the generation of the region_id slot, or 0 (which is never
+ * handed out) if region_id is outside the region cache. Must be called
+ * in a critical section on self.
+ */
+static uint64_t
+_DmStats_slot_generation(DmStatsObject *self, uint64_t region_id)
+{
+    if (!self->ds_region_slots || region_id >= (uint64_t) self->ds_regions_len)
+        return 0;
+    return self->ds_region_slots[region_id].gen;
+}
+
+/*
+ * Read the handle sequence number and the generation of the region_id
+ * slot for a new child object of region_id.
+ */
+static void
+_DmStats_region_stamp(DmStatsObject *self, uint64_t region_id,
+                      uint64_t *sequence, uint64_t *generation)
+{
+    Py_BEGIN_CRITICAL_SECTION(self);
+    *sequence = self->ds_sequence;
+    *generation = _DmStats_slot_generation(self, region_id);
+    Py_END_CRITICAL_SECTION();
+}
+
+/*
+ * Return non-zero if a child object created at sequence and generation
+ * for region_id is still valid: the handle has not been re-bound, and the
+ * region has not been created, deleted or changed since.
+ */
+static int
+_DmStats_region_valid(DmStatsObject *self, uint64_t sequence,
+                      uint64_t region_id, uint64_t generation)
+{
+    int valid;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    valid = (sequence == self->ds_sequence) && generation
+            && (generation == _DmStats_slot_generation(self, region_id));
+    Py_END_CRITICAL_SECTION();
+    return valid;
+}
+
+static void
+_DmStatsRegion_clear_area_cache(DmStatsRegionObject *self)
+{
+    PyObject **areas;
+    Py_ssize_t nr_areas;
+    int64_t i;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    areas = self->dr_areas;
+    nr_areas = self->dr_areas_len;
+    self->dr_areas = NULL;
+    self->dr_areas_len = 0;
+    Py_END_CRITICAL_SECTION();
+
+    if (!areas)
+        return;
+
+    /* If an area is in the cache, we are holding a reference
+     * to the Weakref object that represents it.
+     */
+    for (i = 0; i < nr_areas; i++)
+        Py_XDECREF(areas[i]);
+    PyMem_Free(areas);
+}
+
+/*
+ * Allocate the area cache of a region. This is deferred until the first
+ * indexed access to an area: iterating over a region does not use the
+ * cache, and regions may contain very large numbers of areas. Must be
+ * called in a critical section on self.
+ */
+static int
+_DmStatsRegion_set_area_cache(DmStatsRegionObject *self)
+{
+    struct dm_stats *dms = DMS_FROM_REGION(self);
+    uint64_t nr_slots;
+    DMPY_PROFILE_SCOPE("DmStatsRegion.set_area_cache");
+
+    nr_slots = dm_stats_get_region_nr_areas(dms, self->dr_region_id);
+    if (nr_slots) {
+        self->dr_areas = PyMem_Calloc(nr_slots, sizeof(PyObject *));
+        if (!self->dr_areas) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->dr_areas_len = nr_slots;
+    }
+    return 0;
+}
+
+static PyObject *
+DmStats_get_item(PyObject *o, Py_ssize_t i)
+{
+    DmStatsObject *self = (DmStatsObject *) o;
+    PyObject *region = NULL;
+    int in_range;
+    DMPY_PROFILE_SCOPE("DmStats.__getitem__");
+
+    if (!DmStatsObject_Check(DMPY_STATE(o), o))
+        return NULL;
+
+    DmStats_BusyCheck(self, NULL);
+
+    Py_BEGIN_CRITICAL_SECTION(o);
+    if ((in_range = (i >= 0) && (i < self->ds_regions_len)))
+        region = _dmpy_cache_get(&self->ds_regions[i]);
+    Py_END_CRITICAL_SECTION();
+
+    if (!in_range) {
+        PyErr_SetString(PyExc_IndexError, "DmStats region_id out of range");
+        return NULL;
+    }
+
+    /* cache hit */
+    if (region) {
+        DMPY_PROFILE_COUNT("DmStats.__getitem__.hit");
+        return region;
+    }
+
+    if (!dm_stats_region_present(self->ds_dms, i)) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    /* cache miss, or cache hit but referent expired */
+    DMPY_PROFILE_COUNT("DmStats.__getitem__.miss");
+    if (!(region = (PyObject *) newDmStatsRegionObject(o, i)))
+        return NULL;
+
+    /* The cache may have been rebuilt while the region was created. */
+    Py_BEGIN_CRITICAL_SECTION(o);
+    if (i < self->ds_regions_len)
+        _dmpy_cache_set(&self->ds_regions[i], &region);
+    Py_END_CRITICAL_SECTION();
+
+    return region;
+}
+
+
+static PyObject *
+DmStats_bind_devno(DmStatsObject *self, PyObject *const *args,
+                   Py_ssize_t nargs)
+{
+    static const char *const kwlist[] = {"major", "minor", NULL};
+    PyObject *argv[2], *binding;
+    int major, minor;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("bind_devno", args, nargs, NULL, kwlist, 2, argv)
+        || !_dmpy_int_converter(argv[0], &major)
+        || !_dmpy_int_converter(argv[1], &minor))
+        return NULL;
+
+    if (!(binding = _dmpy_stats_binding(NULL, NULL, major, minor)))
+        return NULL;
+
+    if (!dm_stats_bind_devno(self->ds_dms, major, minor)) {
+        Py_DECREF(binding);
+        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to devno.");
+        return NULL;
+    }
+
+    _DmStats_clear_region_cache(self);
+    self->ds_table_seq++;
+    _DmStats_clear_samples(self);
+    _DmStats_set_binding(self, binding);
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+DmStats_bind_name(DmStatsObject *self, PyObject *arg)
+{
+    PyObject *binding;
+    const char *name;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_str_converter(arg, &name))
+        return NULL;
+
+    if (!name || !strlen(name)) {
+        PyErr_SetString(PyExc_ValueError, "DmStats name cannot be empty "
+                        "or None.");
+        return NULL;
+    }
+
+    if (!(binding = _dmpy_stats_binding(name, NULL, 0, 0)))
+        return NULL;
+
+    if (!dm_stats_bind_name(self->ds_dms, name)) {
+        Py_DECREF(binding);
+        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to name.");
+        return NULL;
+    }
+
+    _DmStats_clear_region_cache(self);
+    self->ds_table_seq++;
+    _DmStats_clear_samples(self);
+    _DmStats_set_binding(self, binding);
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+DmStats_bind_uuid(DmStatsObject *self, PyObject *arg)
+{
+    PyObject *binding;
+    const char *uuid;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_str_converter(arg, &uuid))
+        return NULL;
+
+    if (!uuid || !strlen(uuid)) {
+        PyErr_SetString(PyExc_ValueError, "DmStats uuid cannot be empty "
+                        "or None.");
+        return NULL;
+    }
+
+    if (!(binding = _dmpy_stats_binding(NULL, uuid, 0, 0)))
+        return NULL;
+
+    if (!dm_stats_bind_uuid(self->ds_dms, uuid)) {
+        Py_DECREF(binding);
+        PyErr_SetString(PyExc_OSError, "Failed to bind DmStats to uuid.");
+        return NULL;
+    }
+
+    _DmStats_clear_region_cache(self);
+    self->ds_table_seq++;
+    _DmStats_clear_samples(self);
+    _DmStats_set_binding(self, binding);
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+/*
+ * DmStats property methods
+ * FIXME: expose these via the object's __dict__
+ */
+
+static PyObject *
+DmStats_nr_regions(DmStatsObject *self, PyObject *args)
+{
+    DmStats_BusyCheck(self, NULL);
+
+    return Py_BuildValue("i", dm_stats_get_nr_regions(self->ds_dms));
+}
+
+static PyObject *
+DmStats_nr_groups(DmStatsObject *self, PyObject *args)
+{
+    DmStats_BusyCheck(self, NULL);
+
+    return Py_BuildValue("i", dm_stats_get_nr_groups(self->ds_dms));
+}
+
+static PyObject *
+DmStats_region_present(DmStatsObject *self, PyObject *arg)
+{
+    int region_id;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_int_converter(arg, &region_id))
+        return NULL;
+
+    return Py_BuildValue("i", dm_stats_region_present(self->ds_dms,
+                                                      region_id));
+}
+
+static PyObject *
+DmStats_region_nr_areas(DmStatsObject *self, PyObject *arg)
+{
+    int region_id, val;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_int_converter(arg, &region_id))
+        return NULL;
+
+    /* FIXME: dm_stats_get_region_nr_areas segfaults on an un-listed handle */
+    if (dm_stats_get_nr_areas(self->ds_dms))
+        val = dm_stats_get_region_nr_areas(self->ds_dms, region_id);
+    else
+        val = 0;
+
+    return Py_BuildValue("i", val);
+}
+
+static PyObject *
+DmStats_nr_areas(DmStatsObject *self, PyObject *args)
+{
+    DmStats_BusyCheck(self, NULL);
+
+    return Py_BuildValue("i", dm_stats_get_nr_areas(self->ds_dms));
+}
+
+static PyObject *
+DmStats_group_present(DmStatsObject *self, PyObject *arg)
+{
+    int group_id, val;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_int_converter(arg, &group_id))
+        return NULL;
+
+    val = dm_stats_group_present(self->ds_dms, group_id);
+    return Py_BuildValue("i", val);
+}
+
+static PyObject *
+DmStats_set_sampling_interval(DmStatsObject *self, PyObject *arg)
+{
+    uint64_t interval_ns;
+    double interval = 0.0;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_double_converter(arg, &interval))
+        return NULL;
+
+    interval_ns = (uint64_t)(interval * (double) NSEC_PER_SEC);
+    dm_stats_set_sampling_interval_ns(self->ds_dms, interval_ns);
+
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+DmStats_get_sampling_interval(DmStatsObject *self, PyObject *args)
+{
+    uint64_t interval_ns;
+    double interval;
+
+    DmStats_BusyCheck(self, NULL);
+
+    interval_ns = dm_stats_get_sampling_interval_ns(self->ds_dms);
+    interval = ((double) interval_ns / (double) NSEC_PER_SEC);
+
+    return Py_BuildValue("d", interval);
+}
+
+static PyObject *
+DmStats_set_program_id(DmStatsObject *self, PyObject *const *args,
+                       Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"program_id", "allow_empty",
+                                         NULL};
+    int allow_empty = 0;
+    const char *program_id;
+    PyObject *argv[2];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("set_program_id", args, nargs, kwnames, kwlist,
+                         1, argv)
+        || !_dmpy_str_or_none_converter(argv[0], &program_id)
+        || !_dmpy_int_converter(argv[1], &allow_empty))
+        return NULL;
+
+    if (!allow_empty && (!program_id || !strlen(program_id))) {
+        PyErr_SetString(PyExc_ValueError, "Empty program_id not permitted "
+                        "without allow_empty=True.");
+        return NULL;
+    }
+    if (!dm_stats_set_program_id(self->ds_dms, allow_empty, program_id)) {
+        PyErr_SetString(PyExc_OSError, "Failed to set program_id.");
+        return NULL;
+    }
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+/*
+ * Release the cached weak reference in slot, clearing the area cache of
+ * the region if it is still alive.
+ */
+static void
+_DmStats_release_region_slot(PyObject **slot)
+{
+    PyObject *region;
+
+    if (!*slot)
+        return;
+
+    /* If a region is in the cache, we are holding a reference
+     * to the Weakref object that represents it: if the reference is
+     * still alive, retrive the object and clear its area cache.
+     */
+    if ((region = _dmpy_weakref_get(*slot))) {
+        _DmStatsRegion_clear_area_cache((DmStatsRegionObject *) region);
+        Py_DECREF(region);
+    }
+    Py_CLEAR(*slot);
+}
+
+/*
+ * Release a region cache that has been detached from its handle.
+ */
+static void
+_DmStats_free_region_cache(PyObject **regions, struct dmpy_region_slot *slots,
+                           Py_ssize_t nr_regions)
+{
+    int64_t i;
+
+    if (regions)
+        for (i = 0; i < nr_regions; i++)
+            _DmStats_release_region_slot(&regions[i]);
+
+    PyMem_Free(regions);
+    PyMem_Free(slots);
+}
+
+/*
+ * Drop the region cache and advance the sequence number of the handle,
+ * invalidating every region and area object created from it.
+ */
+static void
+_DmStats_clear_region_cache(DmStatsObject *self)
+{
+    struct dmpy_region_slot *slots;
+    PyObject **regions;
+    Py_ssize_t nr_regions;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    regions = self->ds_regions;
+    slots = self->ds_region_slots;
+    nr_regions = self->ds_regions_len;
+    self->ds_regions = NULL;
+    self->ds_region_slots = NULL;
+    self->ds_regions_len = 0;
+    self->ds_sequence++;
+    Py_END_CRITICAL_SECTION();
+
+    _DmStats_free_region_cache(regions, slots, nr_regions);
+}
+
+/*
+ * Return one more than the largest region_id present in dms, or 0 if it
+ * has no regions. This, and not dm_stats_get_nr_regions(), which counts
+ * the regions present, bounds the region_ids of a handle once a deleted
+ * region has left a hole in the table.
+ */
+static uint64_t
+_dmpy_stats_nr_region_ids(struct dm_stats *dms)
+{
+    uint64_t region_id, max_region = 0;
+
+    if (!dms || !dm_stats_get_nr_areas(dms))
+        return 0;
+
+    dm_stats_foreach_region(dms) {
+        region_id = dm_stats_get_current_region(dms);
+        max_region = (region_id > max_region) ? region_id : max_region;
+    }
+    return max_region + 1;
+}
+
+/*
+ * Rebuild the region cache after the region table has been read. Slots
+ * whose region is unchanged keep their generation and cached region
+ * object, so that existing DmStatsRegion and DmStatsArea objects remain
+ * valid; slots whose region was created, deleted or changed layout are
+ * given a new generation, invalidating any objects that refer to them.
+ * Returns 0 on success, or -1 with an exception set and the cache empty.
+ */
+static int
+_DmStats_update_region_cache(DmStatsObject *self)
+{
+    struct dmpy_region_slot *slots = NULL, *old, *old_slots;
+    PyObject **regions = NULL, **old_regions;
+    Py_ssize_t nr_old;
+    struct dm_stats *dms;
+    uint64_t nr_slots;
+    int64_t i;
+
+    dms = self->ds_dms;
+
+    if ((nr_slots = _dmpy_stats_nr_region_ids(dms))) {
+        regions = PyMem_Calloc(nr_slots, sizeof(*regions));
+        slots = PyMem_Calloc(nr_slots, sizeof(*slots));
+        if (!regions || !slots) {
+            PyMem_Free(regions);
+            PyMem_Free(slots);
+            _DmStats_clear_region_cache(self);
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (i = 0; i < (int64_t) nr_slots; i++) {
+        struct dmpy_region_slot *slot = &slots[i];
+
+        if ((slot->present = dm_stats_region_present(dms, i))) {
+            dm_stats_get_region_start(dms, &slot->start, i);
+            dm_stats_get_region_len(dms, &slot->len, i);
+            slot->nr_areas = dm_stats_get_region_nr_areas(dms, i);
+        }
+
+        old = (i < self->ds_regions_len) ? &self->ds_region_slots[i] : NULL;
+        if (old && (old->present == slot->present)
+            && (!slot->present || ((old->start == slot->start)
+                                   && (old->len == slot->len)
+                                   && (old->nr_areas == slot->nr_areas)))) {
+            slot->gen = old->gen;
+            regions[i] = self->ds_regions[i];
+            self->ds_regions[i] = NULL;
+        } else
+            slot->gen = ++self->ds_generation;
+    }
+
+    old_regions = self->ds_regions;
+    old_slots = self->ds_region_slots;
+    nr_old = self->ds_regions_len;
+    self->ds_regions = regions;
+    self->ds_region_slots = slots;
+    self->ds_regions_len = nr_slots;
+    Py_END_CRITICAL_SECTION();
+
+    _DmStats_free_region_cache(old_regions, old_slots, nr_old);
+    return 0;
+}
+
+/*
+ * Record the duration of a populate() that started at start_ns and the
+ * number of regions it read.
+ */
+static void
+_DmStats_set_populate_time(DmStatsObject *self, uint64_t start_ns,
+                           uint64_t nr_regions)
+{
+    self->ds_populate_time = (double) (_dmpy_monotonic_ns() - start_ns)
+                             / (double) NSEC_PER_SEC;
+    self->ds_populate_nr_regions = nr_regions;
+}
+
+/*
+ * Read the region table for program_id, or the handle's own program_id if
+ * NULL, into the handle. Returns 0 on success or -1 with an exception set.
+ */
+static int
+_DmStats_list(DmStatsObject *self, const char *program_id)
+{
+    uint64_t start, elapsed;
+    int r;
+
+    DMSTATS_BEGIN_IOCTL(self, return -1);
+    start = _dmpy_ioctl_start();
+    r = dm_stats_list(self->ds_dms, program_id);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMSTATS_END_IOCTL(self, r);
+    _dmpy_ioctl_record(DMPY_IOCTL_STATS_LIST, elapsed, r);
+    self->ds_table_seq++;
+
+    if (!r) {
+        /* The library discards the region table on failure. */
+        _DmStats_clear_region_cache(self);
+        PyErr_SetString(PyExc_OSError, "Failed to get region list from "
+                        "device-mapper.");
+        return -1;
+    }
+    return _DmStats_update_region_cache(self);
+}
+
+static PyObject *
+DmStats_list(DmStatsObject *self, PyObject *const *args,
+             Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"program_id", NULL};
+    const char *program_id = NULL;
+    PyObject *argv[1];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("list", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_str_or_none_converter(argv[0], &program_id))
+        return NULL;
+
+    if (_DmStats_list(self, program_id))
+        return NULL;
+
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+/*
+ * Read counter data for region_id, or all regions, into the handle.
+ * Returns 0 on success or -1 with an exception set.
+ */
+static int
+_DmStats_populate(DmStatsObject *self, const char *program_id,
+                  uint64_t region_id)
+{
+    uint64_t start, ioctl_start, elapsed;
+    int r;
+
+    /* Populating a single region requires the region table to have been
+     * dimensioned by a prior list(): the library dereferences the empty
+     * table instead of failing if it has not. */
+    start = _dmpy_monotonic_ns();
+    if ((region_id != DM_STATS_REGIONS_ALL)
+        && !dm_stats_get_nr_regions(self->ds_dms))
+        r = 0;
+    else {
+        DMSTATS_BEGIN_IOCTL(self, return -1);
+        ioctl_start = _dmpy_ioctl_start();
+        r = dm_stats_populate(self->ds_dms, program_id, region_id);
+        elapsed = _dmpy_ioctl_elapsed(ioctl_start);
+        DMSTATS_END_IOCTL(self, r);
+        _dmpy_ioctl_record(DMPY_IOCTL_STATS_POPULATE, elapsed, r);
+    }
+    _DmStats_set_populate_time(self, start, (region_id == DM_STATS_REGIONS_ALL)
+                               ? dm_stats_get_nr_regions(self->ds_dms) : 1);
+
+    self->ds_table_seq++;
+
+    if (!r) {
+        _DmStats_clear_region_cache(self);
+        PyErr_SetString(PyExc_OSError, "Failed to get region data from "
+                        "device-mapper.");
+        return -1;
+    }
+    self->ds_counters_seq = self->ds_table_seq;
+    self->ds_counters_region = region_id;
+    return _DmStats_update_region_cache(self);
+}
+
+/*
+ * Read counter data for the nr_ids regions in region_ids into the handle,
+ * issuing one @stats_print per region with the GIL released once for the
+ * whole set. The region table must already have been read by list() or
+ * populate(): unlisted regions are not touched. Returns 0 on success or
+ * -1 with an exception set.
+ */
+static int
+_DmStats_populate_regions(DmStatsObject *self, const char *program_id,
+                          const uint64_t *region_ids, uint64_t nr_ids)
+{
+    uint64_t i, n, start, ioctl_start, *elapsed;
+    int r = 1;
+
+    if (!dm_stats_get_nr_regions(self->ds_dms)) {
+        PyErr_SetString(PyExc_OSError, "Failed to get region data from "
+                        "device-mapper.");
+        return -1;
+    }
+
+    for (i = 0; i < nr_ids; i++) {
+        if (!dm_stats_region_present(self->ds_dms, region_ids[i])) {
+            PyErr_Format(PyExc_IndexError, "DmStats region_id " FMTu64
+                         " does not exist.", region_ids[i]);
+            return -1;
+        }
+    }
+
+    /* One latency per @stats_print, recorded once the GIL is held. */
+    if (!(elapsed = PyMem_Malloc(sizeof(*elapsed) * (nr_ids + 1)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    start = _dmpy_monotonic_ns();
+    DMSTATS_BEGIN_IOCTL(self, goto busy);
+    for (i = 0; r && (i < nr_ids); i++) {
+        ioctl_start = _dmpy_ioctl_start();
+        r = dm_stats_populate(self->ds_dms, program_id, region_ids[i]);
+        elapsed[i] = _dmpy_ioctl_elapsed(ioctl_start);
+    }
+    DMSTATS_END_IOCTL(self, r);
+    for (n = 0; n < i; n++)
+        _dmpy_ioctl_record(DMPY_IOCTL_STATS_POPULATE, elapsed[n],
+                           r || (n < i - 1));
+    PyMem_Free(elapsed);
+    _DmStats_set_populate_time(self, start, i);
+
+    self->ds_table_seq++;
+
+    if (!r) {
+        _DmStats_clear_region_cache(self);
+        PyErr_Format(PyExc_OSError, "Failed to get region data for "
+                     "region_id " FMTu64 " from device-mapper.",
+                     region_ids[i - 1]);
+        return -1;
+    }
+
+    self->ds_counters_seq = self->ds_table_seq;
+    self->ds_counters_region = DMSTATS_REGIONS_SELECTED;
+    if (_DmStats_update_region_cache(self))
+        return -1;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    for (i = 0; i < nr_ids; i++)
+        if (region_ids[i] < (uint64_t) self->ds_regions_len)
+            self->ds_region_slots[region_ids[i]].counters_seq
+                = self->ds_table_seq;
+    Py_END_CRITICAL_SECTION();
+    return 0;
+
+busy:
+    PyMem_Free(elapsed);
+    return -1;
+}
+
+/*
+ * Convert region_ids, an iterable of region_id values, into a newly
+ * allocated array. Returns 0 on success or -1 with an exception set.
+ */
+static int
+_DmStats_parse_region_ids(PyObject *region_ids, uint64_t **ids,
+                          uint64_t *nr_ids)
+{
+    PyObject *seq;
+    Py_ssize_t i, len;
+
+    if (!(seq = PySequence_Fast(region_ids, "region_ids must be an "
+                                "iterable of region_id values.")))
+        return -1;
+
+    len = PySequence_Fast_GET_SIZE(seq);
+    if (!(*ids = PyMem_Malloc(sizeof(**ids) * (len + 1)))) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        (*ids)[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq,
+                                                                     i));
+        if (PyErr_Occurred()) {
+            PyMem_Free(*ids);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    *nr_ids = (uint64_t) len;
+    Py_DECREF(seq);
+    return 0;
+}
+
+static int
+_DmStats_get_group_members(DmStatsObject *stats, uint64_t group_id,
+                           uint64_t **members, uint64_t *nr_members);
+
+static PyObject *
+DmStats_populate(DmStatsObject *self, PyObject *const *args,
+                 Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"program_id", "region_id",
+                                         "region_ids", "group_id", NULL};
+    uint64_t region_id = DM_STATS_REGIONS_ALL, nr_ids, *ids;
+    PyObject *region_ids = NULL, *group_id = NULL;
+    const char *program_id = NULL;
+    int r;
+    PyObject *argv[4];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("populate", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_str_or_none_converter(argv[0], &program_id)
+        || !_dmpy_long_converter(argv[1], &region_id))
+        return NULL;
+    region_ids = argv[2];
+    group_id = argv[3];
+
+    if (region_ids == Py_None)
+        region_ids = NULL;
+    if (group_id == Py_None)
+        group_id = NULL;
+
+    if ((!!region_ids + !!group_id
+         + (region_id != DM_STATS_REGIONS_ALL)) > 1) {
+        PyErr_SetString(PyExc_TypeError, "Please specify at most one of "
+                        "region_id=, region_ids= or group_id=.");
+        return NULL;
+    }
+
+    if (!region_ids && !group_id) {
+        if (_DmStats_populate(self, program_id, region_id))
+            return NULL;
+        Py_INCREF(self);
+        return (PyObject *) self;
+    }
+
+    if (region_ids) {
+        if (_DmStats_parse_region_ids(region_ids, &ids, &nr_ids))
+            return NULL;
+    } else {
+        region_id = PyLong_AsUnsignedLongLong(group_id);
+        if (PyErr_Occurred())
+            return NULL;
+        if (!dm_stats_group_present(self->ds_dms, region_id)) {
+            PyErr_Format(PyExc_IndexError, "DmStats group_id " FMTu64
+                         " does not exist.", region_id);
+            return NULL;
+        }
+        if (_DmStats_get_group_members(self, region_id, &ids, &nr_ids))
+            return NULL;
+    }
+
+    r = _DmStats_populate_regions(self, program_id, ids, nr_ids);
+    PyMem_Free(ids);
+    if (r)
+        return NULL;
+
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+DmStats_create_region(DmStatsObject *self, PyObject *const *args,
+                      Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"start", "len", "step",
+                                         "precise", "bounds",
+                                         "program_id", "user_data", NULL};
+    const char *program_id = NULL, *user_data = NULL;
+    uint64_t start = 0, len = 0, region_id, ioctl_start, elapsed;
+    PyObject *bounds_obj = NULL;
+    struct dm_histogram *bounds = NULL;
+    int r, precise = 0;
+    int64_t step = -1;
+    PyObject *argv[7];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("create_region", args, nargs, kwnames, kwlist,
+                         0, argv)
+        || !_dmpy_longlong_converter(argv[0], &start)
+        || !_dmpy_longlong_converter(argv[1], &len)
+        || !_dmpy_longlong_converter(argv[2], &step)
+        || !_dmpy_int_converter(argv[3], &precise)
+        || !_dmpy_str_or_none_converter(argv[5], &program_id)
+        || !_dmpy_str_or_none_converter(argv[6], &user_data))
+        return NULL;
+    bounds_obj = argv[4];
+
+    if (bounds_obj && (bounds_obj != Py_None))
+        if (!(bounds = _DmHistogram_bounds_from_object(DMPY_STATE(self),
+                                                       bounds_obj)))
+            return NULL;
+
+    errno = 0;
+    DMSTATS_BEGIN_IOCTL(self, goto busy);
+    ioctl_start = _dmpy_ioctl_start();
+    r = dm_stats_create_region(self->ds_dms, &region_id, start, len, step,
+                               precise, bounds, program_id, user_data);
+    elapsed = _dmpy_ioctl_elapsed(ioctl_start);
+    DMSTATS_END_IOCTL(self, r);
+    _dmpy_ioctl_record(DMPY_IOCTL_STATS_CREATE, elapsed, r);
+
+    if (bounds)
+        dm_histogram_bounds_destroy(bounds);
+
+    if (!r) {
+        if (errno)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else
+            PyErr_SetString(PyExc_OSError, "Failed to create new region.");
+        return NULL;
+    }
+
+    /* The new region has no counter data until the next populate(). */
+    self->ds_counters_seq = UINT64_MAX;
+
+    Py_INCREF(self);
+    return (PyObject *) self;
+
+busy:
+    if (bounds)
+        dm_histogram_bounds_destroy(bounds);
+    return NULL;
+}
+
+static int _DmStats_delete_region(DmStatsObject *self, uint64_t region_id)
+{
+    PyObject *region = NULL;
+    uint64_t start, elapsed;
+    int r;
+
+    DmStats_BusyCheck(self, -1);
+
+    if (!dm_stats_region_present(self->ds_dms, region_id)) {
+        PyErr_Format(PyExc_IndexError, "mStats region_id " FMTu64
+                     " does not exist.", region_id);
+        goto fail;
+    }
+
+    errno = 0;
+
+    DMSTATS_BEGIN_IOCTL(self, goto fail);
+    start = _dmpy_ioctl_start();
+    r = dm_stats_delete_region(self->ds_dms, region_id);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMSTATS_END_IOCTL(self, r);
+    _dmpy_ioctl_record(DMPY_IOCTL_STATS_DELETE, elapsed, r);
+
+    if (!r) {
+        if (errno)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else
+            PyErr_SetString(PyExc_OSError, "Failed to delete region " FMTu64
+                            ".");
+        goto fail;
+    }
+
+    /* Invalidate objects referring to the deleted region. */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (region_id < (uint64_t) self->ds_regions_len) {
+        region = self->ds_regions[region_id];
+        self->ds_regions[region_id] = NULL;
+        self->ds_region_slots[region_id].present = 0;
+        self->ds_region_slots[region_id].gen = ++self->ds_generation;
+    }
+    Py_END_CRITICAL_SECTION();
+    _DmStats_release_region_slot(&region);
+
+    return 0;
+fail:
+    return -1;
+}
+
+static PyObject *
+DmStats_delete_region(DmStatsObject *self, PyObject *arg)
+{
+    uint64_t region_id = 0;
+
+    if (!_dmpy_ulonglong_mask_converter(arg, &region_id))
+        return NULL;
+    if (_DmStats_delete_region(self, region_id))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+/*
+ * Bulk region creation and deletion.
+ *
+ * create_regions() and delete_regions() send one message ioctl per region
+ * in a single loop with the GIL released, and update the region cache
+ * once when the loop is done rather than once per region.
+ */
+
+/* One region to create, and the result of creating it. */
+struct dmpy_region_spec {
+    uint64_t start;
+    uint64_t len;
+    int64_t step;
+    uint64_t region_id;
+    uint64_t elapsed; /* ioctl latency, recorded once the GIL is held */
+    int err; /* 0 on success, or the errno of a failed create */
+};
+
+/*
+ * Parse specs into a newly allocated array of *nr_specs region specs:
+ * either an iterable of (start, len) or (start, len, step) tuples, or a
+ * packed buffer of native uint64_t (start, len) pairs. Specs that do not
+ * give a step use step. Returns 0 on success or -1 with an exception set.
+ */
+static int
+_DmStats_parse_region_specs(PyObject *specs, int64_t step,
+                            struct dmpy_region_spec **out,
+                            Py_ssize_t *nr_specs)
+{
+    struct dmpy_region_spec *spec;
+    PyObject *seq, *item;
+    Py_buffer view;
+    uint64_t pair[2];
+    Py_ssize_t i, nr;
+
+    if (PyObject_CheckBuffer(specs)) {
+        if (_dmpy_get_uint64_buffer(specs, &view, "specs"))
+            return -1;
+        if (view.len % sizeof(pair)) {
+            PyBuffer_Release(&view);
+            PyErr_SetString(PyExc_ValueError, "specs must hold (start, "
+                            "len) pairs.");
+            return -1;
+        }
+        nr = view.len / (Py_ssize_t) sizeof(pair);
+        if (!(*out = PyMem_Calloc(nr ? nr : 1, sizeof(**out)))) {
+            PyBuffer_Release(&view);
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < nr; i++) {
+            memcpy(pair, (char *) view.buf + i * sizeof(pair), sizeof(pair));
+            (*out)[i].start = pair[0];
+            (*out)[i].len = pair[1];
+            (*out)[i].step = step;
+        }
+        PyBuffer_Release(&view);
+        *nr_specs = nr;
+        return 0;
+    }
+
+    if (!(seq = PySequence_Fast(specs, "specs must be an iterable of "
+                                "(start, len[, step]) tuples or a packed "
+                                "buffer.")))
+        return -1;
+
+    nr = PySequence_Fast_GET_SIZE(seq);
+    if (!(*out = PyMem_Calloc(nr ? nr : 1, sizeof(**out)))) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < nr; i++) {
+        spec = &(*out)[i];
+        spec->step = step;
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyTuple_Check(item)
+            || !PyArg_ParseTuple(item, "O&O&|L;specs must be (start, len[, "
+                                 "step]) tuples", _dmpy_uint64_converter,
+                                 &spec->start, _dmpy_uint64_converter,
+                                 &spec->len, &spec->step)) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "specs must be (start, "
+                                "len[, step]) tuples");
+            PyMem_Free(*out);
+            Py_DECREF(seq);
+            return -1;
+        }
+    }
+    Py_DECREF(seq);
+    *nr_specs = nr;
+    return 0;
+}
+
+static PyObject *
+DmStats_create_regions(DmStatsObject *self, PyObject *const *args,
+                       Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"specs", "step", "precise",
+                                         "bounds", "program_id",
+                                         "user_data", NULL};
+    const char *program_id = NULL, *user_data = NULL;
+    struct dmpy_region_spec *specs = NULL, *spec;
+    struct dm_histogram *bounds = NULL;
+    PyObject *argv[6], *results = NULL, *item;
+    Py_ssize_t i, nr_specs = 0, nr_ok = 0;
+    uint64_t start;
+    int64_t step = -1;
+    int precise = 0, r;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("create_regions", args, nargs, kwnames, kwlist, 1,
+                         argv)
+        || !_dmpy_longlong_converter(argv[1], &step)
+        || !_dmpy_int_converter(argv[2], &precise)
+        || !_dmpy_str_or_none_converter(argv[4], &program_id)
+        || !_dmpy_str_or_none_converter(argv[5], &user_data))
+        return NULL;
+
+    if (_DmStats_parse_region_specs(argv[0], step, &specs, &nr_specs))
+        return NULL;
+
+    if (argv[3] && (argv[3] != Py_None)
+        && !(bounds = _DmHistogram_bounds_from_object(DMPY_STATE(self),
+                                                      argv[3])))
+        goto out;
+
+    DMSTATS_BEGIN_IOCTL(self, goto out);
+    for (i = 0; i < nr_specs; i++) {
+        spec = &specs[i];
+        errno = 0;
+        start = _dmpy_ioctl_start();
+        r = dm_stats_create_region(self->ds_dms, &spec->region_id,
+                                   spec->start, spec->len, spec->step,
+                                   precise, bounds, program_id, user_data);
+        spec->elapsed = _dmpy_ioctl_elapsed(start);
+        spec->err = r ? 0 : (errno ? errno : EIO);
+        nr_ok += !!r;
+    }
+    DMSTATS_END_IOCTL(self, nr_ok);
+
+    for (i = 0; i < nr_specs; i++)
+        _dmpy_ioctl_record(DMPY_IOCTL_STATS_CREATE, specs[i].elapsed,
+                           !specs[i].err);
+
+    /* Read back the region table once for all of the new regions, for
+     * the program_id that they were created with. The regions exist
+     * whether or not this succeeds, and the caller needs their ids: a
+     * failed read back leaves the table empty, as a failed list() does,
+     * but still returns the results. */
+    if (nr_ok && _DmStats_list(self, program_id))
+        PyErr_Clear();
+
+    if (!(results = PyList_New(nr_specs)))
+        goto out;
+
+    for (i = 0; i < nr_specs; i++) {
+        spec = &specs[i];
+        if (spec->err)
+            item = Py_BuildValue("(iO)", spec->err, Py_None);
+        else
+            item = Py_BuildValue("(iK)", 0,
+                                 (unsigned long long) spec->region_id);
+        if (!item) {
+            Py_CLEAR(results);
+            goto out;
+        }
+        PyList_SET_ITEM(results, i, item);
+    }
+
+out:
+    if (bounds)
+        dm_histogram_bounds_destroy(bounds);
+    PyMem_Free(specs);
+    return results;
+}
+
+static PyObject *
+DmStats_delete_regions(DmStatsObject *self, PyObject *ids)
+{
+    uint64_t *region_ids = NULL, *elapsed = NULL, nr_ids = 0, i, start;
+    PyObject *results = NULL, *region, *value;
+    Py_buffer view;
+    int *errs = NULL, nr_ok = 0, r;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (PyObject_CheckBuffer(ids)) {
+        if (_dmpy_get_uint64_buffer(ids, &view, "ids"))
+            return NULL;
+        nr_ids = (uint64_t) view.len / sizeof(uint64_t);
+        if ((region_ids = PyMem_Malloc(sizeof(*region_ids) * (nr_ids + 1))))
+            memcpy(region_ids, view.buf, (size_t) view.len);
+        PyBuffer_Release(&view);
+        if (!region_ids)
+            return PyErr_NoMemory();
+    } else if (_DmStats_parse_region_ids(ids, &region_ids, &nr_ids))
+        return NULL;
+
+    errs = PyMem_Calloc(nr_ids + 1, sizeof(*errs));
+    elapsed = PyMem_Malloc(sizeof(*elapsed) * (nr_ids + 1));
+    if (!errs || !elapsed) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    /* Regions that are not in the table are not sent to the kernel, and
+     * no call is recorded for them. */
+    for (i = 0; i < nr_ids; i++) {
+        elapsed[i] = UINT64_MAX;
+        if (!dm_stats_region_present(self->ds_dms, region_ids[i]))
+            errs[i] = ENOENT;
+    }
+
+    DMSTATS_BEGIN_IOCTL(self, goto out);
+    for (i = 0; i < nr_ids; i++) {
+        if (errs[i])
+            continue;
+        errno = 0;
+        start = _dmpy_ioctl_start();
+        r = dm_stats_delete_region(self->ds_dms, region_ids[i]);
+        elapsed[i] = _dmpy_ioctl_elapsed(start);
+        errs[i] = r ? 0 : (errno ? errno : EIO);
+        nr_ok += !!r;
+    }
+    DMSTATS_END_IOCTL(self, nr_ok);
+
+    for (i = 0; i < nr_ids; i++)
+        _dmpy_ioctl_record(DMPY_IOCTL_STATS_DELETE, elapsed[i], !errs[i]);
+
+    /* Invalidate objects referring to the deleted regions. */
+    for (i = 0; i < nr_ids; i++) {
+        if (errs[i])
+            continue;
+        region = NULL;
+        Py_BEGIN_CRITICAL_SECTION(self);
+        if (region_ids[i] < (uint64_t) self->ds_regions_len) {
+            region = self->ds_regions[region_ids[i]];
+            self->ds_regions[region_ids[i]] = NULL;
+            self->ds_region_slots[region_ids[i]].present = 0;
+            self->ds_region_slots[region_ids[i]].gen = ++self->ds_generation;
+        }
+        Py_END_CRITICAL_SECTION();
+        _DmStats_release_region_slot(&region);
+    }
+
+    if (!(results = PyList_New((Py_ssize_t) nr_ids)))
+        goto out;
+
+    for (i = 0; i < nr_ids; i++) {
+        if (!(value = PyLong_FromLong(errs[i]))) {
+            Py_CLEAR(results);
+            goto out;
+        }
+        PyList_SET_ITEM(results, (Py_ssize_t) i, value);
+    }
+
+out:
+    PyMem_Free(elapsed);
+    PyMem_Free(errs);
+    PyMem_Free(region_ids);
+    return results;
+}
+
+static PyObject *
+DmStats_counters(DmStatsObject *self, PyObject *args)
+{
+    DmStats_BusyCheck(self, NULL);
+    return newDmStatsCountersObject(self, DM_STATS_REGIONS_ALL);
+}
+
+static PyObject *
+_DmStats_sample(DmStatsObject *self, const char *program_id);
+
+static PyObject *
+DmStats_sample(DmStatsObject *self, PyObject *const *args,
+               Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"program_id", NULL};
+    const char *program_id = NULL;
+    PyObject *argv[1];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("sample", args, nargs, kwnames, kwlist, 0, argv)
+        || !_dmpy_str_or_none_converter(argv[0], &program_id))
+        return NULL;
+
+    return _DmStats_sample(self, program_id);
+}
+
+static PyObject *
+DmStats_metrics(DmStatsObject *self, PyObject *const *args,
+                Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"names", NULL};
+    PyObject *names = NULL;
+    PyObject *argv[1];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("metrics", args, nargs, kwnames, kwlist, 0, argv))
+        return NULL;
+    names = argv[0];
+
+    return newDmStatsMetricsObject(self, DM_STATS_REGIONS_ALL, names);
+}
+
+static PyObject *
+_DmStats_top_areas(DmStatsObject *self, PyObject *name, Py_ssize_t n);
+
+static PyObject *
+DmStats_top_areas(DmStatsObject *self, PyObject *const *args,
+                  Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"counter", "n", NULL};
+    PyObject *name;
+    Py_ssize_t n = 0;
+    PyObject *argv[2];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("top_areas", args, nargs, kwnames, kwlist, 2, argv)
+        || !_dmpy_ssize_converter(argv[1], &n))
+        return NULL;
+    name = argv[0];
+
+    return _DmStats_top_areas(self, name, n);
+}
+
+static PyObject *
+_DmStats_heatmap(DmStatsObject *stats, PyObject *region, PyObject *name,
+                 Py_ssize_t buckets, const char *op_name, int workers);
+
+static PyObject *
+DmStats_heatmap(DmStatsObject *self, PyObject *const *args,
+                Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"region", "counter", "buckets",
+                                         "op", "workers", NULL};
+    const char *op = "sum";
+    Py_ssize_t buckets = 0;
+    int workers = 1;
+    PyObject *argv[5];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("heatmap", args, nargs, kwnames, kwlist, 3, argv)
+        || !_dmpy_ssize_converter(argv[2], &buckets)
+        || !_dmpy_str_converter(argv[3], &op)
+        || !_dmpy_int_converter(argv[4], &workers))
+        return NULL;
+
+    return _DmStats_heatmap(self, argv[0], argv[1], buckets, op, workers);
+}
+
+static PyObject *
+_DmStats_render_openmetrics(DmStatsObject *self, const char *prefix,
+                            PyObject *labels, PyObject *include_metrics,
+                            int per_region);
+
+static PyObject *
+DmStats_render_openmetrics(DmStatsObject *self, PyObject *const *args,
+                           Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"prefix", "labels",
+                                         "include_metrics", "per_region",
+                                         NULL};
+    const char *prefix = DMPY_OPENMETRICS_PREFIX;
+    PyObject *labels = NULL, *include_metrics = NULL;
+    int per_region = 0;
+    PyObject *argv[4];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("render_openmetrics", args, nargs, kwnames, kwlist,
+                         0, argv)
+        || !_dmpy_str_converter(argv[0], &prefix)
+        || !_dmpy_bool_converter(argv[3], &per_region))
+        return NULL;
+    labels = argv[1];
+    include_metrics = argv[2];
+
+    return _DmStats_render_openmetrics(self, prefix, labels, include_metrics,
+                                       per_region);
+}
+
+static PyObject *
+_DmStats_to_bytes(DmStatsObject *stats);
+
+static PyObject *
+DmStats_to_bytes(DmStatsObject *self, PyObject *args)
+{
+    DmStats_BusyCheck(self, NULL);
+    return _DmStats_to_bytes(self);
+}
+
+static PyObject *
+newDmStatsGroupObject(DmStatsObject *stats, uint64_t group_id);
+
+/*
+ * Convert members, a sequence of region_id values or a region list string
+ * as accepted by dmsetup ("0-3,5"), into a newly allocated region list
+ * string. Each region_id in a sequence must be present in the handle.
+ */
+static char *
+_DmStats_parse_group_members(DmStatsObject *self, PyObject *members)
+{
+    PyObject *seq, *item;
+    Py_ssize_t i, nr_members;
+    const char *str;
+    uint64_t region_id;
+    size_t len = 0, size;
+    char *buf;
+
+    if (PyUnicode_Check(members)) {
+        if (!(str = PyUnicode_AsUTF8(members)))
+            return NULL;
+        if (!(buf = PyMem_Malloc(strlen(str) + 1)))
+            return (char *) PyErr_NoMemory();
+        strcpy(buf, str);
+        return buf;
+    }
+
+    if (!(seq = PySequence_Fast(members, "members must be a sequence of "
+                                "region_id values or a region list string.")))
+        return NULL;
+
+    if (!(nr_members = PySequence_Fast_GET_SIZE(seq))) {
+        PyErr_SetString(PyExc_ValueError, "A group must have at least "
+                        "one member.");
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    /* Up to 20 digits and a separator for each region_id. */
+    size = (size_t) nr_members * 21 + 1;
+    if (!(buf = PyMem_Malloc(size))) {
+        Py_DECREF(seq);
+        return (char *) PyErr_NoMemory();
+    }
+
+    for (i = 0; i < nr_members; i++) {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        region_id = PyLong_AsUnsignedLongLong(item);
+        if (PyErr_Occurred())
+            goto bad;
+        if (!dm_stats_region_present(self->ds_dms, region_id)) {
+            PyErr_Format(PyExc_IndexError, "DmStats region_id " FMTu64
+                         " does not exist.", region_id);
+            goto bad;
+        }
+        len += snprintf(buf + len, size - len, i ? "," FMTu64 : FMTu64,
+                        region_id);
+    }
+
+    Py_DECREF(seq);
+    return buf;
+
+bad:
+    Py_DECREF(seq);
+    PyMem_Free(buf);
+    return NULL;
+}
+
+static PyObject *
+DmStats_create_group(DmStatsObject *self, PyObject *const *args,
+                     Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"members", "alias", NULL};
+    PyObject *members_obj;
+    const char *alias = NULL;
+    char *members;
+    uint64_t group_id;
+    int r;
+    PyObject *argv[2];
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (_dmpy_parse_args("create_group", args, nargs, kwnames, kwlist, 1, argv)
+        || !_dmpy_str_or_none_converter(argv[1], &alias))
+        return NULL;
+    members_obj = argv[0];
+
+    if (!dm_stats_get_nr_regions(self->ds_dms)) {
+        PyErr_SetString(PyExc_ValueError, "No regions: call DmStats.list() "
+                        "first.");
+        return NULL;
+    }
+
+    if (!(members = _DmStats_parse_group_members(self, members_obj)))
+        return NULL;
+
+    errno = 0;
+    DMSTATS_BEGIN_IOCTL(self, goto busy);
+    r = dm_stats_create_group(self->ds_dms, members, alias, &group_id);
+    DMSTATS_END_IOCTL(self, r);
+
+    PyMem_Free(members);
+
+    if (!r) {
+        if (errno)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else
+            PyErr_SetString(PyExc_OSError, "Failed to create group.");
+        return NULL;
+    }
+
+    /* The library updates the group table but not the group_id of the
+     * member regions: re-read the region table as dmstats does. */
+    if (_DmStats_list(self, NULL))
+        return NULL;
+
+    return PyLong_FromUnsignedLongLong(group_id);
+
+busy:
+    PyMem_Free(members);
+    return NULL;
+}
+
+static int
+_DmStats_ungroup(DmStatsObject *self, uint64_t group_id)
+{
+    int r;
+
+    DmStats_BusyCheck(self, -1);
+
+    if (!dm_stats_group_present(self->ds_dms, group_id)) {
+        PyErr_Format(PyExc_IndexError, "DmStats group_id " FMTu64
+                     " does not exist.", group_id);
+        return -1;
+    }
+
+    errno = 0;
+    DMSTATS_BEGIN_IOCTL(self, return -1);
+    r = dm_stats_delete_group(self->ds_dms, group_id, 0);
+    DMSTATS_END_IOCTL(self, r);
+
+    if (!r) {
+        if (errno)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else
+            PyErr_Format(PyExc_OSError, "Failed to delete group " FMTu64
+                         ".", group_id);
+        return -1;
+    }
+    return _DmStats_list(self, NULL);
+}
+
+static PyObject *
+DmStats_ungroup(DmStatsObject *self, PyObject *arg)
+{
+    uint64_t group_id = 0;
+
+    if (!_dmpy_ulonglong_mask_converter(arg, &group_id))
+        return NULL;
+    if (_DmStats_ungroup(self, group_id))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static int
+_DmStats_set_alias(DmStatsObject *self, uint64_t group_id, const char *alias)
+{
+    int r;
+
+    DmStats_BusyCheck(self, -1);
+
+    if (!dm_stats_group_present(self->ds_dms, group_id)) {
+        PyErr_Format(PyExc_IndexError, "DmStats group_id " FMTu64
+                     " does not exist.", group_id);
+        return -1;
+    }
+
+    errno = 0;
+    DMSTATS_BEGIN_IOCTL(self, return -1);
+    r = dm_stats_set_alias(self->ds_dms, group_id, alias);
+    DMSTATS_END_IOCTL(self, r);
+
+    if (!r) {
+        if (errno)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else
+            PyErr_SetString(PyExc_OSError, "Failed to set group alias.");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+DmStats_set_alias(DmStatsObject *self, PyObject *const *args,
+                  Py_ssize_t nargs)
+{
+    static const char *const kwlist[] = {"group_id", "alias", NULL};
+    uint64_t group_id;
+    const char *alias;
+    PyObject *argv[2];
+
+    if (_dmpy_parse_args("set_alias", args, nargs, NULL, kwlist, 2, argv)
+        || !_dmpy_ulonglong_mask_converter(argv[0], &group_id)
+        || !_dmpy_str_converter(argv[1], &alias))
+        return NULL;
+    if (_DmStats_set_alias(self, group_id, alias))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+DmStats_group(DmStatsObject *self, PyObject *arg)
+{
+    uint64_t group_id;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!_dmpy_ulonglong_mask_converter(arg, &group_id))
+        return NULL;
+
+    if (!dm_stats_group_present(self->ds_dms, group_id)) {
+        PyErr_Format(PyExc_IndexError, "DmStats group_id " FMTu64
+                     " does not exist.", group_id);
+        return NULL;
+    }
+
+    return newDmStatsGroupObject(self, group_id);
+}
+
+static PyObject *
+DmStats_groups(DmStatsObject *self, PyObject *args)
+{
+    struct dm_stats *dms = self->ds_dms;
+    PyObject *groups, *group;
+    uint64_t region_id;
+
+    DmStats_BusyCheck(self, NULL);
+
+    if (!(groups = PyList_New(0)))
+        return NULL;
+
+    if (!dm_stats_get_nr_regions(dms))
+        return groups;
+
+    /* The group_id of a group is the region_id of its leader. */
+    dm_stats_foreach_region(dms) {
+        region_id = dm_stats_get_current_region(dms);
+        if (dm_stats_get_group_id(dms, region_id) != region_id)
+            continue;
+        if (!(group = newDmStatsGroupObject(self, region_id)))
+            goto fail;
+        if (PyList_Append(groups, group)) {
+            Py_DECREF(group);
+            goto fail;
+        }
+        Py_DECREF(group);
+    }
+    return groups;
+
+fail:
+    Py_DECREF(groups);
+    return NULL;
+}
+
+#define DMSTATS_bind_devno__doc__ \
+"Bind a DmStats object to the specified device major and minor values.\n" \
+"Any previous binding is cleared and any preexisting counter data\n"      \
+"contained in the object is released."
+
+#define DMSTATS_bind_name__doc__ \
+"Bind a DmStats object to the specified device name. Any previous\n" \
+"binding is cleared and any preexisting counter data contained in\n" \
+"the object is released."
+
+#define DMSTATS_bind_uuid__doc__ \
+"Bind a DmStats object to the specified device UUID. Any previous\n" \
+"binding is cleared and any preexisting counter data contained in\n" \
+"the object is released."
+
+#define DMSTATS_nr_regions__doc__ \
+"Return the number of regions present in this DmStats object."
+
+#define DMSTATS_nr_groups__doc__ \
 "Return the number of groups present in this DmStats object."
 
-#define DMSTATS_region_present__doc__ \
-"Test whether region_id is present in this DmStats object."
+#define DMSTATS_region_present__doc__ \
+"Test whether region_id is present in this DmStats object."
+
+#define DMSTATS_region_nr_areas__doc__ \
+"Return the number of areas present in region_id."
+
+#define DMSTATS_nr_areas__doc__ \
+"Return the number of areas present in this DmStats object."
+
+#define DMSTATS_group_present__doc__ \
+"Test whether group_id is present in this DmStats object."
+
+#define DMSTATS_set_sampling_interval__doc__ \
+"Set the sampling interval for counter data to the specified value in\n" \
+"seconds. Floating point values are permitted.\n\n"                      \
+"The interval is used to calculate time-based metrics from the basic\n"  \
+"counter data: an interval must be set before calling any of the\n"      \
+"metric methods.\n\n"                                                    \
+"For best accuracy the duration should be measured and updated at the\n" \
+"end of each interval.\n\n"                                              \
+"All values are stored internally with nanosecond precision and are\n"   \
+"converted to or from seconds as needed."
+
+#define DMSTATS_get_sampling_interval__doc__ \
+"Return the currently configured sampling interval in seconds, as a\n"   \
+"Floating point value."
+
+#define DMSTATS_set_program_id__doc__ \
+"Override program_id. This may be used to change the default\n"          \
+"program_id value for an existing handle. If the allow_empty argument\n" \
+"is non-zero a program_id of None or the empty string is permitted.\n\n" \
+"Use with caution! Most users of the library should set a valid,\n"      \
+"non-NULL program_id for every statistics region created. Failing to\n"  \
+"do so may result in confusing state when multiple programs are\n"       \
+"creating and managing statistics regions.\n\n"                          \
+"All users of the library are encouraged to choose an unambiguous,\n"    \
+"unique program_id: this could be based on PID (for programs that\n"     \
+"create, report, and delete regions in a single process), session id,\n" \
+"executable name, or some other distinguishing string.\n\n"              \
+"Use of the empty string as a program_id does not simplify use of the\n" \
+"library or the command line tools and use of this value is strongly\n"  \
+"discouraged."
+
+#define DMSTATS_list__doc__ \
+"Send a @stats_list message, and parse the result into this DmStats\n"   \
+"object."
+
+#define DMSTATS_populate__doc__ \
+"Populate this DmStats object with data from device-mapper.\n\n"         \
+"By default the region table is read and counter data is fetched for\n" \
+"every region. A single region may be selected with `region_id=`, or a\n" \
+"subset with `region_ids=`, an iterable of region_id values, or\n"      \
+"`group_id=`, to read only the members of a group: these require the\n"  \
+"region table to have been read by a prior list() or populate(), and\n" \
+"leave the counters of the other regions unavailable until the next\n"  \
+"full populate().\n\n"                                                    \
+"The populate_time and populate_nr_regions attributes give the\n"       \
+"duration of the ioctls issued by the last populate() in seconds, and\n" \
+"the number of regions read."
+
+#define DMSTATS_create_region__doc__ \
+"Create a new statistics region on the device bound to this\n\n"        \
+"DmStats object.\nstart and len specify the region start and length\n"  \
+"512b sectors.\n Passing zero for both start and len will create a\n"   \
+"region spanning the entire device.\n\n"                                \
+"Step determines how to subdivide the region into discrete counter\n"   \
+"sets: a positive value specifies the size of areas into which the\n"   \
+"region should be split while a negative value will split the region\n" \
+"into a number of areas equal to the absolute value of step:\n\n"       \
+"- a region with one area spanning the entire device:\n\n"              \
+"  dms.create_region(dms, 0, 0, -1, p, a);\n\n"                         \
+"- a region with areas of 1MiB:\n\n"                                    \
+"  dms.create_region(dms, 0, 0, 1 << 11, p, a);\n\n"                    \
+"- one 1MiB region starting at 1024 sectors with two areas:\n\n"        \
+"  dms.create_region(dms, 1024, 1 << 11, -2, p, a);\n\n"                \
+"If precise is non-zero attempt to create a region with nanosecond\n"   \
+"precision counters using the kernel precise_timestamps feature.\n\n"   \
+"precise - A flag to request nanosecond precision counters\n"           \
+"to be used for this region.\n\n"                                        \
+"bounds - An optional latency histogram specification: a DmHistogram,\n" \
+"a bounds string such as \"1ms,10ms,100ms\", or a sequence of bin\n"     \
+"boundaries in nanoseconds.\n"
+
+#define DMSTATS_delete_region__doc__ \
+"Delete the specified statistics region. This will also mark the\n"     \
+"region as not-present and discard any existing statistics data."
+
+#define DMSTATS_create_regions__doc__ \
+"Create many regions in one call and return a list of (errno,\n"            \
+"region_id) tuples, one for each spec: errno is 0 and region_id the new\n"  \
+"region's id on success, or region_id is None if the create failed.\n\n"    \
+"specs      - An iterable of (start, len) or (start, len, step) tuples,\n"  \
+"             or a packed buffer of unsigned 64-bit (start, len) pairs\n"   \
+"             (bytes or array.array('Q')).\n"                               \
+"step       - The step of specs that do not give one (default -1: one\n"    \
+"             area per region).\n"                                          \
+"precise, bounds, program_id, user_data - As for create_region(), for\n"    \
+"             every region.\n\n"                                            \
+"The messages are sent with the GIL released and the region table is\n"     \
+"read back once when all of them have been sent, for program_id if one\n"  \
+"was given. If the read back fails the results are still returned, and\n"  \
+"the region table is empty until list() succeeds."
+
+#define DMSTATS_delete_regions__doc__ \
+"Delete many regions in one call and return a list of the errno for\n"      \
+"each region_id: 0 on success, or ENOENT for a region that is not\n"        \
+"present.\n\n"                                                              \
+"ids - An iterable of region_id values, or a packed buffer of unsigned\n"   \
+"      64-bit region_id values.\n\n"                                        \
+"The messages are sent with the GIL released, and the region cache is\n"    \
+"updated once when all of them have been sent."
+
+#define DMSTATS_counters__doc__ \
+"Return a DmStatsCounters snapshot of the counter data for every region\n" \
+"in this DmStats object. The snapshot exports a read-only array of\n"     \
+"unsigned 64-bit values with shape (nr_regions, max_areas, NR_COUNTERS)\n" \
+"through the buffer protocol: pass it to memoryview() or numpy.asarray()\n" \
+"to access the data without creating a Python object per counter.\n\n"   \
+"Regions with fewer than max_areas areas are padded with zeros. The\n"    \
+"region_ids and nr_areas attributes of the snapshot give the region_id\n" \
+"and area count of each row. Counters are indexed by the STATS_*\n"       \
+"counter constants (STATS_READS_COUNT, STATS_WRITES_COUNT, ...).\n\n"     \
+"The object must have been populated by a call to populate()."
+
+#define DMSTATS_sample__doc__ \
+"Populate all regions and return a DmStatsCounters snapshot of the\n"    \
+"change in each counter since the previous call to sample().\n\n"        \
+"The previous snapshot is retained by the DmStats object: no state\n"    \
+"needs to be kept by the caller. The interval attribute of the result\n" \
+"gives the time in seconds between the two samples and rates() returns\n" \
+"the per-second rate of change of each counter.\n\n"                    \
+"The first sample, and regions that are new or have been deleted and\n"  \
+"re-created since the previous sample, report the absolute counter\n"   \
+"values. Counters that decrease, for example because they were cleared,\n" \
+"are also reported from zero. IO_IN_PROGRESS_COUNT is not cumulative\n"  \
+"and always reports its current value.\n\n"                             \
+"Binding the object to a different device discards the retained\n"      \
+"snapshot."
+
+#define DMSTATS_metrics__doc__ \
+"Return a DmStatsMetrics snapshot of the named metrics for every area of\n" \
+"every region in this DmStats object. The snapshot exports a read-only\n"  \
+"array of doubles with shape (nr_regions, max_areas, len(names)) through\n" \
+"the buffer protocol, laid out and padded as for counters().\n\n"         \
+"names - A sequence of metric names, as used for the DmStatsArea\n"        \
+"        metric attributes (\"UTILIZATION\", \"THROUGHPUT\", ...). If\n"   \
+"        omitted all metrics are included, in library order.\n\n"         \
+"Values are identical to those of the DmStatsArea metric attributes: a\n"  \
+"sampling interval must be set for the time-based metrics, and the\n"     \
+"object must have been populated by a call to populate()."
+
+#define DMSTATS_render_openmetrics__doc__ \
+"Return the counters and metrics of this DmStats object as OpenMetrics\n" \
+"(Prometheus) text exposition format bytes, ending with \"# EOF\".\n\n"     \
+"prefix          - The metric name prefix (default \"dmstats_\").\n"       \
+"labels          - A dict of label names and values to add to every\n"     \
+"                  sample.\n"                                             \
+"include_metrics - A sequence of DmStatsArea counter and metric names\n"   \
+"                  or STATS_* counter constants to render. If omitted\n"   \
+"                  all counters are rendered.\n"                          \
+"per_region      - If True, render one sample for each region\n"          \
+"                  aggregated across its areas, instead of one for each\n" \
+"                  area.\n\n"                                             \
+"Each selected value is rendered as one metric family, named by the\n"    \
+"prefix and the lower case attribute name, with one sample per area\n"    \
+"labelled with program_id, region_id and area_id. Counters are of type\n" \
+"counter (with a \"_total\" sample suffix) and metrics and\n"             \
+"io_in_progress_count are gauges. Aggregated region metrics are derived\n" \
+"from the summed counters as for DmStatsGroup.metrics(). Metrics need a\n" \
+"sampling interval, and the object must have been populated by a call\n" \
+"to populate()."
+
+#define DMSTATS_to_bytes__doc__ \
+"Return a binary snapshot of the regions and counters of this DmStats\n" \
+"object as bytes. The snapshot records the layout, program_id and\n"     \
+"aux_data of every region present, the counters of every area, and the\n" \
+"sampling interval, and may be read back with DmStatsSnapshot.from_bytes()\n" \
+"or, if written to a file, DmStatsSnapshot.from_mmap(). Histograms are\n" \
+"not included. The object must have been populated by a call to\n"       \
+"populate()."
+
+#define DMSTATS_top_areas__doc__ \
+"Return a list of (region_id, area_id, value) tuples for the n areas of\n" \
+"all regions with the largest value of a counter or metric, largest\n"    \
+"first. Equal values are ordered by region_id and area_id.\n\n"          \
+"counter - A DmStatsArea counter or metric attribute name\n"              \
+"          (\"WRITE_SECTORS_COUNT\", \"READS_PER_SEC\", ...) or a\n"       \
+"          STATS_* counter constant.\n"                                   \
+"n       - The number of areas to return.\n\n"                            \
+"The areas are scanned in C and only the n largest values are kept, so\n" \
+"no DmStatsArea objects are created. The object must have been\n"         \
+"populated by a call to populate()."
+
+#define DMSTATS_heatmap__doc__ \
+"Return a heat map of a counter or metric as a DmStatsMetrics snapshot.\n"  \
+"The areas of each region are downsampled into buckets equal-width LBA\n"   \
+"ranges, giving an array of doubles with shape (nr_regions, buckets, 1),\n" \
+"or (buckets, 1) for a single region_id.\n\n"                               \
+"region  - A region_id, None for all regions, or an iterable of\n"          \
+"          region_id values.\n"                                             \
+"counter - A DmStatsArea counter or metric attribute name\n"                \
+"          (\"WRITE_SECTORS_COUNT\", \"READS_PER_SEC\", ...) or a\n"        \
+"          STATS_* counter constant.\n"                                     \
+"buckets - The number of buckets in each row.\n"                            \
+"op      - How the areas overlapping a bucket are combined: \"sum\"\n"      \
+"          (default) splits each area's value between buckets in\n"         \
+"          proportion to its sectors in each, \"max\" takes the largest\n"  \
+"          value, and \"mean\" the mean value per sector.\n"                \
+"workers - The number of threads that fill rows (default 1).\n\n"           \
+"The areas are read in C with the GIL released. The object must have\n"     \
+"been populated by a call to populate()."
+
+#define DMSTATS_create_group__doc__ \
+"Create a new group from the specified regions and return its group_id.\n" \
+"The group_id is the region_id of the first member.\n\n"                  \
+"members - A sequence of region_id values, or a region list string as\n"  \
+"          accepted by dmsetup (for example \"0-3,5\").\n"                \
+"alias   - An optional alias for the new group.\n\n"                     \
+"The region table is re-read once the group has been created: counter\n" \
+"data must be read again with populate()."
+
+#define DMSTATS_ungroup__doc__ \
+"Delete the specified group. The member regions are not removed. As for\n" \
+"create_group(), the region table is re-read afterwards."
+
+#define DMSTATS_set_alias__doc__ \
+"Set the alias of the specified group."
+
+#define DMSTATS_group__doc__ \
+"Return a DmStatsGroup object for the specified group_id."
+
+#define DMSTATS_groups__doc__ \
+"Return a list of DmStatsGroup objects for every group in this DmStats\n" \
+"object, in group_id order."
+
+#define DMSTATS___doc__ \
+""
+
+static PyMethodDef DmStats_methods[] = {
+    {"bind_devno", (PyCFunction)DmStats_bind_devno, METH_FASTCALL,
+        PyDoc_STR(DMSTATS_bind_devno__doc__)},
+    {"bind_name", (PyCFunction)DmStats_bind_name, METH_O,
+        PyDoc_STR(DMSTATS_bind_name__doc__)},
+    {"bind_uuid", (PyCFunction)DmStats_bind_uuid, METH_O,
+        PyDoc_STR(DMSTATS_bind_uuid__doc__)},
+    {"nr_regions", (PyCFunction)DmStats_nr_regions, METH_NOARGS,
+        PyDoc_STR(DMSTATS_nr_regions__doc__)},
+    {"nr_groups", (PyCFunction)DmStats_nr_groups, METH_NOARGS,
+        PyDoc_STR(DMSTATS_nr_groups__doc__)},
+    {"nr_areas", (PyCFunction)DmStats_nr_areas, METH_NOARGS,
+        PyDoc_STR(DMSTATS_nr_areas__doc__)},
+    {"region_present", (PyCFunction)DmStats_region_present, METH_O,
+        PyDoc_STR(DMSTATS_region_present__doc__)},
+    {"region_nr_areas", (PyCFunction)DmStats_region_nr_areas, METH_O,
+        PyDoc_STR(DMSTATS_region_nr_areas__doc__)},
+    {"group_present", (PyCFunction)DmStats_group_present, METH_O,
+        PyDoc_STR(DMSTATS_group_present__doc__)},
+    {"set_sampling_interval", (PyCFunction)DmStats_set_sampling_interval,
+        METH_O, PyDoc_STR(DMSTATS_set_sampling_interval__doc__)},
+    {"get_sampling_interval", (PyCFunction)DmStats_get_sampling_interval,
+        METH_NOARGS, PyDoc_STR(DMSTATS_get_sampling_interval__doc__)},
+    {"set_program_id", (PyCFunction)DmStats_set_program_id,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_set_program_id__doc__)},
+    {"list", (PyCFunction)DmStats_list,
+        METH_FASTCALL | METH_KEYWORDS, PyDoc_STR(DMSTATS_list__doc__)},
+    {"populate", (PyCFunction)DmStats_populate,
+        METH_FASTCALL | METH_KEYWORDS, PyDoc_STR(DMSTATS_populate__doc__)},
+    {"create_region", (PyCFunction)DmStats_create_region,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_create_region__doc__)},
+    {"delete_region", (PyCFunction)DmStats_delete_region,
+        METH_O, PyDoc_STR(DMSTATS_delete_region__doc__)},
+    {"create_regions", (PyCFunction)DmStats_create_regions,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_create_regions__doc__)},
+    {"delete_regions", (PyCFunction)DmStats_delete_regions,
+        METH_O, PyDoc_STR(DMSTATS_delete_regions__doc__)},
+    {"counters", (PyCFunction)DmStats_counters, METH_NOARGS,
+        PyDoc_STR(DMSTATS_counters__doc__)},
+    {"metrics", (PyCFunction)DmStats_metrics, METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_metrics__doc__)},
+    {"top_areas", (PyCFunction)DmStats_top_areas,
+        METH_FASTCALL | METH_KEYWORDS, PyDoc_STR(DMSTATS_top_areas__doc__)},
+    {"heatmap", (PyCFunction)DmStats_heatmap,
+        METH_FASTCALL | METH_KEYWORDS, PyDoc_STR(DMSTATS_heatmap__doc__)},
+    {"to_bytes", (PyCFunction)DmStats_to_bytes, METH_NOARGS,
+        PyDoc_STR(DMSTATS_to_bytes__doc__)},
+    {"render_openmetrics", (PyCFunction)DmStats_render_openmetrics,
+        METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_render_openmetrics__doc__)},
+    {"sample", (PyCFunction)DmStats_sample, METH_FASTCALL | METH_KEYWORDS,
+        PyDoc_STR(DMSTATS_sample__doc__)},
+    {"create_group", (PyCFunction)DmStats_create_group,
+        METH_FASTCALL | METH_KEYWORDS, PyDoc_STR(DMSTATS_create_group__doc__)},
+    {"ungroup", (PyCFunction)DmStats_ungroup, METH_O,
+        PyDoc_STR(DMSTATS_ungroup__doc__)},
+    {"set_alias", (PyCFunction)DmStats_set_alias, METH_FASTCALL,
+        PyDoc_STR(DMSTATS_set_alias__doc__)},
+    {"group", (PyCFunction)DmStats_group, METH_O,
+        PyDoc_STR(DMSTATS_group__doc__)},
+    {"groups", (PyCFunction)DmStats_groups, METH_NOARGS,
+        PyDoc_STR(DMSTATS_groups__doc__)},
+    {NULL, NULL}
+};
+
+#define DMSTATS__doc__ \
+"Base class representing a device-mapper statistics handle.\n\n"            \
+"Operations on DmStats objects include managing statistics regions\n"       \
+"and obtaining and manipulating current counter values from the\n"          \
+"kernel. Methods are provided to return baisc count values and to\n"        \
+"derive time-based metrics when a suitable interval estimate is\n"          \
+"provided.\n\n"                                                             \
+                                                                            \
+"Internally the DmStats handle contains a pointer to a table of one\n"      \
+"or more DmStatsRegion objects representing the regions registered\n"       \
+"with the DmStats.create_region() method. These in turn point to a\n"       \
+"table of one or more DmStatsCounters objects containing the\n"             \
+"counter sets for each defined area within the region:\n\n"                 \
+                                                                            \
+"DmStats[nr_regions]->DmStatsRegion[nr_areas]->DmStatsArea\n\n"             \
+                                                                            \
+"Regions and counter sets are stored in order of increasing region_id.\n"   \
+"Depending on region specifications and the sequence of create and\n"       \
+"delete operations this may not correspond to increasing sector\n"          \
+"number: users of the library should not assume that this is the case\n"    \
+"unless region creation is deliberately managed to ensure this (by\n"       \
+"always creating regions in strict order of ascending sector address).\n\n" \
+                                                                            \
+"Regions may also overlap, so the same sector range may be included in\n"   \
+"more than one region or area: applications should be prepared to deal\n"   \
+"with this or manage regions such that it does not occur."
+
+static PyObject *
+DmStats_device_getter(PyObject *o, void *arg)
+{
+    DmStatsObject *self = (DmStatsObject *) o;
+    PyObject *binding, *row;
+    const char *name, *uuid;
+    int major, minor;
+
+    Py_BEGIN_CRITICAL_SECTION(o);
+    binding = Py_XNewRef(self->ds_binding);
+    Py_END_CRITICAL_SECTION();
+
+    if (!binding)
+        Py_RETURN_NONE;
+
+    if (!PyArg_ParseTuple(binding, "zzii", &name, &uuid, &major, &minor))
+        row = NULL;
+    else
+        row = _dmpy_dev_cache_resolve(DMPY_STATE(o), name, uuid,
+                                      (unsigned) major, (unsigned) minor);
+    Py_DECREF(binding);
+    return row;
+}
+
+#define DMSTATS_device__doc__ \
+"The (name, uuid, major, minor, event_nr) row of the bound device, as\n" \
+"given by dmpy.resolve_device() when the attribute is read, or None if\n" \
+"the device does not exist or the handle is not bound."
+
+static PyGetSetDef DmStats_getsets[] = {
+    {"device", DmStats_device_getter, NULL,
+      PyDoc_STR(DMSTATS_device__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStats_members[] = {
+    {"populate_time", T_DOUBLE, offsetof(DmStatsObject, ds_populate_time),
+        READONLY, PyDoc_STR("Duration of the last populate() in seconds.")},
+    {"populate_nr_regions", T_ULONGLONG,
+        offsetof(DmStatsObject, ds_populate_nr_regions), READONLY,
+        PyDoc_STR("Number of regions read by the last populate().")},
+    {NULL}
+};
+
+static PyType_Slot DmStats_slots[] = {
+    {Py_tp_dealloc, DmStats_dealloc},
+    {Py_tp_doc, DMSTATS__doc__},
+    {Py_tp_traverse, DmStats_traverse},
+    {Py_tp_clear, DmStats_clear},
+    {Py_tp_iter, DmStats_iter},
+    {Py_sq_length, DmStats_len},
+    {Py_sq_item, DmStats_get_item},
+    {Py_tp_methods, DmStats_methods},
+    {Py_tp_members, DmStats_members},
+    {Py_tp_getset, DmStats_getsets},
+    {Py_tp_init, DmStats_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStats_spec = {
+    "dmpy.DmStats",             /*name*/
+    sizeof(DmStatsObject),      /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*flags*/
+    DmStats_slots,              /*slots*/
+};
+
+static void
+DmStatsRegion_dealloc(DmStatsRegionObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+
+    /* Notify our parent that we are departing. */
+    if (self->dr_weakreflist)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    _DmStatsRegion_clear_area_cache(self);
+
+    /* release our reference on the parent DmStats. */
+    Py_XDECREF(self->dr_stats);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static DmStatsRegionObject *
+newDmStatsRegionObject(PyObject *stats, uint64_t region_id)
+{
+    DmStatsRegionObject *region;
+    region = PyObject_GC_New(DmStatsRegionObject,
+                             DMPY_STATE(stats)->DmStatsRegion_Type);
+    if (!region)
+        return NULL;
+    region->dr_region_id = region_id;
+    _DmStats_region_stamp((DmStatsObject *) stats, region_id,
+                          &region->dr_sequence, &region->dr_generation);
+    region->dr_weakreflist = NULL;
+    region->dr_areas = NULL;
+    region->dr_areas_len = 0;
+    region->dr_stats = stats;
+
+    /* We keep a reference on the parent DmStats to prevent it (and its handle)
+     * from being deallocated.
+     */
+    Py_INCREF(stats);
+    return region;
+}
+
+static int
+DmStatsRegion_init(DmStatsRegionObject *self, PyObject *args, PyObject *kwds)
+{
+    uint64_t region_id;
+    if (!PyArg_ParseTuple(args, "i:__init__", &region_id))
+        return -1;
+    self->dr_region_id = region_id;
+    return 0;
+}
+
+static int
+DmStatsRegion_traverse(DmStatsRegionObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->dr_stats);
+    return 0;
+}
+
+static int
+DmStatsRegion_clear(DmStatsRegionObject *self)
+{
+    Py_CLEAR(self->dr_stats);
+    return 0;
+}
+
+/* Check the sequence number for this DmStatsRegion against its parent.
+ * The ds_sequence value stored in DmStats is initialised to zero, and
+ * incremented on each operation that invalidates the whole handle
+ * (bind, or a failed list or populate). The generation of the region's
+ * slot changes only when the region itself is created, deleted or
+ * changed by a list, populate or delete_region.
+ *
+ * If either value we are holding does not match the parent, the region
+ * has been invalidated since this object was created and all operations
+ * should raise LookupError.
+ */
+static int
+_DmStatsRegion_sequence_check(PyObject *o)
+{
+    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
+    DmStatsObject *stats;
+    DMPY_PROFILE_SCOPE("DmStatsRegion.sequence_check");
+
+    if (!DmStatsRegionObject_Check(DMPY_STATE(o), o))
+        return -1;
+
+    stats = DMSTATS_FROM_REGION(self);
+
+    DmStats_BusyCheck(stats, -1);
+
+    if (!_DmStats_region_valid(stats, self->dr_sequence, self->dr_region_id,
+                               self->dr_generation)) {
+        DMPY_PROFILE_COUNT("DmStatsRegion.sequence_check.fail");
+        PyErr_SetString(PyExc_LookupError, "Attempt to access regions in"
+                        " changed DmStats object.");
+        return -1;
+    }
+    return 0;
+}
+
+#define DmStatsRegion_SeqCheck(o)                          \
+do {                                                       \
+    if (_DmStatsRegion_sequence_check((PyObject *)(o)))    \
+        return NULL;                                       \
+} while(0);
+
+static Py_ssize_t
+DmStatsRegion_len(PyObject *o)
+{
+    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
+    struct dm_stats *dms;
+
+    if (!DmStatsRegionObject_Check(DMPY_STATE(o), o))
+        return -1;
+
+    if (_DmStatsRegion_sequence_check(o))
+        return -1;
+
+    dms = DMS_FROM_REGION(self);
+    if (!dms)
+        return 0;
+
+    return (Py_ssize_t) dm_stats_get_region_nr_areas(dms, self->dr_region_id);
+}
+
+static DmStatsAreaObject *
+newDmStatsAreaObject(PyObject *stats, uint64_t region_id, uint64_t area_id);
+
+static PyObject *
+DmStatsRegion_get_item(PyObject *o, Py_ssize_t j)
+{
+    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
+    DmStatsObject *stats = (DmStatsObject *) self->dr_stats;
+    uint64_t i = self->dr_region_id;
+    PyObject *area = NULL;
+    int in_range = 0, r = 0;
+    DMPY_PROFILE_SCOPE("DmStatsRegion.__getitem__");
+
+    if (!DmStatsRegionObject_Check(DMPY_STATE(o), o))
+        return NULL;
+
+    DmStatsRegion_SeqCheck(o);
+
+    Py_BEGIN_CRITICAL_SECTION(o);
+    if (self->dr_areas || !(r = _DmStatsRegion_set_area_cache(self)))
+        if ((in_range = (j >= 0) && (j < self->dr_areas_len)))
+            area = _dmpy_cache_get(&self->dr_areas[j]);
+    Py_END_CRITICAL_SECTION();
+
+    if (r)
+        return NULL;
+
+    if (!in_range) {
+        PyErr_SetString(PyExc_IndexError, "DmStats area_id out of range");
+        return NULL;
+    }
+
+    /* cache hit */
+    if (area) {
+        DMPY_PROFILE_COUNT("DmStatsRegion.__getitem__.hit");
+        return area;
+    }
+
+    /* This return is currently unreachable since a not-present region_id
+     * returns the None type for a lookup in the containing DmStats. If
+     * that is later changed to return a singleton "null region", then
+     * the following presence check ensures correct behaviour.
+     */
+    if (!dm_stats_region_present(stats->ds_dms, self->dr_region_id)) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    /* cache miss, or cache hit but referent expired */
+    DMPY_PROFILE_COUNT("DmStatsRegion.__getitem__.miss");
+    if (!(area = (PyObject *) newDmStatsAreaObject((PyObject *) stats, i, j)))
+        return NULL;
+
+    /* The cache may have been cleared while the area was created. */
+    Py_BEGIN_CRITICAL_SECTION(o);
+    if (j < self->dr_areas_len)
+        _dmpy_cache_set(&self->dr_areas[j], &area);
+    Py_END_CRITICAL_SECTION();
+
+    return area;
+}
+
+
+#define DMSTATSREG___doc__ \
+""
+
+#define DMSTATSREG__doc__ \
+"Base class representing a region of a device-mapper statistics handle,\n"  \
+"including any areas and counters contained within it.\n\n"                 \
+
+static PyObject *
+DmStatsRegion_delete(DmStatsRegionObject *self, void *arg)
+{
+    if (_DmStats_delete_region((DmStatsObject *) self->dr_stats,
+                               self->dr_region_id))
+        return NULL;
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+DmStatsRegion_counters(DmStatsRegionObject *self, PyObject *args)
+{
+    DmStatsRegion_SeqCheck(self);
+    return newDmStatsCountersObject(DMSTATS_FROM_REGION(self),
+                                    self->dr_region_id);
+}
+
+static PyObject *
+DmStatsRegion_metrics(DmStatsRegionObject *self, PyObject *args,
+                      PyObject *kwds)
+{
+    static char *kwlist[] = {"names", NULL};
+    PyObject *names = NULL;
+
+    DmStatsRegion_SeqCheck(self);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:metrics", kwlist,
+                                     &names))
+        return NULL;
+
+    return newDmStatsMetricsObject(DMSTATS_FROM_REGION(self),
+                                   self->dr_region_id, names);
+}
+
+static PyObject *
+_DmStats_reduce(DmStatsObject *stats, uint64_t region_id, PyObject *name,
+                const char *op_name);
+
+static PyObject *
+DmStatsRegion_reduce(DmStatsRegionObject *self, PyObject *args,
+                     PyObject *kwds)
+{
+    static char *kwlist[] = {"counter", "op", NULL};
+    PyObject *name;
+    char *op = "sum";
+
+    DmStatsRegion_SeqCheck(self);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|s:reduce", kwlist,
+                                     &name, &op))
+        return NULL;
+
+    return _DmStats_reduce(DMSTATS_FROM_REGION(self), self->dr_region_id,
+                           name, op);
+}
+
+static PyObject *
+_DmStats_heatmap(DmStatsObject *stats, PyObject *region, PyObject *name,
+                 Py_ssize_t buckets, const char *op_name, int workers);
+
+static PyObject *
+DmStatsRegion_heatmap(DmStatsRegionObject *self, PyObject *args,
+                      PyObject *kwds)
+{
+    static char *kwlist[] = {"counter", "buckets", "op", NULL};
+    PyObject *name, *region_id, *heatmap;
+    Py_ssize_t buckets;
+    char *op = "sum";
+
+    DmStatsRegion_SeqCheck(self);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|s:heatmap", kwlist,
+                                     &name, &buckets, &op))
+        return NULL;
+
+    if (!(region_id = PyLong_FromUnsignedLongLong(self->dr_region_id)))
+        return NULL;
+    heatmap = _DmStats_heatmap(DMSTATS_FROM_REGION(self), region_id, name,
+                               buckets, op, 1);
+    Py_DECREF(region_id);
+    return heatmap;
+}
+
+#define DMSTATSREG_delete__doc__ \
+"Delete this region."
+
+#define DMSTATSREG_counters__doc__ \
+"Return a DmStatsCounters snapshot of the counter data for this region.\n" \
+"The snapshot exports a read-only array of unsigned 64-bit values with\n" \
+"shape (nr_areas, NR_COUNTERS) through the buffer protocol."
+
+#define DMSTATSREG_metrics__doc__ \
+"Return a DmStatsMetrics snapshot of the named metrics for this region.\n" \
+"The snapshot exports a read-only array of doubles with shape\n"         \
+"(nr_areas, len(names)) through the buffer protocol. If names is\n"       \
+"omitted all metrics are included."
+
+#define DMSTATSREG_reduce__doc__ \
+"Reduce a counter or metric over the areas of this region without\n"      \
+"creating a DmStatsArea for each one.\n\n"                                \
+"counter - A DmStatsArea counter or metric attribute name\n"              \
+"          (\"WRITE_SECTORS_COUNT\", \"READS_PER_SEC\", ...) or a\n"       \
+"          STATS_* counter constant.\n"                                   \
+"op      - The reduction: \"sum\" (the default), \"min\" or \"max\".\n\n"   \
+"A sum returns the total value over all areas. Min and max return a\n"    \
+"(region_id, area_id, value) tuple for the first area holding the\n"      \
+"smallest or largest value. Counter values are integers and metric\n"    \
+"values are floats."
+
+#define DMSTATSREG_heatmap__doc__ \
+"Return a heat map of a counter or metric for this region: the areas\n"     \
+"are downsampled into buckets equal-width LBA ranges and returned as a\n"   \
+"DmStatsMetrics snapshot of shape (buckets, 1).\n\n"                        \
+"counter - A DmStatsArea counter or metric attribute name or a STATS_*\n"   \
+"          counter constant.\n"                                             \
+"buckets - The number of buckets.\n"                                        \
+"op      - \"sum\" (the default), \"max\" or \"mean\", as for\n"            \
+"          DmStats.heatmap()."
+
+static PyMethodDef DmStatsRegion_methods[] = {
+    {"delete", (PyCFunction)DmStatsRegion_delete, METH_NOARGS,
+        PyDoc_STR(DMSTATSREG_delete__doc__)},
+    {"counters", (PyCFunction)DmStatsRegion_counters, METH_NOARGS,
+        PyDoc_STR(DMSTATSREG_counters__doc__)},
+    {"metrics", (PyCFunction)DmStatsRegion_metrics,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATSREG_metrics__doc__)},
+    {"reduce", (PyCFunction)DmStatsRegion_reduce,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATSREG_reduce__doc__)},
+    {"heatmap", (PyCFunction)DmStatsRegion_heatmap,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATSREG_heatmap__doc__)},
+    {NULL, NULL}
+};
+
+static PyObject *
+DmStatsRegion_nr_areas_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
+    uint64_t nr_areas;
+
+    DmStatsRegion_SeqCheck(self);
+
+    nr_areas = dm_stats_get_region_nr_areas(stats->ds_dms, reg->dr_region_id);
+    return Py_BuildValue("i", nr_areas);
+}
+
+static PyObject *
+DmStatsRegion_present_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+    struct dm_stats *dms = DMS_FROM_REGION(reg);
+    PyObject *ret;
+
+    DmStatsRegion_SeqCheck(self);
+
+    ret = (dm_stats_region_present(dms, reg->dr_region_id))
+        ? Py_True : Py_False;
+    Py_INCREF(ret);
+    return ret;
+}
+
+static PyObject *
+DmStatsRegion_precise_timestamps_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+    struct dm_stats *dms = DMS_FROM_REGION(reg);
+    PyObject *ret;
+
+    DmStatsRegion_SeqCheck(self);
+
+    ret = (dm_stats_get_region_precise_timestamps(dms, reg->dr_region_id))
+        ? Py_True : Py_False;
+    Py_INCREF(ret);
+    return ret;
+}
+
+static PyObject *
+DmStatsRegion_histogram_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+
+    DmStatsRegion_SeqCheck(self);
+
+    return newDmHistogramFromStats(DMSTATS_FROM_REGION(reg),
+                                   reg->dr_region_id, DM_STATS_AREAS_ALL);
+}
+
+#define MkDmStatsRegion_startlen_getter(name)                                \
+static PyObject *                                                            \
+DmStatsRegion_ ## name ##_getter(PyObject *self, void *arg)                  \
+{                                                                            \
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;                 \
+    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);                         \
+    uint64_t name;                                                           \
+    int r;                                                                   \
+    DMPY_PROFILE_SCOPE("DmStatsRegion." #name);                              \
+                                                                             \
+    DmStatsRegion_SeqCheck(self);                                            \
+                                                                             \
+    r = dm_stats_get_region_ ## name(stats->ds_dms, &name,                   \
+                                     reg->dr_region_id);                     \
+    if (!r) {                                                                \
+        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "     \
+                        "state: no region data.");                           \
+        return NULL;                                                         \
+    }                                                                        \
+    return Py_BuildValue("l", name);                                         \
+}
+
+MkDmStatsRegion_startlen_getter(start)
+MkDmStatsRegion_startlen_getter(len)
+MkDmStatsRegion_startlen_getter(area_len)
+
+static PyObject *
+DmStatsRegion_program_id_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
+    const char *program_id;
+
+    DmStatsRegion_SeqCheck(self);
+
+    program_id = dm_stats_get_region_program_id(stats->ds_dms,
+                                                reg->dr_region_id);
+
+    return Py_BuildValue("z", program_id);
+}
+
+static PyObject *
+DmStatsRegion_aux_data_getter(PyObject *self, void *arg)
+{
+    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
+    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
+    const char *aux_data;
+
+    DmStatsRegion_SeqCheck(self);
+
+    aux_data = dm_stats_get_region_aux_data(stats->ds_dms,
+                                            reg->dr_region_id);
+
+    return Py_BuildValue("z", aux_data);
+}
+
+#define DMSTATSREG_nr_areas_gets__doc__                \
+"Return the number of areas contained in this region."
+
+#define DMSTATSREG_present_gets__doc__                      \
+"Boolean indicating whether this region is present or not."
+
+#define DMSTATSREG_precise_timestamps_gets__doc__                            \
+"Returns True if the specified region has the precise_timestamps feature\n"  \
+"enabled (i.e. produces nanosecond-precision counter values) or False for\n" \
+"a region using the default milisecond precision."
+
+#define DMSTATSREG_start_gets__doc__ \
+"The start offset of this region in sectors."
+
+#define DMSTATSREG_len_gets__doc__ \
+"The length of this region in sectors."
+
+#define DMSTATSREG_area_len_gets__doc__ \
+"The lenght of each area contained in this region."
+
+#define DMSTATSREG_program_id_gets__doc__ \
+"The program_id string use to create this region."
+
+#define DMSTATSREG_aux_data_gets__doc__ \
+"The aux_data value for this region."
+
+#define DMSTATSREG_histogram_gets__doc__ \
+"A DmHistogram holding the sum of the latency histograms of all areas\n" \
+"in this region, or None if the region has no histogram."
+
+static PyGetSetDef DmStatsRegion_getsets[] = {
+    {"present", DmStatsRegion_present_getter, NULL,
+      PyDoc_STR(DMSTATSREG_present_gets__doc__), NULL},
+    {"nr_areas", DmStatsRegion_nr_areas_getter, NULL,
+      PyDoc_STR(DMSTATSREG_nr_areas_gets__doc__), NULL},
+    {"precise_timestamps", DmStatsRegion_precise_timestamps_getter, NULL,
+      PyDoc_STR(DMSTATSREG_precise_timestamps_gets__doc__), NULL},
+    {"start", DmStatsRegion_start_getter, NULL,
+      PyDoc_STR(DMSTATSREG_start_gets__doc__), NULL},
+    {"len", DmStatsRegion_len_getter, NULL,
+      PyDoc_STR(DMSTATSREG_len_gets__doc__), NULL},
+    {"area_len", DmStatsRegion_area_len_getter, NULL,
+      PyDoc_STR(DMSTATSREG_area_len_gets__doc__), NULL},
+    {"program_id", DmStatsRegion_program_id_getter, NULL,
+      PyDoc_STR(DMSTATSREG_program_id_gets__doc__), NULL},
+    {"aux_data", DmStatsRegion_aux_data_getter, NULL,
+      PyDoc_STR(DMSTATSREG_aux_data_gets__doc__), NULL},
+    {"histogram", DmStatsRegion_histogram_getter, NULL,
+      PyDoc_STR(DMSTATSREG_histogram_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsRegion_members[] = {
+    {"region_id", T_LONG, offsetof(DmStatsRegionObject, dr_region_id),
+     READONLY, PyDoc_STR("The region identifier of this region.")},
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(DmStatsRegionObject, dr_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot DmStatsRegion_slots[] = {
+    {Py_tp_dealloc, DmStatsRegion_dealloc},
+    {Py_tp_doc, DMSTATSREG__doc__},
+    {Py_tp_traverse, DmStatsRegion_traverse},
+    {Py_tp_clear, DmStatsRegion_clear},
+    {Py_tp_iter, DmStatsRegion_iter},
+    {Py_sq_length, DmStatsRegion_len},
+    {Py_sq_item, DmStatsRegion_get_item},
+    {Py_tp_methods, DmStatsRegion_methods},
+    {Py_tp_members, DmStatsRegion_members},
+    {Py_tp_getset, DmStatsRegion_getsets},
+    {Py_tp_init, DmStatsRegion_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsRegion_spec = {
+    "dmpy.DmStatsRegion",       /*name*/
+    sizeof(DmStatsRegionObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*flags*/
+    DmStatsRegion_slots,        /*slots*/
+};
+
+
+static void
+DmStatsArea_dealloc(DmStatsAreaObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    /* Notify our parent that we are departing. */
+    if (self->da_weakreflist)
+        PyObject_ClearWeakRefs((PyObject *) self);
+
+    /* release our reference on the parent DmStats. */
+    Py_XDECREF(self->da_stats);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static DmStatsAreaObject *
+newDmStatsAreaObject(PyObject *stats, uint64_t region_id, uint64_t area_id)
+{
+    DmStatsAreaObject *area;
+    area = PyObject_New(DmStatsAreaObject,
+                        DMPY_STATE(stats)->DmStatsArea_Type);
+    if (!area)
+        return NULL;
+    area->da_region_id = region_id;
+    area->da_area_id = area_id;
+    area->da_weakreflist = NULL;
+    area->da_stats = stats;
+    _DmStats_region_stamp((DmStatsObject *) stats, region_id,
+                          &area->da_sequence, &area->da_generation);
+
+    /* We keep a reference on the parent DmStats to prevent it (and its handle)
+     * from being deallocated.
+     */
+    Py_INCREF(stats);
+    return area;
+}
+
+static int
+DmStatsArea_init(DmStatsAreaObject *self, PyObject *args, PyObject *kwds)
+{
+    uint64_t area_id;
+    if (!PyArg_ParseTuple(args, "i:__init__", &area_id))
+        return -1;
+    self->da_area_id = area_id;
+    return 0;
+}
+
+/* Check the sequence number and region generation for this DmStatsArea
+ * against its parent, as for DmStatsRegion.
+ */
+static int
+_DmStatsArea_sequence_check(PyObject *o)
+{
+    DmStatsAreaObject *self = (DmStatsAreaObject *) o;
+    DmStatsObject *stats;
+    DMPY_PROFILE_SCOPE("DmStatsArea.sequence_check");
+
+    if (!DmStatsAreaObject_Check(DMPY_STATE(o), o))
+        return -1;
+
+    stats = DMSTATS_FROM_AREA(self);
+
+    DmStats_BusyCheck(stats, -1);
+
+    if (!_DmStats_region_valid(stats, self->da_sequence, self->da_region_id,
+                               self->da_generation)) {
+        DMPY_PROFILE_COUNT("DmStatsArea.sequence_check.fail");
+        PyErr_SetString(PyExc_LookupError, "Attempt to access regions in"
+                        " changed DmStats object.");
+        return -1;
+    }
+    return 0;
+}
+
+#define DmStatsArea_SeqCheck(o)                          \
+do {                                                     \
+    if (_DmStatsArea_sequence_check((PyObject *)(o)))    \
+        return NULL;                                     \
+} while(0);
+
+#define MkDmStatsArea_startlen_getter(name)                                   \
+static PyObject *                                                             \
+DmStatsArea_ ## name ##_getter(DmStatsAreaObject *self, void *arg)            \
+{                                                                             \
+    DmStatsObject *stats = DMSTATS_FROM_AREA(self);                           \
+    uint64_t name;                                                            \
+    int r;                                                                    \
+    DMPY_PROFILE_SCOPE("DmStatsArea." #name);                                 \
+                                                                              \
+    DmStatsArea_SeqCheck(self);                                               \
+                                                                              \
+    r = dm_stats_get_area_ ## name(stats->ds_dms, &name,                      \
+                                     self->da_region_id, self->da_area_id);   \
+    if (!r) {                                                                 \
+        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "      \
+                        "state: no region data.");                            \
+        return NULL;                                                          \
+    }                                                                         \
+    return Py_BuildValue("l", name);                                          \
+}
+
+MkDmStatsArea_startlen_getter(start)
+MkDmStatsArea_startlen_getter(offset)
+
+static PyObject *
+DmStatsArea_len_getter(DmStatsAreaObject *self, void *arg)
+{
+    DmStatsObject *stats = DMSTATS_FROM_AREA(self);
+    uint64_t len;
+    int r;
+    DMPY_PROFILE_SCOPE("DmStatsArea.len");
+
+    DmStatsArea_SeqCheck(self);
+
+    r = dm_stats_get_region_area_len(stats->ds_dms, &len, self->da_region_id);
+    if (!r) {
+        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "
+                        "state: no region data.");
+        return NULL;
+    }
+    return Py_BuildValue("l", len);
+}
+
+static PyObject *
+DmStatsArea_region_getter(DmStatsAreaObject *self, void *arg)
+{
+    return DmStats_get_item(self->da_stats, self->da_region_id);
+}
+
+static PyObject *
+DmStatsArea_histogram_getter(DmStatsAreaObject *self, void *arg)
+{
+    DmStatsArea_SeqCheck(self);
+
+    return newDmHistogramFromStats(DMSTATS_FROM_AREA(self),
+                                   self->da_region_id, self->da_area_id);
+}
+
+static PyObject *
+DmStatsArea_counter_getter(DmStatsAreaObject *self, void *arg)
+{
+    dm_stats_counter_t counter = (dm_stats_counter_t) arg;
+    struct dm_stats *dms = DMS_FROM_AREA(self);
+    DMPY_PROFILE_SCOPE("DmStatsArea.counter");
+
+    if (counter < 0 || counter >= DM_STATS_NR_COUNTERS) {
+        PyErr_SetString(PyExc_AttributeError, "Invalid counter attribute.");
+        return NULL;
+    }
+
+    DmStatsArea_SeqCheck(self);
+
+    if (!_DmStats_have_counters(DMSTATS_FROM_AREA(self), self->da_region_id)) {
+        PyErr_SetString(PyExc_ValueError, "No counter data for region: "
+                        "call DmStats.populate() first.");
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLongLong(dm_stats_get_counter(dms, counter,
+                                                            self->da_region_id,
+                                                            self->da_area_id));
+}
+
+static PyObject *
+DmStatsArea_metric_getter(DmStatsAreaObject *self, void *arg)
+{
+    dm_stats_metric_t metric = (dm_stats_counter_t) arg;
+    struct dm_stats *dms = DMS_FROM_AREA(self);
+    double value;
+    DMPY_PROFILE_SCOPE("DmStatsArea.metric");
+
+    if (metric < 0 || metric >= DM_STATS_NR_METRICS) {
+        PyErr_SetString(PyExc_AttributeError, "Invalid metric attribute.");
+        return NULL;
+    }
+
+    if (!dm_stats_get_metric(dms, metric,
+                             self->da_region_id, self->da_area_id, &value)) {
+        PyErr_SetString(PyExc_OSError, "Failed to get metric data from "
+                        "device-mapper.");
+        return NULL;
+    }
+
+    return Py_BuildValue("d", value);
+}
+
+#define DMSTATSAREA_start_gets__doc__ \
+"The starting sector of this area, relative to the containing device."
+
+#define DMSTATSAREA_offset_gets__doc__ \
+"The offset of this area, within the containing region, in sectors."
+
+#define DMSTATSAREA_len_gets__doc__ \
+"The length of this area in sectors."
+
+#define DMSTATSAREA_region_gets__doc__ \
+"The region that contains this area."
+
+#define DMSTATSAREA_histogram_gets__doc__ \
+"A DmHistogram of the latency histogram of this area, or None if the\n" \
+"containing region has no histogram."
+
+#define DMSTATSAREA_counter_gets__doc__ \
+"The value of the specified counter for this area. The available\n"      \
+"counter attributes are:\n\n"                                            \
+"READS_COUNT, READS_MERGED_COUNT, READ_SECTORS_COUNT, READ_NSECS,\n"     \
+"WRITES_COUNT, WRITES_MERGED_COUNT, WRITE_SECTORS_COUNT, WRITE_NSECS,\n" \
+"IO_IN_PROGRESS_COUNT, IO_NSECS, WEIGHTED_IO_NSECS, TOTAL_READ_NSECS."
+
+#define DMSTATSAREA_metric_gets__doc__ \
+"The value of the specified metric for this area. The available\n"       \
+"metric attributes are:\n\n"                                             \
+
+#define COUNTER_AS_VOID(c) ((void *)(c))
+#define METRIC_AS_VOID(c) ((void *)(c))
+static PyGetSetDef DmStatsArea_getsets[] = {
+    {"start", (getter)DmStatsArea_start_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_start_gets__doc__), NULL},
+    {"offset", (getter)DmStatsArea_offset_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_offset_gets__doc__), NULL},
+    {"len", (getter)DmStatsArea_len_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_len_gets__doc__), NULL},
+    {"region", (getter)DmStatsArea_region_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_region_gets__doc__), NULL},
+    {"histogram", (getter)DmStatsArea_histogram_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_histogram_gets__doc__), NULL},
+    {"READS_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(0)},
+    {"READS_MERGED_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(1)},
+    {"READ_SECTORS_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(2)},
+    {"READ_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(3)},
+    {"WRITES_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(4)},
+    {"WRITES_MERGED_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(5)},
+    {"WRITE_SECTORS_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(6)},
+    {"WRITE_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(7)},
+    {"IO_IN_PROGRESS_COUNT", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(8)},
+    {"IO_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(9)},
+    {"WEIGHTED_IO_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(10)},
+    {"TOTAL_READ_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(11)},
+    {"TOTAL_WRITE_NSECS", (getter)DmStatsArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(12)},
+    {"RD_MERGES_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(0)},
+    {"WR_MERGES_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(1)},
+    {"READS_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(2)},
+    {"WRITES_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(3)},
+    {"READ_SECTORS_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(4)},
+    {"WRITE_SECTORS_PER_SEC", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(5)},
+    {"AVERAGE_REQUEST_SIZE", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(6)},
+    {"AVERAGE_QUEUE_SIZE", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(7)},
+    {"AVERAGE_WAIT_TIME", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(8)},
+    {"AVERAGE_RD_WAIT_TIME", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(9)},
+    {"AVERAGE_WR_WAIT_TIME", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(10)},
+    {"SERVICE_TIME", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(11)},
+    {"THROUGHPUT", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(12)},
+    {"UTILIZATION", (getter)DmStatsArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(13)},
+    {NULL, NULL}
+};
+#undef COUNTER_AS_VOID
+#undef METRIC_AS_VOID
+
+#define DMSTATSAREA___doc__ \
+""
+
+#define DMSTATSAREA__doc__ \
+"Base class representing one area of a device-mapper statistics handle,\n"  \
+"and the counter data contained within it."
+
+static PyMethodDef DmStatsArea_methods[] = {
+//    {"nr_areas", (PyCFunction)DmStatsArea_nr_areas, METH_NOARGS,
+//        PyDoc_STR(DMSTATSREG_nr_areas__doc__)},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsArea_members[] = {
+    {"area_id", T_LONG, offsetof(DmStatsAreaObject, da_area_id),
+     READONLY, PyDoc_STR("The area identifier of this area.")},
+    {"__weaklistoffset__", T_PYSSIZET,
+     offsetof(DmStatsAreaObject, da_weakreflist), READONLY},
+    {NULL}
+};
+
+static PyType_Slot DmStatsArea_slots[] = {
+    {Py_tp_dealloc, DmStatsArea_dealloc},
+    {Py_tp_doc, DMSTATSAREA__doc__},
+    {Py_tp_methods, DmStatsArea_methods},
+    {Py_tp_members, DmStatsArea_members},
+    {Py_tp_getset, DmStatsArea_getsets},
+    {Py_tp_init, DmStatsArea_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsArea_spec = {
+    "dmpy.DmStatsArea",         /*name*/
+    sizeof(DmStatsAreaObject),  /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*flags*/
+    DmStatsArea_slots,          /*slots*/
+};
+
+
+/*
+ * DmStatsIterator objects.
+ *
+ * Native iterators over the regions of a DmStats and the areas of a
+ * DmStatsRegion. Regions are returned from the DmStats region cache, as
+ * for indexed access. Areas are returned through a single flyweight
+ * DmStatsArea that is re-pointed at the next area on each step, provided
+ * that the caller has dropped all references to it: a full walk of a
+ * region allocates O(1) objects and does not populate the area cache.
+ * An area that is still referenced when the iterator advances is left
+ * untouched and a new flyweight is allocated in its place.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *si_parent; /* the DmStats or DmStatsRegion iterated over */
+    uint64_t si_index; /* the next region_id or area_id */
+    DmStatsAreaObject *si_area; /* flyweight area for region iterators */
+} DmStatsIteratorObject;
+
+static void
+DmStatsIterator_dealloc(DmStatsIteratorObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    Py_XDECREF(self->si_area);
+    Py_XDECREF(self->si_parent);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+newDmStatsIteratorObject(PyObject *parent)
+{
+    DmStatsIteratorObject *iter;
+
+    if (!(iter = PyObject_New(DmStatsIteratorObject,
+                              DMPY_STATE(parent)->DmStatsIterator_Type)))
+        return NULL;
+
+    Py_INCREF(parent);
+    iter->si_parent = parent;
+    iter->si_index = 0;
+    iter->si_area = NULL;
+    return (PyObject *) iter;
+}
+
+static PyObject *
+DmStats_iter(PyObject *o)
+{
+    DmStats_BusyCheck((DmStatsObject *) o, NULL);
+    return newDmStatsIteratorObject(o);
+}
+
+static PyObject *
+DmStatsRegion_iter(PyObject *o)
+{
+    DmStatsRegion_SeqCheck(o);
+    return newDmStatsIteratorObject(o);
+}
+
+static PyObject *
+_DmStatsIterator_next_region(DmStatsIteratorObject *self)
+{
+    DmStatsObject *stats = (DmStatsObject *) self->si_parent;
+
+    DmStats_BusyCheck(stats, NULL);
+
+    if (self->si_index >= (uint64_t) stats->ds_regions_len)
+        return NULL;
+
+    return DmStats_get_item(self->si_parent, self->si_index++);
+}
+
+static PyObject *
+_DmStatsIterator_next_area(DmStatsIteratorObject *self)
+{
+    DmStatsRegionObject *region = (DmStatsRegionObject *) self->si_parent;
+    DmStatsObject *stats = DMSTATS_FROM_REGION(region);
+    DmStatsAreaObject *area = self->si_area;
+
+    DmStatsRegion_SeqCheck(region);
+
+    if (self->si_index >= dm_stats_get_region_nr_areas(stats->ds_dms,
+                                                       region->dr_region_id))
+        return NULL;
+
+    /* Re-use the flyweight only if nothing else can observe it. */
+    if (area && (Py_REFCNT(area) == 1) && !area->da_weakreflist) {
+        area->da_area_id = self->si_index;
+        _DmStats_region_stamp(stats, region->dr_region_id,
+                              &area->da_sequence, &area->da_generation);
+    } else {
+        Py_XDECREF(area);
+        self->si_area = area = newDmStatsAreaObject((PyObject *) stats,
+                                                    region->dr_region_id,
+                                                    self->si_index);
+        if (!area)
+            return NULL;
+    }
+    self->si_index++;
+
+    Py_INCREF(area);
+    return (PyObject *) area;
+}
+
+static PyObject *
+DmStatsIterator_next(DmStatsIteratorObject *self)
+{
+    if (!self->si_parent)
+        return NULL;
+
+    if (DmStatsObject_Check(DMPY_STATE(self), self->si_parent))
+        return _DmStatsIterator_next_region(self);
+
+    return _DmStatsIterator_next_area(self);
+}
+
+#define DMSTATSITER__doc__ \
+"An iterator over the regions of a DmStats or the areas of a\n"           \
+"DmStatsRegion.\n\n"                                                      \
+"Area iterators return a single DmStatsArea object that is re-used for\n" \
+"each area if no other reference to it is held: code that needs to keep\n" \
+"an area beyond the current iteration may simply retain a reference.\n"
+
+static PyType_Slot DmStatsIterator_slots[] = {
+    {Py_tp_dealloc, DmStatsIterator_dealloc},
+    {Py_tp_doc, DMSTATSITER__doc__},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, DmStatsIterator_next},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsIterator_spec = {
+    "dmpy.DmStatsIterator",     /*name*/
+    sizeof(DmStatsIteratorObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsIterator_slots,      /*slots*/
+};
+
+
+/*
+ * DmStatsCounters objects.
+ *
+ * A DmStatsCounters is an immutable snapshot of the counter data held in
+ * a DmStats handle, copied into a single contiguous array of uint64_t and
+ * exported via the buffer protocol. Unlike the DmStatsRegion and
+ * DmStatsArea shims it holds no reference to its parent: the data remains
+ * valid after the DmStats object is listed, populated, or destroyed.
+ */
+
+#define DMSTATS_COUNTERS_MAX_DIM 3
+
+/* order must match libdevmapper.h dm_stats_counter_t enum */
+static const char *_dmpy_stats_counter_names[] = {
+    "STATS_READS_COUNT",
+    "STATS_READS_MERGED_COUNT",
+    "STATS_READ_SECTORS_COUNT",
+    "STATS_READ_NSECS",
+    "STATS_WRITES_COUNT",
+    "STATS_WRITES_MERGED_COUNT",
+    "STATS_WRITE_SECTORS_COUNT",
+    "STATS_WRITE_NSECS",
+    "STATS_IO_IN_PROGRESS_COUNT",
+    "STATS_IO_NSECS",
+    "STATS_WEIGHTED_IO_NSECS",
+    "STATS_TOTAL_READ_NSECS",
+    "STATS_TOTAL_WRITE_NSECS",
+    NULL
+};
+
+typedef struct {
+    PyObject_HEAD
+    uint64_t *dc_counters;
+    int dc_ndim;
+    Py_ssize_t dc_shape[DMSTATS_COUNTERS_MAX_DIM];
+    Py_ssize_t dc_strides[DMSTATS_COUNTERS_MAX_DIM];
+    PyObject *dc_region_ids; /* tuple of region_id for each row */
+    PyObject *dc_nr_areas; /* tuple of the area count of each row */
+    double dc_interval; /* seconds covered by sample() deltas, or 0.0 */
+} DmStatsCountersObject;
+
+#define DmStatsCountersObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmStatsCounters_Type)
+
+static void
+DmStatsCounters_dealloc(DmStatsCountersObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->dc_counters)
+        PyMem_Free(self->dc_counters);
+    self->dc_counters = NULL;
+    Py_XDECREF(self->dc_region_ids);
+    Py_XDECREF(self->dc_nr_areas);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+/*
+ * Collect the region_id and area count of each region of stats to be
+ * exported into a snapshot: region_id, or all regions present if
+ * region_id is DM_STATS_REGIONS_ALL. On success the caller owns the
+ * two arrays returned and must release them with PyMem_Free().
+ */
+static int
+_DmStats_get_layout(DmStatsObject *stats, uint64_t region_id,
+                    uint64_t **region_ids, uint64_t **nr_areas,
+                    uint64_t *nr_regions, uint64_t *max_areas)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    uint64_t i, nr_slots;
+    int all = (region_id == DM_STATS_REGIONS_ALL);
+
+    if (!dms || !_DmStats_have_counters(stats, region_id)) {
+        PyErr_SetString(PyExc_ValueError, "No counter data: call "
+                        "DmStats.populate() first.");
+        return -1;
+    }
+
+    if (!all && !dm_stats_region_present(dms, region_id)) {
+        PyErr_Format(PyExc_IndexError, "DmStats region_id " FMTu64
+                     " does not exist.", region_id);
+        return -1;
+    }
+
+    nr_slots = all ? _dmpy_stats_nr_region_ids(dms) : 1;
+
+    /* Allocate at least one slot so that empty handles export a valid
+     * (zero-length) buffer. */
+    *region_ids = PyMem_Malloc(sizeof(**region_ids) * (nr_slots + 1));
+    *nr_areas = PyMem_Malloc(sizeof(**nr_areas) * (nr_slots + 1));
+    if (!*region_ids || !*nr_areas) {
+        PyMem_Free(*region_ids);
+        PyMem_Free(*nr_areas);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    *nr_regions = *max_areas = 0;
+    for (i = 0; i < nr_slots; i++) {
+        uint64_t id = all ? i : region_id;
+        if (!dm_stats_region_present(dms, id))
+            continue;
+        (*region_ids)[*nr_regions] = id;
+        (*nr_areas)[*nr_regions] = dm_stats_get_region_nr_areas(dms, id);
+        if ((*nr_areas)[*nr_regions] > *max_areas)
+            *max_areas = (*nr_areas)[*nr_regions];
+        (*nr_regions)++;
+    }
+    return 0;
+}
+
+/*
+ * Return a new tuple of the nr_values integers in values.
+ */
+static PyObject *
+_dmpy_uint64_tuple(const uint64_t *values, uint64_t nr_values)
+{
+    PyObject *tuple, *value;
+    uint64_t i;
+
+    if (!(tuple = PyTuple_New((Py_ssize_t) nr_values)))
+        return NULL;
+
+    for (i = 0; i < nr_values; i++) {
+        if (!(value = PyLong_FromUnsignedLongLong(values[i]))) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, value);
+    }
+    return tuple;
+}
+
+/*
+ * Set the dimensions of a snapshot array of nr_regions rows of max_areas
+ * areas and width values per area: a single region is exported without
+ * the leading region dimension. The strides describe a C-contiguous array
+ * of itemsize byte values. Returns the number of dimensions.
+ */
+static int
+_dmpy_snapshot_shape(Py_ssize_t *shape, Py_ssize_t *strides, int all,
+                     uint64_t nr_regions, uint64_t max_areas,
+                     Py_ssize_t width, Py_ssize_t itemsize)
+{
+    int i, ndim = 0;
+
+    if (all)
+        shape[ndim++] = (Py_ssize_t) nr_regions;
+    shape[ndim++] = (Py_ssize_t) max_areas;
+    shape[ndim++] = width;
+
+    strides[ndim - 1] = itemsize;
+    for (i = ndim - 1; i > 0; i--)
+        strides[i - 1] = strides[i] * shape[i];
+
+    return ndim;
+}
+
+/*
+ * Copy the counters for the region_ids[nr_regions] into buf, a zeroed
+ * array of nr_regions * max_areas * DM_STATS_NR_COUNTERS values.
+ */
+static void
+_DmStatsCounters_fill(uint64_t *buf, struct dm_stats *dms,
+                      const uint64_t *region_ids, const uint64_t *nr_areas,
+                      uint64_t nr_regions, uint64_t max_areas)
+{
+    uint64_t i, j, *row;
+    int c;
+
+    for (i = 0; i < nr_regions; i++) {
+        row = buf + i * max_areas * DM_STATS_NR_COUNTERS;
+        for (j = 0; j < nr_areas[i]; j++, row += DM_STATS_NR_COUNTERS)
+            for (c = 0; c < DM_STATS_NR_COUNTERS; c++)
+                row[c] = dm_stats_get_counter(dms, (dm_stats_counter_t) c,
+                                              region_ids[i], j);
+    }
+}
+
+/*
+ * Allocate a new, zeroed DmStatsCounters for the region_ids[nr_regions]
+ * with the given area counts. A single region (all == 0) is exported as
+ * an (nr_areas, NR_COUNTERS) array, all regions as a
+ * (nr_regions, max_areas, NR_COUNTERS) array.
+ */
+static DmStatsCountersObject *
+_newDmStatsCountersObject(dmpy_state *st, const uint64_t *region_ids,
+                          const uint64_t *nr_areas, uint64_t nr_regions,
+                          uint64_t max_areas, int all)
+{
+    DmStatsCountersObject *counters;
+    size_t nr_counters;
+
+    if (!(counters = PyObject_New(DmStatsCountersObject,
+                                  st->DmStatsCounters_Type)))
+        return NULL;
+
+    counters->dc_counters = NULL;
+    counters->dc_region_ids = NULL;
+    counters->dc_nr_areas = NULL;
+    counters->dc_interval = 0.0;
+
+    nr_counters = (size_t) (nr_regions * max_areas * DM_STATS_NR_COUNTERS);
+    counters->dc_counters = PyMem_Calloc(nr_counters ? nr_counters : 1,
+                                         sizeof(uint64_t));
+    if (!counters->dc_counters) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    if (!(counters->dc_region_ids = _dmpy_uint64_tuple(region_ids,
+                                                       nr_regions)))
+        goto fail;
+    if (!(counters->dc_nr_areas = _dmpy_uint64_tuple(nr_areas, nr_regions)))
+        goto fail;
+
+    counters->dc_ndim = _dmpy_snapshot_shape(counters->dc_shape,
+                                             counters->dc_strides, all,
+                                             nr_regions, max_areas,
+                                             DM_STATS_NR_COUNTERS,
+                                             sizeof(uint64_t));
+    return counters;
+
+fail:
+    Py_DECREF(counters);
+    return NULL;
+}
+
+/*
+ * Build a new DmStatsCounters for region_id, or for all regions present
+ * in stats if region_id is DM_STATS_REGIONS_ALL.
+ */
+static PyObject *
+newDmStatsCountersObject(DmStatsObject *stats, uint64_t region_id)
+{
+    DmStatsCountersObject *counters;
+    uint64_t *region_ids = NULL, *nr_areas = NULL;
+    uint64_t nr_regions, max_areas;
+
+    if (_DmStats_get_layout(stats, region_id, &region_ids, &nr_areas,
+                            &nr_regions, &max_areas))
+        return NULL;
+
+    counters = _newDmStatsCountersObject(DMPY_STATE(stats), region_ids,
+                                         nr_areas, nr_regions, max_areas,
+                                         region_id == DM_STATS_REGIONS_ALL);
+    if (counters)
+        _DmStatsCounters_fill(counters->dc_counters, stats->ds_dms,
+                              region_ids, nr_areas, nr_regions, max_areas);
+
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return (PyObject *) counters;
+}
+
+/*
+ * Grow *buf to hold at least len values. Returns 0 on success or -1 with
+ * an exception set.
+ */
+static int
+_dmpy_uint64_reserve(uint64_t **buf, size_t *buf_len, size_t len)
+{
+    uint64_t *new_buf;
+
+    if (*buf_len >= len)
+        return 0;
+
+    if (!(new_buf = PyMem_Realloc(*buf, sizeof(uint64_t) * len))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    *buf = new_buf;
+    *buf_len = len;
+    return 0;
+}
+
+/*
+ * Store the counters and layout of the region_ids[nr_regions] of dms in
+ * sample, re-using its buffers where possible.
+ */
+static int
+_DmStats_store_sample(struct dmpy_stats_sample *sample, struct dm_stats *dms,
+                      const uint64_t *region_ids, const uint64_t *nr_areas,
+                      uint64_t nr_regions, uint64_t max_areas)
+{
+    size_t nr_counters = (size_t) (nr_regions * max_areas
+                                   * DM_STATS_NR_COUNTERS);
+    uint64_t i, *layout;
+
+    if (_dmpy_uint64_reserve(&sample->counters, &sample->counters_len,
+                             nr_counters ? nr_counters : 1))
+        return -1;
+    if (_dmpy_uint64_reserve(&sample->layout, &sample->layout_len,
+                             (nr_regions ? nr_regions : 1)
+                             * DMSTATS_SAMPLE_LAYOUT))
+        return -1;
+
+    memset(sample->counters, 0, sizeof(uint64_t) * nr_counters);
+    _DmStatsCounters_fill(sample->counters, dms, region_ids, nr_areas,
+                          nr_regions, max_areas);
+
+    for (i = 0; i < nr_regions; i++) {
+        layout = sample->layout + i * DMSTATS_SAMPLE_LAYOUT;
+        layout[0] = region_ids[i];
+        layout[1] = nr_areas[i];
+        if (!dm_stats_get_region_start(dms, &layout[2], region_ids[i]))
+            layout[2] = UINT64_MAX;
+        if (!dm_stats_get_region_len(dms, &layout[3], region_ids[i]))
+            layout[3] = UINT64_MAX;
+    }
+
+    sample->nr_regions = nr_regions;
+    sample->max_areas = max_areas;
+    return 0;
+}
+
+/*
+ * Write the difference between the counters of cur and prev to delta, an
+ * array with the dimensions of cur. Rows are matched by region_id: a
+ * region that is absent from prev, or whose layout differs, is reported
+ * from zero, as is any counter that has gone backwards. The
+ * IO_IN_PROGRESS_COUNT gauge is copied unchanged.
+ */
+static void
+_DmStats_sample_delta(uint64_t *delta, const struct dmpy_stats_sample *cur,
+                      const struct dmpy_stats_sample *prev)
+{
+    size_t row_len = (size_t) (cur->max_areas * DM_STATS_NR_COUNTERS);
+    const uint64_t *layout, *prev_layout = NULL, *now, *then;
+    uint64_t i, j = 0;
+    size_t k;
+
+    for (i = 0; i < cur->nr_regions; i++, delta += row_len) {
+        layout = cur->layout + i * DMSTATS_SAMPLE_LAYOUT;
+        now = cur->counters + i * row_len;
+
+        /* Both samples list regions in ascending region_id order. */
+        while (prev && (j < prev->nr_regions)
+               && (prev->layout[j * DMSTATS_SAMPLE_LAYOUT] < layout[0]))
+            j++;
+        if (prev && (j < prev->nr_regions))
+            prev_layout = prev->layout + j * DMSTATS_SAMPLE_LAYOUT;
+        else
+            prev_layout = NULL;
+
+        if (!prev_layout || memcmp(layout, prev_layout,
+                                   sizeof(uint64_t) * DMSTATS_SAMPLE_LAYOUT)) {
+            memcpy(delta, now, sizeof(uint64_t) * row_len);
+            continue;
+        }
+
+        then = prev->counters + j * prev->max_areas * DM_STATS_NR_COUNTERS;
+        for (k = 0; k < layout[1] * DM_STATS_NR_COUNTERS; k++) {
+            if ((k % DM_STATS_NR_COUNTERS) == DM_STATS_IO_IN_PROGRESS_COUNT)
+                delta[k] = now[k];
+            else
+                delta[k] = (now[k] >= then[k]) ? now[k] - then[k] : now[k];
+        }
+    }
+}
+
+/*
+ * Populate all regions of self and return a DmStatsCounters holding the
+ * change in each counter since the last sample.
+ */
+static PyObject *
+_DmStats_sample(DmStatsObject *self, const char *program_id)
+{
+    struct dmpy_stats_sample *cur, *prev;
+    DmStatsCountersObject *counters = NULL;
+    uint64_t *region_ids = NULL, *nr_areas = NULL;
+    uint64_t nr_regions, max_areas;
+    int next;
+
+    if (_DmStats_populate(self, program_id, DM_STATS_REGIONS_ALL))
+        return NULL;
+
+    if (_DmStats_get_layout(self, DM_STATS_REGIONS_ALL, &region_ids,
+                            &nr_areas, &nr_regions, &max_areas))
+        return NULL;
+
+    next = (self->ds_sample == 0) ? 1 : 0;
+    cur = &self->ds_samples[next];
+    prev = (self->ds_sample < 0) ? NULL : &self->ds_samples[self->ds_sample];
+
+    if (_DmStats_store_sample(cur, self->ds_dms, region_ids, nr_areas,
+                              nr_regions, max_areas))
+        goto out;
+    cur->timestamp = _dmpy_monotonic_ns();
+
+    counters = _newDmStatsCountersObject(DMPY_STATE(self), region_ids,
+                                         nr_areas, nr_regions, max_areas, 1);
+    if (!counters)
+        goto out;
+
+    _DmStats_sample_delta(counters->dc_counters, cur, prev);
+    if (prev)
+        counters->dc_interval = (double) (cur->timestamp - prev->timestamp)
+                                / (double) NSEC_PER_SEC;
+    self->ds_sample = next;
+
+out:
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return (PyObject *) counters;
+}
+
+/*
+ * Fill in view to export the read-only, C-contiguous snapshot array buf
+ * of obj, with the given item format and dimensions.
+ */
+static int
+_dmpy_snapshot_getbuffer(PyObject *obj, Py_buffer *view, int flags,
+                         void *buf, const char *format, Py_ssize_t itemsize,
+                         int ndim, Py_ssize_t *shape, Py_ssize_t *strides)
+{
+    int i;
+
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_Format(PyExc_BufferError, "%s buffers are read-only.",
+                     Py_TYPE(obj)->tp_name);
+        view->obj = NULL;
+        return -1;
+    }
+
+    view->buf = buf;
+    view->itemsize = itemsize;
+    view->len = view->itemsize;
+    for (i = 0; i < ndim; i++)
+        view->len *= shape[i];
+    view->readonly = 1;
+    view->format = (flags & PyBUF_FORMAT) ? (char *) format : NULL;
+
+    /* The array is C-contiguous: a request without PyBUF_ND is exported
+     * as a flat run of bytes, with the shape implied by len and itemsize,
+     * and strides may be omitted if the consumer did not ask for them. */
+    if (flags & PyBUF_ND) {
+        view->ndim = ndim;
+        view->shape = shape;
+    } else {
+        view->ndim = 1;
+        view->shape = NULL;
+        /* Without a format the unit is the unsigned byte. */
+        if (!view->format)
+            view->itemsize = 1;
+    }
+    view->strides = (((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+                     && view->shape) ? strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    Py_INCREF(obj);
+    view->obj = obj;
+    return 0;
+}
+
+/*
+ * Return the shape of a snapshot array as a tuple.
+ */
+static PyObject *
+_dmpy_shape_tuple(int ndim, const Py_ssize_t *shape)
+{
+    PyObject *tuple, *value;
+    int i;
+
+    if (!(tuple = PyTuple_New(ndim)))
+        return NULL;
+
+    for (i = 0; i < ndim; i++) {
+        if (!(value = PyLong_FromSsize_t(shape[i]))) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, i, value);
+    }
+    return tuple;
+}
+
+static int
+DmStatsCounters_getbuffer(DmStatsCountersObject *self, Py_buffer *view,
+                          int flags)
+{
+    return _dmpy_snapshot_getbuffer((PyObject *) self, view, flags,
+                                    self->dc_counters, "Q", sizeof(uint64_t),
+                                    self->dc_ndim, self->dc_shape,
+                                    self->dc_strides);
+}
+
+
+static Py_ssize_t
+DmStatsCounters_len(PyObject *o)
+{
+    return ((DmStatsCountersObject *) o)->dc_shape[0];
+}
+
+
+static PyObject *
+DmStatsCounters_shape_getter(DmStatsCountersObject *self, void *arg)
+{
+    return _dmpy_shape_tuple(self->dc_ndim, self->dc_shape);
+}
+
+#define DMSTATSCOUNTERS_shape_gets__doc__ \
+"A tuple giving the dimensions of the exported counter array."
+
+static PyGetSetDef DmStatsCounters_getsets[] = {
+    {"shape", (getter)DmStatsCounters_shape_getter, NULL,
+      PyDoc_STR(DMSTATSCOUNTERS_shape_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyObject *
+DmStatsCounters_rates(DmStatsCountersObject *self, PyObject *args);
+
+#define DMSTATSCOUNTERS_rates__doc__ \
+"Return a DmStatsMetrics snapshot of the per-second rate of change of\n" \
+"each counter in a DmStats.sample() result: the counter deltas divided\n" \
+"by the sample interval. The names attribute of the result gives the\n"  \
+"counter name of each column; IO_IN_PROGRESS_COUNT is reported as a\n"   \
+"value rather than a rate.\n\n"                                           \
+"Raises ValueError if the snapshot does not cover an interval."
+
+static PyMethodDef DmStatsCounters_methods[] = {
+    {"rates", (PyCFunction)DmStatsCounters_rates, METH_NOARGS,
+        PyDoc_STR(DMSTATSCOUNTERS_rates__doc__)},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsCounters_members[] = {
+    {"region_ids", T_OBJECT, offsetof(DmStatsCountersObject, dc_region_ids),
+     READONLY, PyDoc_STR("The region_id of each region in the snapshot.")},
+    {"nr_areas", T_OBJECT, offsetof(DmStatsCountersObject, dc_nr_areas),
+     READONLY, PyDoc_STR("The number of areas in each region in the "
+                         "snapshot.")},
+    {"interval", T_DOUBLE, offsetof(DmStatsCountersObject, dc_interval),
+     READONLY, PyDoc_STR("The time in seconds covered by the counter "
+                         "deltas of a DmStats.sample() snapshot, or 0.0.")},
+    {NULL}
+};
+
+#define DMSTATSCOUNTERS__doc__ \
+"A read-only snapshot of device-mapper statistics counter data.\n\n"        \
+"DmStatsCounters objects are returned by DmStats.counters() and\n"          \
+"DmStatsRegion.counters() and export their data as a C-contiguous array\n"  \
+"of unsigned 64-bit integers via the buffer protocol:\n\n"                  \
+"  counters = dms.counters()\n"                                             \
+"  view = memoryview(counters)\n"                                           \
+"  reads = view[0, 0, dmpy.STATS_READS_COUNT]\n"
+
+static PyType_Slot DmStatsCounters_slots[] = {
+    {Py_tp_dealloc, DmStatsCounters_dealloc},
+    {Py_tp_doc, DMSTATSCOUNTERS__doc__},
+    {Py_sq_length, DmStatsCounters_len},
+    {Py_bf_getbuffer, DmStatsCounters_getbuffer},
+    {Py_tp_methods, DmStatsCounters_methods},
+    {Py_tp_members, DmStatsCounters_members},
+    {Py_tp_getset, DmStatsCounters_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsCounters_spec = {
+    "dmpy.DmStatsCounters",     /*name*/
+    sizeof(DmStatsCountersObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsCounters_slots,      /*slots*/
+};
+
+
+/*
+ * DmStatsMetrics objects.
+ *
+ * A DmStatsMetrics is an immutable snapshot of a set of derived metrics
+ * for every area of one or all regions of a DmStats handle, computed in
+ * a single pass and exported as a C-contiguous array of doubles via the
+ * buffer protocol. The last dimension holds one value per metric, in
+ * the order given by the names attribute.
+ */
+
+/* order must match libdevmapper.h dm_stats_metric_t enum */
+static const char *_dmpy_stats_metric_names[] = {
+    "RD_MERGES_PER_SEC",
+    "WR_MERGES_PER_SEC",
+    "READS_PER_SEC",
+    "WRITES_PER_SEC",
+    "READ_SECTORS_PER_SEC",
+    "WRITE_SECTORS_PER_SEC",
+    "AVERAGE_REQUEST_SIZE",
+    "AVERAGE_QUEUE_SIZE",
+    "AVERAGE_WAIT_TIME",
+    "AVERAGE_RD_WAIT_TIME",
+    "AVERAGE_WR_WAIT_TIME",
+    "SERVICE_TIME",
+    "THROUGHPUT",
+    "UTILIZATION",
+    NULL
+};
+
+typedef struct {
+    PyObject_HEAD
+    double *dx_metrics;
+    int dx_ndim;
+    Py_ssize_t dx_shape[DMSTATS_COUNTERS_MAX_DIM];
+    Py_ssize_t dx_strides[DMSTATS_COUNTERS_MAX_DIM];
+    PyObject *dx_region_ids; /* tuple of region_id for each row */
+    PyObject *dx_nr_areas; /* tuple of the area count of each row */
+    PyObject *dx_names; /* tuple of the metric name of each column */
+} DmStatsMetricsObject;
+
+#define DmStatsMetricsObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmStatsMetrics_Type)
+
+static void
+DmStatsMetrics_dealloc(DmStatsMetricsObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->dx_metrics)
+        PyMem_Free(self->dx_metrics);
+    self->dx_metrics = NULL;
+    Py_XDECREF(self->dx_region_ids);
+    Py_XDECREF(self->dx_nr_areas);
+    Py_XDECREF(self->dx_names);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+/*
+ * Parse names, a sequence of metric names or None for all metrics, into
+ * the array metrics[DM_STATS_NR_METRICS]. Returns the number of metrics
+ * and sets *name_tuple to a new tuple of the names, or -1 on error.
+ */
+static Py_ssize_t
+_DmStatsMetrics_parse_names(PyObject *names, dm_stats_metric_t *metrics,
+                            PyObject **name_tuple)
+{
+    PyObject *seq, *name;
+    Py_ssize_t i, nr_metrics;
+    const char *str;
+    int m;
+
+    if (!names || (names == Py_None)) {
+        if (!(*name_tuple = PyTuple_New(DM_STATS_NR_METRICS)))
+            return -1;
+        for (m = 0; m < DM_STATS_NR_METRICS; m++) {
+            if (!(name = PyUnicode_FromString(_dmpy_stats_metric_names[m])))
+                goto fail;
+            PyTuple_SET_ITEM(*name_tuple, m, name);
+            metrics[m] = (dm_stats_metric_t) m;
+        }
+        return DM_STATS_NR_METRICS;
+    }
+
+    if (PyUnicode_Check(names)) {
+        PyErr_SetString(PyExc_TypeError, "names must be a sequence of "
+                        "metric names.");
+        return -1;
+    }
+
+    if (!(seq = PySequence_Fast(names, "names must be a sequence of "
+                                "metric names.")))
+        return -1;
+
+    nr_metrics = PySequence_Fast_GET_SIZE(seq);
+    if (!nr_metrics || (nr_metrics > DM_STATS_NR_METRICS)) {
+        PyErr_Format(PyExc_ValueError, "names must contain between 1 and "
+                     "%d metric names.", DM_STATS_NR_METRICS);
+        Py_DECREF(seq);
+        return -1;
+    }
+
+    for (i = 0; i < nr_metrics; i++) {
+        name = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyUnicode_Check(name)) {
+            PyErr_SetString(PyExc_TypeError, "Metric names must be "
+                            "strings.");
+            goto bad;
+        }
+        if (!(str = PyUnicode_AsUTF8(name)))
+            goto bad;
+        for (m = 0; _dmpy_stats_metric_names[m]; m++)
+            if (!strcmp(str, _dmpy_stats_metric_names[m]))
+                break;
+        if (!_dmpy_stats_metric_names[m]) {
+            PyErr_Format(PyExc_ValueError, "Unknown metric name: %s", str);
+            goto bad;
+        }
+        metrics[i] = (dm_stats_metric_t) m;
+    }
+
+    *name_tuple = PySequence_Tuple(seq);
+    Py_DECREF(seq);
+    return *name_tuple ? nr_metrics : -1;
+
+bad:
+    Py_DECREF(seq);
+    return -1;
+
+fail:
+    Py_CLEAR(*name_tuple);
+    return -1;
+}
+
+/*
+ * Compute the nr_metrics metrics[] for the region_ids[nr_regions] into
+ * buf, a zeroed array of nr_regions * max_areas * nr_metrics values.
+ *
+ * Each value is obtained from dm_stats_get_metric(), exactly as for the
+ * DmStatsArea metric attributes, so that the snapshot honours the same
+ * sampling interval and counter scaling rules. Returns 0 on success, or
+ * -1 if the library fails to compute a metric.
+ */
+static int
+_DmStatsMetrics_fill(double *buf, struct dm_stats *dms,
+                     const dm_stats_metric_t *metrics, Py_ssize_t nr_metrics,
+                     const uint64_t *region_ids, const uint64_t *nr_areas,
+                     uint64_t nr_regions, uint64_t max_areas)
+{
+    uint64_t i, j;
+    double *row;
+    Py_ssize_t m;
+
+    for (i = 0; i < nr_regions; i++) {
+        row = buf + i * max_areas * nr_metrics;
+        for (j = 0; j < nr_areas[i]; j++, row += nr_metrics)
+            for (m = 0; m < nr_metrics; m++)
+                if (!dm_stats_get_metric(dms, metrics[m], region_ids[i], j,
+                                         &row[m]))
+                    return -1;
+    }
+    return 0;
+}
+
+/*
+ * Allocate a new, zeroed DmStatsMetrics for the region_ids[nr_regions]
+ * with the given area counts and one column per name in name_tuple. The
+ * new object steals the reference to name_tuple, even on failure.
+ */
+static DmStatsMetricsObject *
+_newDmStatsMetricsObject(dmpy_state *st, const uint64_t *region_ids,
+                         const uint64_t *nr_areas, uint64_t nr_regions,
+                         uint64_t max_areas, int all, PyObject *name_tuple)
+{
+    DmStatsMetricsObject *metrics;
+    Py_ssize_t nr_metrics = PyTuple_GET_SIZE(name_tuple);
+    size_t nr_values;
+
+    if (!(metrics = PyObject_New(DmStatsMetricsObject,
+                                 st->DmStatsMetrics_Type))) {
+        Py_DECREF(name_tuple);
+        return NULL;
+    }
+
+    metrics->dx_metrics = NULL;
+    metrics->dx_region_ids = NULL;
+    metrics->dx_nr_areas = NULL;
+    metrics->dx_names = name_tuple;
+
+    nr_values = (size_t) (nr_regions * max_areas * nr_metrics);
+    metrics->dx_metrics = PyMem_Calloc(nr_values ? nr_values : 1,
+                                       sizeof(double));
+    if (!metrics->dx_metrics) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    if (!(metrics->dx_region_ids = _dmpy_uint64_tuple(region_ids,
+                                                      nr_regions)))
+        goto fail;
+    if (!(metrics->dx_nr_areas = _dmpy_uint64_tuple(nr_areas, nr_regions)))
+        goto fail;
+
+    metrics->dx_ndim = _dmpy_snapshot_shape(metrics->dx_shape,
+                                            metrics->dx_strides, all,
+                                            nr_regions, max_areas,
+                                            nr_metrics, sizeof(double));
+    return metrics;
+
+fail:
+    Py_DECREF(metrics);
+    return NULL;
+}
+
+/*
+ * Build a new DmStatsMetrics for the metrics named by names for region_id,
+ * or for all regions present in stats if region_id is
+ * DM_STATS_REGIONS_ALL. The array shapes follow DmStatsCounters, with one
+ * column per requested metric.
+ */
+static PyObject *
+newDmStatsMetricsObject(DmStatsObject *stats, uint64_t region_id,
+                        PyObject *names)
+{
+    DmStatsMetricsObject *metrics = NULL;
+    dm_stats_metric_t metric_ids[DM_STATS_NR_METRICS];
+    uint64_t *region_ids = NULL, *nr_areas = NULL;
+    uint64_t nr_regions, max_areas;
+    Py_ssize_t nr_metrics;
+    PyObject *name_tuple = NULL;
+
+    if ((nr_metrics = _DmStatsMetrics_parse_names(names, metric_ids,
+                                                  &name_tuple)) < 0)
+        return NULL;
+
+    if (_DmStats_get_layout(stats, region_id, &region_ids, &nr_areas,
+                            &nr_regions, &max_areas)) {
+        Py_DECREF(name_tuple);
+        return NULL;
+    }
+
+    if (!(metrics = _newDmStatsMetricsObject(DMPY_STATE(stats), region_ids,
+                                             nr_areas, nr_regions, max_areas,
+                                             region_id == DM_STATS_REGIONS_ALL,
+                                             name_tuple)))
+        goto fail;
+
+    if (_DmStatsMetrics_fill(metrics->dx_metrics, stats->ds_dms, metric_ids,
+                             nr_metrics, region_ids, nr_areas, nr_regions,
+                             max_areas)) {
+        PyErr_SetString(PyExc_OSError, "Failed to get metric data from "
+                        "device-mapper.");
+        goto fail;
+    }
+
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return (PyObject *) metrics;
+
+fail:
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    Py_XDECREF(metrics);
+    return NULL;
+}
+
+static int
+DmStatsMetrics_getbuffer(DmStatsMetricsObject *self, Py_buffer *view,
+                         int flags)
+{
+    return _dmpy_snapshot_getbuffer((PyObject *) self, view, flags,
+                                    self->dx_metrics, "d", sizeof(double),
+                                    self->dx_ndim, self->dx_shape,
+                                    self->dx_strides);
+}
+
+
+static Py_ssize_t
+DmStatsMetrics_len(PyObject *o)
+{
+    return ((DmStatsMetricsObject *) o)->dx_shape[0];
+}
+
+
+static PyObject *
+DmStatsMetrics_shape_getter(DmStatsMetricsObject *self, void *arg)
+{
+    return _dmpy_shape_tuple(self->dx_ndim, self->dx_shape);
+}
+
+#define DMSTATSMETRICS_shape_gets__doc__ \
+"A tuple giving the dimensions of the exported metric array."
+
+static PyGetSetDef DmStatsMetrics_getsets[] = {
+    {"shape", (getter)DmStatsMetrics_shape_getter, NULL,
+      PyDoc_STR(DMSTATSMETRICS_shape_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsMetrics_members[] = {
+    {"region_ids", T_OBJECT, offsetof(DmStatsMetricsObject, dx_region_ids),
+     READONLY, PyDoc_STR("The region_id of each region in the snapshot.")},
+    {"nr_areas", T_OBJECT, offsetof(DmStatsMetricsObject, dx_nr_areas),
+     READONLY, PyDoc_STR("The number of areas in each region in the "
+                         "snapshot.")},
+    {"names", T_OBJECT, offsetof(DmStatsMetricsObject, dx_names),
+     READONLY, PyDoc_STR("The name of the metric in each column of the "
+                         "snapshot.")},
+    {NULL}
+};
+
+#define DMSTATSMETRICS__doc__ \
+"A read-only snapshot of device-mapper statistics metric data.\n\n"         \
+"DmStatsMetrics objects are returned by DmStats.metrics() and\n"            \
+"DmStatsRegion.metrics() and export their data as a C-contiguous array\n"   \
+"of doubles via the buffer protocol, with one column for each metric\n"     \
+"named in the names attribute:\n\n"                                         \
+"  metrics = dms.metrics([\"UTILIZATION\", \"THROUGHPUT\"])\n"              \
+"  view = memoryview(metrics)\n"                                            \
+"  util = view[0, 0, 0]\n"
+
+static PyType_Slot DmStatsMetrics_slots[] = {
+    {Py_tp_dealloc, DmStatsMetrics_dealloc},
+    {Py_tp_doc, DMSTATSMETRICS__doc__},
+    {Py_sq_length, DmStatsMetrics_len},
+    {Py_bf_getbuffer, DmStatsMetrics_getbuffer},
+    {Py_tp_members, DmStatsMetrics_members},
+    {Py_tp_getset, DmStatsMetrics_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsMetrics_spec = {
+    "dmpy.DmStatsMetrics",      /*name*/
+    sizeof(DmStatsMetricsObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsMetrics_slots,       /*slots*/
+};
+
+static PyObject *
+DmStatsCounters_rates(DmStatsCountersObject *self, PyObject *args)
+{
+    DmStatsMetricsObject *rates;
+    PyObject *name;
+    Py_ssize_t i, nr_values = 1;
+    int c;
+
+    if (self->dc_interval <= 0.0) {
+        PyErr_SetString(PyExc_ValueError, "No sample interval: rates are "
+                        "only available for DmStats.sample() snapshots "
+                        "after the first.");
+        return NULL;
+    }
+
+    if (!(rates = PyObject_New(DmStatsMetricsObject,
+                               DMPY_STATE(self)->DmStatsMetrics_Type)))
+        return NULL;
+
+    rates->dx_region_ids = self->dc_region_ids;
+    Py_INCREF(rates->dx_region_ids);
+    rates->dx_nr_areas = self->dc_nr_areas;
+    Py_INCREF(rates->dx_nr_areas);
+    rates->dx_metrics = NULL;
+    rates->dx_names = NULL;
+
+    rates->dx_ndim = self->dc_ndim;
+    for (i = 0; i < self->dc_ndim; i++) {
+        rates->dx_shape[i] = self->dc_shape[i];
+        nr_values *= self->dc_shape[i];
+    }
+    rates->dx_strides[rates->dx_ndim - 1] = sizeof(double);
+    for (i = rates->dx_ndim - 1; i > 0; i--)
+        rates->dx_strides[i - 1] = rates->dx_strides[i] * rates->dx_shape[i];
+
+    if (!(rates->dx_names = PyTuple_New(DM_STATS_NR_COUNTERS)))
+        goto fail;
+    for (c = 0; c < DM_STATS_NR_COUNTERS; c++) {
+        /* Column names match the DmStatsArea counter attributes. */
+        name = PyUnicode_FromString(_dmpy_stats_counter_names[c]
+                                    + strlen("STATS_"));
+        if (!name)
+            goto fail;
+        PyTuple_SET_ITEM(rates->dx_names, c, name);
+    }
+
+    if (!(rates->dx_metrics = PyMem_Calloc(nr_values ? nr_values : 1,
+                                           sizeof(double)))) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    for (i = 0; i < nr_values; i++) {
+        if ((i % DM_STATS_NR_COUNTERS) == DM_STATS_IO_IN_PROGRESS_COUNT)
+            rates->dx_metrics[i] = (double) self->dc_counters[i];
+        else
+            rates->dx_metrics[i] = (double) self->dc_counters[i]
+                                   / self->dc_interval;
+    }
+
+    return (PyObject *) rates;
+
+fail:
+    Py_DECREF(rates);
+    return NULL;
+}
+
+
+/*
+ * Reductions over DmStats counter and metric values.
+ *
+ * DmStatsRegion.reduce() and DmStats.top_areas() reduce one counter or
+ * metric across many areas without creating a DmStatsArea for each one:
+ * values are read directly from the dm_stats handle and only the result
+ * is converted into Python objects.
+ */
+
+/* A counter or metric selected by name, as for the DmStatsArea attributes. */
+struct dmpy_stats_value {
+    int is_metric;
+    int index; /* dm_stats_counter_t or dm_stats_metric_t */
+};
+
+/* The value of a counter or metric for one area. */
+struct dmpy_area_value {
+    uint64_t region_id;
+    uint64_t area_id;
+    uint64_t count; /* counter value */
+    double value; /* metric value */
+};
+
+#define DMPY_REDUCE_SUM 0
+#define DMPY_REDUCE_MIN 1
+#define DMPY_REDUCE_MAX 2
+
+static const char *_dmpy_reduce_op_names[] = {
+    "sum",
+    "min",
+    "max",
+    NULL
+};
+
+/*
+ * Parse name, a DmStatsArea counter or metric attribute name
+ * ("WRITE_SECTORS_COUNT", "READS_PER_SEC", ...) or one of the module's
+ * integer counter constants (STATS_READS_COUNT, ...), into v.
+ */
+static int
+_DmStats_parse_value_name(PyObject *name, struct dmpy_stats_value *v)
+{
+    const char *str;
+    long counter;
+    int i;
+
+    if (PyLong_Check(name)) {
+        counter = PyLong_AsLong(name);
+        if (PyErr_Occurred())
+            return -1;
+        if (counter < 0 || counter >= DM_STATS_NR_COUNTERS) {
+            PyErr_Format(PyExc_ValueError, "Invalid counter: %ld", counter);
+            return -1;
+        }
+        v->is_metric = 0;
+        v->index = (int) counter;
+        return 0;
+    }
+
+    if (!PyUnicode_Check(name)) {
+        PyErr_SetString(PyExc_TypeError, "Counter or metric must be a name "
+                        "or a STATS_* counter constant.");
+        return -1;
+    }
+
+    if (!(str = PyUnicode_AsUTF8(name)))
+        return -1;
+
+    for (i = 0; _dmpy_stats_counter_names[i]; i++) {
+        if (!strcmp(str, _dmpy_stats_counter_names[i] + strlen("STATS_"))) {
+            v->is_metric = 0;
+            v->index = i;
+            return 0;
+        }
+    }
+    for (i = 0; _dmpy_stats_metric_names[i]; i++) {
+        if (!strcmp(str, _dmpy_stats_metric_names[i])) {
+            v->is_metric = 1;
+            v->index = i;
+            return 0;
+        }
+    }
+
+    PyErr_Format(PyExc_ValueError, "Unknown counter or metric name: %s", str);
+    return -1;
+}
+
+/*
+ * Read the value v of area_id in region_id into av. Counters are read
+ * with dm_stats_get_counter() and metrics with dm_stats_get_metric(),
+ * exactly as for the DmStatsArea attributes.
+ */
+static int
+_DmStats_get_area_value(struct dm_stats *dms, const struct dmpy_stats_value *v,
+                        uint64_t region_id, uint64_t area_id,
+                        struct dmpy_area_value *av)
+{
+    av->region_id = region_id;
+    av->area_id = area_id;
+    av->count = 0;
+    av->value = 0.0;
+
+    if (!v->is_metric) {
+        av->count = dm_stats_get_counter(dms, (dm_stats_counter_t) v->index,
+                                         region_id, area_id);
+        return 0;
+    }
+
+    if (!dm_stats_get_metric(dms, (dm_stats_metric_t) v->index,
+                             region_id, area_id, &av->value)) {
+        PyErr_SetString(PyExc_OSError, "Failed to get metric data from "
+                        "device-mapper.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compare the values of a and b: returns less than, equal to, or greater
+ * than zero as a is smaller than, equal to, or larger than b.
+ */
+static int
+_dmpy_area_value_cmp(const struct dmpy_area_value *a,
+                     const struct dmpy_area_value *b, int is_metric)
+{
+    if (is_metric)
+        return (a->value > b->value) - (a->value < b->value);
+    return (a->count > b->count) - (a->count < b->count);
+}
+
+/*
+ * Order a and b as for _dmpy_area_value_cmp(), ranking equal values by
+ * location so that the lower (region_id, area_id) is the larger: this
+ * makes top_areas() results independent of the order of the heap.
+ */
+static int
+_dmpy_area_value_order(const struct dmpy_area_value *a,
+                       const struct dmpy_area_value *b, int is_metric)
+{
+    int cmp = _dmpy_area_value_cmp(a, b, is_metric);
+
+    if (cmp)
+        return cmp;
+    if (a->region_id != b->region_id)
+        return (a->region_id > b->region_id) ? -1 : 1;
+    if (a->area_id != b->area_id)
+        return (a->area_id > b->area_id) ? -1 : 1;
+    return 0;
+}
+
+static PyObject *
+_dmpy_area_value_to_object(const struct dmpy_area_value *av, int is_metric)
+{
+    if (is_metric)
+        return PyFloat_FromDouble(av->value);
+    return PyLong_FromUnsignedLongLong(av->count);
+}
+
+/* Return a new (region_id, area_id, value) tuple for av. */
+static PyObject *
+_dmpy_area_value_tuple(const struct dmpy_area_value *av, int is_metric)
+{
+    return Py_BuildValue("(KKN)", av->region_id, av->area_id,
+                         _dmpy_area_value_to_object(av, is_metric));
+}
+
+/*
+ * Reduce the counter or metric name over the areas of region_id with the
+ * operation op ("sum", "min" or "max"). A sum returns the total value;
+ * min and max return a (region_id, area_id, value) tuple for the area
+ * holding the smallest or largest value.
+ */
+static PyObject *
+_DmStats_reduce(DmStatsObject *stats, uint64_t region_id, PyObject *name,
+                const char *op_name)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    struct dmpy_stats_value v;
+    struct dmpy_area_value av, best;
+    uint64_t *region_ids, *nr_areas, nr_regions, max_areas, j;
+    uint64_t count_sum = 0;
+    double value_sum = 0.0;
+    int op, cmp;
+
+    if (_DmStats_parse_value_name(name, &v))
+        return NULL;
+
+    for (op = 0; _dmpy_reduce_op_names[op]; op++)
+        if (!strcmp(op_name, _dmpy_reduce_op_names[op]))
+            break;
+    if (!_dmpy_reduce_op_names[op]) {
+        PyErr_Format(PyExc_ValueError, "Unknown reduction: %s (expected "
+                     "'sum', 'min' or 'max')", op_name);
+        return NULL;
+    }
+
+    if (_DmStats_get_layout(stats, region_id, &region_ids, &nr_areas,
+                            &nr_regions, &max_areas))
+        return NULL;
+
+    memset(&best, 0, sizeof(best));
+    for (j = 0; nr_regions && j < nr_areas[0]; j++) {
+        if (_DmStats_get_area_value(dms, &v, region_id, j, &av))
+            goto fail;
+        if (op == DMPY_REDUCE_SUM) {
+            count_sum += av.count;
+            value_sum += av.value;
+            continue;
+        }
+        /* the first of several equal values is returned */
+        cmp = _dmpy_area_value_cmp(&av, &best, v.is_metric);
+        if (!j || ((op == DMPY_REDUCE_MAX) ? (cmp > 0) : (cmp < 0)))
+            best = av;
+    }
+
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+
+    if (op != DMPY_REDUCE_SUM)
+        return _dmpy_area_value_tuple(&best, v.is_metric);
+    if (v.is_metric)
+        return PyFloat_FromDouble(value_sum);
+    return PyLong_FromUnsignedLongLong(count_sum);
+
+fail:
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return NULL;
+}
+
+/* Restore the min-heap property of heap[0..nr) below slot i. */
+static void
+_dmpy_area_heap_down(struct dmpy_area_value *heap, Py_ssize_t nr,
+                     Py_ssize_t i, int is_metric)
+{
+    struct dmpy_area_value tmp;
+    Py_ssize_t child;
+
+    while ((child = 2 * i + 1) < nr) {
+        if ((child + 1 < nr)
+            && (_dmpy_area_value_order(&heap[child + 1], &heap[child],
+                                     is_metric) < 0))
+            child++;
+        if (_dmpy_area_value_order(&heap[child], &heap[i], is_metric) >= 0)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+/* Restore the min-heap property of heap[] above slot i. */
+static void
+_dmpy_area_heap_up(struct dmpy_area_value *heap, Py_ssize_t i, int is_metric)
+{
+    struct dmpy_area_value tmp;
+    Py_ssize_t parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (_dmpy_area_value_order(&heap[i], &heap[parent], is_metric) >= 0)
+            break;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/*
+ * Return a list of (region_id, area_id, value) tuples for the n areas of
+ * stats with the largest value of the counter or metric name, largest
+ * first. The n largest values are kept in a bounded min-heap while the
+ * areas are scanned, so only n values are held at any time.
+ */
+static PyObject *
+_DmStats_top_areas(DmStatsObject *stats, PyObject *name, Py_ssize_t n)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    struct dmpy_stats_value v;
+    struct dmpy_area_value av, *heap = NULL;
+    uint64_t *region_ids, *nr_areas, nr_regions, max_areas, total = 0, i, j;
+    Py_ssize_t nr = 0, k;
+    PyObject *list = NULL, *item;
+
+    if (_DmStats_parse_value_name(name, &v))
+        return NULL;
+
+    if (n < 0) {
+        PyErr_SetString(PyExc_ValueError, "n must be zero or greater.");
+        return NULL;
+    }
+
+    if (_DmStats_get_layout(stats, DM_STATS_REGIONS_ALL, &region_ids,
+                            &nr_areas, &nr_regions, &max_areas))
+        return NULL;
+
+    for (i = 0; i < nr_regions; i++)
+        total += nr_areas[i];
+    if ((uint64_t) n > total)
+        n = (Py_ssize_t) total;
+
+    if (n && !(heap = PyMem_Malloc(sizeof(*heap) * n))) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (i = 0; n && i < nr_regions; i++) {
+        for (j = 0; j < nr_areas[i]; j++) {
+            if (_DmStats_get_area_value(dms, &v, region_ids[i], j, &av))
+                goto out;
+            if (nr < n) {
+                heap[nr] = av;
+                _dmpy_area_heap_up(heap, nr++, v.is_metric);
+            } else if (_dmpy_area_value_order(&av, &heap[0],
+                                              v.is_metric) > 0) {
+                heap[0] = av;
+                _dmpy_area_heap_down(heap, nr, 0, v.is_metric);
+            }
+        }
+    }
+
+    if (!(list = PyList_New(nr)))
+        goto out;
+
+    /* Popping the smallest value fills the list from the end. */
+    for (k = nr - 1; k >= 0; k--) {
+        if (!(item = _dmpy_area_value_tuple(&heap[0], v.is_metric))) {
+            Py_CLEAR(list);
+            goto out;
+        }
+        PyList_SET_ITEM(list, k, item);
+        heap[0] = heap[k];
+        _dmpy_area_heap_down(heap, k, 0, v.is_metric);
+    }
+
+out:
+    PyMem_Free(heap);
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return list;
+}
+
+/*
+ * Area heat maps.
+ *
+ * heatmap() downsamples the areas of one or more regions into a fixed
+ * number of equal-width LBA buckets. Bucket b of a region of len sectors
+ * covers the sectors [b * len / buckets, (b + 1) * len / buckets) of the
+ * region, and an area contributes to every bucket that it overlaps:
+ *
+ *   sum  - the area value is split between buckets in proportion to the
+ *          sectors of the area that fall in each one.
+ *   max  - the largest value of any area overlapping the bucket.
+ *   mean - the mean value over the sectors of the bucket.
+ *
+ * A bucket of zero width (buckets > len) reads as zero. Regions are
+ * independent jobs: with workers > 1 they are shared between a small
+ * pool of native threads with the GIL released, as for run_tasks(). Each
+ * job writes only its own row of the result, and the workers never touch
+ * a Python object.
+ */
+
+#define DMPY_HEATMAP_SUM 0
+#define DMPY_HEATMAP_MAX 1
+#define DMPY_HEATMAP_MEAN 2
+
+static const char *_dmpy_heatmap_op_names[] = {
+    "sum",
+    "max",
+    "mean",
+    NULL
+};
+
+#define DMPY_HEATMAP_MAX_BUCKETS (1 << 24)
+#define DMPY_HEATMAP_MAX_WORKERS 64
+
+/* The geometry of one region of a heat map, and its row of buckets. */
+struct dmpy_heatmap_region {
+    uint64_t region_id;
+    uint64_t len;
+    uint64_t area_len;
+    uint64_t nr_areas;
+    double *row;
+};
+
+struct dmpy_heatmap_batch {
+    PyThread_type_lock lock; /* protects next, nr_running, failed, refs */
+    PyThread_type_lock done; /* released when the last worker finishes */
+    struct dm_stats *dms;
+    struct dmpy_stats_value v;
+    int op;
+    uint64_t buckets;
+    Py_ssize_t nr_regions;
+    Py_ssize_t next; /* index of the next unclaimed region */
+    int nr_running; /* workers that have not yet finished */
+    int refs; /* threads holding a reference to the batch */
+    int failed; /* a metric could not be read */
+    struct dmpy_heatmap_region *regions;
+};
+
+/* Return the first sector of bucket b of a region of len sectors. */
+static uint64_t
+_dmpy_heatmap_bucket_start(uint64_t b, uint64_t len, uint64_t buckets)
+{
+    /* b * len / buckets, without overflowing 64 bits */
+    return b * (len / buckets) + b * (len % buckets) / buckets;
+}
+
+/*
+ * Fill the row of buckets for reg, a zeroed array, from the value v of
+ * each of its areas. Returns 0 on success or -1 if a metric could not
+ * be read. Needs no Python state and may run with the GIL released.
+ */
+static int
+_dmpy_heatmap_fill(struct dm_stats *dms, const struct dmpy_stats_value *v,
+                   int op, uint64_t buckets,
+                   const struct dmpy_heatmap_region *reg)
+{
+    uint64_t area_len = reg->area_len ? reg->area_len : reg->len;
+    uint64_t j, b = 0, k, a_start, a_end, b_start, b_end, overlap;
+    double value;
+
+    for (j = 0; j < reg->nr_areas; j++) {
+        a_start = j * area_len;
+        if (a_start >= reg->len)
+            break;
+        a_end = (reg->len - a_start > area_len) ? a_start + area_len
+                                                : reg->len;
+
+        if (!v->is_metric)
+            value = (double) dm_stats_get_counter(dms,
+                                                  (dm_stats_counter_t)
+                                                  v->index,
+                                                  reg->region_id, j);
+        else if (!dm_stats_get_metric(dms, (dm_stats_metric_t) v->index,
+                                      reg->region_id, j, &value))
+            return -1;
+
+        /* Areas are in LBA order: skip the buckets that end before this
+         * area starts. */
+        while ((b < buckets)
+               && (_dmpy_heatmap_bucket_start(b + 1, reg->len, buckets)
+                   <= a_start))
+            b++;
+
+        for (k = b; k < buckets; k++) {
+            b_start = _dmpy_heatmap_bucket_start(k, reg->len, buckets);
+            if (b_start >= a_end)
+                break;
+            b_end = _dmpy_heatmap_bucket_start(k + 1, reg->len, buckets);
+            if (b_end == b_start)
+                continue;
+            overlap = ((a_end < b_end) ? a_end : b_end)
+                      - ((a_start > b_start) ? a_start : b_start);
+            if (op == DMPY_HEATMAP_SUM)
+                reg->row[k] += value * (double) overlap
+                               / (double) (a_end - a_start);
+            else if (op == DMPY_HEATMAP_MEAN)
+                reg->row[k] += value * (double) overlap
+                               / (double) (b_end - b_start);
+            else if (value > reg->row[k])
+                reg->row[k] = value;
+        }
+    }
+    return 0;
+}
+
+static void
+_dmpy_heatmap_batch_free(struct dmpy_heatmap_batch *batch)
+{
+    if (batch->lock)
+        PyThread_free_lock(batch->lock);
+    if (batch->done)
+        PyThread_free_lock(batch->done);
+    PyMem_RawFree(batch->regions);
+    PyMem_RawFree(batch);
+}
+
+static struct dmpy_heatmap_batch *
+_dmpy_heatmap_batch_new(Py_ssize_t nr_regions)
+{
+    struct dmpy_heatmap_batch *batch;
+
+    if (!(batch = PyMem_RawCalloc(1, sizeof(*batch))))
+        return NULL;
+
+    batch->nr_regions = nr_regions;
+    batch->refs = 1;
+    batch->nr_running = 1;
+    batch->regions = PyMem_RawCalloc(nr_regions ? nr_regions : 1,
+                                     sizeof(*batch->regions));
+    batch->lock = PyThread_allocate_lock();
+    batch->done = PyThread_allocate_lock();
+
+    if (!batch->regions || !batch->lock || !batch->done) {
+        _dmpy_heatmap_batch_free(batch);
+        return NULL;
+    }
+
+    /* Held until the last worker finishes. */
+    PyThread_acquire_lock(batch->done, WAIT_LOCK);
+    return batch;
+}
+
+static void
+_dmpy_heatmap_batch_put(struct dmpy_heatmap_batch *batch)
+{
+    int refs;
+
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    refs = --batch->refs;
+    PyThread_release_lock(batch->lock);
+
+    if (!refs)
+        _dmpy_heatmap_batch_free(batch);
+}
+
+/*
+ * Fill regions from batch until none remain. Must be called with the GIL
+ * released.
+ */
+static void
+_dmpy_heatmap_batch_work(struct dmpy_heatmap_batch *batch)
+{
+    Py_ssize_t i;
+    int last, r;
+
+    for (;;) {
+        PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+        i = batch->failed ? batch->nr_regions : batch->next++;
+        PyThread_release_lock(batch->lock);
+
+        if (i >= batch->nr_regions)
+            break;
+
+        r = _dmpy_heatmap_fill(batch->dms, &batch->v, batch->op,
+                               batch->buckets, &batch->regions[i]);
+        if (r) {
+            PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+            batch->failed = 1;
+            PyThread_release_lock(batch->lock);
+        }
+    }
+
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    last = !--batch->nr_running;
+    PyThread_release_lock(batch->lock);
+
+    if (last)
+        PyThread_release_lock(batch->done);
+}
+
+static void
+_dmpy_heatmap_batch_thread(void *arg)
+{
+    struct dmpy_heatmap_batch *batch = arg;
+
+    _dmpy_heatmap_batch_work(batch);
+    _dmpy_heatmap_batch_put(batch);
+}
+
+/*
+ * Collect the region_id and area count of the nr_ids regions in ids, as
+ * for _DmStats_get_layout(). On success the caller owns the two arrays
+ * returned and must release them with PyMem_Free().
+ */
+static int
+_DmStats_get_layout_ids(DmStatsObject *stats, const uint64_t *ids,
+                        uint64_t nr_ids, uint64_t **region_ids,
+                        uint64_t **nr_areas, uint64_t *max_areas)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    uint64_t i;
+
+    for (i = 0; i < nr_ids; i++) {
+        if (!dms || !_DmStats_have_counters(stats, ids[i])) {
+            PyErr_SetString(PyExc_ValueError, "No counter data: call "
+                            "DmStats.populate() first.");
+            return -1;
+        }
+        if (!dm_stats_region_present(dms, ids[i])) {
+            PyErr_Format(PyExc_IndexError, "DmStats region_id " FMTu64
+                         " does not exist.", ids[i]);
+            return -1;
+        }
+    }
+
+    *region_ids = PyMem_Malloc(sizeof(**region_ids) * (nr_ids + 1));
+    *nr_areas = PyMem_Malloc(sizeof(**nr_areas) * (nr_ids + 1));
+    if (!*region_ids || !*nr_areas) {
+        PyMem_Free(*region_ids);
+        PyMem_Free(*nr_areas);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    *max_areas = 0;
+    for (i = 0; i < nr_ids; i++) {
+        (*region_ids)[i] = ids[i];
+        (*nr_areas)[i] = dm_stats_get_region_nr_areas(dms, ids[i]);
+        if ((*nr_areas)[i] > *max_areas)
+            *max_areas = (*nr_areas)[i];
+    }
+    return 0;
+}
+
+/*
+ * Return a DmStatsMetrics heat map of the counter or metric name for the
+ * regions selected by region: a region_id, None for all regions present
+ * in stats, or an iterable of region_id values. The map has one column,
+ * and one row of buckets values for each region: a single region_id is
+ * exported without the leading region dimension, as for metrics().
+ */
+static PyObject *
+_DmStats_heatmap(DmStatsObject *stats, PyObject *region, PyObject *name,
+                 Py_ssize_t buckets, const char *op_name, int workers)
+{
+    DmStatsMetricsObject *heatmap = NULL;
+    struct dmpy_heatmap_batch *batch = NULL;
+    struct dmpy_heatmap_region *reg;
+    struct dmpy_stats_value v;
+    uint64_t *region_ids = NULL, *nr_areas = NULL, *ids;
+    uint64_t region_id, nr_regions, max_areas, i;
+    PyObject *name_tuple;
+    int op, all, w, r, failed;
+
+    if (_DmStats_parse_value_name(name, &v))
+        return NULL;
+
+    for (op = 0; _dmpy_heatmap_op_names[op]; op++)
+        if (!strcmp(op_name, _dmpy_heatmap_op_names[op]))
+            break;
+    if (!_dmpy_heatmap_op_names[op]) {
+        PyErr_Format(PyExc_ValueError, "Unknown heat map operation: %s "
+                     "(expected 'sum', 'max' or 'mean')", op_name);
+        return NULL;
+    }
+
+    if ((buckets < 1) || (buckets > DMPY_HEATMAP_MAX_BUCKETS)) {
+        PyErr_Format(PyExc_ValueError, "buckets must be between 1 and %d.",
+                     DMPY_HEATMAP_MAX_BUCKETS);
+        return NULL;
+    }
+
+    if ((workers < 1) || (workers > DMPY_HEATMAP_MAX_WORKERS)) {
+        PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d.",
+                     DMPY_HEATMAP_MAX_WORKERS);
+        return NULL;
+    }
+
+    if ((all = (region == Py_None))) {
+        if (_DmStats_get_layout(stats, DM_STATS_REGIONS_ALL, &region_ids,
+                                &nr_areas, &nr_regions, &max_areas))
+            return NULL;
+    } else if (PyLong_Check(region)) {
+        region_id = PyLong_AsUnsignedLongLong(region);
+        if (PyErr_Occurred())
+            return NULL;
+        if (_DmStats_get_layout(stats, region_id, &region_ids, &nr_areas,
+                                &nr_regions, &max_areas))
+            return NULL;
+    } else {
+        all = 1;
+        if (_DmStats_parse_region_ids(region, &ids, &nr_regions))
+            return NULL;
+        r = _DmStats_get_layout_ids(stats, ids, nr_regions, &region_ids,
+                                    &nr_areas, &max_areas);
+        PyMem_Free(ids);
+        if (r)
+            return NULL;
+    }
+
+    /* Label the column with the attribute name of the counter or metric. */
+    name_tuple = Py_BuildValue("(s)", v.is_metric
+                               ? _dmpy_stats_metric_names[v.index]
+                               : _dmpy_stats_counter_names[v.index]
+                                 + strlen("STATS_"));
+    if (!name_tuple)
+        goto out;
+
+    /* Each row holds buckets values: nr_areas reports the bucket count. */
+    for (i = 0; i < nr_regions; i++)
+        nr_areas[i] = (uint64_t) buckets;
+
+    if (!(heatmap = _newDmStatsMetricsObject(DMPY_STATE(stats), region_ids,
+                                             nr_areas, nr_regions,
+                                             (uint64_t) buckets, all,
+                                             name_tuple)))
+        goto out;
+
+    if (!(batch = _dmpy_heatmap_batch_new((Py_ssize_t) nr_regions))) {
+        PyErr_NoMemory();
+        goto fail;
+    }
+
+    batch->dms = stats->ds_dms;
+    batch->v = v;
+    batch->op = op;
+    batch->buckets = (uint64_t) buckets;
+    for (i = 0; i < nr_regions; i++) {
+        reg = &batch->regions[i];
+        reg->region_id = region_ids[i];
+        reg->nr_areas = dm_stats_get_region_nr_areas(stats->ds_dms,
+                                                     region_ids[i]);
+        reg->row = heatmap->dx_metrics + i * (uint64_t) buckets;
+        if (!dm_stats_get_region_len(stats->ds_dms, &reg->len,
+                                     region_ids[i])
+            || !dm_stats_get_region_area_len(stats->ds_dms, &reg->area_len,
+                                             region_ids[i])) {
+            PyErr_SetString(PyExc_OSError, "Failed to get region data "
+                            "from device-mapper.");
+            goto fail;
+        }
+    }
+
+    /* Exclude other threads from the handle while the GIL is released. */
+    if (_dmpy_busy_claim(&stats->ds_busy, "DmStats"))
+        goto fail;
+
+    if ((uint64_t) workers > nr_regions)
+        workers = (int) (nr_regions ? nr_regions : 1);
+
+    for (w = 1; w < workers; w++) {
+        PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+        batch->refs++;
+        batch->nr_running++;
+        PyThread_release_lock(batch->lock);
+        if (PyThread_start_new_thread(_dmpy_heatmap_batch_thread, batch)
+            == PYTHREAD_INVALID_THREAD_ID) {
+            /* Run with the workers started so far. */
+            PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+            batch->refs--;
+            batch->nr_running--;
+            PyThread_release_lock(batch->lock);
+            break;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    _dmpy_heatmap_batch_work(batch);
+    PyThread_acquire_lock(batch->done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+
+    stats->ds_busy = 0;
+    failed = batch->failed;
+    _dmpy_heatmap_batch_put(batch);
+    batch = NULL;
+
+    if (failed) {
+        PyErr_SetString(PyExc_OSError, "Failed to get metric data from "
+                        "device-mapper.");
+        goto fail;
+    }
+    goto out;
+
+fail:
+    Py_CLEAR(heatmap);
+out:
+    if (batch)
+        _dmpy_heatmap_batch_put(batch);
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return (PyObject *) heatmap;
+}
+
+/*
+ * DmStatsGroup objects.
+ *
+ * A DmStatsGroup represents a group of regions in a DmStats handle. It is
+ * a sequence of the member DmStatsRegion objects, and its counters and
+ * metrics are aggregated in C across every area of every member region.
+ * The group_id of a group is the region_id of its first member.
+ *
+ * Like DmStatsRegion, a DmStatsGroup is a shim holding a reference to its
+ * parent DmStats: it is invalidated by any operation that changes the
+ * handle's tables, and by deleting the group.
+ */
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *dg_stats;
+    uint64_t dg_sequence;
+    uint64_t dg_generation; /* generation of the leader region's slot */
+    uint64_t dg_group_id;
+} DmStatsGroupObject;
+
+#define DmStatsGroupObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmStatsGroup_Type)
+
+#define DMSTATS_FROM_GROUP(g) ((DmStatsObject *)((g)->dg_stats))
+
+static void
+DmStatsGroup_dealloc(DmStatsGroupObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    PyObject_GC_UnTrack(self);
+
+    /* release our reference on the parent DmStats. */
+    Py_XDECREF(self->dg_stats);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+newDmStatsGroupObject(DmStatsObject *stats, uint64_t group_id)
+{
+    DmStatsGroupObject *group;
+
+    if (!(group = PyObject_GC_New(DmStatsGroupObject,
+                                  DMPY_STATE(stats)->DmStatsGroup_Type)))
+        return NULL;
+
+    group->dg_group_id = group_id;
+    _DmStats_region_stamp(stats, group_id, &group->dg_sequence,
+                          &group->dg_generation);
+    group->dg_stats = (PyObject *) stats;
+
+    /* Keep a reference on the parent DmStats, as for DmStatsRegion. */
+    Py_INCREF(stats);
+    return (PyObject *) group;
+}
+
+static int
+DmStatsGroup_traverse(DmStatsGroupObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->dg_stats);
+    return 0;
+}
+
+static int
+DmStatsGroup_clear(DmStatsGroupObject *self)
+{
+    Py_CLEAR(self->dg_stats);
+    return 0;
+}
+
+/*
+ * Collect the region_id of each member of group_id. On success the caller
+ * owns the array returned in *members and must release it with
+ * PyMem_Free().
+ */
+static int
+_DmStats_get_group_members(DmStatsObject *stats, uint64_t group_id,
+                           uint64_t **members, uint64_t *nr_members)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    uint64_t region_id, nr_slots;
+
+    nr_slots = _dmpy_stats_nr_region_ids(dms);
+
+    if (!(*members = PyMem_Malloc(sizeof(**members) * (nr_slots + 1)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    *nr_members = 0;
+    if (!nr_slots)
+        return 0;
+
+    dm_stats_foreach_region(dms) {
+        region_id = dm_stats_get_current_region(dms);
+        if (dm_stats_get_group_id(dms, region_id) != group_id)
+            continue;
+        if (*nr_members == nr_slots)
+            break;
+        (*members)[(*nr_members)++] = region_id;
+    }
+    return 0;
+}
+
+/*
+ * Check that the DmStats handle is unchanged since this DmStatsGroup was
+ * created, and that the group is still present. Returns 0 if the group
+ * may be accessed, or -1 with LookupError set.
+ */
+static int
+_DmStatsGroup_check(DmStatsGroupObject *self)
+{
+    DmStatsObject *stats = DMSTATS_FROM_GROUP(self);
+
+    DmStats_BusyCheck(stats, -1);
+
+    if (!_DmStats_region_valid(stats, self->dg_sequence, self->dg_group_id,
+                               self->dg_generation)) {
+        PyErr_SetString(PyExc_LookupError, "Attempt to access group in"
+                        " changed DmStats object.");
+        return -1;
+    }
+
+    if (!dm_stats_group_present(stats->ds_dms, self->dg_group_id)) {
+        PyErr_Format(PyExc_LookupError, "DmStats group_id " FMTu64
+                     " is no longer present.", self->dg_group_id);
+        return -1;
+    }
+    return 0;
+}
+
+#define DmStatsGroup_Check(o)                                   \
+do {                                                            \
+    if (_DmStatsGroup_check((DmStatsGroupObject *)(o)))         \
+        return NULL;                                            \
+} while(0);
+
+/*
+ * Sum the counters of every area of the group members into
+ * sums[DM_STATS_NR_COUNTERS]. Returns 0 on success, or -1 with ValueError
+ * set if the handle does not hold counter data for every member.
+ */
+static int
+_DmStatsGroup_sum_counters(DmStatsGroupObject *self, uint64_t *sums)
+{
+    DmStatsObject *stats = DMSTATS_FROM_GROUP(self);
+    struct dm_stats *dms = stats->ds_dms;
+    uint64_t *members, nr_members, i, j, nr_areas;
+    int c;
+
+    if (_DmStats_get_group_members(stats, self->dg_group_id, &members,
+                                   &nr_members))
+        return -1;
+
+    memset(sums, 0, sizeof(*sums) * DM_STATS_NR_COUNTERS);
+    for (i = 0; i < nr_members; i++) {
+        if (!_DmStats_have_counters(stats, members[i])) {
+            PyErr_SetString(PyExc_ValueError, "No counter data: call "
+                            "DmStats.populate() first.");
+            PyMem_Free(members);
+            return -1;
+        }
+        nr_areas = dm_stats_get_region_nr_areas(dms, members[i]);
+        for (j = 0; j < nr_areas; j++)
+            for (c = 0; c < DM_STATS_NR_COUNTERS; c++)
+                sums[c] += dm_stats_get_counter(dms, (dm_stats_counter_t) c,
+                                                members[i], j);
+    }
+    PyMem_Free(members);
+    return 0;
+}
+
+/*
+ * Derive metric from a set of DM_STATS_NR_COUNTERS counter values
+ * covering interval_ns nanoseconds, using exactly the definitions of
+ * dm_stats_get_metric() so that aggregated and snapshot metrics agree
+ * with the DmStatsArea attributes. Note that the library divides merge
+ * counts by the interval in nanoseconds, and computes the service time
+ * from a utilization truncated to a whole dm_percent_t percentage.
+ */
+static double
+_dmpy_stats_counters_metric(const uint64_t *c, uint64_t interval_ns,
+                            dm_stats_metric_t metric)
+{
+    double nsecs = (double) interval_ns;
+    uint64_t ios = c[DM_STATS_READS_COUNT] + c[DM_STATS_WRITES_COUNT];
+    uint64_t io_nsecs;
+    dm_percent_t util;
+    double tput;
+
+    switch (metric) {
+    case DM_STATS_RD_MERGES_PER_SEC:
+        return (double) c[DM_STATS_READS_MERGED_COUNT] / nsecs;
+    case DM_STATS_WR_MERGES_PER_SEC:
+        return (double) c[DM_STATS_WRITES_MERGED_COUNT] / nsecs;
+    case DM_STATS_READS_PER_SEC:
+        return ((double) c[DM_STATS_READS_COUNT] * NSEC_PER_SEC) / nsecs;
+    case DM_STATS_WRITES_PER_SEC:
+        return ((double) c[DM_STATS_WRITES_COUNT] * NSEC_PER_SEC) / nsecs;
+    case DM_STATS_READ_SECTORS_PER_SEC:
+        return ((double) c[DM_STATS_READ_SECTORS_COUNT]
+                * (double) NSEC_PER_SEC) / nsecs;
+    case DM_STATS_WRITE_SECTORS_PER_SEC:
+        return ((double) c[DM_STATS_WRITE_SECTORS_COUNT]
+                * (double) NSEC_PER_SEC) / nsecs;
+    case DM_STATS_AVERAGE_REQUEST_SIZE:
+        if (!ios)
+            return 0.0;
+        return (double) (c[DM_STATS_READ_SECTORS_COUNT]
+                         + c[DM_STATS_WRITE_SECTORS_COUNT]) / (double) ios;
+    case DM_STATS_AVERAGE_QUEUE_SIZE:
+        if (!c[DM_STATS_WEIGHTED_IO_NSECS])
+            return 0.0;
+        return (double) c[DM_STATS_WEIGHTED_IO_NSECS] / nsecs;
+    case DM_STATS_AVERAGE_WAIT_TIME:
+        if (!ios)
+            return 0.0;
+        return (double) (c[DM_STATS_READ_NSECS] + c[DM_STATS_WRITE_NSECS])
+               / (double) ios;
+    case DM_STATS_AVERAGE_RD_WAIT_TIME:
+        if (!c[DM_STATS_READS_COUNT])
+            return 0.0;
+        return (double) c[DM_STATS_READ_NSECS]
+               / (double) c[DM_STATS_READS_COUNT];
+    case DM_STATS_AVERAGE_WR_WAIT_TIME:
+        if (!c[DM_STATS_WRITES_COUNT])
+            return 0.0;
+        return (double) c[DM_STATS_WRITE_NSECS]
+               / (double) c[DM_STATS_WRITES_COUNT];
+    case DM_STATS_SERVICE_TIME:
+        tput = _dmpy_stats_counters_metric(c, interval_ns,
+                                           DM_STATS_THROUGHPUT);
+        io_nsecs = c[DM_STATS_IO_NSECS];
+        io_nsecs = (io_nsecs < interval_ns) ? io_nsecs : interval_ns;
+        util = dm_make_percent(io_nsecs, interval_ns) / DM_PERCENT_1;
+        if (((uint64_t) tput == 0) || (util == 0))
+            return 0.0;
+        return ((double) NSEC_PER_SEC * dm_percent_to_float(util))
+               / (100.0 * tput);
+    case DM_STATS_THROUGHPUT:
+        return ((double) NSEC_PER_SEC * (double) ios) / nsecs;
+    case DM_STATS_UTILIZATION:
+        /* Busy time can exceed the interval when members overlap, or
+         * when sampling starts with uncleared counters: clamp to 100%. */
+        io_nsecs = c[DM_STATS_IO_NSECS];
+        io_nsecs = (io_nsecs < interval_ns) ? io_nsecs : interval_ns;
+        return (double) io_nsecs / nsecs;
+    default:
+        return 0.0;
+    }
+}
+
+static Py_ssize_t
+DmStatsGroup_len(PyObject *o)
+{
+    DmStatsGroupObject *self = (DmStatsGroupObject *) o;
+    uint64_t *members, nr_members;
+
+    if (_DmStatsGroup_check(self))
+        return -1;
+
+    if (_DmStats_get_group_members(DMSTATS_FROM_GROUP(self),
+                                   self->dg_group_id, &members, &nr_members))
+        return -1;
+
+    PyMem_Free(members);
+    return (Py_ssize_t) nr_members;
+}
+
+static PyObject *
+DmStatsGroup_get_item(PyObject *o, Py_ssize_t i)
+{
+    DmStatsGroupObject *self = (DmStatsGroupObject *) o;
+    uint64_t *members, nr_members, region_id;
+
+    DmStatsGroup_Check(self);
+
+    if (_DmStats_get_group_members(DMSTATS_FROM_GROUP(self),
+                                   self->dg_group_id, &members, &nr_members))
+        return NULL;
+
+    if ((i < 0) || ((uint64_t) i >= nr_members)) {
+        PyMem_Free(members);
+        PyErr_SetString(PyExc_IndexError, "DmStatsGroup index out of range");
+        return NULL;
+    }
+
+    region_id = members[i];
+    PyMem_Free(members);
+    return DmStats_get_item(self->dg_stats, (Py_ssize_t) region_id);
+}
+
+
+static PyObject *
+DmStatsGroup_counters(DmStatsGroupObject *self, PyObject *args)
+{
+    DmStatsCountersObject *counters;
+    uint64_t one = 1;
+
+    DmStatsGroup_Check(self);
+
+    if (!(counters = _newDmStatsCountersObject(DMPY_STATE(self),
+                                               &self->dg_group_id, &one,
+                                               1, 1, 0)))
+        return NULL;
+
+    if (_DmStatsGroup_sum_counters(self, counters->dc_counters)) {
+        Py_DECREF(counters);
+        return NULL;
+    }
+    return (PyObject *) counters;
+}
+
+static PyObject *
+DmStatsGroup_metrics(DmStatsGroupObject *self, PyObject *args,
+                     PyObject *kwds)
+{
+    static char *kwlist[] = {"names", NULL};
+    dm_stats_metric_t metric_ids[DM_STATS_NR_METRICS];
+    uint64_t sums[DM_STATS_NR_COUNTERS], interval_ns, one = 1;
+    DmStatsMetricsObject *metrics;
+    PyObject *names = NULL, *name_tuple;
+    Py_ssize_t m, nr_metrics;
+
+    DmStatsGroup_Check(self);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:metrics", kwlist,
+                                     &names))
+        return NULL;
+
+    if ((nr_metrics = _DmStatsMetrics_parse_names(names, metric_ids,
+                                                  &name_tuple)) < 0)
+        return NULL;
+
+    if (!(metrics = _newDmStatsMetricsObject(DMPY_STATE(self),
+                                             &self->dg_group_id, &one, 1, 1,
+                                             0, name_tuple)))
+        return NULL;
+
+    if (_DmStatsGroup_sum_counters(self, sums))
+        goto fail;
+
+    interval_ns = dm_stats_get_sampling_interval_ns(
+                        DMSTATS_FROM_GROUP(self)->ds_dms);
+    if (!interval_ns) {
+        PyErr_SetString(PyExc_ValueError, "No sampling interval: call "
+                        "DmStats.set_sampling_interval() first.");
+        goto fail;
+    }
+
+    for (m = 0; m < nr_metrics; m++)
+        metrics->dx_metrics[m] = _dmpy_stats_counters_metric(sums,
+                                                             interval_ns,
+                                                             metric_ids[m]);
+    return (PyObject *) metrics;
+
+fail:
+    Py_DECREF(metrics);
+    return NULL;
+}
+
+static PyObject *
+DmStatsGroup_ungroup(DmStatsGroupObject *self, PyObject *args)
+{
+    DmStatsGroup_Check(self);
+
+    if (_DmStats_ungroup(DMSTATS_FROM_GROUP(self), self->dg_group_id))
+        return NULL;
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+DmStatsGroup_alias_getter(PyObject *self, void *arg)
+{
+    DmStatsGroupObject *group = (DmStatsGroupObject *) self;
+
+    DmStatsGroup_Check(self);
+
+    return Py_BuildValue("z", dm_stats_get_alias(
+                                DMSTATS_FROM_GROUP(group)->ds_dms,
+                                group->dg_group_id));
+}
+
+static int
+DmStatsGroup_alias_setter(PyObject *self, PyObject *value, void *arg)
+{
+    DmStatsGroupObject *group = (DmStatsGroupObject *) self;
+    const char *alias;
+
+    if (_DmStatsGroup_check(group))
+        return -1;
+
+    if (!value || !PyUnicode_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "DmStatsGroup alias must be a "
+                        "string.");
+        return -1;
+    }
+
+    if (!(alias = PyUnicode_AsUTF8(value)))
+        return -1;
+
+    return _DmStats_set_alias(DMSTATS_FROM_GROUP(group), group->dg_group_id,
+                              alias);
+}
+
+static PyObject *
+DmStatsGroup_members_getter(PyObject *self, void *arg)
+{
+    DmStatsGroupObject *group = (DmStatsGroupObject *) self;
+    uint64_t *members, nr_members;
+    PyObject *tuple;
+
+    DmStatsGroup_Check(self);
+
+    if (_DmStats_get_group_members(DMSTATS_FROM_GROUP(group),
+                                   group->dg_group_id, &members, &nr_members))
+        return NULL;
+
+    tuple = _dmpy_uint64_tuple(members, nr_members);
+    PyMem_Free(members);
+    return tuple;
+}
+
+static PyObject *
+DmStatsGroup_histogram_getter(PyObject *self, void *arg)
+{
+    DmStatsGroupObject *group = (DmStatsGroupObject *) self;
+    uint64_t *members, nr_members;
+    PyObject *hist;
+
+    DmStatsGroup_Check(self);
+
+    if (_DmStats_get_group_members(DMSTATS_FROM_GROUP(group),
+                                   group->dg_group_id, &members, &nr_members))
+        return NULL;
+
+    hist = newDmHistogramFromGroup(DMSTATS_FROM_GROUP(group), members,
+                                   nr_members);
+    PyMem_Free(members);
+    return hist;
+}
+
+static PyObject *
+DmStatsGroup_present_getter(PyObject *self, void *arg)
+{
+    DmStatsGroupObject *group = (DmStatsGroupObject *) self;
+    DmStatsObject *stats = DMSTATS_FROM_GROUP(group);
+
+    DmStats_BusyCheck(stats, NULL);
+
+    if (_DmStats_region_valid(stats, group->dg_sequence, group->dg_group_id,
+                              group->dg_generation)
+        && dm_stats_group_present(stats->ds_dms, group->dg_group_id))
+        Py_RETURN_TRUE;
+    Py_RETURN_FALSE;
+}
+
+#define DMSTATSGROUP_counters__doc__ \
+"Return a DmStatsCounters snapshot of the counters of this group, summed\n" \
+"over every area of every member region, as a (1, NR_COUNTERS) array.\n"   \
+"The object must have been populated by a call to populate()."
+
+#define DMSTATSGROUP_metrics__doc__ \
+"Return a DmStatsMetrics snapshot of the named metrics for this group as\n" \
+"a (1, len(names)) array. Metrics are derived from the group counters\n" \
+"with the definitions used for the DmStatsArea metric attributes.\n\n"    \
+"names - A sequence of metric names, or None for all metrics.\n\n"        \
+"A sampling interval must be set, and utilization is limited to 1.0\n"   \
+"for groups whose members overlap."
+
+#define DMSTATSGROUP_ungroup__doc__ \
+"Delete this group. The member regions are not removed."
+
+static PyMethodDef DmStatsGroup_methods[] = {
+    {"counters", (PyCFunction)DmStatsGroup_counters, METH_NOARGS,
+        PyDoc_STR(DMSTATSGROUP_counters__doc__)},
+    {"metrics", (PyCFunction)DmStatsGroup_metrics,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATSGROUP_metrics__doc__)},
+    {"ungroup", (PyCFunction)DmStatsGroup_ungroup, METH_NOARGS,
+        PyDoc_STR(DMSTATSGROUP_ungroup__doc__)},
+    {NULL, NULL}
+};
+
+#define DMSTATSGROUP_alias_gets__doc__ \
+"The alias of this group. If no alias has been set this is the name of\n" \
+"the device."
+
+#define DMSTATSGROUP_members_gets__doc__ \
+"A tuple of the region_id of each member of this group."
+
+#define DMSTATSGROUP_histogram_gets__doc__ \
+"A DmHistogram holding the sum of the latency histograms of all areas\n" \
+"of every member region, or None if the group has no histogram."
+
+#define DMSTATSGROUP_present_gets__doc__ \
+"Boolean indicating whether this group is present or not."
+
+static PyGetSetDef DmStatsGroup_getsets[] = {
+    {"alias", DmStatsGroup_alias_getter, DmStatsGroup_alias_setter,
+      PyDoc_STR(DMSTATSGROUP_alias_gets__doc__), NULL},
+    {"members", DmStatsGroup_members_getter, NULL,
+      PyDoc_STR(DMSTATSGROUP_members_gets__doc__), NULL},
+    {"histogram", DmStatsGroup_histogram_getter, NULL,
+      PyDoc_STR(DMSTATSGROUP_histogram_gets__doc__), NULL},
+    {"present", DmStatsGroup_present_getter, NULL,
+      PyDoc_STR(DMSTATSGROUP_present_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsGroup_members[] = {
+    {"group_id", T_LONG, offsetof(DmStatsGroupObject, dg_group_id),
+     READONLY, PyDoc_STR("The group identifier of this group.")},
+    {NULL}
+};
+
+#define DMSTATSGROUP__doc__ \
+"Class representing a group of regions of a device-mapper statistics\n"  \
+"handle. Indexing a DmStatsGroup returns its member regions, and the\n"  \
+"counters() and metrics() methods and the histogram attribute aggregate\n" \
+"data across all of them."
+
+static PyType_Slot DmStatsGroup_slots[] = {
+    {Py_tp_dealloc, DmStatsGroup_dealloc},
+    {Py_tp_doc, DMSTATSGROUP__doc__},
+    {Py_tp_traverse, DmStatsGroup_traverse},
+    {Py_tp_clear, DmStatsGroup_clear},
+    {Py_sq_length, DmStatsGroup_len},
+    {Py_sq_item, DmStatsGroup_get_item},
+    {Py_tp_methods, DmStatsGroup_methods},
+    {Py_tp_members, DmStatsGroup_members},
+    {Py_tp_getset, DmStatsGroup_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsGroup_spec = {
+    "dmpy.DmStatsGroup",        /*name*/
+    sizeof(DmStatsGroupObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+    Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsGroup_slots,         /*slots*/
+};
+
+/*
+ * OpenMetrics rendering.
+ *
+ * DmStats.render_openmetrics() formats the counters and metrics of a
+ * populated handle as OpenMetrics text directly into a single bytes
+ * object: one metric family for each selected counter or metric, and
+ * one sample for each area (or each region, if per_region is set) of
+ * every region present. The label set of each region is escaped and
+ * formatted once, and no Python objects are created for the samples.
+ */
+
+/* An output buffer growing inside a bytes object. */
+struct dmpy_outbuf {
+    PyObject *bytes;
+    size_t len;
+    size_t size;
+};
+
+static int
+_dmpy_outbuf_init(struct dmpy_outbuf *out, size_t size)
+{
+    out->len = 0;
+    out->size = size ? size : 1;
+    if (!(out->bytes = PyBytes_FromStringAndSize(NULL,
+                                                 (Py_ssize_t) out->size)))
+        return -1;
+    return 0;
+}
+
+/* Make room for len more bytes in out, doubling its size as needed. */
+static int
+_dmpy_outbuf_reserve(struct dmpy_outbuf *out, size_t len)
+{
+    size_t size = out->size;
+
+    if (out->len + len <= out->size)
+        return 0;
+    while (size < out->len + len) {
+        if (size > (size_t) PY_SSIZE_T_MAX / 2) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        size *= 2;
+    }
+    if (_PyBytes_Resize(&out->bytes, (Py_ssize_t) size))
+        return -1;
+    out->size = size;
+    return 0;
+}
+
+static int
+_dmpy_outbuf_write(struct dmpy_outbuf *out, const char *str, size_t len)
+{
+    if (_dmpy_outbuf_reserve(out, len))
+        return -1;
+    memcpy(PyBytes_AS_STRING(out->bytes) + out->len, str, len);
+    out->len += len;
+    return 0;
+}
+
+#define _dmpy_outbuf_puts(out, str) _dmpy_outbuf_write(out, str, strlen(str))
+
+/* Append str to out as an OpenMetrics label value. */
+static int
+_dmpy_outbuf_escape(struct dmpy_outbuf *out, const char *str)
+{
+    char *buf;
+
+    /* At most two bytes for every input byte. */
+    if (_dmpy_outbuf_reserve(out, 2 * strlen(str)))
+        return -1;
+
+    buf = PyBytes_AS_STRING(out->bytes);
+    for (; *str; str++) {
+        switch (*str) {
+        case '\\':
+        case '"':
+            buf[out->len++] = '\\';
+            buf[out->len++] = *str;
+            break;
+        case '\n':
+            buf[out->len++] = '\\';
+            buf[out->len++] = 'n';
+            break;
+        default:
+            buf[out->len++] = *str;
+        }
+    }
+    return 0;
+}
+
+static int
+_dmpy_outbuf_u64(struct dmpy_outbuf *out, uint64_t value)
+{
+    char buf[24], *p = buf + sizeof(buf);
+
+    do {
+        *--p = '0' + (char) (value % 10);
+        value /= 10;
+    } while (value);
+    return _dmpy_outbuf_write(out, p, (size_t) (buf + sizeof(buf) - p));
+}
+
+static int
+_dmpy_outbuf_double(struct dmpy_outbuf *out, double value)
+{
+    char buf[32];
+    int len;
+
+    if (Py_IS_NAN(value))
+        return _dmpy_outbuf_puts(out, "NaN");
+    if (Py_IS_INFINITY(value))
+        return _dmpy_outbuf_puts(out, (value > 0) ? "+Inf" : "-Inf");
+    len = PyOS_snprintf(buf, sizeof(buf), "%.17g", value);
+    return _dmpy_outbuf_write(out, buf, (size_t) len);
+}
+
+/* Return non-zero if str is a valid metric (colons) or label name. */
+static int
+_dmpy_openmetrics_valid_name(const char *str, int colons, int empty)
+{
+    const char *p;
+
+    if (!*str)
+        return empty;
+    for (p = str; *p; p++) {
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+            || (*p == '_') || (colons && *p == ':'))
+            continue;
+        if ((p != str) && (*p >= '0' && *p <= '9'))
+            continue;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Format the label set of every region present into one buffer: the
+ * user labels, then program_id and region_id. The labels of region i are
+ * held in labels[offsets[i]] to labels[offsets[i + 1]], without braces.
+ */
+static int
+_DmStats_openmetrics_labels(DmStatsObject *stats, PyObject *labels,
+                            const uint64_t *region_ids, uint64_t nr_regions,
+                            struct dmpy_outbuf *out, size_t *offsets)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    struct dmpy_outbuf user;
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    const char *str;
+    uint64_t i;
+
+    if (_dmpy_outbuf_init(&user, 64))
+        return -1;
+
+    while (labels && PyDict_Next(labels, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key) || !PyUnicode_Check(value)) {
+            PyErr_SetString(PyExc_TypeError, "OpenMetrics label names and "
+                            "values must be strings.");
+            goto fail;
+        }
+        if (!(str = PyUnicode_AsUTF8(key)))
+            goto fail;
+        if (!_dmpy_openmetrics_valid_name(str, 0, 0)) {
+            PyErr_Format(PyExc_ValueError, "Invalid OpenMetrics label name: "
+                         "%s", str);
+            goto fail;
+        }
+        if (_dmpy_outbuf_puts(&user, str) || _dmpy_outbuf_puts(&user, "=\""))
+            goto fail;
+        if (!(str = PyUnicode_AsUTF8(value)))
+            goto fail;
+        if (_dmpy_outbuf_escape(&user, str) || _dmpy_outbuf_puts(&user, "\","))
+            goto fail;
+    }
+
+    for (i = 0; i < nr_regions; i++) {
+        offsets[i] = out->len;
+        str = dm_stats_get_region_program_id(dms, region_ids[i]);
+        if (_dmpy_outbuf_write(out, PyBytes_AS_STRING(user.bytes), user.len)
+            || _dmpy_outbuf_puts(out, "program_id=\"")
+            || _dmpy_outbuf_escape(out, str ? str : "")
+            || _dmpy_outbuf_puts(out, "\",region_id=\"")
+            || _dmpy_outbuf_u64(out, region_ids[i])
+            || _dmpy_outbuf_puts(out, "\""))
+            goto fail;
+    }
+    offsets[nr_regions] = out->len;
+
+    Py_DECREF(user.bytes);
+    return 0;
+
+fail:
+    Py_DECREF(user.bytes);
+    return -1;
+}
+
+/*
+ * Parse include_metrics, a sequence of counter or metric names or
+ * counter constants, into a new array of *nr values. All counters are
+ * selected if include_metrics is NULL or None.
+ */
+static struct dmpy_stats_value *
+_DmStats_openmetrics_values(PyObject *include_metrics, Py_ssize_t *nr)
+{
+    struct dmpy_stats_value *values;
+    PyObject *seq = NULL;
+    Py_ssize_t i;
+
+    if (include_metrics && (include_metrics != Py_None)) {
+        if (!(seq = PySequence_Fast(include_metrics, "include_metrics must "
+                                    "be a sequence of counter or metric "
+                                    "names.")))
+            return NULL;
+        *nr = PySequence_Fast_GET_SIZE(seq);
+    } else
+        *nr = DM_STATS_NR_COUNTERS;
+
+    if (!(values = PyMem_Malloc(sizeof(*values) * (*nr ? *nr : 1)))) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (i = 0; i < *nr; i++) {
+        if (!seq) {
+            values[i].is_metric = 0;
+            values[i].index = (int) i;
+        } else if (_DmStats_parse_value_name(
+                       PySequence_Fast_GET_ITEM(seq, i), &values[i])) {
+            PyMem_Free(values);
+            values = NULL;
+            goto out;
+        }
+    }
+
+out:
+    Py_XDECREF(seq);
+    return values;
+}
+
+/* Write the "# TYPE" line of the metric family for v. */
+static int
+_DmStats_openmetrics_family(struct dmpy_outbuf *out, const char *prefix,
+                            const char *name, const struct dmpy_stats_value *v)
+{
+    const char *type;
+
+    if (v->is_metric || (v->index == DM_STATS_IO_IN_PROGRESS_COUNT))
+        type = " gauge\n";
+    else
+        type = " counter\n";
+
+    return (_dmpy_outbuf_puts(out, "# TYPE ")
+            || _dmpy_outbuf_puts(out, prefix)
+            || _dmpy_outbuf_puts(out, name)
+            || _dmpy_outbuf_puts(out, type));
+}
+
+static PyObject *
+_DmStats_render_openmetrics(DmStatsObject *self, const char *prefix,
+                            PyObject *labels, PyObject *include_metrics,
+                            int per_region)
+{
+    struct dm_stats *dms = self->ds_dms;
+    uint64_t *region_ids = NULL, *nr_areas = NULL, nr_regions, max_areas;
+    uint64_t i, j, k, interval_ns, sums[DM_STATS_NR_COUNTERS];
+    struct dmpy_stats_value *values = NULL;
+    struct dmpy_area_value av;
+    struct dmpy_outbuf label_buf = {NULL, 0, 0}, out = {NULL, 0, 0};
+    const char *labels_str, *suffix;
+    char name[64], *p;
+    size_t *offsets = NULL, size;
+    Py_ssize_t v, nr_values;
+    int counter, metrics = 0;
+
+    if (labels && (labels != Py_None) && !PyDict_Check(labels)) {
+        PyErr_SetString(PyExc_TypeError, "labels must be a dict.");
+        return NULL;
+    }
+    if (labels == Py_None)
+        labels = NULL;
+
+    if (!_dmpy_openmetrics_valid_name(prefix, 1, 1)) {
+        PyErr_Format(PyExc_ValueError, "Invalid OpenMetrics metric name "
+                     "prefix: %s", prefix);
+        return NULL;
+    }
+
+    if (!(values = _DmStats_openmetrics_values(include_metrics, &nr_values)))
+        return NULL;
+
+    for (v = 0; v < nr_values; v++)
+        metrics |= values[v].is_metric;
+
+    interval_ns = dm_stats_get_sampling_interval_ns(dms);
+    if (metrics && !interval_ns) {
+        PyErr_SetString(PyExc_ValueError, "No sampling interval: call "
+                        "DmStats.set_sampling_interval() first.");
+        goto out;
+    }
+
+    if (_DmStats_get_layout(self, DM_STATS_REGIONS_ALL, &region_ids,
+                            &nr_areas, &nr_regions, &max_areas))
+        goto out;
+
+    if (!(offsets = PyMem_Malloc(sizeof(*offsets) * (nr_regions + 1)))) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    if (_dmpy_outbuf_init(&label_buf, (size_t) nr_regions * 64))
+        goto out;
+    if (_DmStats_openmetrics_labels(self, labels, region_ids, nr_regions,
+                                    &label_buf, offsets))
+        goto out;
+    labels_str = PyBytes_AS_STRING(label_buf.bytes);
+
+    /*
+     * Size the output for the labels, name and a 20-digit value of every
+     * sample, and the family lines: it is grown if this is exceeded.
+     */
+    size = strlen(prefix) + 64;
+    for (i = 0; i < nr_regions; i++)
+        size += (per_region ? 1 : (size_t) nr_areas[i])
+                * (offsets[i + 1] - offsets[i] + strlen(prefix) + 80);
+    size = size * (size_t) nr_values + sizeof("# EOF\n");
+    if (_dmpy_outbuf_init(&out, size))
+        goto out;
+
+    for (v = 0; v < nr_values; v++) {
+        counter = !values[v].is_metric;
+        if (counter)
+            PyOS_snprintf(name, sizeof(name), "%s", _dmpy_stats_counter_names[
+                          values[v].index] + strlen("STATS_"));
+        else
+            PyOS_snprintf(name, sizeof(name), "%s",
+                          _dmpy_stats_metric_names[values[v].index]);
+        for (p = name; *p; p++)
+            if (*p >= 'A' && *p <= 'Z')
+                *p += 'a' - 'A';
+
+        if (_DmStats_openmetrics_family(&out, prefix, name, &values[v]))
+            goto fail;
+        suffix = (counter && (values[v].index
+                              != DM_STATS_IO_IN_PROGRESS_COUNT)) ? "_total{"
+                                                                 : "{";
+
+        for (i = 0; i < nr_regions; i++) {
+            if (per_region) {
+                memset(sums, 0, sizeof(sums));
+                for (j = 0; j < nr_areas[i]; j++)
+                    for (k = 0; k < DM_STATS_NR_COUNTERS; k++)
+                        sums[k] += dm_stats_get_counter(
+                            dms, (dm_stats_counter_t) k, region_ids[i], j);
+            }
+
+            for (j = 0; j < (per_region ? 1 : nr_areas[i]); j++) {
+                if (_dmpy_outbuf_puts(&out, prefix)
+                    || _dmpy_outbuf_puts(&out, name)
+                    || _dmpy_outbuf_puts(&out, suffix)
+                    || _dmpy_outbuf_write(&out, labels_str + offsets[i],
+                                          offsets[i + 1] - offsets[i]))
+                    goto fail;
+                if (!per_region && (_dmpy_outbuf_puts(&out, ",area_id=\"")
+                                    || _dmpy_outbuf_u64(&out, j)
+                                    || _dmpy_outbuf_puts(&out, "\"")))
+                    goto fail;
+                if (_dmpy_outbuf_puts(&out, "} "))
+                    goto fail;
+
+                if (per_region && counter) {
+                    if (_dmpy_outbuf_u64(&out, sums[values[v].index]))
+                        goto fail;
+                } else if (per_region) {
+                    if (_dmpy_outbuf_double(&out, _dmpy_stats_counters_metric(
+                            sums, interval_ns,
+                            (dm_stats_metric_t) values[v].index)))
+                        goto fail;
+                } else {
+                    if (_DmStats_get_area_value(dms, &values[v],
+                                                region_ids[i], j, &av))
+                        goto fail;
+                    if (counter ? _dmpy_outbuf_u64(&out, av.count)
+                                : _dmpy_outbuf_double(&out, av.value))
+                        goto fail;
+                }
+                if (_dmpy_outbuf_puts(&out, "\n"))
+                    goto fail;
+            }
+        }
+    }
+
+    if (_dmpy_outbuf_puts(&out, "# EOF\n"))
+        goto fail;
+    if (_PyBytes_Resize(&out.bytes, (Py_ssize_t) out.len))
+        out.bytes = NULL;
+    goto out;
+
+fail:
+    Py_CLEAR(out.bytes);
+out:
+    Py_XDECREF(label_buf.bytes);
+    PyMem_Free(offsets);
+    PyMem_Free(values);
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return out.bytes;
+}
+
+/*
+ * DmStatsSnapshot objects.
+ *
+ * DmStats.to_bytes() serialises the region layout and counters of a
+ * populated handle into a versioned, fixed-width binary snapshot, and a
+ * DmStatsSnapshot offers the region, area, counter and metric API of the
+ * live objects over such a buffer without copying or parsing it.
+ *
+ * A snapshot is a struct dmpy_snapshot_header, followed by one struct
+ * dmpy_snapshot_region for each region present (in region_id order), the
+ * NR_COUNTERS counters of every area of every region, and a table of
+ * NUL-terminated strings holding the program_id and aux_data of each
+ * region. All fields are uint64_t in host byte order, and the total size
+ * is a multiple of eight bytes, so that snapshots may be appended to a
+ * history file and mapped at any snapshot boundary.
+ *
+ * Snapshots are immutable: the region and area objects of a snapshot
+ * hold a reference to it and are never invalidated.
+ */
+
+#define DMPY_SNAPSHOT_MAGIC 0x50414e5359504d44ULL /* "DMPYSNAP" */
+#define DMPY_SNAPSHOT_VERSION 1
+
+/* No string: program_id and aux_data offsets of a region without one. */
+#define DMPY_SNAPSHOT_NO_STRING UINT64_MAX
+
+/* Region flags */
+#define DMPY_SNAPSHOT_PRECISE 0x1
+
+struct dmpy_snapshot_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t size; /* bytes in this snapshot, a multiple of 8 */
+    uint64_t timestamp_ns; /* CLOCK_REALTIME time of to_bytes() */
+    uint64_t interval_ns; /* sampling interval of the handle */
+    uint64_t nr_counters; /* DM_STATS_NR_COUNTERS */
+    uint64_t nr_region_ids; /* largest region_id present + 1 */
+    uint64_t nr_regions; /* regions present */
+    uint64_t nr_areas; /* areas in all regions present */
+    uint64_t regions_offset;
+    uint64_t counters_offset;
+    uint64_t strings_offset;
+    uint64_t strings_len;
+};
+
+struct dmpy_snapshot_region {
+    uint64_t region_id;
+    uint64_t start;
+    uint64_t len;
+    uint64_t area_len;
+    uint64_t nr_areas;
+    uint64_t first_area; /* index of the first area in the counters */
+    uint64_t group_id; /* DM_STATS_GROUP_NOT_PRESENT if not grouped */
+    uint64_t program_id; /* string table offset, or DMPY_SNAPSHOT_NO_STRING */
+    uint64_t aux_data; /* string table offset, or DMPY_SNAPSHOT_NO_STRING */
+    uint64_t flags;
+};
+
+#define DMPY_SNAPSHOT_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+/* Append str to the string table at *pos and return its offset. */
+static uint64_t
+_dmpy_snapshot_add_string(char *strings, uint64_t *pos, const char *str)
+{
+    uint64_t offset = *pos;
+
+    if (!str)
+        return DMPY_SNAPSHOT_NO_STRING;
+    memcpy(strings + offset, str, strlen(str) + 1);
+    *pos += strlen(str) + 1;
+    return offset;
+}
+
+static PyObject *
+_DmStats_to_bytes(DmStatsObject *stats)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    uint64_t *region_ids, *nr_areas, nr_regions, max_areas;
+    uint64_t i, j, nr_total = 0, strings_len = 0, pos = 0, size;
+    struct dmpy_snapshot_header *h;
+    struct dmpy_snapshot_region *reg;
+    const char *str;
+    uint64_t *counters;
+    struct timespec ts;
+    PyObject *bytes = NULL;
+    int c;
+
+    if (_DmStats_get_layout(stats, DM_STATS_REGIONS_ALL, &region_ids,
+                            &nr_areas, &nr_regions, &max_areas))
+        return NULL;
+
+    for (i = 0; i < nr_regions; i++) {
+        nr_total += nr_areas[i];
+        if ((str = dm_stats_get_region_program_id(dms, region_ids[i])))
+            strings_len += strlen(str) + 1;
+        if ((str = dm_stats_get_region_aux_data(dms, region_ids[i])))
+            strings_len += strlen(str) + 1;
+    }
+
+    size = sizeof(*h) + nr_regions * sizeof(*reg)
+           + nr_total * DM_STATS_NR_COUNTERS * sizeof(uint64_t)
+           + DMPY_SNAPSHOT_ALIGN(strings_len);
+    if (size > (uint64_t) PY_SSIZE_T_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "DmStats snapshot is too "
+                        "large.");
+        goto out;
+    }
+
+    if (!(bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t) size)))
+        goto out;
+    h = (struct dmpy_snapshot_header *) PyBytes_AS_STRING(bytes);
+    memset(h, 0, (size_t) size);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h->magic = DMPY_SNAPSHOT_MAGIC;
+    h->version = DMPY_SNAPSHOT_VERSION;
+    h->size = size;
+    h->timestamp_ns = (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+    h->interval_ns = dm_stats_get_sampling_interval_ns(dms);
+    h->nr_counters = DM_STATS_NR_COUNTERS;
+    h->nr_region_ids = _dmpy_stats_nr_region_ids(dms);
+    h->nr_regions = nr_regions;
+    h->nr_areas = nr_total;
+    h->regions_offset = sizeof(*h);
+    h->counters_offset = h->regions_offset + nr_regions * sizeof(*reg);
+    h->strings_offset = h->counters_offset
+                        + nr_total * DM_STATS_NR_COUNTERS * sizeof(uint64_t);
+    h->strings_len = strings_len;
+
+    reg = (struct dmpy_snapshot_region *) ((char *) h + h->regions_offset);
+    counters = (uint64_t *) ((char *) h + h->counters_offset);
+    for (i = 0, nr_total = 0; i < nr_regions; i++, reg++) {
+        reg->region_id = region_ids[i];
+        dm_stats_get_region_start(dms, &reg->start, region_ids[i]);
+        dm_stats_get_region_len(dms, &reg->len, region_ids[i]);
+        dm_stats_get_region_area_len(dms, &reg->area_len, region_ids[i]);
+        reg->nr_areas = nr_areas[i];
+        reg->first_area = nr_total;
+        reg->group_id = dm_stats_get_group_id(dms, region_ids[i]);
+        reg->program_id = _dmpy_snapshot_add_string(
+            (char *) h + h->strings_offset, &pos,
+            dm_stats_get_region_program_id(dms, region_ids[i]));
+        reg->aux_data = _dmpy_snapshot_add_string(
+            (char *) h + h->strings_offset, &pos,
+            dm_stats_get_region_aux_data(dms, region_ids[i]));
+        if (dm_stats_get_region_precise_timestamps(dms, region_ids[i]))
+            reg->flags |= DMPY_SNAPSHOT_PRECISE;
+
+        for (j = 0; j < nr_areas[i]; j++, counters += DM_STATS_NR_COUNTERS)
+            for (c = 0; c < DM_STATS_NR_COUNTERS; c++)
+                counters[c] = dm_stats_get_counter(dms,
+                                                   (dm_stats_counter_t) c,
+                                                   region_ids[i], j);
+        nr_total += nr_areas[i];
+    }
+
+out:
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return bytes;
+}
+
+typedef struct {
+    PyObject_HEAD
+    const struct dmpy_snapshot_header *sn_header;
+    Py_buffer sn_view; /* from_bytes() source buffer, if sn_view.obj */
+    void *sn_copy; /* aligned copy of an unaligned source buffer */
+    void *sn_map; /* from_mmap() file mapping */
+    size_t sn_map_len;
+} DmStatsSnapshotObject;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *sr_snapshot;
+    const struct dmpy_snapshot_region *sr_region;
+} DmStatsSnapshotRegionObject;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *sa_snapshot;
+    const struct dmpy_snapshot_region *sa_region;
+    uint64_t sa_area_id;
+} DmStatsSnapshotAreaObject;
+
+#define SNAPSHOT_FROM_REGION(r) ((DmStatsSnapshotObject *)((r)->sr_snapshot))
+#define SNAPSHOT_FROM_AREA(a) ((DmStatsSnapshotObject *)((a)->sa_snapshot))
+
+#define DMPY_SNAPSHOT_REGIONS(h) \
+    ((const struct dmpy_snapshot_region *) \
+     ((const char *) (h) + (h)->regions_offset))
+
+#define DMPY_SNAPSHOT_STRING(h, offset) \
+    (((offset) == DMPY_SNAPSHOT_NO_STRING) ? NULL \
+     : (const char *) (h) + (h)->strings_offset + (offset))
+
+/* Return the counters of area_id of reg in the snapshot h. */
+static const uint64_t *
+_dmpy_snapshot_counters(const struct dmpy_snapshot_header *h,
+                        const struct dmpy_snapshot_region *reg,
+                        uint64_t area_id)
+{
+    return (const uint64_t *) ((const char *) h + h->counters_offset)
+           + (reg->first_area + area_id) * DM_STATS_NR_COUNTERS;
+}
+
+/*
+ * Check that the len bytes at h hold a valid snapshot of this version:
+ * every table lies within the buffer, every region's areas and strings
+ * lie within their tables, and nr_region_ids is one more than the last
+ * region_id, as to_bytes() writes it, so that len() and indexing agree
+ * with the regions present.
+ */
+static int
+_DmStatsSnapshot_check(const struct dmpy_snapshot_header *h, uint64_t len)
+{
+    const struct dmpy_snapshot_region *reg;
+    const char *strings;
+    uint64_t i, nr_areas = 0;
+
+    if (len < sizeof(*h)) {
+        PyErr_SetString(PyExc_ValueError, "Buffer is too short for a "
+                        "DmStats snapshot.");
+        return -1;
+    }
+    if (h->magic != DMPY_SNAPSHOT_MAGIC) {
+        PyErr_SetString(PyExc_ValueError, "Not a DmStats snapshot (bad "
+                        "magic or byte order).");
+        return -1;
+    }
+    if (h->version != DMPY_SNAPSHOT_VERSION) {
+        PyErr_Format(PyExc_ValueError, "Unsupported DmStats snapshot "
+                     "version: " FMTu64, h->version);
+        return -1;
+    }
+
+    if ((h->size > len) || (h->size % 8)
+        || (h->nr_counters != DM_STATS_NR_COUNTERS)
+        || (h->nr_region_ids > (uint64_t) PY_SSIZE_T_MAX)
+        || (h->regions_offset != sizeof(*h))
+        || (h->nr_regions > (h->size / sizeof(*reg)))
+        || (h->counters_offset != h->regions_offset
+                                  + h->nr_regions * sizeof(*reg))
+        || (h->nr_areas > (h->size / (DM_STATS_NR_COUNTERS * 8)))
+        || (h->strings_offset != h->counters_offset
+                                 + h->nr_areas * DM_STATS_NR_COUNTERS * 8)
+        || (h->strings_offset > h->size)
+        || (h->strings_len > h->size - h->strings_offset))
+        goto bad;
+
+    strings = (const char *) h + h->strings_offset;
+    if (h->strings_len && strings[h->strings_len - 1])
+        goto bad;
+
+    reg = DMPY_SNAPSHOT_REGIONS(h);
+    for (i = 0; i < h->nr_regions; i++, reg++) {
+        if ((i && (reg->region_id <= reg[-1].region_id))
+            || (reg->region_id >= h->nr_region_ids)
+            || (reg->first_area != nr_areas)
+            || (reg->nr_areas > h->nr_areas - nr_areas))
+            goto bad;
+        if (((reg->program_id != DMPY_SNAPSHOT_NO_STRING)
+             && (reg->program_id >= h->strings_len))
+            || ((reg->aux_data != DMPY_SNAPSHOT_NO_STRING)
+                && (reg->aux_data >= h->strings_len)))
+            goto bad;
+        nr_areas += reg->nr_areas;
+    }
+    if ((nr_areas != h->nr_areas)
+        || (h->nr_region_ids != (h->nr_regions ? reg[-1].region_id + 1 : 0)))
+        goto bad;
+    return 0;
+
+bad:
+    PyErr_SetString(PyExc_ValueError, "Corrupt DmStats snapshot.");
+    return -1;
+}
+
+static void
+DmStatsSnapshot_dealloc(DmStatsSnapshotObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->sn_view.obj)
+        PyBuffer_Release(&self->sn_view);
+    PyMem_Free(self->sn_copy);
+    if (self->sn_map)
+        munmap(self->sn_map, self->sn_map_len);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static DmStatsSnapshotObject *
+_newDmStatsSnapshotObject(PyObject *cls)
+{
+    dmpy_state *st = _dmpy_state_by_type((PyTypeObject *) cls);
+    DmStatsSnapshotObject *snap;
+
+    if (!(snap = PyObject_New(DmStatsSnapshotObject,
+                              st->DmStatsSnapshot_Type)))
+        return NULL;
+    snap->sn_header = NULL;
+    memset(&snap->sn_view, 0, sizeof(snap->sn_view));
+    snap->sn_copy = NULL;
+    snap->sn_map = NULL;
+    snap->sn_map_len = 0;
+    return snap;
+}
+
+static PyObject *
+DmStatsSnapshot_from_bytes(PyObject *cls, PyObject *args)
+{
+    DmStatsSnapshotObject *snap;
+    const void *buf;
+    PyObject *data;
+
+    if (!PyArg_ParseTuple(args, "O:from_bytes", &data))
+        return NULL;
+
+    if (!(snap = _newDmStatsSnapshotObject(cls)))
+        return NULL;
+
+    if (PyObject_GetBuffer(data, &snap->sn_view, PyBUF_SIMPLE))
+        goto fail;
+
+    buf = snap->sn_view.buf;
+    if ((uintptr_t) buf % 8) {
+        /* The fields are read in place: copy an unaligned buffer. */
+        if (!(snap->sn_copy = PyMem_Malloc(snap->sn_view.len ?
+                                           snap->sn_view.len : 1))) {
+            PyErr_NoMemory();
+            goto fail;
+        }
+        memcpy(snap->sn_copy, buf, snap->sn_view.len);
+        buf = snap->sn_copy;
+    }
+
+    if (_DmStatsSnapshot_check(buf, (uint64_t) snap->sn_view.len))
+        goto fail;
+
+    snap->sn_header = buf;
+    return (PyObject *) snap;
+
+fail:
+    Py_DECREF(snap);
+    return NULL;
+}
+
+static PyObject *
+DmStatsSnapshot_from_mmap(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "offset", NULL};
+    unsigned long long offset = 0;
+    struct dmpy_snapshot_header h;
+    DmStatsSnapshotObject *snap;
+    uint64_t len, map_offset;
+    PyObject *path;
+    struct stat st;
+    ssize_t r;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|K:from_mmap", kwlist,
+                                     PyUnicode_FSConverter, &path, &offset))
+        return NULL;
+
+    if (!(snap = _newDmStatsSnapshotObject(cls)))
+        goto out;
+
+    if ((fd = open(PyBytes_AS_STRING(path), O_RDONLY | O_CLOEXEC)) < 0)
+        goto bad_errno;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        goto bad_errno;
+    }
+    if ((offset % 8) || (offset >= (uint64_t) st.st_size)) {
+        close(fd);
+        PyErr_Format(PyExc_ValueError, "Invalid snapshot offset: %llu",
+                     offset);
+        goto fail;
+    }
+
+    /* Map only the snapshot itself, as its header gives its size, so that
+     * snapshots appended later are not part of the mapping. */
+    len = (uint64_t) st.st_size - offset;
+    do
+        r = pread(fd, &h, sizeof(h), (off_t) offset);
+    while ((r < 0) && (errno == EINTR));
+    if (r < 0) {
+        close(fd);
+        goto bad_errno;
+    }
+    if (((size_t) r == sizeof(h)) && (h.size >= sizeof(h)) && (h.size < len))
+        len = h.size;
+
+    map_offset = offset & ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+    len += offset - map_offset;
+    snap->sn_map = mmap(NULL, (size_t) len, PROT_READ, MAP_SHARED, fd,
+                        (off_t) map_offset);
+    close(fd);
+    if (snap->sn_map == MAP_FAILED) {
+        snap->sn_map = NULL;
+        goto bad_errno;
+    }
+    snap->sn_map_len = (size_t) len;
+
+    if (_DmStatsSnapshot_check((const void *) ((char *) snap->sn_map
+                                               + offset - map_offset),
+                               len - (offset - map_offset)))
+        goto fail;
+
+    snap->sn_header = (const void *) ((char *) snap->sn_map
+                                      + offset - map_offset);
+    goto out;
+
+bad_errno:
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+fail:
+    Py_CLEAR(snap);
+out:
+    Py_DECREF(path);
+    return (PyObject *) snap;
+}
+
+#define DmStatsSnapshot_CheckInit(o, ret)                               \
+do {                                                                    \
+    if (!(o)->sn_header) {                                              \
+        PyErr_SetString(PyExc_ValueError, "DmStatsSnapshot has no data: " \
+                        "use from_bytes() or from_mmap().");            \
+        return ret;                                                     \
+    }                                                                   \
+} while (0)
+
+/*
+ * Return the snapshot region for region_id, or NULL if it is not
+ * present. Regions are stored in region_id order.
+ */
+static const struct dmpy_snapshot_region *
+_DmStatsSnapshot_find_region(DmStatsSnapshotObject *self, uint64_t region_id)
+{
+    const struct dmpy_snapshot_region *regions;
+    uint64_t lo = 0, hi = self->sn_header->nr_regions, mid;
+
+    regions = DMPY_SNAPSHOT_REGIONS(self->sn_header);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (regions[mid].region_id == region_id)
+            return &regions[mid];
+        if (regions[mid].region_id < region_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static Py_ssize_t
+DmStatsSnapshot_len(PyObject *o)
+{
+    DmStatsSnapshotObject *self = (DmStatsSnapshotObject *) o;
+
+    DmStatsSnapshot_CheckInit(self, -1);
+    return (Py_ssize_t) self->sn_header->nr_region_ids;
+}
+
+static PyObject *
+DmStatsSnapshot_get_item(PyObject *o, Py_ssize_t i)
+{
+    DmStatsSnapshotObject *self = (DmStatsSnapshotObject *) o;
+    DmStatsSnapshotRegionObject *region;
+    const struct dmpy_snapshot_region *reg;
+
+    DmStatsSnapshot_CheckInit(self, NULL);
+
+    if ((i < 0) || ((uint64_t) i >= self->sn_header->nr_region_ids)) {
+        PyErr_SetString(PyExc_IndexError, "DmStatsSnapshot region_id out "
+                        "of range");
+        return NULL;
+    }
+
+    if (!(reg = _DmStatsSnapshot_find_region(self, (uint64_t) i))) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    if (!(region = PyObject_New(DmStatsSnapshotRegionObject,
+                                DMPY_STATE(o)->DmStatsSnapshotRegion_Type)))
+        return NULL;
+    Py_INCREF(o);
+    region->sr_snapshot = o;
+    region->sr_region = reg;
+    return (PyObject *) region;
+}
+
+
+/*
+ * Build a new DmStatsCounters of the counters of the snapshot regions
+ * regs[nr_regions], exported as for DmStats.counters() if all is set, or
+ * as for DmStatsRegion.counters() otherwise.
+ */
+static PyObject *
+_DmStatsSnapshot_counters(DmStatsSnapshotObject *self,
+                          const struct dmpy_snapshot_region *regs,
+                          uint64_t nr_regions, int all)
+{
+    DmStatsCountersObject *counters = NULL;
+    uint64_t *region_ids, *nr_areas, i, max_areas = 0;
+
+    region_ids = PyMem_Malloc(sizeof(*region_ids) * (nr_regions + 1));
+    nr_areas = PyMem_Malloc(sizeof(*nr_areas) * (nr_regions + 1));
+    if (!region_ids || !nr_areas) {
+        PyErr_NoMemory();
+        goto out;
+    }
+
+    for (i = 0; i < nr_regions; i++) {
+        region_ids[i] = regs[i].region_id;
+        nr_areas[i] = regs[i].nr_areas;
+        if (nr_areas[i] > max_areas)
+            max_areas = nr_areas[i];
+    }
+
+    counters = _newDmStatsCountersObject(DMPY_STATE(self), region_ids,
+                                         nr_areas, nr_regions, max_areas, all);
+    if (!counters)
+        goto out;
+
+    for (i = 0; i < nr_regions; i++)
+        memcpy(counters->dc_counters + i * max_areas * DM_STATS_NR_COUNTERS,
+               _dmpy_snapshot_counters(self->sn_header, &regs[i], 0),
+               regs[i].nr_areas * DM_STATS_NR_COUNTERS * sizeof(uint64_t));
+
+out:
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return (PyObject *) counters;
+}
+
+static PyObject *
+DmStatsSnapshot_counters(DmStatsSnapshotObject *self, PyObject *args)
+{
+    DmStatsSnapshot_CheckInit(self, NULL);
+    return _DmStatsSnapshot_counters(self,
+                                     DMPY_SNAPSHOT_REGIONS(self->sn_header),
+                                     self->sn_header->nr_regions, 1);
+}
+
+static PyObject *
+DmStatsSnapshot_to_bytes(DmStatsSnapshotObject *self, PyObject *args)
+{
+    DmStatsSnapshot_CheckInit(self, NULL);
+    return PyBytes_FromStringAndSize((const char *) self->sn_header,
+                                     (Py_ssize_t) self->sn_header->size);
+}
+
+#define MkDmStatsSnapshot_header_getter(name, field)                         \
+static PyObject *                                                            \
+DmStatsSnapshot_ ## name ## _getter(DmStatsSnapshotObject *self, void *arg)  \
+{                                                                            \
+    DmStatsSnapshot_CheckInit(self, NULL);                                   \
+    return PyLong_FromUnsignedLongLong(self->sn_header->field);              \
+}
+
+MkDmStatsSnapshot_header_getter(size, size)
+MkDmStatsSnapshot_header_getter(timestamp_ns, timestamp_ns)
+MkDmStatsSnapshot_header_getter(nr_areas, nr_areas)
+MkDmStatsSnapshot_header_getter(nr_regions, nr_regions)
+
+static PyObject *
+DmStatsSnapshot_interval_getter(DmStatsSnapshotObject *self, void *arg)
+{
+    DmStatsSnapshot_CheckInit(self, NULL);
+    return PyFloat_FromDouble((double) self->sn_header->interval_ns
+                              / (double) NSEC_PER_SEC);
+}
+
+#define DMSTATSSNAPSHOT_from_bytes__doc__ \
+"Return a DmStatsSnapshot over data, a bytes-like object holding a\n"   \
+"snapshot returned by DmStats.to_bytes(). The snapshot reads the data\n" \
+"in place and keeps a reference to it."
+
+#define DMSTATSSNAPSHOT_from_mmap__doc__ \
+"Map the snapshot at offset in the file at path read-only and return a\n" \
+"DmStatsSnapshot over it. A history file is a sequence of to_bytes()\n"   \
+"snapshots: the next snapshot of a history starts at offset + size.\n"   \
+"Only the snapshot itself is mapped, and it is read in place: history\n"  \
+"files must only ever be appended to, since a snapshot that is rewritten\n" \
+"or truncated while it is mapped is not checked again."
+
+#define DMSTATSSNAPSHOT_counters__doc__ \
+"Return a DmStatsCounters of the counters in this snapshot, laid out as\n" \
+"for DmStats.counters()."
+
+#define DMSTATSSNAPSHOT_to_bytes__doc__ \
+"Return a copy of the snapshot data as bytes."
+
+#define DMSTATSSNAPSHOT_size_gets__doc__ \
+"The size in bytes of this snapshot."
+
+#define DMSTATSSNAPSHOT_timestamp_ns_gets__doc__ \
+"The CLOCK_REALTIME time at which the snapshot was taken, in ns."
+
+#define DMSTATSSNAPSHOT_nr_areas_gets__doc__ \
+"The number of areas in all regions of this snapshot."
+
+#define DMSTATSSNAPSHOT_nr_regions_gets__doc__ \
+"The number of regions present in this snapshot."
+
+#define DMSTATSSNAPSHOT_interval_gets__doc__ \
+"The sampling interval of the DmStats object at the time of the\n" \
+"snapshot, in seconds. Used to derive metric values."
+
+static PyMethodDef DmStatsSnapshot_methods[] = {
+    {"from_bytes", (PyCFunction)DmStatsSnapshot_from_bytes,
+        METH_VARARGS | METH_CLASS,
+        PyDoc_STR(DMSTATSSNAPSHOT_from_bytes__doc__)},
+    {"from_mmap", (PyCFunction)DmStatsSnapshot_from_mmap,
+        METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+        PyDoc_STR(DMSTATSSNAPSHOT_from_mmap__doc__)},
+    {"counters", (PyCFunction)DmStatsSnapshot_counters, METH_NOARGS,
+        PyDoc_STR(DMSTATSSNAPSHOT_counters__doc__)},
+    {"to_bytes", (PyCFunction)DmStatsSnapshot_to_bytes, METH_NOARGS,
+        PyDoc_STR(DMSTATSSNAPSHOT_to_bytes__doc__)},
+    {NULL, NULL}
+};
+
+static PyGetSetDef DmStatsSnapshot_getsets[] = {
+    {"size", (getter)DmStatsSnapshot_size_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOT_size_gets__doc__), NULL},
+    {"timestamp_ns", (getter)DmStatsSnapshot_timestamp_ns_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOT_timestamp_ns_gets__doc__), NULL},
+    {"nr_areas", (getter)DmStatsSnapshot_nr_areas_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOT_nr_areas_gets__doc__), NULL},
+    {"nr_regions", (getter)DmStatsSnapshot_nr_regions_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOT_nr_regions_gets__doc__), NULL},
+    {"interval", (getter)DmStatsSnapshot_interval_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOT_interval_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+#define DMSTATSSNAPSHOT__doc__ \
+"A read-only snapshot of the regions and counters of a DmStats object,\n" \
+"created by DmStatsSnapshot.from_bytes() or DmStatsSnapshot.from_mmap()\n" \
+"from the data returned by DmStats.to_bytes().\n\n"                       \
+"A snapshot is a sequence of DmStatsSnapshotRegion objects indexed by\n" \
+"region_id, as for DmStats, and each region is a sequence of\n"          \
+"DmStatsSnapshotArea objects with the counter and metric attributes of\n" \
+"DmStatsArea. Values are read directly from the snapshot buffer."
+
+static PyType_Slot DmStatsSnapshot_slots[] = {
+    {Py_tp_dealloc, DmStatsSnapshot_dealloc},
+    {Py_tp_doc, DMSTATSSNAPSHOT__doc__},
+    {Py_sq_length, DmStatsSnapshot_len},
+    {Py_sq_item, DmStatsSnapshot_get_item},
+    {Py_tp_methods, DmStatsSnapshot_methods},
+    {Py_tp_getset, DmStatsSnapshot_getsets},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsSnapshot_spec = {
+    "dmpy.DmStatsSnapshot",     /*name*/
+    sizeof(DmStatsSnapshotObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmStatsSnapshot_slots,      /*slots*/
+};
+
+static void
+DmStatsSnapshotRegion_dealloc(DmStatsSnapshotRegionObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    Py_XDECREF(self->sr_snapshot);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static Py_ssize_t
+DmStatsSnapshotRegion_len(PyObject *o)
+{
+    return (Py_ssize_t) ((DmStatsSnapshotRegionObject *) o)
+                            ->sr_region->nr_areas;
+}
+
+static PyObject *
+DmStatsSnapshotRegion_get_item(PyObject *o, Py_ssize_t j)
+{
+    DmStatsSnapshotRegionObject *self = (DmStatsSnapshotRegionObject *) o;
+    DmStatsSnapshotAreaObject *area;
+
+    if ((j < 0) || ((uint64_t) j >= self->sr_region->nr_areas)) {
+        PyErr_SetString(PyExc_IndexError, "DmStatsSnapshotRegion area_id "
+                        "out of range");
+        return NULL;
+    }
+
+    if (!(area = PyObject_New(DmStatsSnapshotAreaObject,
+                              DMPY_STATE(o)->DmStatsSnapshotArea_Type)))
+        return NULL;
+    Py_INCREF(self->sr_snapshot);
+    area->sa_snapshot = self->sr_snapshot;
+    area->sa_region = self->sr_region;
+    area->sa_area_id = (uint64_t) j;
+    return (PyObject *) area;
+}
+
+
+static PyObject *
+DmStatsSnapshotRegion_counters(DmStatsSnapshotRegionObject *self,
+                               PyObject *args)
+{
+    return _DmStatsSnapshot_counters(SNAPSHOT_FROM_REGION(self),
+                                     self->sr_region, 1, 0);
+}
+
+#define MkDmStatsSnapshotRegion_getter(name)                                 \
+static PyObject *                                                            \
+DmStatsSnapshotRegion_ ## name ## _getter(DmStatsSnapshotRegionObject *self, \
+                                          void *arg)                         \
+{                                                                            \
+    return PyLong_FromUnsignedLongLong(self->sr_region->name);               \
+}
+
+MkDmStatsSnapshotRegion_getter(region_id)
+MkDmStatsSnapshotRegion_getter(start)
+MkDmStatsSnapshotRegion_getter(len)
+MkDmStatsSnapshotRegion_getter(area_len)
+MkDmStatsSnapshotRegion_getter(nr_areas)
+
+static PyObject *
+DmStatsSnapshotRegion_group_id_getter(DmStatsSnapshotRegionObject *self,
+                                      void *arg)
+{
+    if (self->sr_region->group_id == DM_STATS_GROUP_NOT_PRESENT) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyLong_FromUnsignedLongLong(self->sr_region->group_id);
+}
+
+static PyObject *
+DmStatsSnapshotRegion_precise_timestamps_getter(
+    DmStatsSnapshotRegionObject *self, void *arg)
+{
+    return PyBool_FromLong(self->sr_region->flags & DMPY_SNAPSHOT_PRECISE);
+}
+
+static PyObject *
+DmStatsSnapshotRegion_program_id_getter(DmStatsSnapshotRegionObject *self,
+                                        void *arg)
+{
+    return Py_BuildValue("z", DMPY_SNAPSHOT_STRING(
+                         SNAPSHOT_FROM_REGION(self)->sn_header,
+                         self->sr_region->program_id));
+}
+
+static PyObject *
+DmStatsSnapshotRegion_aux_data_getter(DmStatsSnapshotRegionObject *self,
+                                      void *arg)
+{
+    return Py_BuildValue("z", DMPY_SNAPSHOT_STRING(
+                         SNAPSHOT_FROM_REGION(self)->sn_header,
+                         self->sr_region->aux_data));
+}
+
+#define DMSTATSSNAPSHOTREG_group_id_gets__doc__ \
+"The group_id of the group containing this region, or None."
+
+static PyMethodDef DmStatsSnapshotRegion_methods[] = {
+    {"counters", (PyCFunction)DmStatsSnapshotRegion_counters, METH_NOARGS,
+        PyDoc_STR(DMSTATSREG_counters__doc__)},
+    {NULL, NULL}
+};
+
+static PyGetSetDef DmStatsSnapshotRegion_getsets[] = {
+    {"region_id", (getter)DmStatsSnapshotRegion_region_id_getter, NULL,
+      PyDoc_STR("The region identifier of this region."), NULL},
+    {"nr_areas", (getter)DmStatsSnapshotRegion_nr_areas_getter, NULL,
+      PyDoc_STR(DMSTATSREG_nr_areas_gets__doc__), NULL},
+    {"precise_timestamps",
+      (getter)DmStatsSnapshotRegion_precise_timestamps_getter, NULL,
+      PyDoc_STR(DMSTATSREG_precise_timestamps_gets__doc__), NULL},
+    {"start", (getter)DmStatsSnapshotRegion_start_getter, NULL,
+      PyDoc_STR(DMSTATSREG_start_gets__doc__), NULL},
+    {"len", (getter)DmStatsSnapshotRegion_len_getter, NULL,
+      PyDoc_STR(DMSTATSREG_len_gets__doc__), NULL},
+    {"area_len", (getter)DmStatsSnapshotRegion_area_len_getter, NULL,
+      PyDoc_STR(DMSTATSREG_area_len_gets__doc__), NULL},
+    {"program_id", (getter)DmStatsSnapshotRegion_program_id_getter, NULL,
+      PyDoc_STR(DMSTATSREG_program_id_gets__doc__), NULL},
+    {"aux_data", (getter)DmStatsSnapshotRegion_aux_data_getter, NULL,
+      PyDoc_STR(DMSTATSREG_aux_data_gets__doc__), NULL},
+    {"group_id", (getter)DmStatsSnapshotRegion_group_id_getter, NULL,
+      PyDoc_STR(DMSTATSSNAPSHOTREG_group_id_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+#define DMSTATSSNAPSHOTREG__doc__ \
+"A region of a DmStatsSnapshot: a sequence of DmStatsSnapshotArea\n" \
+"objects with the attributes of DmStatsRegion."
+
+static PyType_Slot DmStatsSnapshotRegion_slots[] = {
+    {Py_tp_dealloc, DmStatsSnapshotRegion_dealloc},
+    {Py_tp_doc, DMSTATSSNAPSHOTREG__doc__},
+    {Py_sq_length, DmStatsSnapshotRegion_len},
+    {Py_sq_item, DmStatsSnapshotRegion_get_item},
+    {Py_tp_methods, DmStatsSnapshotRegion_methods},
+    {Py_tp_getset, DmStatsSnapshotRegion_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsSnapshotRegion_spec = {
+    "dmpy.DmStatsSnapshotRegion", /*name*/
+    sizeof(DmStatsSnapshotRegionObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsSnapshotRegion_slots, /*slots*/
+};
+
+static void
+DmStatsSnapshotArea_dealloc(DmStatsSnapshotAreaObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    Py_XDECREF(self->sa_snapshot);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static PyObject *
+DmStatsSnapshotArea_start_getter(DmStatsSnapshotAreaObject *self, void *arg)
+{
+    return PyLong_FromUnsignedLongLong(self->sa_region->start
+                                       + self->sa_area_id
+                                       * self->sa_region->area_len);
+}
+
+static PyObject *
+DmStatsSnapshotArea_offset_getter(DmStatsSnapshotAreaObject *self, void *arg)
+{
+    return PyLong_FromUnsignedLongLong(self->sa_area_id
+                                       * self->sa_region->area_len);
+}
+
+static PyObject *
+DmStatsSnapshotArea_len_getter(DmStatsSnapshotAreaObject *self, void *arg)
+{
+    return PyLong_FromUnsignedLongLong(self->sa_region->area_len);
+}
+
+static PyObject *
+DmStatsSnapshotArea_region_getter(DmStatsSnapshotAreaObject *self, void *arg)
+{
+    return DmStatsSnapshot_get_item(self->sa_snapshot,
+                                    (Py_ssize_t) self->sa_region->region_id);
+}
+
+static PyObject *
+DmStatsSnapshotArea_counter_getter(DmStatsSnapshotAreaObject *self,
+                                   void *arg)
+{
+    dm_stats_counter_t counter = (dm_stats_counter_t) arg;
+    const uint64_t *c;
+
+    c = _dmpy_snapshot_counters(SNAPSHOT_FROM_AREA(self)->sn_header,
+                                self->sa_region, self->sa_area_id);
+    return PyLong_FromUnsignedLongLong(c[counter]);
+}
+
+static PyObject *
+DmStatsSnapshotArea_metric_getter(DmStatsSnapshotAreaObject *self, void *arg)
+{
+    dm_stats_metric_t metric = (dm_stats_metric_t) arg;
+    const struct dmpy_snapshot_header *h;
+
+    h = SNAPSHOT_FROM_AREA(self)->sn_header;
+    if (!h->interval_ns) {
+        PyErr_SetString(PyExc_ValueError, "Snapshot has no sampling "
+                        "interval.");
+        return NULL;
+    }
+    return PyFloat_FromDouble(_dmpy_stats_counters_metric(
+        _dmpy_snapshot_counters(h, self->sa_region, self->sa_area_id),
+        h->interval_ns, metric));
+}
+
+static PyMemberDef DmStatsSnapshotArea_members[] = {
+    {"area_id", T_ULONGLONG, offsetof(DmStatsSnapshotAreaObject, sa_area_id),
+     READONLY, PyDoc_STR("The area identifier of this area.")},
+    {NULL}
+};
+
+#define COUNTER_AS_VOID(c) ((void *)(c))
+#define METRIC_AS_VOID(c) ((void *)(c))
+static PyGetSetDef DmStatsSnapshotArea_getsets[] = {
+    {"start", (getter)DmStatsSnapshotArea_start_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_start_gets__doc__), NULL},
+    {"offset", (getter)DmStatsSnapshotArea_offset_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_offset_gets__doc__), NULL},
+    {"len", (getter)DmStatsSnapshotArea_len_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_len_gets__doc__), NULL},
+    {"region", (getter)DmStatsSnapshotArea_region_getter, NULL,
+      PyDoc_STR(DMSTATSAREA_region_gets__doc__), NULL},
+    {"READS_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(0)},
+    {"READS_MERGED_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(1)},
+    {"READ_SECTORS_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(2)},
+    {"READ_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(3)},
+    {"WRITES_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(4)},
+    {"WRITES_MERGED_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(5)},
+    {"WRITE_SECTORS_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(6)},
+    {"WRITE_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(7)},
+    {"IO_IN_PROGRESS_COUNT", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(8)},
+    {"IO_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(9)},
+    {"WEIGHTED_IO_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(10)},
+    {"TOTAL_READ_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(11)},
+    {"TOTAL_WRITE_NSECS", (getter)DmStatsSnapshotArea_counter_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(12)},
+    {"RD_MERGES_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(0)},
+    {"WR_MERGES_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(1)},
+    {"READS_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(2)},
+    {"WRITES_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(3)},
+    {"READ_SECTORS_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(4)},
+    {"WRITE_SECTORS_PER_SEC", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(5)},
+    {"AVERAGE_REQUEST_SIZE", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(6)},
+    {"AVERAGE_QUEUE_SIZE", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(7)},
+    {"AVERAGE_WAIT_TIME", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(8)},
+    {"AVERAGE_RD_WAIT_TIME", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(9)},
+    {"AVERAGE_WR_WAIT_TIME", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(10)},
+    {"SERVICE_TIME", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(11)},
+    {"THROUGHPUT", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(12)},
+    {"UTILIZATION", (getter)DmStatsSnapshotArea_metric_getter,
+      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(13)},
+    {NULL, NULL}
+};
+#undef COUNTER_AS_VOID
+#undef METRIC_AS_VOID
+
+#define DMSTATSSNAPSHOTAREA__doc__ \
+"An area of a DmStatsSnapshotRegion, with the counter and metric\n"   \
+"attributes of DmStatsArea. Metrics are derived from the snapshot's\n" \
+"counters and sampling interval as for DmStatsCounters.rates()."
+
+static PyType_Slot DmStatsSnapshotArea_slots[] = {
+    {Py_tp_dealloc, DmStatsSnapshotArea_dealloc},
+    {Py_tp_doc, DMSTATSSNAPSHOTAREA__doc__},
+    {Py_tp_members, DmStatsSnapshotArea_members},
+    {Py_tp_getset, DmStatsSnapshotArea_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsSnapshotArea_spec = {
+    "dmpy.DmStatsSnapshotArea", /*name*/
+    sizeof(DmStatsSnapshotAreaObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmStatsSnapshotArea_slots,  /*slots*/
+};
+
+/*
+ * DmStatsSampler and DmStatsRing objects.
+ *
+ * A DmStatsSampler owns a DmStats handle and populates it on a native
+ * thread once per sampling interval, publishing each set of counters into
+ * a ring of fixed-layout snapshots in a shared file mapping (normally a
+ * file in /dev/shm). A DmStatsRing attaches to the same file read-only
+ * from any process and reads the snapshots without issuing an ioctl, so
+ * one ioctl stream can serve any number of consumers.
+ *
+ * The mapping starts with a struct dmpy_ring_header, followed by the
+ * region_id and area count of each row, followed by nr_slots slots. Each
+ * slot is a struct dmpy_ring_slot and a (nr_regions, max_areas,
+ * NR_COUNTERS) array of uint64_t counters laid out as for
+ * DmStats.counters(). The layout is fixed when the sampler is created;
+ * regions created later are not sampled, and regions deleted later read
+ * as zero.
+ *
+ * Each slot is protected by a sequence lock: the writer makes the slot's
+ * sequence odd, writes the slot, and makes it even again before
+ * advancing the header's head count. A reader retries any copy during
+ * which the sequence was odd or changed. The sampler thread never touches
+ * a Python object, and the owned DmStats is marked busy while it runs.
+ */
+
+#define DMPY_RING_MAGIC 0x474e495259504d44ULL /* "DMPYRING" */
+#define DMPY_RING_VERSION 1
+#define DMPY_RING_DEFAULT_SLOTS 16
+#define DMPY_RING_READ_RETRIES 1000
+
+struct dmpy_ring_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t nr_counters; /* DM_STATS_NR_COUNTERS */
+    uint64_t nr_regions;
+    uint64_t max_areas;
+    uint64_t nr_slots;
+    uint64_t slot_size; /* bytes in each slot, including its header */
+    uint64_t slots_offset; /* offset of the first slot in the mapping */
+    uint64_t interval_ns; /* configured sampling interval */
+    uint64_t head; /* number of snapshots published */
+    uint64_t nr_errors; /* populate() calls that failed */
+    uint64_t running; /* non-zero while the sampler thread runs */
+};
+
+struct dmpy_ring_slot {
+    uint64_t seq; /* odd while the slot is being written */
+    uint64_t number; /* snapshot number: head before it was published */
+    uint64_t timestamp_ns; /* CLOCK_MONOTONIC time of the snapshot */
+    uint64_t interval_ns; /* time since the previous snapshot, or 0 */
+};
+
+#define DMPY_RING_SLOT(h, n)                                        \
+    ((struct dmpy_ring_slot *) ((char *) (h) + (h)->slots_offset      \
+                                + ((n) % (h)->nr_slots) * (h)->slot_size))
+
+#define DMPY_RING_COUNTERS(s) ((uint64_t *) ((s) + 1))
+
+/* The region_ids[nr_regions] and nr_areas[nr_regions] row tables. */
+#define DMPY_RING_REGION_IDS(h) ((uint64_t *) ((h) + 1))
+#define DMPY_RING_NR_AREAS(h) (DMPY_RING_REGION_IDS(h) + (h)->nr_regions)
+
+/*
+ * Return the size of a ring mapping for the given layout, or 0 if it
+ * would overflow.
+ */
+static uint64_t
+_dmpy_ring_size(uint64_t nr_regions, uint64_t max_areas, uint64_t nr_slots,
+                uint64_t *slot_size, uint64_t *slots_offset)
+{
+    uint64_t nr_values;
+
+    if (max_areas && (nr_regions > UINT64_MAX / max_areas))
+        return 0;
+    nr_values = nr_regions * max_areas;
+    if (nr_values > (UINT64_MAX / 2) / (DM_STATS_NR_COUNTERS * 8))
+        return 0;
+
+    *slot_size = sizeof(struct dmpy_ring_slot)
+                 + nr_values * DM_STATS_NR_COUNTERS * sizeof(uint64_t);
+    *slots_offset = sizeof(struct dmpy_ring_header)
+                    + 2 * nr_regions * sizeof(uint64_t);
+
+    if (!nr_slots || (*slot_size > (UINT64_MAX / 2) / nr_slots))
+        return 0;
+    return *slots_offset + nr_slots * *slot_size;
+}
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *sm_stats; /* the sampled DmStats */
+    PyObject *sm_path;
+    struct dmpy_ring_header *sm_header; /* shared mapping, or NULL */
+    size_t sm_map_len;
+    PyThread_type_lock sm_wake; /* held while running; released to stop */
+    PyThread_type_lock sm_done; /* released when the thread exits */
+    int sm_running;
+    int sm_stop;
+    int sm_last_ok; /* result of the thread's last populate */
+} DmStatsSamplerObject;
+
+
+#define DMSTATS_FROM_SAMPLER(s) ((DmStatsObject *)((s)->sm_stats))
+
+/*
+ * Publish the counters held in dms into the next slot of the ring.
+ */
+static void
+_dmpy_ring_publish(struct dmpy_ring_header *h, struct dm_stats *dms,
+                   uint64_t now, uint64_t *last)
+{
+    uint64_t head = __atomic_load_n(&h->head, __ATOMIC_RELAXED);
+    struct dmpy_ring_slot *slot = DMPY_RING_SLOT(h, head);
+    uint64_t *region_ids = DMPY_RING_REGION_IDS(h);
+    uint64_t *nr_areas = DMPY_RING_NR_AREAS(h);
+    uint64_t *row, i, j, n, seq = slot->seq;
+    int c;
+
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->number = head;
+    slot->timestamp_ns = now;
+    slot->interval_ns = *last ? now - *last : 0;
+    *last = now;
+
+    memset(DMPY_RING_COUNTERS(slot), 0, h->slot_size - sizeof(*slot));
+    for (i = 0; i < h->nr_regions; i++) {
+        if (!dm_stats_region_present(dms, region_ids[i]))
+            continue;
+        n = dm_stats_get_region_nr_areas(dms, region_ids[i]);
+        if (n > nr_areas[i])
+            n = nr_areas[i];
+        row = DMPY_RING_COUNTERS(slot) + i * h->max_areas
+              * DM_STATS_NR_COUNTERS;
+        for (j = 0; j < n; j++, row += DM_STATS_NR_COUNTERS)
+            for (c = 0; c < DM_STATS_NR_COUNTERS; c++)
+                row[c] = dm_stats_get_counter(dms, (dm_stats_counter_t) c,
+                                              region_ids[i], j);
+    }
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The sampler thread: populate the handle and publish a snapshot once per
+ * interval until stopped. Runs without the GIL.
+ */
+static void
+_DmStatsSampler_thread(void *arg)
+{
+    DmStatsSamplerObject *self = arg;
+    struct dmpy_ring_header *h = self->sm_header;
+    struct dm_stats *dms = DMSTATS_FROM_SAMPLER(self)->ds_dms;
+    uint64_t interval = h->interval_ns, last = 0, next, now;
+    PY_TIMEOUT_T timeout;
+    int node_lock, r;
+
+    next = _dmpy_monotonic_ns();
+    for (;;) {
+        node_lock = !_dmpy_control_ready;
+        DMPY_NODE_LOCK(node_lock);
+        r = dm_stats_populate(dms, NULL, DM_STATS_REGIONS_ALL);
+        if (r)
+            _dmpy_control_ready = 1;
+        DMPY_NODE_UNLOCK(node_lock);
+
+        now = _dmpy_monotonic_ns();
+        self->sm_last_ok = r;
+        if (r)
+            _dmpy_ring_publish(h, dms, now, &last);
+        else
+            __atomic_add_fetch(&h->nr_errors, 1, __ATOMIC_RELAXED);
+
+        /* Sleep until the next interval, or until woken by stop(). If a
+         * populate overruns, skip the missed intervals. */
+        next += interval;
+        if (next <= now)
+            next = now + interval - (now - next) % interval;
+        timeout = (PY_TIMEOUT_T) ((next - now) / 1000);
+        if (PyThread_acquire_lock_timed(self->sm_wake, timeout, 0)
+            == PY_LOCK_ACQUIRED) {
+            PyThread_release_lock(self->sm_wake);
+            if (__atomic_load_n(&self->sm_stop, __ATOMIC_ACQUIRE))
+                break;
+        }
+    }
+
+    __atomic_store_n(&h->running, 0, __ATOMIC_RELEASE);
+    PyThread_release_lock(self->sm_done);
+}
+
+/*
+ * Stop the sampler thread and wait for it to exit, then bring the owned
+ * DmStats back into a consistent state: the thread last populated every
+ * region, so the handle is treated exactly as after populate().
+ */
+static int
+_DmStatsSampler_stop(DmStatsSamplerObject *self)
+{
+    DmStatsObject *stats = DMSTATS_FROM_SAMPLER(self);
+
+    if (!self->sm_running)
+        return 0;
+
+    __atomic_store_n(&self->sm_stop, 1, __ATOMIC_RELEASE);
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_release_lock(self->sm_wake);
+    PyThread_acquire_lock(self->sm_done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    self->sm_running = 0;
+    stats->ds_busy = 0;
+
+    stats->ds_table_seq++;
+    if (!self->sm_last_ok) {
+        _DmStats_clear_region_cache(stats);
+        return 0;
+    }
+    stats->ds_counters_seq = stats->ds_table_seq;
+    stats->ds_counters_region = DM_STATS_REGIONS_ALL;
+    return _DmStats_update_region_cache(stats);
+}
+
+static void
+_DmStatsSampler_close(DmStatsSamplerObject *self)
+{
+    if (_DmStatsSampler_stop(self))
+        PyErr_Clear();
+    if (self->sm_header)
+        munmap(self->sm_header, self->sm_map_len);
+    self->sm_header = NULL;
+    if (self->sm_wake)
+        PyThread_free_lock(self->sm_wake);
+    self->sm_wake = NULL;
+    if (self->sm_done)
+        PyThread_free_lock(self->sm_done);
+    self->sm_done = NULL;
+}
+
+static void
+DmStatsSampler_dealloc(DmStatsSamplerObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    _DmStatsSampler_close(self);
+    Py_CLEAR(self->sm_stats);
+    Py_CLEAR(self->sm_path);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+/*
+ * Create and map the ring file at path for the layout of stats. The ring
+ * is built under a temporary name and renamed over path, so a DmStatsRing
+ * still mapping an earlier ring at path keeps reading the old file rather
+ * than faulting on a truncated one.
+ */
+static int
+_DmStatsSampler_map(DmStatsSamplerObject *self, const char *path,
+                    uint64_t nr_slots)
+{
+    DmStatsObject *stats = DMSTATS_FROM_SAMPLER(self);
+    uint64_t *region_ids, *nr_areas, nr_regions, max_areas;
+    uint64_t slot_size, slots_offset, size;
+    struct dmpy_ring_header *h;
+    char *tmp_path = NULL;
+    void *map;
+    int fd, r = -1;
+
+    if (_DmStats_get_layout(stats, DM_STATS_REGIONS_ALL, &region_ids,
+                            &nr_areas, &nr_regions, &max_areas))
+        return -1;
+
+    size = _dmpy_ring_size(nr_regions, max_areas, nr_slots, &slot_size,
+                           &slots_offset);
+    if (!size || (size > (uint64_t) PY_SSIZE_T_MAX)) {
+        PyErr_SetString(PyExc_OverflowError, "Sampler ring is too large.");
+        goto out;
+    }
+
+    if (!(tmp_path = PyMem_Malloc(strlen(path) + sizeof(".XXXXXX")))) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    if ((fd = mkostemp(tmp_path, O_CLOEXEC)) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        goto out;
+    }
+    if ((fchmod(fd, 0644) < 0) || (ftruncate(fd, (off_t) size) < 0)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, tmp_path);
+        close(fd);
+        goto fail_unlink;
+    }
+    map = mmap(NULL, (size_t) size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, tmp_path);
+        goto fail_unlink;
+    }
+
+    h = map;
+    h->version = DMPY_RING_VERSION;
+    h->nr_counters = DM_STATS_NR_COUNTERS;
+    h->nr_regions = nr_regions;
+    h->max_areas = max_areas;
+    h->nr_slots = nr_slots;
+    h->slot_size = slot_size;
+    h->slots_offset = slots_offset;
+    h->interval_ns = dm_stats_get_sampling_interval_ns(stats->ds_dms);
+    memcpy(DMPY_RING_REGION_IDS(h), region_ids,
+           nr_regions * sizeof(*region_ids));
+    memcpy(DMPY_RING_NR_AREAS(h), nr_areas, nr_regions * sizeof(*nr_areas));
+    /* Readers check the magic last. */
+    __atomic_store_n(&h->magic, DMPY_RING_MAGIC, __ATOMIC_RELEASE);
+
+    if (rename(tmp_path, path) < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        munmap(map, (size_t) size);
+        goto fail_unlink;
+    }
+
+    self->sm_header = h;
+    self->sm_map_len = (size_t) size;
+    r = 0;
+    goto out;
+
+fail_unlink:
+    unlink(tmp_path);
+out:
+    PyMem_Free(tmp_path);
+    PyMem_Free(region_ids);
+    PyMem_Free(nr_areas);
+    return r;
+}
+
+static int
+DmStatsSampler_init(DmStatsSamplerObject *self, PyObject *args,
+                    PyObject *kwds)
+{
+    static char *kwlist[] = {"stats", "path", "nr_slots", NULL};
+    unsigned long long nr_slots = DMPY_RING_DEFAULT_SLOTS;
+    DmStatsObject *stats;
+    PyObject *path;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O&|K:__init__", kwlist,
+                                     DMPY_STATE(self)->DmStats_Type, &stats,
+                                     PyUnicode_FSConverter, &path, &nr_slots))
+        return -1;
+
+    _DmStatsSampler_close(self);
+    Py_CLEAR(self->sm_stats);
+    Py_CLEAR(self->sm_path);
+    self->sm_path = path;
+    Py_INCREF(stats);
+    self->sm_stats = (PyObject *) stats;
+
+    DmStats_BusyCheck(stats, -1);
+
+    if (!nr_slots) {
+        PyErr_SetString(PyExc_ValueError, "nr_slots must be at least 1.");
+        return -1;
+    }
+
+    if (!stats->ds_dms || !dm_stats_get_sampling_interval_ns(stats->ds_dms)) {
+        PyErr_SetString(PyExc_ValueError, "DmStats has no sampling "
+                        "interval: call set_sampling_interval() first.");
+        return -1;
+    }
+
+    /* Read the region table that fixes the ring layout. */
+    if (_DmStats_populate(stats, NULL, DM_STATS_REGIONS_ALL))
+        return -1;
+
+    if (!(self->sm_wake = PyThread_allocate_lock())
+        || !(self->sm_done = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    return _DmStatsSampler_map(self, PyBytes_AS_STRING(path),
+                               (uint64_t) nr_slots);
+}
+
+#define DmStatsSampler_ClosedCheck(o, ret)                              \
+do {                                                                    \
+    if (!(o)->sm_header) {                                              \
+        PyErr_SetString(PyExc_ValueError, "DmStatsSampler is closed."); \
+        return ret;                                                     \
+    }                                                                   \
+} while (0)
+
+static PyObject *
+DmStatsSampler_start(DmStatsSamplerObject *self, PyObject *args)
+{
+    DmStatsObject *stats;
+
+    DmStatsSampler_ClosedCheck(self, NULL);
+    stats = DMSTATS_FROM_SAMPLER(self);
+
+    if (self->sm_running) {
+        PyErr_SetString(PyExc_RuntimeError, "DmStatsSampler is already "
+                        "running.");
+        return NULL;
+    }
+    DMPY_BUSY_CLAIM(stats->ds_busy, "DmStats", NULL);
+
+    /* The thread sleeps on sm_wake, which is held until stop(). */
+    PyThread_acquire_lock(self->sm_wake, WAIT_LOCK);
+    PyThread_acquire_lock(self->sm_done, WAIT_LOCK);
+    self->sm_stop = 0;
+    self->sm_last_ok = 0;
+    __atomic_store_n(&self->sm_header->running, 1, __ATOMIC_RELEASE);
+
+    if (PyThread_start_new_thread(_DmStatsSampler_thread, self)
+        == PYTHREAD_INVALID_THREAD_ID) {
+        __atomic_store_n(&self->sm_header->running, 0, __ATOMIC_RELEASE);
+        stats->ds_busy = 0;
+        PyThread_release_lock(self->sm_done);
+        PyThread_release_lock(self->sm_wake);
+        PyErr_SetString(PyExc_RuntimeError, "Failed to start sampler "
+                        "thread.");
+        return NULL;
+    }
+    self->sm_running = 1;
+
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+DmStatsSampler_stop(DmStatsSamplerObject *self, PyObject *args)
+{
+    if (_DmStatsSampler_stop(self))
+        return NULL;
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+DmStatsSampler_close(DmStatsSamplerObject *self, PyObject *args)
+{
+    if (_DmStatsSampler_stop(self))
+        return NULL;
+    _DmStatsSampler_close(self);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+DmStatsSampler_running_getter(DmStatsSamplerObject *self, void *arg)
+{
+    return PyBool_FromLong(self->sm_running);
+}
+
+static PyObject *
+DmStatsSampler_nr_samples_getter(DmStatsSamplerObject *self, void *arg)
+{
+    DmStatsSampler_ClosedCheck(self, NULL);
+    return PyLong_FromUnsignedLongLong(
+        __atomic_load_n(&self->sm_header->head, __ATOMIC_ACQUIRE));
+}
+
+static PyObject *
+DmStatsSampler_nr_errors_getter(DmStatsSamplerObject *self, void *arg)
+{
+    DmStatsSampler_ClosedCheck(self, NULL);
+    return PyLong_FromUnsignedLongLong(
+        __atomic_load_n(&self->sm_header->nr_errors, __ATOMIC_RELAXED));
+}
+
+static PyObject *
+DmStatsSampler_path_getter(DmStatsSamplerObject *self, void *arg)
+{
+    if (!self->sm_path) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyUnicode_DecodeFSDefault(PyBytes_AS_STRING(self->sm_path));
+}
+
+#define DMSTATSSAMPLER_start__doc__ \
+"Start sampling: populate the DmStats object and publish its counters\n" \
+"once per sampling interval on a native thread. The DmStats object is\n" \
+"busy until stop() is called."
+
+#define DMSTATSSAMPLER_stop__doc__ \
+"Stop sampling and wait for the sampler thread to exit. The DmStats\n"   \
+"object may then be used again, and holds the counters of the last\n"   \
+"sample."
+
+#define DMSTATSSAMPLER_close__doc__ \
+"Stop sampling and unmap the ring. The ring file is not removed."
+
+#define DMSTATSSAMPLER_running_gets__doc__ \
+"True while the sampler thread is running."
+
+#define DMSTATSSAMPLER_nr_samples_gets__doc__ \
+"The number of snapshots published into the ring."
+
+#define DMSTATSSAMPLER_nr_errors_gets__doc__ \
+"The number of samples that failed to populate the DmStats object."
+
+#define DMSTATSSAMPLER_path_gets__doc__ \
+"The path of the ring file."
+
+#define DMSTATSSAMPLER_stats_members__doc__ \
+"The DmStats object being sampled."
+
+static PyMethodDef DmStatsSampler_methods[] = {
+    {"start", (PyCFunction)DmStatsSampler_start, METH_NOARGS,
+        PyDoc_STR(DMSTATSSAMPLER_start__doc__)},
+    {"stop", (PyCFunction)DmStatsSampler_stop, METH_NOARGS,
+        PyDoc_STR(DMSTATSSAMPLER_stop__doc__)},
+    {"close", (PyCFunction)DmStatsSampler_close, METH_NOARGS,
+        PyDoc_STR(DMSTATSSAMPLER_close__doc__)},
+    {NULL, NULL}
+};
+
+static PyGetSetDef DmStatsSampler_getsets[] = {
+    {"running", (getter)DmStatsSampler_running_getter, NULL,
+      PyDoc_STR(DMSTATSSAMPLER_running_gets__doc__), NULL},
+    {"nr_samples", (getter)DmStatsSampler_nr_samples_getter, NULL,
+      PyDoc_STR(DMSTATSSAMPLER_nr_samples_gets__doc__), NULL},
+    {"nr_errors", (getter)DmStatsSampler_nr_errors_getter, NULL,
+      PyDoc_STR(DMSTATSSAMPLER_nr_errors_gets__doc__), NULL},
+    {"path", (getter)DmStatsSampler_path_getter, NULL,
+      PyDoc_STR(DMSTATSSAMPLER_path_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsSampler_members[] = {
+    {"stats", T_OBJECT, offsetof(DmStatsSamplerObject, sm_stats), READONLY,
+        PyDoc_STR(DMSTATSSAMPLER_stats_members__doc__)},
+    {NULL}
+};
+
+#define DMSTATSSAMPLER__doc__ \
+"DmStatsSampler(stats, path, nr_slots=16)\n\n"                            \
+"Sample a DmStats object on a native thread and publish the counters\n"  \
+"into a shared ring of snapshots that other processes can read with\n"   \
+"DmStatsRing, without issuing any ioctls of their own.\n\n"              \
+"stats    - A bound DmStats object with a sampling interval set. It\n"   \
+"           is populated once per interval while the sampler runs.\n"    \
+"path     - The file to create for the ring, normally in /dev/shm.\n"   \
+"nr_slots - The number of snapshots kept in the ring.\n\n"               \
+"The layout of the ring is fixed by the regions present when the\n"     \
+"sampler is created."
+
+static PyType_Slot DmStatsSampler_slots[] = {
+    {Py_tp_dealloc, DmStatsSampler_dealloc},
+    {Py_tp_doc, DMSTATSSAMPLER__doc__},
+    {Py_tp_methods, DmStatsSampler_methods},
+    {Py_tp_members, DmStatsSampler_members},
+    {Py_tp_getset, DmStatsSampler_getsets},
+    {Py_tp_init, DmStatsSampler_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsSampler_spec = {
+    "dmpy.DmStatsSampler",      /*name*/
+    sizeof(DmStatsSamplerObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmStatsSampler_slots,       /*slots*/
+};
+
+typedef struct {
+    PyObject_HEAD
+    const struct dmpy_ring_header *rg_header; /* read-only mapping, or NULL */
+    size_t rg_map_len;
+    PyObject *rg_region_ids; /* tuple of the region_id of each row */
+    PyObject *rg_nr_areas; /* tuple of the area count of each row */
+} DmStatsRingObject;
+
+
+static void
+_DmStatsRing_close(DmStatsRingObject *self)
+{
+    if (self->rg_header)
+        munmap((void *) self->rg_header, self->rg_map_len);
+    self->rg_header = NULL;
+}
+
+static void
+DmStatsRing_dealloc(DmStatsRingObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    _DmStatsRing_close(self);
+    Py_CLEAR(self->rg_region_ids);
+    Py_CLEAR(self->rg_nr_areas);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+#define DmStatsRing_ClosedCheck(o, ret)                                 \
+do {                                                                    \
+    if (!(o)->rg_header) {                                              \
+        PyErr_SetString(PyExc_ValueError, "DmStatsRing is closed.");    \
+        return ret;                                                     \
+    }                                                                   \
+} while (0)
+
+/*
+ * Check that the mapping of map_len bytes at h holds a ring of this
+ * version whose layout fits the mapping.
+ */
+static int
+_DmStatsRing_check(const struct dmpy_ring_header *h, size_t map_len)
+{
+    uint64_t slot_size, slots_offset, size;
+
+    if ((map_len < sizeof(*h))
+        || (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != DMPY_RING_MAGIC)
+        || (h->version != DMPY_RING_VERSION)
+        || (h->nr_counters != DM_STATS_NR_COUNTERS))
+        return 0;
+
+    size = _dmpy_ring_size(h->nr_regions, h->max_areas, h->nr_slots,
+                           &slot_size, &slots_offset);
+    return size && (size <= map_len) && (slot_size == h->slot_size)
+           && (slots_offset == h->slots_offset);
+}
+
+static int
+DmStatsRing_init(DmStatsRingObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", NULL};
+    const struct dmpy_ring_header *h;
+    PyObject *path;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&:__init__", kwlist,
+                                     PyUnicode_FSConverter, &path))
+        return -1;
+
+    _DmStatsRing_close(self);
+    Py_CLEAR(self->rg_region_ids);
+    Py_CLEAR(self->rg_nr_areas);
+
+    if ((fd = open(PyBytes_AS_STRING(path), O_RDONLY | O_CLOEXEC)) < 0)
+        goto bad_errno;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        goto bad_errno;
+    }
+    if ((size_t) st.st_size < sizeof(*h)) {
+        close(fd);
+        goto bad_ring;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        goto bad_errno;
+
+    self->rg_header = h = map;
+    self->rg_map_len = (size_t) st.st_size;
+
+    if (!_DmStatsRing_check(h, self->rg_map_len)) {
+        _DmStatsRing_close(self);
+        goto bad_ring;
+    }
+
+    Py_DECREF(path);
+    self->rg_region_ids = _dmpy_uint64_tuple(DMPY_RING_REGION_IDS(h),
+                                             h->nr_regions);
+    self->rg_nr_areas = _dmpy_uint64_tuple(DMPY_RING_NR_AREAS(h),
+                                           h->nr_regions);
+    if (!self->rg_region_ids || !self->rg_nr_areas) {
+        _DmStatsRing_close(self);
+        return -1;
+    }
+    return 0;
+
+bad_errno:
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    Py_DECREF(path);
+    return -1;
+
+bad_ring:
+    PyErr_Format(PyExc_ValueError, "%s is not a DmStatsSampler ring.",
+                 PyBytes_AS_STRING(path));
+    Py_DECREF(path);
+    return -1;
+}
+
+/*
+ * Copy snapshot number from the ring into a new DmStatsCounters, or the
+ * latest snapshot if latest is set. Returns a (number, timestamp_ns,
+ * interval_ns, counters) tuple, None if latest is set and no snapshot has
+ * been published, or NULL with IndexError set if the snapshot is not in
+ * the ring.
+ */
+static PyObject *
+_DmStatsRing_read(DmStatsRingObject *self, uint64_t number, int latest)
+{
+    const struct dmpy_ring_header *h = self->rg_header;
+    const struct dmpy_ring_slot *slot;
+    DmStatsCountersObject *counters;
+    uint64_t head, seq, timestamp = 0, interval = 0;
+    int retries;
+
+    counters = _newDmStatsCountersObject(DMPY_STATE(self),
+                                         DMPY_RING_REGION_IDS(h),
+                                         DMPY_RING_NR_AREAS(h),
+                                         h->nr_regions, h->max_areas, 1);
+    if (!counters)
+        return NULL;
+
+    for (retries = 0; retries < DMPY_RING_READ_RETRIES; retries++) {
+        head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (latest) {
+            if (!head) {
+                Py_DECREF(counters);
+                Py_INCREF(Py_None);
+                return Py_None;
+            }
+            number = head - 1;
+        }
+        if ((number >= head) || (head - number > h->nr_slots))
+            goto not_found;
+
+        slot = DMPY_RING_SLOT(h, number);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        memcpy(counters->dc_counters, DMPY_RING_COUNTERS(slot),
+               h->slot_size - sizeof(*slot));
+        timestamp = slot->timestamp_ns;
+        interval = slot->interval_ns;
+        if (slot->number != number)
+            seq = UINT64_MAX;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            return Py_BuildValue("(KKKN)", number, timestamp, interval,
+                                 (PyObject *) counters);
+        if (!latest && (slot->number != number))
+            goto not_found;
+    }
+
+    Py_DECREF(counters);
+    PyErr_SetString(PyExc_RuntimeError, "Timed out reading DmStatsRing "
+                    "snapshot.");
+    return NULL;
+
+not_found:
+    Py_DECREF(counters);
+    PyErr_Format(PyExc_IndexError, "DmStatsRing snapshot " FMTu64
+                 " is not in the ring.", number);
+    return NULL;
+}
+
+static PyObject *
+DmStatsRing_latest(DmStatsRingObject *self, PyObject *args)
+{
+    DmStatsRing_ClosedCheck(self, NULL);
+    return _DmStatsRing_read(self, 0, 1);
+}
+
+static PyObject *
+DmStatsRing_read(DmStatsRingObject *self, PyObject *args)
+{
+    unsigned long long number;
+
+    DmStatsRing_ClosedCheck(self, NULL);
+
+    if (!PyArg_ParseTuple(args, "K:read", &number))
+        return NULL;
+
+    return _DmStatsRing_read(self, (uint64_t) number, 0);
+}
+
+static PyObject *
+DmStatsRing_close(DmStatsRingObject *self, PyObject *args)
+{
+    _DmStatsRing_close(self);
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#define MkDmStatsRing_header_getter(name, field)                             \
+static PyObject *                                                            \
+DmStatsRing_ ## name ## _getter(DmStatsRingObject *self, void *arg)          \
+{                                                                            \
+    DmStatsRing_ClosedCheck(self, NULL);                                     \
+    return PyLong_FromUnsignedLongLong(                                      \
+        __atomic_load_n(&self->rg_header->field, __ATOMIC_ACQUIRE));         \
+}
+
+MkDmStatsRing_header_getter(nr_samples, head)
+MkDmStatsRing_header_getter(nr_errors, nr_errors)
+MkDmStatsRing_header_getter(nr_slots, nr_slots)
+
+static PyObject *
+DmStatsRing_running_getter(DmStatsRingObject *self, void *arg)
+{
+    DmStatsRing_ClosedCheck(self, NULL);
+    return PyBool_FromLong(__atomic_load_n(&self->rg_header->running,
+                                           __ATOMIC_ACQUIRE) != 0);
+}
+
+static PyObject *
+DmStatsRing_interval_getter(DmStatsRingObject *self, void *arg)
+{
+    DmStatsRing_ClosedCheck(self, NULL);
+    return PyFloat_FromDouble((double) self->rg_header->interval_ns
+                              / (double) NSEC_PER_SEC);
+}
+
+#define DMSTATSRING_latest__doc__ \
+"Return the latest snapshot as a (number, timestamp_ns, interval_ns,\n"  \
+"counters) tuple, or None if no snapshot has been published. counters\n" \
+"is a DmStatsCounters laid out as for DmStats.counters(), timestamp_ns\n" \
+"is the CLOCK_MONOTONIC time of the sample (as for time.monotonic_ns())\n" \
+"and interval_ns the time since the previous sample, or 0 for the\n"     \
+"first."
+
+#define DMSTATSRING_read__doc__ \
+"Return snapshot number as for latest(). Raises IndexError if the\n" \
+"snapshot has not yet been published or has been overwritten."
+
+#define DMSTATSRING_close__doc__ \
+"Unmap the ring."
+
+#define DMSTATSRING_nr_samples_gets__doc__ \
+"The number of snapshots published into the ring."
+
+#define DMSTATSRING_nr_errors_gets__doc__ \
+"The number of samples that failed to populate the sampled DmStats."
+
+#define DMSTATSRING_nr_slots_gets__doc__ \
+"The number of snapshots kept in the ring."
+
+#define DMSTATSRING_running_gets__doc__ \
+"True while the sampler is running."
+
+#define DMSTATSRING_interval_gets__doc__ \
+"The sampling interval of the sampler in seconds."
+
+#define DMSTATSRING_region_ids_members__doc__ \
+"A tuple of the region_id of each row of the snapshots."
+
+#define DMSTATSRING_nr_areas_members__doc__ \
+"A tuple of the area count of each row of the snapshots."
+
+static PyMethodDef DmStatsRing_methods[] = {
+    {"latest", (PyCFunction)DmStatsRing_latest, METH_NOARGS,
+        PyDoc_STR(DMSTATSRING_latest__doc__)},
+    {"read", (PyCFunction)DmStatsRing_read, METH_VARARGS,
+        PyDoc_STR(DMSTATSRING_read__doc__)},
+    {"close", (PyCFunction)DmStatsRing_close, METH_NOARGS,
+        PyDoc_STR(DMSTATSRING_close__doc__)},
+    {NULL, NULL}
+};
+
+static PyGetSetDef DmStatsRing_getsets[] = {
+    {"nr_samples", (getter)DmStatsRing_nr_samples_getter, NULL,
+      PyDoc_STR(DMSTATSRING_nr_samples_gets__doc__), NULL},
+    {"nr_errors", (getter)DmStatsRing_nr_errors_getter, NULL,
+      PyDoc_STR(DMSTATSRING_nr_errors_gets__doc__), NULL},
+    {"nr_slots", (getter)DmStatsRing_nr_slots_getter, NULL,
+      PyDoc_STR(DMSTATSRING_nr_slots_gets__doc__), NULL},
+    {"running", (getter)DmStatsRing_running_getter, NULL,
+      PyDoc_STR(DMSTATSRING_running_gets__doc__), NULL},
+    {"interval", (getter)DmStatsRing_interval_getter, NULL,
+      PyDoc_STR(DMSTATSRING_interval_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmStatsRing_members[] = {
+    {"region_ids", T_OBJECT, offsetof(DmStatsRingObject, rg_region_ids),
+        READONLY, PyDoc_STR(DMSTATSRING_region_ids_members__doc__)},
+    {"nr_areas", T_OBJECT, offsetof(DmStatsRingObject, rg_nr_areas),
+        READONLY, PyDoc_STR(DMSTATSRING_nr_areas_members__doc__)},
+    {NULL}
+};
+
+#define DMSTATSRING__doc__ \
+"DmStatsRing(path)\n\n"                                                   \
+"Attach read-only to the snapshot ring of a DmStatsSampler, which may\n" \
+"be running in another process. Reading snapshots issues no ioctls."
+
+static PyType_Slot DmStatsRing_slots[] = {
+    {Py_tp_dealloc, DmStatsRing_dealloc},
+    {Py_tp_doc, DMSTATSRING__doc__},
+    {Py_tp_methods, DmStatsRing_methods},
+    {Py_tp_members, DmStatsRing_members},
+    {Py_tp_getset, DmStatsRing_getsets},
+    {Py_tp_init, DmStatsRing_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmStatsRing_spec = {
+    "dmpy.DmStatsRing",         /*name*/
+    sizeof(DmStatsRingObject),  /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmStatsRing_slots,          /*slots*/
+};
+
+/*
+ * DmHistogram objects.
+ *
+ * A DmHistogram holds a copy of a set of latency histogram bins: either
+ * bounds only, as built from a bounds specification for use with
+ * DmStats.create_region(), or the bins and counts of a populated area or
+ * region. Bins are laid out as the kernel reports them: one bin below
+ * each boundary and a final, unbounded, bin above the last boundary.
+ *
+ * The bins are exported via the buffer protocol as an (nr_bins, 3) array
+ * of unsigned 64-bit values holding the lower bound, upper bound and
+ * count of each bin, indexed by the HISTOGRAM_LOWER, HISTOGRAM_UPPER and
+ * HISTOGRAM_COUNT constants. The upper bound of the last bin is
+ * UINT64_MAX.
+ */
+
+#define DMHIST_LOWER 0
+#define DMHIST_UPPER 1
+#define DMHIST_COUNT 2
+#define DMHIST_NR_COLUMNS 3
+
+typedef struct {
+    PyObject_HEAD
+    uint64_t *dh_bins; /* nr_bins rows of DMHIST_NR_COLUMNS values */
+    Py_ssize_t dh_shape[2];
+    Py_ssize_t dh_strides[2];
+    uint64_t dh_sum; /* sum of the bin counts */
+} DmHistogramObject;
+
+#define DmHistogramObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmHistogram_Type)
+
+#define DMHIST_NR_BINS(h) ((h)->dh_shape[0])
+#define DMHIST_BIN(h, bin) ((h)->dh_bins + (bin) * DMHIST_NR_COLUMNS)
+
+static void
+DmHistogram_dealloc(DmHistogramObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->dh_bins)
+        PyMem_Free(self->dh_bins);
+    self->dh_bins = NULL;
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+/*
+ * (Re-)size the bin table of self to nr_bins zeroed bins.
+ */
+static int
+_DmHistogram_alloc_bins(DmHistogramObject *self, Py_ssize_t nr_bins)
+{
+    uint64_t *bins;
+
+    bins = PyMem_Calloc(nr_bins * DMHIST_NR_COLUMNS, sizeof(uint64_t));
+    if (!bins) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    PyMem_Free(self->dh_bins);
+    self->dh_bins = bins;
+    self->dh_sum = 0;
+    self->dh_shape[0] = nr_bins;
+    self->dh_shape[1] = DMHIST_NR_COLUMNS;
+    self->dh_strides[1] = sizeof(uint64_t);
+    self->dh_strides[0] = DMHIST_NR_COLUMNS * sizeof(uint64_t);
+    return 0;
+}
+
+/*
+ * Fill the bin table of self from the nr_bounds ascending boundaries in
+ * bounds.
+ */
+static int
+_DmHistogram_set_bounds(DmHistogramObject *self, const uint64_t *bounds,
+                        Py_ssize_t nr_bounds)
+{
+    Py_ssize_t i;
+
+    if (_DmHistogram_alloc_bins(self, nr_bounds + 1))
+        return -1;
+
+    for (i = 0; i <= nr_bounds; i++) {
+        DMHIST_BIN(self, i)[DMHIST_LOWER] = i ? bounds[i - 1] : 0;
+        DMHIST_BIN(self, i)[DMHIST_UPPER] = (i < nr_bounds) ? bounds[i]
+                                                            : UINT64_MAX;
+    }
+    return 0;
+}
+
+/*
+ * Parse a bounds specification into a new array of boundaries: obj may be
+ * a DmHistogram, a bounds string in the format accepted by dmstats, or a
+ * sequence of boundaries in nanoseconds. Boundaries must be non-zero and
+ * strictly increasing. Returns the number of boundaries, or -1 with an
+ * exception set. The array must be released with PyMem_Free().
+ */
+static Py_ssize_t
+_DmHistogram_parse_bounds(dmpy_state *st, PyObject *obj, uint64_t **bounds)
+{
+    struct dm_histogram *dmh;
+    PyObject *seq, *item;
+    Py_ssize_t i, nr_bounds;
+
+    *bounds = NULL;
+
+    if (DmHistogramObject_Check(st, obj)) {
+        DmHistogramObject *hist = (DmHistogramObject *) obj;
+        nr_bounds = DMHIST_NR_BINS(hist) - 1;
+        if (!(*bounds = PyMem_Malloc(sizeof(uint64_t) * (nr_bounds + 1))))
+            goto nomem;
+        for (i = 0; i < nr_bounds; i++)
+            (*bounds)[i] = DMHIST_BIN(hist, i)[DMHIST_UPPER];
+    } else if (PyUnicode_Check(obj)) {
+        const char *str = PyUnicode_AsUTF8(obj);
+        if (!str)
+            return -1;
+        if (!(dmh = dm_histogram_bounds_from_string(str))) {
+            PyErr_Format(PyExc_ValueError, "Invalid histogram bounds: %s",
+                         str);
+            return -1;
+        }
+        nr_bounds = dm_histogram_get_nr_bins(dmh);
+        if (!(*bounds = PyMem_Malloc(sizeof(uint64_t) * (nr_bounds + 1)))) {
+            dm_histogram_bounds_destroy(dmh);
+            goto nomem;
+        }
+        for (i = 0; i < nr_bounds; i++)
+            (*bounds)[i] = dm_histogram_get_bin_upper(dmh, (int) i);
+        dm_histogram_bounds_destroy(dmh);
+    } else {
+        if (!(seq = PySequence_Fast(obj, "Histogram bounds must be a "
+                                    "DmHistogram, string or sequence.")))
+            return -1;
+        nr_bounds = PySequence_Fast_GET_SIZE(seq);
+        if (!(*bounds = PyMem_Malloc(sizeof(uint64_t) * (nr_bounds + 1)))) {
+            Py_DECREF(seq);
+            goto nomem;
+        }
+        for (i = 0; i < nr_bounds; i++) {
+            item = PySequence_Fast_GET_ITEM(seq, i);
+            (*bounds)[i] = PyLong_AsUnsignedLongLong(item);
+            if (PyErr_Occurred()) {
+                Py_DECREF(seq);
+                goto fail;
+            }
+        }
+        Py_DECREF(seq);
+    }
+
+    if (nr_bounds < 1) {
+        PyErr_SetString(PyExc_ValueError, "Histogram bounds must contain "
+                        "at least one boundary.");
+        goto fail;
+    }
+
+    for (i = 0; i < nr_bounds; i++) {
+        if (!(*bounds)[i] || (i && ((*bounds)[i] <= (*bounds)[i - 1]))) {
+            PyErr_SetString(PyExc_ValueError, "Histogram bounds must be "
+                            "non-zero and strictly increasing.");
+            goto fail;
+        }
+    }
+
+    (*bounds)[nr_bounds] = 0;
+    return nr_bounds;
+
+nomem:
+    PyErr_NoMemory();
+fail:
+    PyMem_Free(*bounds);
+    *bounds = NULL;
+    return -1;
+}
+
+/*
+ * Return a new libdevmapper bounds histogram for the bounds specification
+ * in obj, or NULL with an exception set. The caller must release it with
+ * dm_histogram_bounds_destroy().
+ */
+static struct dm_histogram *
+_DmHistogram_bounds_from_object(dmpy_state *st, PyObject *obj)
+{
+    struct dm_histogram *dmh;
+    uint64_t *bounds;
+
+    if (_DmHistogram_parse_bounds(st, obj, &bounds) < 0)
+        return NULL;
+
+    dmh = dm_histogram_bounds_from_uint64(bounds);
+    PyMem_Free(bounds);
+
+    if (!dmh)
+        PyErr_SetString(PyExc_MemoryError, "Failed to allocate histogram "
+                        "bounds.");
+    return dmh;
+}
+
+static int
+DmHistogram_init(DmHistogramObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"bounds", NULL};
+    PyObject *obj;
+    uint64_t *bounds;
+    Py_ssize_t nr_bounds;
+    int r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:__init__", kwlist, &obj))
+        return -1;
+
+    if ((nr_bounds = _DmHistogram_parse_bounds(DMPY_STATE(self), obj,
+                                               &bounds)) < 0)
+        return -1;
+
+    r = _DmHistogram_set_bounds(self, bounds, nr_bounds);
+    PyMem_Free(bounds);
+    return r;
+}
+
+/*
+ * Build a new DmHistogram from the histogram data of area_id in
+ * region_id, or the sum over all areas of the region if area_id is
+ * DM_STATS_AREAS_ALL. Returns None if the region has no histogram.
+ */
+static PyObject *
+newDmHistogramFromStats(DmStatsObject *stats, uint64_t region_id,
+                        uint64_t area_id)
+{
+    struct dm_stats *dms = stats->ds_dms;
+    struct dm_histogram *dmh;
+    DmHistogramObject *hist;
+    uint64_t area, nr_areas, *row;
+    int bin, nr_bins;
+
+    nr_bins = dm_stats_get_region_nr_histogram_bins(dms, region_id);
+    if (nr_bins <= 0)
+        Py_RETURN_NONE;
+
+    if (!_DmStats_have_counters(stats, region_id)) {
+        PyErr_SetString(PyExc_ValueError, "No histogram data: call "
+                        "DmStats.populate() first.");
+        return NULL;
+    }
+
+    if (!(hist = PyObject_New(DmHistogramObject,
+                              DMPY_STATE(stats)->DmHistogram_Type)))
+        return NULL;
+    hist->dh_bins = NULL;
+
+    if (_DmHistogram_alloc_bins(hist, nr_bins))
+        goto fail;
+
+    nr_areas = dm_stats_get_region_nr_areas(dms, region_id);
+    for (area = 0; area < nr_areas; area++) {
+        if ((area_id != DM_STATS_AREAS_ALL) && (area != area_id))
+            continue;
+        if (!(dmh = dm_stats_get_histogram(dms, region_id, area))) {
+            PyErr_SetString(PyExc_OSError, "Failed to get histogram data "
+                            "from device-mapper.");
+            goto fail;
+        }
+        for (bin = 0, row = hist->dh_bins; bin < nr_bins;
+             bin++, row += DMHIST_NR_COLUMNS)
+            row[DMHIST_COUNT] += dm_histogram_get_bin_count(dmh, bin);
+        hist->dh_sum += dm_histogram_get_sum(dmh);
+
+        /* All areas of a region share the same bounds. */
+        for (bin = 0, row = hist->dh_bins; bin < nr_bins;
+             bin++, row += DMHIST_NR_COLUMNS) {
+            row[DMHIST_LOWER] = dm_histogram_get_bin_lower(dmh, bin);
+            row[DMHIST_UPPER] = (bin < nr_bins - 1)
+                                ? dm_histogram_get_bin_upper(dmh, bin)
+                                : UINT64_MAX;
+        }
+    }
+
+    return (PyObject *) hist;
+
+fail:
+    Py_DECREF(hist);
+    return NULL;
+}
+
+/*
+ * Build a new DmHistogram holding the sum of the histograms of the
+ * nr_members regions in members, as for newDmHistogramFromStats(). The
+ * members of a group share histogram bounds: a member with different
+ * bounds raises ValueError. Returns None if the first member has no
+ * histogram.
+ */
+static PyObject *
+newDmHistogramFromGroup(DmStatsObject *stats, const uint64_t *members,
+                        uint64_t nr_members)
+{
+    DmHistogramObject *hist, *member;
+    uint64_t i, *row, *member_row;
+    Py_ssize_t bin;
+
+    if (!nr_members)
+        Py_RETURN_NONE;
+
+    hist = (DmHistogramObject *) newDmHistogramFromStats(stats, members[0],
+                                                         DM_STATS_AREAS_ALL);
+    if (!hist || ((PyObject *) hist == Py_None))
+        return (PyObject *) hist;
+
+    for (i = 1; i < nr_members; i++) {
+        member = (DmHistogramObject *)
+                 newDmHistogramFromStats(stats, members[i],
+                                         DM_STATS_AREAS_ALL);
+        if (!member)
+            goto fail;
+        if (((PyObject *) member == Py_None)
+            || (DMHIST_NR_BINS(member) != DMHIST_NR_BINS(hist)))
+            goto mismatch;
+        for (bin = 0; bin < DMHIST_NR_BINS(hist); bin++) {
+            row = DMHIST_BIN(hist, bin);
+            member_row = DMHIST_BIN(member, bin);
+            if ((row[DMHIST_LOWER] != member_row[DMHIST_LOWER])
+                || (row[DMHIST_UPPER] != member_row[DMHIST_UPPER]))
+                goto mismatch;
+            row[DMHIST_COUNT] += member_row[DMHIST_COUNT];
+        }
+        hist->dh_sum += member->dh_sum;
+        Py_DECREF(member);
+    }
+    return (PyObject *) hist;
+
+mismatch:
+    PyErr_SetString(PyExc_ValueError, "DmStatsGroup members have different "
+                    "histogram bounds.");
+    Py_DECREF(member);
+fail:
+    Py_DECREF(hist);
+    return NULL;
+}
+
+/*
+ * Return the value below which the fraction p (0.0 <= p <= 1.0) of the
+ * samples in self fall, interpolating linearly within the bin containing
+ * it. Values in the final, unbounded, bin are reported as its lower
+ * bound. An empty histogram returns 0.0.
+ */
+static double
+_DmHistogram_percentile(DmHistogramObject *self, double p)
+{
+    double target = p * (double) self->dh_sum, cum = 0.0, count;
+    Py_ssize_t bin, nr_bins = DMHIST_NR_BINS(self);
+    uint64_t *row;
+
+    if (!self->dh_sum)
+        return 0.0;
+
+    for (bin = 0; bin < nr_bins; bin++) {
+        row = DMHIST_BIN(self, bin);
+        count = (double) row[DMHIST_COUNT];
+        if (!count || (cum + count < target)) {
+            cum += count;
+            continue;
+        }
+        if (bin == nr_bins - 1)
+            break;
+        return (double) row[DMHIST_LOWER]
+               + ((target - cum) / count)
+                 * (double) (row[DMHIST_UPPER] - row[DMHIST_LOWER]);
+    }
+    return (double) DMHIST_BIN(self, nr_bins - 1)[DMHIST_LOWER];
+}
+
+static int
+_DmHistogram_parse_percent(PyObject *obj, double *p)
+{
+    *p = PyFloat_AsDouble(obj);
+    if ((*p == -1.0) && PyErr_Occurred())
+        return -1;
+    if ((*p < 0.0) || (*p > 100.0)) {
+        PyErr_SetString(PyExc_ValueError, "Percentile must be between 0 "
+                        "and 100.");
+        return -1;
+    }
+    *p /= 100.0;
+    return 0;
+}
+
+static PyObject *
+DmHistogram_percentile(DmHistogramObject *self, PyObject *args)
+{
+    PyObject *obj;
+    double p;
+
+    if (!PyArg_ParseTuple(args, "O:percentile", &obj))
+        return NULL;
+
+    if (_DmHistogram_parse_percent(obj, &p))
+        return NULL;
+
+    return PyFloat_FromDouble(_DmHistogram_percentile(self, p));
+}
+
+static PyObject *
+DmHistogram_percentiles(DmHistogramObject *self, PyObject *args)
+{
+    PyObject *obj, *seq, *result, *value;
+    Py_ssize_t i, nr_values;
+    double p;
+
+    if (!PyArg_ParseTuple(args, "O:percentiles", &obj))
+        return NULL;
+
+    if (!(seq = PySequence_Fast(obj, "percentiles() requires a sequence.")))
+        return NULL;
+
+    nr_values = PySequence_Fast_GET_SIZE(seq);
+    if (!(result = PyTuple_New(nr_values)))
+        goto out;
+
+    for (i = 0; i < nr_values; i++) {
+        if (_DmHistogram_parse_percent(PySequence_Fast_GET_ITEM(seq, i), &p))
+            goto fail;
+        if (!(value = PyFloat_FromDouble(_DmHistogram_percentile(self, p))))
+            goto fail;
+        PyTuple_SET_ITEM(result, i, value);
+    }
+    goto out;
+
+fail:
+    Py_CLEAR(result);
+out:
+    Py_DECREF(seq);
+    return result;
+}
+
+static int
+DmHistogram_getbuffer(DmHistogramObject *self, Py_buffer *view, int flags)
+{
+    return _dmpy_snapshot_getbuffer((PyObject *) self, view, flags,
+                                    self->dh_bins, "Q", sizeof(uint64_t),
+                                    2, self->dh_shape, self->dh_strides);
+}
+
+
+static Py_ssize_t
+DmHistogram_len(PyObject *o)
+{
+    return DMHIST_NR_BINS((DmHistogramObject *) o);
+}
+
+
+static PyObject *
+DmHistogram_bounds_getter(DmHistogramObject *self, void *arg)
+{
+    PyObject *bounds, *value;
+    Py_ssize_t i, nr_bounds = DMHIST_NR_BINS(self) - 1;
+
+    if (nr_bounds < 0)
+        nr_bounds = 0;
+
+    if (!(bounds = PyTuple_New(nr_bounds)))
+        return NULL;
+
+    for (i = 0; i < nr_bounds; i++) {
+        value = PyLong_FromUnsignedLongLong(DMHIST_BIN(self, i)[DMHIST_UPPER]);
+        if (!value) {
+            Py_DECREF(bounds);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(bounds, i, value);
+    }
+    return bounds;
+}
+
+static PyObject *
+DmHistogram_counts_getter(DmHistogramObject *self, void *arg)
+{
+    PyObject *counts, *value;
+    Py_ssize_t i, nr_bins = DMHIST_NR_BINS(self);
+
+    if (!(counts = PyTuple_New(nr_bins)))
+        return NULL;
+
+    for (i = 0; i < nr_bins; i++) {
+        value = PyLong_FromUnsignedLongLong(DMHIST_BIN(self, i)[DMHIST_COUNT]);
+        if (!value) {
+            Py_DECREF(counts);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(counts, i, value);
+    }
+    return counts;
+}
+
+#define DMHISTOGRAM_percentile__doc__ \
+"Return the latency below which the given percentage (0-100) of the\n"   \
+"samples in this histogram fall, interpolated within the containing\n"  \
+"bin. Samples in the final, unbounded, bin are reported as its lower\n" \
+"bound. An empty histogram returns 0.0."
+
+#define DMHISTOGRAM_percentiles__doc__ \
+"Return a tuple of the percentile() values for each percentage in the\n" \
+"given sequence, for example: hist.percentiles((50, 99, 99.9))."
+
+static PyMethodDef DmHistogram_methods[] = {
+    {"percentile", (PyCFunction)DmHistogram_percentile, METH_VARARGS,
+        PyDoc_STR(DMHISTOGRAM_percentile__doc__)},
+    {"percentiles", (PyCFunction)DmHistogram_percentiles, METH_VARARGS,
+        PyDoc_STR(DMHISTOGRAM_percentiles__doc__)},
+    {NULL, NULL}
+};
+
+#define DMHISTOGRAM_bounds_gets__doc__ \
+"A tuple of the bin boundaries of this histogram in nanoseconds."
+
+#define DMHISTOGRAM_counts_gets__doc__ \
+"A tuple of the count of each bin of this histogram."
+
+static PyGetSetDef DmHistogram_getsets[] = {
+    {"bounds", (getter)DmHistogram_bounds_getter, NULL,
+      PyDoc_STR(DMHISTOGRAM_bounds_gets__doc__), NULL},
+    {"counts", (getter)DmHistogram_counts_getter, NULL,
+      PyDoc_STR(DMHISTOGRAM_counts_gets__doc__), NULL},
+    {NULL, NULL}
+};
+
+static PyMemberDef DmHistogram_members[] = {
+    {"sum", T_ULONGLONG, offsetof(DmHistogramObject, dh_sum),
+     READONLY, PyDoc_STR("The sum of the bin counts of this histogram.")},
+    {NULL}
+};
+
+#define DMHISTOGRAM__doc__ \
+"A device-mapper statistics latency histogram.\n\n"                       \
+"DmHistogram(bounds) builds an empty histogram from a bounds string\n"   \
+"(\"1ms,10ms,100ms\"), a sequence of boundaries in nanoseconds, or\n"    \
+"another DmHistogram, for use with DmStats.create_region(). The\n"      \
+"histogram attributes of DmStatsRegion and DmStatsArea return the\n"    \
+"histogram data of populated regions and areas.\n\n"                    \
+"The bins are exported via the buffer protocol as an (nr_bins, 3)\n"    \
+"array of unsigned 64-bit values indexed by HISTOGRAM_LOWER,\n"         \
+"HISTOGRAM_UPPER and HISTOGRAM_COUNT.\n"
+
+static PyType_Slot DmHistogram_slots[] = {
+    {Py_tp_dealloc, DmHistogram_dealloc},
+    {Py_tp_doc, DMHISTOGRAM__doc__},
+    {Py_sq_length, DmHistogram_len},
+    {Py_bf_getbuffer, DmHistogram_getbuffer},
+    {Py_tp_methods, DmHistogram_methods},
+    {Py_tp_members, DmHistogram_members},
+    {Py_tp_getset, DmHistogram_getsets},
+    {Py_tp_init, DmHistogram_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
+
+static PyType_Spec DmHistogram_spec = {
+    "dmpy.DmHistogram",         /*name*/
+    sizeof(DmHistogramObject),  /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmHistogram_slots,          /*slots*/
+};
+
+/*
+ * dmpy module methods.
+ */
+
+static PyObject *
+_dmpy_get_lib_version(PyObject *self, PyObject *args)
+{
+    char version[64];
+    if (!dm_get_library_version(version, sizeof(version))) {
+        PyErr_SetString(PyExc_OSError, "Failed to get device-mapper "
+                        "library version.");
+        return NULL;
+    } 
+    return Py_BuildValue("s", version);
+}
+
+static PyObject *
+_dmpy_update_nodes(PyObject *self, PyObject *args)
+{
+    dm_task_update_nodes();
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+_dmpy_set_name_mangling_mode(PyObject *self, PyObject *args)
+{
+    int mangle_mode;
+
+    if (!PyArg_ParseTuple(args, "i:set_name_mangling_mode", &mangle_mode))
+        return NULL;
+
+    if ((mangle_mode < 0) || (mangle_mode > DM_STRING_MANGLING_HEX)) {
+        PyErr_SetString(PyExc_ValueError, "Name mangling mode value "
+                        "out of range.");
+        return NULL;
+    }
+
+    if (!dm_set_name_mangling_mode(mangle_mode)) {
+        PyErr_SetString(PyExc_OSError, "Failed to set device-mapper name "
+                        "mangling mode.");
+        return NULL;
+    }
+
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+_dmpy_get_name_mangling_mode(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", dm_get_name_mangling_mode());
+}
+
+static PyObject *
+_dmpy_set_dev_dir(PyObject *self, PyObject *args)
+{
+    char *dir;
+
+    if (!PyArg_ParseTuple(args, "s:set_dev_dir", &dir))
+        goto fail;
+
+    if (dir[0] != '/') {
+        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
+                     "not an absolute name.", dir);
+        goto fail;
+    }
+
+    if (!dm_set_dev_dir(dir)) {
+        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
+                     "name too long.", dir);
+        goto fail;
+    }
+
+    Py_INCREF(Py_True);
+    return Py_True;
+
+fail:
+    return NULL;
+}
+
+static PyObject *
+_dmpy_get_dev_dir(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("s", dm_dir());
+}
+
+static PyObject *
+_dmpy_set_sysfs_dir(PyObject *self, PyObject *args)
+{
+    char *dir;
+
+    if (!PyArg_ParseTuple(args, "s:set_sysfs_dir", &dir))
+        goto fail;
+
+    if (dir[0] != '/') {
+        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
+                     "not an absolute name.", dir);
+        goto fail;
+    }
+
+    if (!dm_set_sysfs_dir(dir)) {
+        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
+                     "name too long.", dir);
+        goto fail;
+    }
+
+    Py_INCREF(Py_True);
+    return Py_True;
+
+fail:
+    return NULL;
+}
+
+static PyObject *
+_dmpy_get_sysfs_dir(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("s", dm_sysfs_dir());
+}
+
+/* Taken from libdm/libdm-common.c */
+#define DM_MAX_UUID_PREFIX_LEN  15
+
+static PyObject *
+_dmpy_set_uuid_prefix(PyObject *self, PyObject *args)
+{
+    char *prefix;
+
+    if (!PyArg_ParseTuple(args, "s:set_uuid_prefix", &prefix))
+        goto fail;
+
+    if (!prefix) {
+        PyErr_SetString(PyExc_ValueError, "New uuid prefix cannot be empty.");
+        goto fail;
+    }
+
+    if (strlen(prefix) > DM_MAX_UUID_PREFIX_LEN) {
+        PyErr_Format(PyExc_ValueError, "New uuid prefix %s too long.", prefix);
+        goto fail;
+    }
+
+    if (!dm_set_uuid_prefix(prefix)) {
+        PyErr_SetString(PyExc_OSError, "Failed to set new uuid prefix.");
+        goto fail;
+    }
+
+    Py_INCREF(Py_True);
+    return Py_True;
+
+fail:
+    return NULL;
+}
+
+static PyObject *
+_dmpy_get_uuid_prefix(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("s", dm_uuid_prefix());
+}
+
+static PyObject *
+_dmpy_is_dm_major(PyObject *self, PyObject *args)
+{
+    int major;
+
+    if (!PyArg_ParseTuple(args, "i:is_dm_major", &major))
+        return NULL;
+
+    if (dm_is_dm_major(major)) {
+        Py_INCREF(Py_True);
+        return Py_True;
+    } else {
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+}
+
+static PyObject *
+_dmpy_lib_release(PyObject *self, PyObject *args)
+{
+    dm_lib_release();
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+_dmpy_hold_control_dev(PyObject *self, PyObject *args)
+{
+    int hold_open;
+    PyObject *ret;
 
-#define DMSTATS_region_nr_areas__doc__ \
-"Return the number of areas present in region_id."
+    if (!PyArg_ParseTuple(args, "i:hold_control_dev", &hold_open))
+        return NULL;
 
-#define DMSTATS_nr_areas__doc__ \
-"Return the number of areas present in this DmStats object."
+    dm_hold_control_dev(hold_open);
 
-#define DMSTATS_group_present__doc__ \
-"Test whether group_id is present in this DmStats object."
+    if (hold_open)
+        ret = Py_True;
+    else
+        ret = Py_False;
+    Py_INCREF(ret);
 
-#define DMSTATS_set_sampling_interval__doc__ \
-"Set the sampling interval for counter data to the specified value in\n" \
-"seconds. Floating point values are permitted.\n\n"                      \
-"The interval is used to calculate time-based metrics from the basic\n"  \
-"counter data: an interval must be set before calling any of the\n"      \
-"metric methods.\n\n"                                                    \
-"For best accuracy the duration should be measured and updated at the\n" \
-"end of each interval.\n\n"                                              \
-"All values are stored internally with nanosecond precision and are\n"   \
-"converted to or from seconds as needed."
+    return ret;
+}
 
-#define DMSTATS_get_sampling_interval__doc__ \
-"Return the currently configured sampling interval in seconds, as a\n"   \
-"Floating point value."
+static PyObject *
+_dmpy_mknodes(PyObject *self, PyObject *args)
+{
+    char *name = NULL;
 
-#define DMSTATS_set_program_id__doc__ \
-"Override program_id. This may be used to change the default\n"          \
-"program_id value for an existing handle. If the allow_empty argument\n" \
-"is non-zero a program_id of None or the empty string is permitted.\n\n" \
-"Use with caution! Most users of the library should set a valid,\n"      \
-"non-NULL program_id for every statistics region created. Failing to\n"  \
-"do so may result in confusing state when multiple programs are\n"       \
-"creating and managing statistics regions.\n\n"                          \
-"All users of the library are encouraged to choose an unambiguous,\n"    \
-"unique program_id: this could be based on PID (for programs that\n"     \
-"create, report, and delete regions in a single process), session id,\n" \
-"executable name, or some other distinguishing string.\n\n"              \
-"Use of the empty string as a program_id does not simplify use of the\n" \
-"library or the command line tools and use of this value is strongly\n"  \
-"discouraged."
+    if (!PyArg_ParseTuple(args, "z:mknodes", &name))
+        goto fail;
 
-#define DMSTATS_list__doc__ \
-"Send a @stats_list message, and parse the result into this DmStats\n"   \
-"object."
+    if (!dm_mknodes(name)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto fail;
+    }
 
-#define DMSTATS_populate__doc__ \
-"Populate this DmStats object with data from device-mapper."
+    Py_INCREF(Py_True);
+    return Py_True;
 
-#define DMSTATS_create_region__doc__ \
-"Create a new statistics region on the device bound to this\n\n"        \
-"DmStats object.\nstart and len specify the region start and length\n"  \
-"512b sectors.\n Passing zero for both start and len will create a\n"   \
-"region spanning the entire device.\n\n"                                \
-"Step determines how to subdivide the region into discrete counter\n"   \
-"sets: a positive value specifies the size of areas into which the\n"   \
-"region should be split while a negative value will split the region\n" \
-"into a number of areas equal to the absolute value of step:\n\n"       \
-"- a region with one area spanning the entire device:\n\n"              \
-"  dms.create_region(dms, 0, 0, -1, p, a);\n\n"                         \
-"- a region with areas of 1MiB:\n\n"                                    \
-"  dms.create_region(dms, 0, 0, 1 << 11, p, a);\n\n"                    \
-"- one 1MiB region starting at 1024 sectors with two areas:\n\n"        \
-"  dms.create_region(dms, 1024, 1 << 11, -2, p, a);\n\n"                \
-"If precise is non-zero attempt to create a region with nanosecond\n"   \
-"precision counters using the kernel precise_timestamps feature.\n\n"   \
-"precise - A flag to request nanosecond precision counters\n"           \
-"to be used for this region.\n"
+fail:
+    return NULL;
+}
 
-#define DMSTATS_delete_region__doc__ \
-"Delete the specified statistics region. This will also mark the\n"     \
-"region as not-present and discard any existing statistics data."
+static PyObject *
+_dmpy_driver_version(PyObject *self, PyObject *args)
+{
+    char version[DMPY_VERSION_BUF_LEN];
+
+    if (!dm_driver_version(version, sizeof(version))) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    return Py_BuildValue("s", version);
+}
+
+static PyObject *
+_dmpy_dump_memory(PyObject *self, PyObject *args)
+{
+    dm_dump_memory();
+    Py_INCREF(Py_True);
+    return Py_True;
+}
+
+static PyObject *
+_dmpy_udev_set_sync_support(PyObject *self, PyObject *args)
+{
+    int sync_with_udev;
+
+    if (!PyArg_ParseTuple(args, "i:udev_set_sync_support", &sync_with_udev))
+        return NULL;
+
+    dm_udev_set_sync_support(sync_with_udev);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+_dmpy_udev_get_sync_support(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", dm_udev_get_sync_support());
+}
+
+static PyObject *
+_dmpy_udev_set_checking(PyObject *self, PyObject *args)
+{
+    int checking;
+
+    if (!PyArg_ParseTuple(args, "i:udev_set_checking", &checking))
+        return NULL;
+
+    dm_udev_set_checking(checking);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+_dmpy_udev_get_checking(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("i", dm_udev_get_checking());
+}
+
+static PyObject *
+_dmpy_cookie_supported(PyObject *self, PyObject *args)
+{
+    PyObject *ret = Py_True;
+    int cookie_supported = dm_cookie_supported();
+    if (!cookie_supported)
+        ret = Py_False;
+    Py_INCREF(ret);
+    return ret;
+}
+
+static PyObject *
+_dmpy_udev_create_cookie(PyObject *self, PyObject *args)
+{
+    DmCookieObject *cookie;
+    uint32_t cookie_val;
+
+    if (!dm_udev_create_cookie(&cookie_val)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    cookie = PyObject_New(DmCookieObject,
+                          _dmpy_get_state(self)->DmCookie_Type);
+    if (!cookie)
+        return NULL;
+
+    if (_DmCookie_init(cookie, cookie_val))
+        return NULL;
+
+    cookie->ck_cookie = cookie_val;
+    _dmpy_set_cookie_values(cookie);
+    return (PyObject *) cookie;
+}
+
+static PyObject *
+_dmpy_udev_complete(PyObject *self, PyObject *args)
+{
+    DmCookieObject *cookie;
+
+    if (!PyArg_ParseTuple(args, "O!", _dmpy_get_state(self)->DmCookie_Type,
+                          &cookie))
+        return NULL;
+
+    return DmCookie_udev_complete(cookie, NULL);
+}
+
+static PyObject *
+_dmpy_udev_wait(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char * kwlist[] = {"immediate", NULL};
+    DmCookieObject *cookie;
+    int immediate = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|i", kwlist,
+                                     _dmpy_get_state(self)->DmCookie_Type,
+                                     &cookie, &immediate))
+        return NULL;
+
+    return _DmCookie_udev_wait(cookie, immediate);
+}
+
+static PyObject *
+_dmpy_message_supports_precise_timestamps(PyObject *self, PyObject *args)
+{
+    int precise = dm_message_supports_precise_timestamps();
+    PyObject *ret;
+
+    if (precise)
+        ret = Py_True;
+    else
+        ret = Py_False;
+
+    Py_INCREF(ret);
+    return ret;
+}
+
+static PyObject *
+_dmpy_stats_driver_supports_precise(PyObject *self, PyObject *args)
+{
+    int precise = dm_stats_driver_supports_precise();
+    PyObject *ret;
+
+    if (precise)
+        ret = Py_True;
+    else
+        ret = Py_False;
+
+    Py_INCREF(ret);
+    return ret;
+}
+
+static PyObject *
+_dmpy_stats_driver_supports_histogram(PyObject *self, PyObject *args)
+{
+    int histogram = dm_stats_driver_supports_histogram();
+    PyObject *ret;
+
+    if (histogram)
+        ret = Py_True;
+    else
+        ret = Py_False;
+
+    Py_INCREF(ret);
+    return ret;
+}
 
-#define DMSTATS___doc__ \
-""
+/*
+ * DmTransaction objects.
+ *
+ * A DmTransaction queues table loads, suspends, resumes and removes
+ * across many devices and runs them together at commit(): first every
+ * load (into the inactive table slot, so that no allocation happens with
+ * devices suspended), then the suspends, resumes and removes, each phase
+ * ordered by the dependencies between the devices in the transaction.
+ * Devices are suspended and removed top-down (holders before the devices
+ * they use) and resumed bottom-up.
+ *
+ * Every task that generates uevents is attached to one DmCookie, so that
+ * the transaction waits for udev once, at the end of commit(), rather
+ * than once per device. If a step fails the previous live tables of the
+ * loaded devices are restored, and suspended devices resumed, before the
+ * error is raised.
+ *
+ * Dependencies are read with DM_DEVICE_DEPS: only the direct dependencies
+ * between devices that are part of the same transaction are considered.
+ */
 
-static PyMethodDef DmStats_methods[] = {
-    {"bind_devno", (PyCFunction)DmStats_bind_devno, METH_VARARGS,
-        PyDoc_STR(DMSTATS_bind_devno__doc__)},
-    {"bind_name", (PyCFunction)DmStats_bind_name, METH_VARARGS,
-        PyDoc_STR(DMSTATS_bind_name__doc__)},
-    {"bind_uuid", (PyCFunction)DmStats_bind_uuid, METH_VARARGS,
-        PyDoc_STR(DMSTATS_bind_uuid__doc__)},
-    {"nr_regions", (PyCFunction)DmStats_nr_regions, METH_NOARGS,
-        PyDoc_STR(DMSTATS_nr_regions__doc__)},
-    {"nr_groups", (PyCFunction)DmStats_nr_groups, METH_NOARGS,
-        PyDoc_STR(DMSTATS_nr_groups__doc__)},
-    {"nr_areas", (PyCFunction)DmStats_nr_areas, METH_NOARGS,
-        PyDoc_STR(DMSTATS_nr_areas__doc__)},
-    {"region_present", (PyCFunction)DmStats_region_present, METH_VARARGS,
-        PyDoc_STR(DMSTATS_region_present__doc__)},
-    {"region_nr_areas", (PyCFunction)DmStats_region_nr_areas, METH_VARARGS,
-        PyDoc_STR(DMSTATS_region_nr_areas__doc__)},
-    {"group_present", (PyCFunction)DmStats_group_present, METH_VARARGS,
-        PyDoc_STR(DMSTATS_group_present__doc__)},
-    {"set_sampling_interval", (PyCFunction)DmStats_set_sampling_interval,
-        METH_VARARGS, PyDoc_STR(DMSTATS_set_sampling_interval__doc__)},
-    {"get_sampling_interval", (PyCFunction)DmStats_get_sampling_interval,
-        METH_VARARGS, PyDoc_STR(DMSTATS_get_sampling_interval__doc__)},
-    {"set_program_id", (PyCFunction)DmStats_set_program_id,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATS_set_program_id__doc__)},
-    {"list", (PyCFunction)DmStats_list,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATS_list__doc__)},
-    {"populate", (PyCFunction)DmStats_populate,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATS_populate__doc__)},
-    {"create_region", (PyCFunction)DmStats_create_region,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATS_create_region__doc__)},
-    {"delete_region", (PyCFunction)DmStats_delete_region,
-        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMSTATS_delete_region__doc__)},
-    {NULL, NULL}
+#define DMPY_TXN_LOAD       0
+#define DMPY_TXN_SUSPEND    1
+#define DMPY_TXN_RESUME     2
+#define DMPY_TXN_REMOVE     3
+#define DMPY_TXN_CLEAR      4 /* rollback of a load that was not resumed */
+#define DMPY_TXN_NR_QUEUED  4 /* ops that may be queued by the caller */
+
+static const char *_dmpy_txn_op_names[] = {
+    "load",
+    "suspend",
+    "resume",
+    "remove",
+    "clear",
+    NULL
 };
 
-#define DMSTATS__doc__ \
-"Base class representing a device-mapper statistics handle.\n\n"            \
-"Operations on DmStats objects include managing statistics regions\n"       \
-"and obtaining and manipulating current counter values from the\n"          \
-"kernel. Methods are provided to return baisc count values and to\n"        \
-"derive time-based metrics when a suitable interval estimate is\n"          \
-"provided.\n\n"                                                             \
-                                                                            \
-"Internally the DmStats handle contains a pointer to a table of one\n"      \
-"or more DmStatsRegion objects representing the regions registered\n"       \
-"with the DmStats.create_region() method. These in turn point to a\n"       \
-"table of one or more DmStatsCounters objects containing the\n"             \
-"counter sets for each defined area within the region:\n\n"                 \
-                                                                            \
-"DmStats[nr_regions]->DmStatsRegion[nr_areas]->DmStatsArea\n\n"             \
-                                                                            \
-"Regions and counter sets are stored in order of increasing region_id.\n"   \
-"Depending on region specifications and the sequence of create and\n"       \
-"delete operations this may not correspond to increasing sector\n"          \
-"number: users of the library should not assume that this is the case\n"    \
-"unless region creation is deliberately managed to ensure this (by\n"       \
-"always creating regions in strict order of ascending sector address).\n\n" \
-                                                                            \
-"Regions may also overlap, so the same sector range may be included in\n"   \
-"more than one region or area: applications should be prepared to deal\n"   \
-"with this or manage regions such that it does not occur."
+static const int _dmpy_txn_op_types[] = {
+    DM_DEVICE_RELOAD,
+    DM_DEVICE_SUSPEND,
+    DM_DEVICE_RESUME,
+    DM_DEVICE_REMOVE,
+    DM_DEVICE_CLEAR,
+};
 
-static PyTypeObject DmStats_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmStats",             /*tp_name*/
-    sizeof(DmStatsObject),      /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmStats_dealloc, /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    &DmStats_sequence_methods,  /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
-    DMSTATS__doc__,             /*tp_doc*/
-    (traverseproc)DmStats_traverse, /*tp_traverse*/
-    (inquiry)DmStats_clear,     /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    0,                          /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmStats_methods,            /*tp_methods*/
-    0,                          /*tp_members*/
-    0,                          /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmStats_init,     /*tp_init*/
-    0,                          /*tp_alloc*/
-    DmStats_new,                /*tp_new*/
-    PyObject_GC_Del,            /*tp_free*/
-    0,                          /*tp_is_gc*/
+/* A device named by one or more operations of a transaction. */
+struct dmpy_txn_dev {
+    char *name;
+    uint64_t dev; /* MKDEV(major, minor) as reported by DM_DEVICE_DEPS */
+    uint64_t *deps; /* live table dependencies */
+    uint32_t nr_deps;
+    uint64_t *new_deps; /* dependencies of the loaded table */
+    uint32_t nr_new_deps;
+    struct dm_task *load; /* queued DM_DEVICE_RELOAD, or NULL */
+    struct dm_task *undo; /* reload of the previous live table, or NULL */
+    int queued[DMPY_TXN_NR_QUEUED]; /* op queued for this device */
+    int done[DMPY_TXN_NR_QUEUED]; /* op completed for this device */
 };
 
+typedef struct {
+    PyObject_HEAD
+    struct dmpy_txn_dev *tx_devs;
+    Py_ssize_t tx_nr_devs;
+    Py_ssize_t tx_nr_ops;
+    DmCookieObject *tx_cookie; /* shared cookie, set at commit() */
+    PyObject *tx_log; /* list of (op, name, errno) steps run by commit() */
+    PyObject *tx_rolled_back; /* Py_True / Py_False */
+    int tx_committed;
+    int tx_busy; /* set while commit() runs */
+} DmTransactionObject;
+
+
+/*
+ * The state and device list of a transaction are only checked and
+ * changed inside a critical section on the object: once commit() has
+ * marked the transaction committed and busy, it owns the device list
+ * until it returns, and nothing else may queue operations or
+ * re-initialise the transaction.
+ */
+
 static void
-DmStatsRegion_dealloc(DmStatsRegionObject *self)
+_DmTransaction_free_devs(DmTransactionObject *self)
 {
-    /* Notify our parent that we are departing. */
-    if (self->dr_weakreflist)
-        PyObject_ClearWeakRefs((PyObject *) self);
+    Py_ssize_t i;
+
+    for (i = 0; i < self->tx_nr_devs; i++) {
+        PyMem_Free(self->tx_devs[i].name);
+        PyMem_Free(self->tx_devs[i].deps);
+        PyMem_Free(self->tx_devs[i].new_deps);
+        if (self->tx_devs[i].load)
+            dm_task_destroy(self->tx_devs[i].load);
+        if (self->tx_devs[i].undo)
+            dm_task_destroy(self->tx_devs[i].undo);
+    }
+    PyMem_Free(self->tx_devs);
+    self->tx_devs = NULL;
+    self->tx_nr_devs = 0;
+    self->tx_nr_ops = 0;
+}
 
-    /* release our reference on the parent DmStats. */
-    Py_DECREF(self->dr_stats);
-    return;
+static void
+DmTransaction_dealloc(DmTransactionObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    _DmTransaction_free_devs(self);
+    Py_XDECREF(self->tx_cookie);
+    Py_XDECREF(self->tx_log);
+    Py_XDECREF(self->tx_rolled_back);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
-static DmStatsRegionObject *
-newDmStatsRegionObject(PyObject *stats, uint64_t region_id)
+static int
+DmTransaction_init(DmTransactionObject *self, PyObject *args, PyObject *kwds)
 {
-    DmStatsRegionObject *region;
-    region = PyObject_GC_New(DmStatsRegionObject, &DmStatsRegion_Type);
-    region->dr_region_id = region_id;
-    region->dr_sequence = ((DmStatsObject *)stats)->ds_sequence;
-    region->dr_weakreflist = NULL;
-    region->dr_stats = stats;
+    static char *kwlist[] = {NULL};
+    PyObject *log;
+    int r = -1;
 
-    /* We keep a reference on the parent DmStats to prevent it (and its handle)
-     * from being deallocated.
-     */
-    Py_INCREF(stats);
-    return region;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ":__init__", kwlist))
+        return -1;
+
+    if (!(log = PyList_New(0)))
+        return -1;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->tx_busy)
+        PyErr_SetString(PyExc_RuntimeError, "DmTransaction object is in "
+                        "use by another thread.");
+    else {
+        _DmTransaction_free_devs(self);
+        Py_CLEAR(self->tx_cookie);
+        Py_XSETREF(self->tx_log, log);
+        log = NULL;
+        Py_INCREF(Py_False);
+        Py_XSETREF(self->tx_rolled_back, Py_False);
+        self->tx_committed = 0;
+        r = 0;
+    }
+    Py_END_CRITICAL_SECTION();
+
+    Py_XDECREF(log);
+    return r;
 }
 
+/*
+ * Return 0 if operations may be queued on self or it may be committed,
+ * or -1 with an exception set. Must be called in a critical section on
+ * self.
+ */
 static int
-DmStatsRegion_init(DmStatsRegionObject *self, PyObject *args, PyObject *kwds)
+_DmTransaction_check_open(DmTransactionObject *self)
 {
-    uint64_t region_id;
-    if (!PyArg_ParseTuple(args, "i:__init__", &region_id))
+    if (self->tx_busy) {
+        PyErr_SetString(PyExc_RuntimeError, "DmTransaction object is in "
+                        "use by another thread.");
         return -1;
-    self->dr_region_id = region_id;
+    }
+    if (!self->tx_log) {
+        PyErr_SetString(PyExc_ValueError, "DmTransaction is not "
+                        "initialised.");
+        return -1;
+    }
+    if (self->tx_committed) {
+        PyErr_SetString(PyExc_ValueError, "DmTransaction has already "
+                        "been committed.");
+        return -1;
+    }
     return 0;
 }
 
-static int
-DmStatsRegion_traverse(DmStatsRegionObject *self, visitproc visit, void *arg)
+/*
+ * Return the device named name, or NULL if it has no queued operation.
+ */
+static struct dmpy_txn_dev *
+_DmTransaction_find_dev(DmTransactionObject *self, const char *name)
 {
-    Py_VISIT(self->dr_stats);
-    return 0;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->tx_nr_devs; i++)
+        if (!strcmp(self->tx_devs[i].name, name))
+            return &self->tx_devs[i];
+    return NULL;
+}
+
+/*
+ * Add the device named name to the transaction, returning the new device
+ * or NULL on error.
+ */
+static struct dmpy_txn_dev *
+_DmTransaction_add_dev(DmTransactionObject *self, const char *name)
+{
+    struct dmpy_txn_dev *devs, *dev;
+
+    devs = PyMem_Realloc(self->tx_devs,
+                         sizeof(*devs) * (size_t) (self->tx_nr_devs + 1));
+    if (!devs) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    self->tx_devs = devs;
+
+    dev = &devs[self->tx_nr_devs];
+    memset(dev, 0, sizeof(*dev));
+    if (!(dev->name = PyMem_Malloc(strlen(name) + 1))) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    strcpy(dev->name, name);
+    self->tx_nr_devs++;
+    return dev;
+}
+
+static PyObject *
+_DmTransaction_queue(DmTransactionObject *self, int op, const char *name,
+                     PyObject *targets)
+{
+    struct dmpy_txn_dev *dev;
+    struct dm_task *dmt = NULL;
+    uint64_t nr_targets;
+    int r = -1;
+
+    /* The targets are read before the transaction is locked: reading
+     * them may run arbitrary Python code. */
+    if (op == DMPY_TXN_LOAD) {
+        if (!(dmt = dm_task_create(DM_DEVICE_RELOAD))
+            || !dm_task_set_name(dmt, name)) {
+            PyErr_SetString(PyExc_OSError, "Failed to create DmTransaction "
+                            "load task.");
+            goto fail;
+        }
+        if (_dmpy_task_add_targets(dmt, targets, &nr_targets, NULL))
+            goto fail;
+        if (!nr_targets) {
+            PyErr_SetString(PyExc_ValueError, "A table load needs at least "
+                            "one target.");
+            goto fail;
+        }
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTransaction_check_open(self)) {
+        dev = _DmTransaction_find_dev(self, name);
+        if (dev && dev->queued[op])
+            PyErr_Format(PyExc_ValueError, "A %s of %s is already queued.",
+                         _dmpy_txn_op_names[op], name);
+        /* Only add a device once its operation has been validated:
+         * commit() looks up every device in the transaction. */
+        else if (dev || (dev = _DmTransaction_add_dev(self, name))) {
+            if (dmt)
+                dev->load = dmt;
+            dmt = NULL;
+            dev->queued[op] = 1;
+            self->tx_nr_ops++;
+            r = 0;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+
+    if (!r) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+fail:
+    if (dmt)
+        dm_task_destroy(dmt);
+    return NULL;
+}
+
+static PyObject *
+DmTransaction_load(DmTransactionObject *self, PyObject *args)
+{
+    PyObject *targets;
+    const char *name;
+
+    if (!PyArg_ParseTuple(args, "sO:load", &name, &targets))
+        return NULL;
+
+    return _DmTransaction_queue(self, DMPY_TXN_LOAD, name, targets);
+}
+
+#define MkDmTransaction_queue_method(op, OP)                             \
+static PyObject *                                                        \
+DmTransaction_ ## op(DmTransactionObject *self, PyObject *args)          \
+{                                                                        \
+    const char *name;                                                    \
+                                                                         \
+    if (!PyArg_ParseTuple(args, "s:" #op, &name))                        \
+        return NULL;                                                     \
+                                                                         \
+    return _DmTransaction_queue(self, DMPY_TXN_ ## OP, name, NULL);      \
+}
+
+MkDmTransaction_queue_method(suspend, SUSPEND)
+MkDmTransaction_queue_method(resume, RESUME)
+MkDmTransaction_queue_method(remove, REMOVE)
+
+static Py_ssize_t
+DmTransaction_len(PyObject *o)
+{
+    DmTransactionObject *self = (DmTransactionObject *) o;
+    Py_ssize_t len;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    len = self->tx_nr_ops;
+    Py_END_CRITICAL_SECTION();
+    return len;
 }
 
+/*
+ * Run dmt, of DM_DEVICE_* type, with the GIL released, as DmTask.run()
+ * does. Returns 0 on success or the errno of the failed task.
+ */
 static int
-DmStatsRegion_clear(DmStatsRegionObject *self)
+_DmTransaction_run_task(DmTransactionObject *self, struct dm_task *dmt,
+                        int type)
 {
-    Py_CLEAR(self->dr_stats);
+    uint64_t start, elapsed;
+    int node_lock, r;
+
+    node_lock = _DmTask_needs_node_lock(type);
+
+    /* commit() holds tx_busy for the whole run. */
+    Py_BEGIN_ALLOW_THREADS
+    DMPY_NODE_LOCK(node_lock);
+    start = _dmpy_ioctl_start();
+    r = dm_task_run(dmt);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMPY_NODE_UNLOCK(node_lock);
+    Py_END_ALLOW_THREADS
+
+    _dmpy_ioctl_record(type, elapsed, r);
+
+    if (!r)
+        return dm_task_get_errno(dmt) ? dm_task_get_errno(dmt) : EIO;
+
+    _dmpy_control_ready = 1;
+    _dmpy_dev_cache_task_done(type);
     return 0;
 }
 
-/* Check the sequence number for this DmStatsRegion against its parent.
- * The ds_sequence value stored in DmStats is initialised to zero, and
- * incremented on each operation that invalidates the handle's tables
- * (bind, list, populate).
- *
- * If the sequence number we are holding, and the one stored in the
- * parent do not match, the handle has been invalidated since this
- * object was created and all operations should raise LookupError.
+/*
+ * Run op on dev and append it to the transaction log. Tasks that generate
+ * uevents use the shared cookie. Returns 0 on success, the errno of a
+ * failed task, or -1 with an exception set if the log or the task could
+ * not be created.
  */
 static int
-_DmStatsRegion_sequence_check(PyObject *o)
+_DmTransaction_run_op(DmTransactionObject *self, struct dmpy_txn_dev *dev,
+                      int op, struct dm_task *dmt)
 {
-    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
-    DmStatsObject *stats;
+    int type = _dmpy_txn_op_types[op], own = !dmt, err;
+    PyObject *entry;
+
+    if (own && (!(dmt = dm_task_create(type))
+                || !dm_task_set_name(dmt, dev->name))) {
+        if (dmt)
+            dm_task_destroy(dmt);
+        PyErr_SetString(PyExc_OSError, "Failed to create DmTransaction "
+                        "task.");
+        return -1;
+    }
 
-    if (!DmStatsRegionObject_Check(o))
+    if (((type == DM_DEVICE_RESUME) || (type == DM_DEVICE_REMOVE))
+        && !dm_task_set_cookie(dmt, &self->tx_cookie->ck_cookie, 0)) {
+        dm_task_destroy(dmt);
+        PyErr_SetString(PyExc_OSError, "Failed to set DmTransaction "
+                        "cookie.");
         return -1;
+    }
 
-    stats = DMSTATS_FROM_REGION(self);
+    err = _DmTransaction_run_task(self, dmt, type);
+    if (own)
+        dm_task_destroy(dmt);
 
-    if (self->dr_sequence != stats->ds_sequence) {
-        PyErr_SetString(PyExc_LookupError, "Attempt to access regions in"
-                        " changed DmStats object.");
+    if (!(entry = Py_BuildValue("(ssi)", _dmpy_txn_op_names[op], dev->name,
+                                err)))
+        return -1;
+    if (PyList_Append(self->tx_log, entry)) {
+        Py_DECREF(entry);
         return -1;
     }
-    return 0;
+    Py_DECREF(entry);
+    return err;
 }
 
-#define DmStatsRegion_SeqCheck(o)                          \
-do {                                                       \
-    if (_DmStatsRegion_sequence_check((PyObject *)(o)))    \
-        return NULL;                                       \
-} while(0);
+/*
+ * Read the device number and the live (or, if inactive, the loaded)
+ * table dependencies of dev. Returns 0 or an errno value as for
+ * _DmTransaction_run_task().
+ */
+static int
+_DmTransaction_get_deps(DmTransactionObject *self, struct dmpy_txn_dev *dev,
+                        int inactive)
+{
+    uint64_t **deps = inactive ? &dev->new_deps : &dev->deps;
+    uint32_t *nr_deps = inactive ? &dev->nr_new_deps : &dev->nr_deps;
+    struct dm_deps *dm_deps;
+    struct dm_task *dmt;
+    struct dm_info info;
+    int err;
+
+    if (!(dmt = dm_task_create(DM_DEVICE_DEPS))
+        || !dm_task_set_name(dmt, dev->name)
+        || (inactive && !dm_task_query_inactive_table(dmt))) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    if ((err = _DmTransaction_run_task(self, dmt, DM_DEVICE_DEPS)))
+        goto out;
+
+    if (!dm_task_get_info(dmt, &info) || !info.exists) {
+        err = ENXIO;
+        goto out;
+    }
+    dev->dev = ((uint64_t) info.major << 8) | (info.minor & 0xff)
+               | ((uint64_t) (info.minor & ~0xff) << 12);
+
+    PyMem_Free(*deps);
+    *deps = NULL;
+    *nr_deps = 0;
+    if ((dm_deps = dm_task_get_deps(dmt)) && dm_deps->count) {
+        if (!(*deps = PyMem_Malloc(sizeof(**deps) * dm_deps->count))) {
+            err = ENOMEM;
+            goto out;
+        }
+        memcpy(*deps, dm_deps->device, sizeof(**deps) * dm_deps->count);
+        *nr_deps = dm_deps->count;
+    }
+
+out:
+    if (dmt)
+        dm_task_destroy(dmt);
+    return err;
+}
+
+/*
+ * Save the live table of dev as a DM_DEVICE_RELOAD task in dev->undo.
+ * A device without a live table has no undo task.
+ */
+static int
+_DmTransaction_save_table(DmTransactionObject *self, struct dmpy_txn_dev *dev)
+{
+    struct dm_task *dmt, *undo = NULL;
+    uint64_t start, length;
+    char *ttype, *params;
+    void *next = NULL;
+    int err;
+
+    if (!(dmt = dm_task_create(DM_DEVICE_TABLE))
+        || !dm_task_set_name(dmt, dev->name)) {
+        err = ENOMEM;
+        goto out;
+    }
 
+    if ((err = _DmTransaction_run_task(self, dmt, DM_DEVICE_TABLE)))
+        goto out;
+
+    do {
+        next = dm_get_next_target(dmt, next, &start, &length, &ttype,
+                                  &params);
+        if (!ttype)
+            break;
+        if ((!undo && (!(undo = dm_task_create(DM_DEVICE_RELOAD))
+                       || !dm_task_set_name(undo, dev->name)))
+            || !dm_task_add_target(undo, start, length, ttype, params)) {
+            err = ENOMEM;
+            goto out;
+        }
+    } while (next);
+
+    dev->undo = undo;
+    undo = NULL;
+
+out:
+    if (undo)
+        dm_task_destroy(undo);
+    if (dmt)
+        dm_task_destroy(dmt);
+    return err;
+}
+
+/* Return non-zero if a depends directly on b, using a's new table if set. */
+static int
+_dmpy_txn_depends(const struct dmpy_txn_dev *a, const struct dmpy_txn_dev *b,
+                  int new_table)
+{
+    const uint64_t *deps = new_table ? a->new_deps : a->deps;
+    uint32_t i, nr_deps = new_table ? a->nr_new_deps : a->nr_deps;
+
+    for (i = 0; i < nr_deps; i++)
+        if (deps[i] == b->dev)
+            return 1;
+    return 0;
+}
+
+/*
+ * Order the devices for which op is queued into order[], returning their
+ * number. With top_down set a device comes before every device it
+ * depends on, and after them otherwise; devices are otherwise kept in
+ * the order they were added to the transaction. The new table of a
+ * loaded device is used for the dependencies if new_table is set.
+ */
 static Py_ssize_t
-DmStatsRegion_len(PyObject *o)
+_DmTransaction_order(DmTransactionObject *self, const int *wanted,
+                     int top_down, int new_table, Py_ssize_t *order,
+                     char *placed)
 {
-    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
-    struct dm_stats *dms;
+    struct dmpy_txn_dev *devs = self->tx_devs, *a, *b;
+    Py_ssize_t i, j, nr = 0, nr_wanted = 0;
+    int blocked, progress;
 
-    if (!DmStatsRegionObject_Check(o))
-        return -1;
+    for (i = 0; i < self->tx_nr_devs; i++) {
+        placed[i] = !wanted[i];
+        nr_wanted += !!wanted[i];
+    }
 
-    if (_DmStatsRegion_sequence_check(o))
-        return -1;
+    while (nr < nr_wanted) {
+        progress = 0;
+        for (i = 0; i < self->tx_nr_devs; i++) {
+            if (placed[i])
+                continue;
+            blocked = 0;
+            for (j = 0; j < self->tx_nr_devs && !blocked; j++) {
+                if ((i == j) || placed[j])
+                    continue;
+                /* Top-down: a holder of i must go first. */
+                a = top_down ? &devs[j] : &devs[i];
+                b = top_down ? &devs[i] : &devs[j];
+                blocked = _dmpy_txn_depends(a, b, new_table
+                                            && a->queued[DMPY_TXN_LOAD]);
+            }
+            if (!blocked) {
+                order[nr++] = i;
+                placed[i] = 1;
+                progress = 1;
+                break;
+            }
+        }
+        /* A dependency cycle: fall back to the order of addition. */
+        if (!progress)
+            for (i = 0; i < self->tx_nr_devs; i++)
+                if (!placed[i]) {
+                    order[nr++] = i;
+                    placed[i] = 1;
+                }
+    }
+    return nr;
+}
 
-    dms = DMS_FROM_REGION(self);
-    if (!dms)
-        return 0;
+/*
+ * Run op for every device with a queued op, in dependency order. Returns
+ * 0, or the errno (or -1 with an exception set) of the first failure.
+ */
+static int
+_DmTransaction_run_phase(DmTransactionObject *self, int op, int top_down,
+                         Py_ssize_t *order, char *placed, int *wanted,
+                         struct dmpy_txn_dev **failed)
+{
+    struct dmpy_txn_dev *dev;
+    Py_ssize_t i, nr;
+    int err;
+
+    for (i = 0; i < self->tx_nr_devs; i++)
+        wanted[i] = self->tx_devs[i].queued[op];
+    nr = _DmTransaction_order(self, wanted, top_down, op == DMPY_TXN_RESUME,
+                              order, placed);
+
+    for (i = 0; i < nr; i++) {
+        dev = &self->tx_devs[order[i]];
+        err = _DmTransaction_run_op(self, dev, op, (op == DMPY_TXN_LOAD)
+                                                   ? dev->load : NULL);
+        if (err) {
+            *failed = dev;
+            return err;
+        }
+        dev->done[op] = 1;
+    }
+    return 0;
+}
+
+/*
+ * Undo the completed loads, suspends and resumes of the transaction:
+ * drop loaded tables that were not resumed, reload the previous table of
+ * devices that were, and resume every device left suspended or holding
+ * a restored table, bottom-up. Returns 0 if every step succeeded.
+ */
+static int
+_DmTransaction_rollback(DmTransactionObject *self, Py_ssize_t *order,
+                        char *placed, int *wanted)
+{
+    struct dmpy_txn_dev *dev;
+    Py_ssize_t i, nr;
+    int r = 0, err;
+
+    for (i = 0; i < self->tx_nr_devs; i++) {
+        dev = &self->tx_devs[i];
+        wanted[i] = 0;
+        if (dev->done[DMPY_TXN_LOAD] && dev->done[DMPY_TXN_RESUME]) {
+            if (!dev->undo)
+                continue;
+            err = _DmTransaction_run_op(self, dev, DMPY_TXN_LOAD, dev->undo);
+            wanted[i] = !err;
+        } else if (dev->done[DMPY_TXN_LOAD])
+            err = _DmTransaction_run_op(self, dev, DMPY_TXN_CLEAR, NULL);
+        else
+            err = 0;
+        if (err < 0)
+            return -1;
+        r |= err;
+        if (dev->done[DMPY_TXN_SUSPEND] && !dev->done[DMPY_TXN_RESUME])
+            wanted[i] = 1;
+    }
 
-    return (Py_ssize_t) dm_stats_get_region_nr_areas(dms, self->dr_region_id);
+    nr = _DmTransaction_order(self, wanted, 0, 0, order, placed);
+    for (i = 0; i < nr; i++) {
+        err = _DmTransaction_run_op(self, &self->tx_devs[order[i]],
+                                    DMPY_TXN_RESUME, NULL);
+        if (err < 0)
+            return -1;
+        r |= err;
+    }
+    return r;
 }
 
-static DmStatsAreaObject *
-newDmStatsAreaObject(PyObject *stats, uint64_t region_id, uint64_t area_id);
+/* Raise OSError(err, ...) for the failure of op on the device name. */
+static void
+_DmTransaction_set_error(int err, int op, const char *name)
+{
+    PyObject *value;
+
+    value = Py_BuildValue("(iN)", err, PyUnicode_FromFormat(
+                          "DmTransaction %s of %s failed: %s",
+                          (op < DMPY_TXN_NR_QUEUED) ? _dmpy_txn_op_names[op]
+                          : "lookup", name, strerror(err)));
+    if (value) {
+        PyErr_SetObject(PyExc_OSError, value);
+        Py_DECREF(value);
+    }
+}
 
 static PyObject *
-DmStatsRegion_get_item(PyObject *o, Py_ssize_t j)
+DmTransaction_commit(DmTransactionObject *self, PyObject *args,
+                     PyObject *kwds)
 {
-    DmStatsRegionObject *self = (DmStatsRegionObject *) o;
-    DmStatsObject *stats = (DmStatsObject *) self->dr_stats;
-    uint64_t i = self->dr_region_id;
-    PyObject *area;
-
-    if (!DmStatsRegionObject_Check(o))
+    static char *kwlist[] = {"rollback", NULL};
+    static const int phases[] = {
+        DMPY_TXN_SUSPEND, DMPY_TXN_RESUME, DMPY_TXN_REMOVE
+    };
+    struct dmpy_txn_dev *failed = NULL;
+    PyObject *ret = NULL, *waited, *exc_type, *exc_value, *exc_tb;
+    Py_ssize_t i, *order = NULL;
+    char *placed = NULL;
+    int *wanted = NULL;
+    int rollback = 1, err = 0, failed_op = -1, p, r;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:commit", kwlist,
+                                     &rollback))
         return NULL;
 
-    DmStatsRegion_SeqCheck(o);
-
-    if ((j < 0) || (j >= self->dr_areas_len)) {
-        PyErr_SetString(PyExc_IndexError, "DmStats area_id out of range");
-        return NULL;
+    /* Only one thread may commit, and it owns the device list until it
+     * returns: queueing and re-initialising fail while it is busy. */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!(r = _DmTransaction_check_open(self))) {
+        self->tx_committed = 1;
+        self->tx_busy = 1;
     }
+    Py_END_CRITICAL_SECTION();
+    if (r)
+        return NULL;
 
-    /* This return is currently unreachable since a not-present region_id
-     * returns the None type for a lookup in the containing DmStats. If
-     * that is later changed to return a singleton "null region", then
-     * the following presence check ensures correct behaviour.
-     */
-    if (!dm_stats_region_present(stats->ds_dms, self->dr_region_id)) {
-        Py_INCREF(Py_None);
-        return Py_None;
+    self->tx_cookie = PyObject_New(DmCookieObject,
+                                   DMPY_STATE(self)->DmCookie_Type);
+    if (!self->tx_cookie)
+        goto out;
+    self->tx_cookie->ck_ready = NULL;
+    if (_DmCookie_init(self->tx_cookie, 0))
+        goto out;
+
+    order = PyMem_Malloc(sizeof(*order) * (size_t) (self->tx_nr_devs + 1));
+    placed = PyMem_Malloc((size_t) self->tx_nr_devs + 1);
+    wanted = PyMem_Malloc(sizeof(*wanted) * (size_t) (self->tx_nr_devs + 1));
+    if (!order || !placed || !wanted) {
+        PyErr_NoMemory();
+        goto out;
     }
 
-    if (!self->dr_areas[j]) {
-cache_new:
-        /* cache miss */
-        area = (PyObject *) newDmStatsAreaObject((PyObject *) stats, i, j);
-        self->dr_areas[j] = PyWeakref_NewRef(area, NULL);
-    } else {
-        area = PyWeakref_GetObject(self->dr_areas[j]);
-        if (area == Py_None) {
-            /* cache hit but referent expired */
-            Py_DECREF(self->dr_areas[j]);
-            self->dr_areas[j] = NULL;
-            goto cache_new;
-        }
-        /* cache hit */
-        Py_INCREF(area);
+    /* Resolve every device, and save the tables to restore on failure. */
+    for (i = 0; i < self->tx_nr_devs && !err; i++) {
+        failed = &self->tx_devs[i];
+        failed_op = DMPY_TXN_NR_QUEUED; /* preparation */
+        err = _DmTransaction_get_deps(self, failed, 0);
+        if (!err && rollback && failed->queued[DMPY_TXN_LOAD])
+            err = _DmTransaction_save_table(self, failed);
     }
+    if (err)
+        goto raise;
 
-    return area;
-}
+    failed_op = DMPY_TXN_LOAD;
+    if ((err = _DmTransaction_run_phase(self, DMPY_TXN_LOAD, 0, order,
+                                        placed, wanted, &failed)))
+        goto fail;
 
-static PySequenceMethods DmStatsRegion_sequence_methods = {
-    DmStatsRegion_len,
-    0,
-    0,
-    DmStatsRegion_get_item
-};
+    failed_op = DMPY_TXN_NR_QUEUED; /* lookup of the loaded tables */
+    for (i = 0; i < self->tx_nr_devs; i++) {
+        if (!self->tx_devs[i].queued[DMPY_TXN_LOAD])
+            continue;
+        failed = &self->tx_devs[i];
+        if ((err = _DmTransaction_get_deps(self, failed, 1)))
+            goto fail;
+    }
 
-#define DMSTATSREG___doc__ \
-""
+    for (p = 0; p < (int) (sizeof(phases) / sizeof(phases[0])); p++) {
+        failed_op = phases[p];
+        if ((err = _DmTransaction_run_phase(self, phases[p],
+                                            phases[p] != DMPY_TXN_RESUME,
+                                            order, placed, wanted, &failed)))
+            goto fail;
+    }
+    goto wait;
 
-#define DMSTATSREG__doc__ \
-"Base class representing a region of a device-mapper statistics handle,\n"  \
-"including any areas and counters contained within it.\n\n"                 \
+fail:
+    /* A remove cannot be undone: only roll back the earlier phases. */
+    if ((err > 0) && rollback && (failed_op != DMPY_TXN_REMOVE)) {
+        switch (_DmTransaction_rollback(self, order, placed, wanted)) {
+        case -1:
+            err = -1;
+            break;
+        case 0:
+            Py_INCREF(Py_True);
+            Py_XSETREF(self->tx_rolled_back, Py_True);
+            break;
+        }
+    }
+
+wait:
+    /* Wait for udev once for every task that used the cookie. Tasks have
+     * run by now, so wait even if an exception is already set: it is
+     * raised once the cookie's semaphore has been released. */
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    waited = _DmCookie_udev_wait(self->tx_cookie, 0);
+    if (exc_type) {
+        Py_XDECREF(waited);
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+        goto out;
+    }
+    if (!waited)
+        goto out;
+    Py_DECREF(waited);
+
+raise:
+    if (err) {
+        if (err > 0)
+            _DmTransaction_set_error(err, failed_op, failed->name);
+        goto out;
+    }
 
-static PyObject *
-DmStatsRegion_delete(DmStatsRegionObject *self, void *arg)
-{
-    if (_DmStats_delete_region((DmStatsObject *) self->dr_stats,
-                               self->dr_region_id))
-        return NULL;
     Py_INCREF(Py_True);
-    return Py_True;
-}
+    ret = Py_True;
 
-#define DMSTATSREG_delete__doc__ \
-"Delete this region."
+out:
+    PyMem_Free(order);
+    PyMem_Free(placed);
+    PyMem_Free(wanted);
+    __atomic_store_n(&self->tx_busy, 0, __ATOMIC_RELEASE);
+    return ret;
+}
 
-static PyMethodDef DmStatsRegion_methods[] = {
-    {"delete", (PyCFunction)DmStatsRegion_delete, METH_NOARGS,
-        PyDoc_STR(DMSTATSREG_delete__doc__)},
+#define DMTRANSACTION_load__doc__ \
+"Queue a load of a new inactive table for the device name. targets is\n" \
+"an iterable of (start, length, target_type, params) tuples, as for\n"   \
+"DmTask.add_targets(). The table becomes live when the device is\n"      \
+"resumed."
+
+#define DMTRANSACTION_suspend__doc__ \
+"Queue a suspend of the device name."
+
+#define DMTRANSACTION_resume__doc__ \
+"Queue a resume of the device name, making any loaded table live."
+
+#define DMTRANSACTION_remove__doc__ \
+"Queue a remove of the device name."
+
+#define DMTRANSACTION_commit__doc__ \
+"Run the queued operations: every load, then the suspends (top-down),\n" \
+"resumes (bottom-up) and removes (top-down), ordered by the\n"           \
+"dependencies between the devices of the transaction. Resumes and\n"     \
+"removes share one DmCookie, and commit() waits for udev once, after\n"  \
+"the last operation.\n\n"                                                \
+"If an operation fails and rollback is True (the default) the previous\n" \
+"tables of the loaded devices are restored and the suspended devices\n"  \
+"resumed before OSError is raised: rolled_back is set if every\n"        \
+"rollback step succeeded. A failed remove is not rolled back. Returns\n" \
+"True on success. A transaction can only be committed once."
+
+#define DMTRANSACTION_log__doc__ \
+"A list of (op, name, errno) tuples for each operation run by commit(),\n" \
+"including any rollback steps, in order. errno is 0 for success."
+
+#define DMTRANSACTION_cookie__doc__ \
+"The DmCookie shared by the tasks of the transaction, or None before\n" \
+"commit()."
+
+#define DMTRANSACTION_rolled_back__doc__ \
+"True if commit() failed and the transaction was rolled back."
+
+static PyMethodDef DmTransaction_methods[] = {
+    {"load", (PyCFunction)DmTransaction_load, METH_VARARGS,
+        PyDoc_STR(DMTRANSACTION_load__doc__)},
+    {"suspend", (PyCFunction)DmTransaction_suspend, METH_VARARGS,
+        PyDoc_STR(DMTRANSACTION_suspend__doc__)},
+    {"resume", (PyCFunction)DmTransaction_resume, METH_VARARGS,
+        PyDoc_STR(DMTRANSACTION_resume__doc__)},
+    {"remove", (PyCFunction)DmTransaction_remove, METH_VARARGS,
+        PyDoc_STR(DMTRANSACTION_remove__doc__)},
+    {"commit", (PyCFunction)DmTransaction_commit,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMTRANSACTION_commit__doc__)},
     {NULL, NULL}
 };
 
-static PyObject *
-DmStatsRegion_nr_areas_getter(PyObject *self, void *arg)
-{
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
-    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
-    uint64_t nr_areas;
+static PyMemberDef DmTransaction_members[] = {
+    {"log", T_OBJECT, offsetof(DmTransactionObject, tx_log), READONLY,
+     PyDoc_STR(DMTRANSACTION_log__doc__)},
+    {"cookie", T_OBJECT, offsetof(DmTransactionObject, tx_cookie), READONLY,
+     PyDoc_STR(DMTRANSACTION_cookie__doc__)},
+    {"rolled_back", T_OBJECT, offsetof(DmTransactionObject, tx_rolled_back),
+     READONLY, PyDoc_STR(DMTRANSACTION_rolled_back__doc__)},
+    {NULL}
+};
 
-    DmStatsRegion_SeqCheck(self);
 
-    nr_areas = dm_stats_get_region_nr_areas(stats->ds_dms, reg->dr_region_id);
-    return Py_BuildValue("i", nr_areas);
-}
+#define DMTRANSACTION__doc__ \
+"A set of suspend, table load, resume and remove operations across\n"  \
+"many devices that are run together, in dependency order and under\n"  \
+"one udev cookie, by commit(). len() is the number of queued\n"        \
+"operations."
+
+static PyType_Slot DmTransaction_slots[] = {
+    {Py_tp_dealloc, DmTransaction_dealloc},
+    {Py_tp_doc, DMTRANSACTION__doc__},
+    {Py_sq_length, DmTransaction_len},
+    {Py_tp_methods, DmTransaction_methods},
+    {Py_tp_members, DmTransaction_members},
+    {Py_tp_init, DmTransaction_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
 
-static PyObject *
-DmStatsRegion_present_getter(PyObject *self, void *arg)
-{
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
-    struct dm_stats *dms = DMS_FROM_REGION(reg);
-    PyObject *ret;
+static PyType_Spec DmTransaction_spec = {
+    "dmpy.DmTransaction",       /*name*/
+    sizeof(DmTransactionObject), /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmTransaction_slots,        /*slots*/
+};
 
-    DmStatsRegion_SeqCheck(self);
+/*
+ * Batched task execution.
+ *
+ * run_tasks() runs a list of prepared DmTask objects on a small pool of
+ * native threads with the GIL released. The calling thread is one of the
+ * workers: it spawns workers - 1 helper threads and all of them claim the
+ * next unclaimed task from the batch until none remain. The batch itself
+ * is the (bounded) work queue, so no task is copied or queued twice.
+ *
+ * The batch is shared with threads that cannot be joined, and is freed by
+ * whichever thread drops the last reference to it. Workers never touch a
+ * Python object.
+ */
 
-    ret = (dm_stats_region_present(dms, reg->dr_region_id))
-        ? Py_True : Py_False;
-    Py_INCREF(ret);
-    return ret;
-}
+#define DMPY_RUN_TASKS_MAX_WORKERS 64
+#define DMPY_RUN_TASKS_DEFAULT_WORKERS 4
+
+struct dmpy_task_batch {
+    PyThread_type_lock lock; /* protects next, nr_running and refs */
+    PyThread_type_lock done; /* released when the last worker finishes */
+    Py_ssize_t nr_tasks;
+    Py_ssize_t next; /* index of the next unclaimed task */
+    int nr_running; /* workers that have not yet finished */
+    int refs; /* threads holding a reference to the batch */
+    int nr_ok; /* tasks that completed successfully */
+    struct dm_task **dmts;
+    int *types;
+    int *errnos; /* 0 on success, or the errno of a failed task */
+    uint64_t *elapsed; /* run time of each task for ioctl stats */
+};
 
-static PyObject *
-DmStatsRegion_precise_timestamps_getter(PyObject *self, void *arg)
+static void
+_dmpy_task_batch_free(struct dmpy_task_batch *batch)
 {
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
-    struct dm_stats *dms = DMS_FROM_REGION(reg);
-    PyObject *ret;
-
-    DmStatsRegion_SeqCheck(self);
-
-    ret = (dm_stats_get_region_precise_timestamps(dms, reg->dr_region_id))
-        ? Py_True : Py_False;
-    Py_INCREF(ret);
-    return ret;
-}
-
-#define MkDmStatsRegion_startlen_getter(name)                                \
-static PyObject *                                                            \
-DmStatsRegion_ ## name ##_getter(PyObject *self, void *arg)                  \
-{                                                                            \
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;                 \
-    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);                         \
-    uint64_t name;                                                           \
-    int r;                                                                   \
-                                                                             \
-    DmStatsRegion_SeqCheck(self);                                            \
-                                                                             \
-    r = dm_stats_get_region_ ## name(stats->ds_dms, &name,                   \
-                                     reg->dr_region_id);                     \
-    if (!r) {                                                                \
-        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "     \
-                        "state: no region data.");                           \
-        return NULL;                                                         \
-    }                                                                        \
-    return Py_BuildValue("l", name);                                         \
+    if (batch->lock)
+        PyThread_free_lock(batch->lock);
+    if (batch->done)
+        PyThread_free_lock(batch->done);
+    PyMem_RawFree(batch->dmts);
+    PyMem_RawFree(batch->types);
+    PyMem_RawFree(batch->errnos);
+    PyMem_RawFree(batch->elapsed);
+    PyMem_RawFree(batch);
 }
 
-MkDmStatsRegion_startlen_getter(start)
-MkDmStatsRegion_startlen_getter(len)
-MkDmStatsRegion_startlen_getter(area_len)
-
-static PyObject *
-DmStatsRegion_program_id_getter(PyObject *self, void *arg)
+static struct dmpy_task_batch *
+_dmpy_task_batch_new(Py_ssize_t nr_tasks)
 {
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
-    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
-    const char *program_id;
+    struct dmpy_task_batch *batch;
+    size_t nr_slots = (size_t) (nr_tasks ? nr_tasks : 1);
 
-    DmStatsRegion_SeqCheck(self);
+    if (!(batch = PyMem_RawCalloc(1, sizeof(*batch))))
+        return NULL;
 
-    program_id = dm_stats_get_region_program_id(stats->ds_dms,
-                                                reg->dr_region_id);
+    batch->nr_tasks = nr_tasks;
+    batch->refs = 1;
+    batch->nr_running = 1;
+    batch->dmts = PyMem_RawCalloc(nr_slots, sizeof(*batch->dmts));
+    batch->types = PyMem_RawCalloc(nr_slots, sizeof(*batch->types));
+    batch->errnos = PyMem_RawCalloc(nr_slots, sizeof(*batch->errnos));
+    batch->elapsed = PyMem_RawCalloc(nr_slots, sizeof(*batch->elapsed));
+    batch->lock = PyThread_allocate_lock();
+    batch->done = PyThread_allocate_lock();
+
+    if (!batch->dmts || !batch->types || !batch->errnos || !batch->elapsed
+        || !batch->lock || !batch->done) {
+        _dmpy_task_batch_free(batch);
+        return NULL;
+    }
 
-    return Py_BuildValue("z", program_id);
+    /* Held until the last worker finishes. */
+    PyThread_acquire_lock(batch->done, WAIT_LOCK);
+    return batch;
 }
 
-static PyObject *
-DmStatsRegion_aux_data_getter(PyObject *self, void *arg)
+static void
+_dmpy_task_batch_put(struct dmpy_task_batch *batch)
 {
-    DmStatsRegionObject *reg = (DmStatsRegionObject *) self;
-    DmStatsObject *stats = DMSTATS_FROM_REGION(reg);
-    const char *aux_data;
-
-    DmStatsRegion_SeqCheck(self);
+    int refs;
 
-    aux_data = dm_stats_get_region_aux_data(stats->ds_dms,
-                                            reg->dr_region_id);
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    refs = --batch->refs;
+    PyThread_release_lock(batch->lock);
 
-    return Py_BuildValue("z", aux_data);
+    if (!refs)
+        _dmpy_task_batch_free(batch);
 }
 
-#define DMSTATSREG_nr_areas_gets__doc__                \
-"Return the number of areas contained in this region."
-
-#define DMSTATSREG_present_gets__doc__                      \
-"Boolean indicating whether this region is present or not."
-
-#define DMSTATSREG_precise_timestamps_gets__doc__                            \
-"Returns True if the specified region has the precise_timestamps feature\n"  \
-"enabled (i.e. produces nanosecond-precision counter values) or False for\n" \
-"a region using the default milisecond precision."
-
-#define DMSTATSREG_start_gets__doc__ \
-"The start offset of this region in sectors."
+/*
+ * Run tasks from batch until none remain. Must be called with the GIL
+ * released.
+ */
+static void
+_dmpy_task_batch_work(struct dmpy_task_batch *batch)
+{
+    int node_lock, last, r;
+    uint64_t start;
+    Py_ssize_t i;
+
+    for (;;) {
+        PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+        i = batch->next++;
+        PyThread_release_lock(batch->lock);
+
+        if (i >= batch->nr_tasks)
+            break;
+
+        node_lock = _DmTask_needs_node_lock(batch->types[i]);
+        DMPY_NODE_LOCK(node_lock);
+        start = _dmpy_ioctl_start();
+        r = dm_task_run(batch->dmts[i]);
+        batch->elapsed[i] = _dmpy_ioctl_elapsed(start);
+        if (r)
+            _dmpy_control_ready = 1;
+        DMPY_NODE_UNLOCK(node_lock);
+
+        if (r)
+            batch->errnos[i] = 0;
+        else
+            batch->errnos[i] = dm_task_get_errno(batch->dmts[i])
+                               ? dm_task_get_errno(batch->dmts[i]) : EIO;
+    }
 
-#define DMSTATSREG_len_gets__doc__ \
-"The length of this region in sectors."
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    last = !--batch->nr_running;
+    PyThread_release_lock(batch->lock);
 
-#define DMSTATSREG_area_len_gets__doc__ \
-"The lenght of each area contained in this region."
+    if (last)
+        PyThread_release_lock(batch->done);
+}
 
-#define DMSTATSREG_program_id_gets__doc__ \
-"The program_id string use to create this region."
+static void
+_dmpy_task_batch_thread(void *arg)
+{
+    struct dmpy_task_batch *batch = arg;
 
-#define DMSTATSREG_aux_data_gets__doc__ \
-"The aux_data value for this region."
+    _dmpy_task_batch_work(batch);
+    _dmpy_task_batch_put(batch);
+}
 
-static PyGetSetDef DmStatsRegion_getsets[] = {
-    {"present", DmStatsRegion_present_getter, NULL,
-      PyDoc_STR(DMSTATSREG_present_gets__doc__), NULL},
-    {"nr_areas", DmStatsRegion_nr_areas_getter, NULL,
-      PyDoc_STR(DMSTATSREG_nr_areas_gets__doc__), NULL},
-    {"precise_timestamps", DmStatsRegion_precise_timestamps_getter, NULL,
-      PyDoc_STR(DMSTATSREG_precise_timestamps_gets__doc__), NULL},
-    {"start", DmStatsRegion_start_getter, NULL,
-      PyDoc_STR(DMSTATSREG_start_gets__doc__), NULL},
-    {"len", DmStatsRegion_len_getter, NULL,
-      PyDoc_STR(DMSTATSREG_len_gets__doc__), NULL},
-    {"area_len", DmStatsRegion_area_len_getter, NULL,
-      PyDoc_STR(DMSTATSREG_area_len_gets__doc__), NULL},
-    {"program_id", DmStatsRegion_program_id_getter, NULL,
-      PyDoc_STR(DMSTATSREG_program_id_gets__doc__), NULL},
-    {"aux_data", DmStatsRegion_aux_data_getter, NULL,
-      PyDoc_STR(DMSTATSREG_aux_data_gets__doc__), NULL},
-    {NULL, NULL}
-};
+static PyObject *
+_dmpy_list_devices(PyObject *self, PyObject *args)
+{
+    return _dmpy_list_device_snapshot(_dmpy_get_state(self), -1);
+}
 
-static PyMemberDef DmStatsRegion_members[] = {
-    {"region_id", T_LONG, offsetof(DmStatsRegionObject, dr_region_id),
-     READONLY, PyDoc_STR("The region identifier of this region.")},
-    {NULL}
-};
+static PyObject *
+_dmpy_resolve_device(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"name", "uuid", "major", "minor", NULL};
+    const char *name = NULL, *uuid = NULL;
+    int major = -1, minor = -1;
+    PyObject *row;
 
-static PyTypeObject DmStatsRegion_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmStatsRegion",             /*tp_name*/
-    sizeof(DmStatsRegionObject),      /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmStatsRegion_dealloc,
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    &DmStatsRegion_sequence_methods, /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
-    DMSTATSREG__doc__,          /*tp_doc*/
-    (traverseproc) DmStatsRegion_traverse, /*tp_traverse*/
-    (inquiry) DmStatsRegion_clear, /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    offsetof(DmStatsRegionObject, dr_weakreflist), /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmStatsRegion_methods,      /*tp_methods*/
-    DmStatsRegion_members,      /*tp_members*/
-    DmStatsRegion_getsets,      /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmStatsRegion_init, /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
-};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ssii:resolve_device",
+                                     kwlist, &name, &uuid, &major, &minor))
+        return NULL;
 
+    if ((!!name + !!uuid + (major >= 0 || minor >= 0)) != 1
+        || ((major >= 0) != (minor >= 0))) {
+        PyErr_SetString(PyExc_TypeError, "Please specify one of name=, "
+                        "uuid=, or major= and minor= keyword arguments.");
+        return NULL;
+    }
 
-static void
-DmStatsArea_dealloc(DmStatsAreaObject *self)
-{
-    /* Notify our parent that we are departing. */
-    if (self->da_weakreflist)
-        PyObject_ClearWeakRefs((PyObject *) self);
+    if (!(row = _dmpy_dev_cache_resolve(_dmpy_get_state(self),
+                                        name, uuid, major, minor)))
+        return NULL;
 
-    /* release our reference on the parent DmStats. */
-    Py_DECREF(self->da_stats);
-    return;
+    if (row == Py_None) {
+        Py_DECREF(row);
+        PyErr_SetString(PyExc_KeyError, "No such device.");
+        return NULL;
+    }
+    return row;
 }
 
-static DmStatsAreaObject *
-newDmStatsAreaObject(PyObject *stats, uint64_t region_id, uint64_t area_id)
+static PyObject *
+_dmpy_enable_ioctl_stats(PyObject *self, PyObject *args)
 {
-    DmStatsAreaObject *area;
-    area = PyObject_GC_New(DmStatsAreaObject, &DmStatsArea_Type);
-    area->da_region_id = region_id;
-    area->da_area_id = area_id;
-    area->da_weakreflist = NULL;
-    area->da_stats = stats;
-    area->da_sequence = ((DmStatsObject *) stats)->ds_sequence;
+    int enable = 1, was_enabled = _dmpy_ioctl_stats_enabled;
 
-    /* We keep a reference on the parent DmStats to prevent it (and its handle)
-     * from being deallocated.
-     */
-    Py_INCREF(stats);
-    return area;
+    if (!PyArg_ParseTuple(args, "|p:enable_ioctl_stats", &enable))
+        return NULL;
+
+    _dmpy_ioctl_stats_enabled = enable;
+    return PyBool_FromLong(was_enabled);
 }
 
-static int
-DmStatsArea_init(DmStatsAreaObject *self, PyObject *args, PyObject *kwds)
+static PyObject *
+_dmpy_reset_ioctl_stats(PyObject *self, PyObject *args)
 {
-    uint64_t area_id;
-    if (!PyArg_ParseTuple(args, "i:__init__", &area_id))
-        return -1;
-    self->da_area_id = area_id;
-    return 0;
+    PyThread_acquire_lock(_dmpy_ioctl_stats_lock, WAIT_LOCK);
+    memset(_dmpy_ioctl_stats, 0, sizeof(_dmpy_ioctl_stats));
+    PyThread_release_lock(_dmpy_ioctl_stats_lock);
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-/* Check the sequence number for this DmStatsArea against its parent.
- * The ds_sequence value stored in DmStats is initialised to zero, and
- * incremented on each operation that invalidates the handle's tables
- * (bind, list, populate).
- *
- * If the sequence number we are holding, and the one stored in the
- * parent do not match, the handle has been invalidated since this
- * object was created and all operations should raise LookupError.
+/*
+ * Return a new dictionary describing one row of the ioctl stats.
  */
-static int
-_DmStatsArea_sequence_check(PyObject *o)
+static PyObject *
+_dmpy_ioctl_stat_dict(const struct dmpy_ioctl_stat *stat)
 {
-    DmStatsAreaObject *self = (DmStatsAreaObject *) o;
-    DmStatsObject *stats;
-
-    if (!DmStatsAreaObject_Check(o))
-        return -1;
+    PyObject *hist, *value, *dict = NULL;
+    int i;
 
-    stats = DMSTATS_FROM_AREA(self);
+    if (!(hist = PyTuple_New(DMPY_IOCTL_HIST_BINS)))
+        return NULL;
 
-    if (self->da_sequence != stats->ds_sequence) {
-        PyErr_SetString(PyExc_LookupError, "Attempt to access regions in"
-                        " changed DmStats object.");
-        return -1;
+    for (i = 0; i < DMPY_IOCTL_HIST_BINS; i++) {
+        if (!(value = PyLong_FromUnsignedLongLong(stat->hist[i])))
+            goto out;
+        PyTuple_SET_ITEM(hist, i, value);
     }
-    return 0;
+
+    dict = Py_BuildValue("{s:K,s:K,s:K,s:O}",
+                         "calls", (unsigned long long) stat->calls,
+                         "errors", (unsigned long long) stat->errors,
+                         "total_ns", (unsigned long long) stat->total_ns,
+                         "histogram", hist);
+out:
+    Py_DECREF(hist);
+    return dict;
 }
 
-#define DmStatsArea_SeqCheck(o)                          \
-do {                                                     \
-    if (_DmStatsArea_sequence_check((PyObject *)(o)))    \
-        return NULL;                                     \
-} while(0);
+static PyObject *
+_dmpy_get_ioctl_stats(PyObject *self, PyObject *args)
+{
+    struct dmpy_ioctl_stat row;
+    PyObject *stats, *stat;
+    const char *name;
+    int i;
 
-#define MkDmStatsArea_startlen_getter(name)                                   \
-static PyObject *                                                             \
-DmStatsArea_ ## name ##_getter(DmStatsAreaObject *self, void *arg)            \
-{                                                                             \
-    DmStatsObject *stats = DMSTATS_FROM_AREA(self);                           \
-    uint64_t name;                                                            \
-    int r;                                                                    \
-                                                                              \
-    DmStatsArea_SeqCheck(self);                                               \
-                                                                              \
-    r = dm_stats_get_area_ ## name(stats->ds_dms, &name,                      \
-                                     self->da_region_id, self->da_area_id);   \
-    if (!r) {                                                                 \
-        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "      \
-                        "state: no region data.");                            \
-        return NULL;                                                          \
-    }                                                                         \
-    return Py_BuildValue("l", name);                                          \
-}
+    if (!(stats = PyDict_New()))
+        return NULL;
 
-MkDmStatsArea_startlen_getter(start)
-MkDmStatsArea_startlen_getter(offset)
+    for (i = 0; i < DMPY_NR_IOCTL_STATS; i++) {
+        PyThread_acquire_lock(_dmpy_ioctl_stats_lock, WAIT_LOCK);
+        row = _dmpy_ioctl_stats[i];
+        PyThread_release_lock(_dmpy_ioctl_stats_lock);
+        if (!row.calls)
+            continue;
+        name = (i < DMPY_NR_TASK_TYPES) ? _dm_task_type_names[i]
+               : _dmpy_ioctl_stats_names[i - DMPY_NR_TASK_TYPES];
+        if (!(stat = _dmpy_ioctl_stat_dict(&row))
+            || PyDict_SetItemString(stats, name, stat)) {
+            Py_XDECREF(stat);
+            Py_DECREF(stats);
+            return NULL;
+        }
+        Py_DECREF(stat);
+    }
+    return stats;
+}
 
 static PyObject *
-DmStatsArea_len_getter(DmStatsAreaObject *self, void *arg)
+_dmpy_profile_enable(PyObject *self, PyObject *args)
 {
-    DmStatsObject *stats = DMSTATS_FROM_AREA(self);
-    uint64_t len;
-    int r;
-
-    DmStatsArea_SeqCheck(self);
+    int enable = 1;
+#ifdef DMPY_PROFILE
+    int was_enabled = _dmpy_profile_enabled;
+#endif
 
-    r = dm_stats_get_region_area_len(stats->ds_dms, &len, self->da_region_id);
-    if (!r) {
-        PyErr_SetString(PyExc_SystemError, "Unexpected dm_stats handle "
-                        "state: no region data.");
+    if (!PyArg_ParseTuple(args, "|p:profile_enable", &enable))
         return NULL;
-    }
-    return Py_BuildValue("l", len);
+
+#ifdef DMPY_PROFILE
+    _dmpy_profile_enabled = enable;
+    return PyBool_FromLong(was_enabled);
+#else
+    PyErr_SetString(PyExc_NotImplementedError, "dmpy was built without "
+                    "DMPY_PROFILE.");
+    return NULL;
+#endif
 }
 
 static PyObject *
-DmStatsArea_region_getter(DmStatsAreaObject *self, void *arg)
+_dmpy_profile_reset(PyObject *self, PyObject *args)
 {
-    return DmStats_get_item(self->da_stats, self->da_region_id);
+#ifdef DMPY_PROFILE
+    struct dmpy_profile_site *site;
+
+    site = __atomic_load_n(&_dmpy_profile_sites, __ATOMIC_ACQUIRE);
+    for (; site; site = site->next) {
+        __atomic_store_n(&site->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->cycles, 0, __ATOMIC_RELAXED);
+    }
+#endif
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
 static PyObject *
-DmStatsArea_counter_getter(DmStatsAreaObject *self, void *arg)
+_dmpy_profile_snapshot(PyObject *self, PyObject *args)
 {
-    dm_stats_counter_t counter = (dm_stats_counter_t) arg;
-    struct dm_stats *dms = DMS_FROM_AREA(self);
+    PyObject *sites;
+#ifdef DMPY_PROFILE
+    struct dmpy_profile_site *site;
+    PyObject *value;
+    uint64_t calls, cycles;
+#endif
 
-    if (counter < 0 || counter >= DM_STATS_NR_COUNTERS) {
-        PyErr_SetString(PyExc_AttributeError, "Invalid counter attribute.");
+    if (!(sites = PyDict_New()))
         return NULL;
-    }
 
-    return Py_BuildValue("l", dm_stats_get_counter(dms, counter,
-                                                   self->da_region_id,
-                                                   self->da_area_id));
+#ifdef DMPY_PROFILE
+    site = __atomic_load_n(&_dmpy_profile_sites, __ATOMIC_ACQUIRE);
+    for (; site; site = site->next) {
+        calls = __atomic_load_n(&site->calls, __ATOMIC_RELAXED);
+        cycles = __atomic_load_n(&site->cycles, __ATOMIC_RELAXED);
+        if (!calls)
+            continue;
+        value = Py_BuildValue("{s:K,s:K}",
+                              "calls", (unsigned long long) calls,
+                              "cycles", (unsigned long long) cycles);
+        if (!value || PyDict_SetItemString(sites, site->name, value)) {
+            Py_XDECREF(value);
+            Py_DECREF(sites);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+#endif
+    return sites;
 }
 
 static PyObject *
-DmStatsArea_metric_getter(DmStatsAreaObject *self, void *arg)
+_dmpy_run_tasks(PyObject *self, PyObject *args, PyObject *kwds)
 {
-    dm_stats_metric_t metric = (dm_stats_counter_t) arg;
-    struct dm_stats *dms = DMS_FROM_AREA(self);
-    double value;
+    static char *kwlist[] = {"tasks", "workers", NULL};
+    int workers = DMPY_RUN_TASKS_DEFAULT_WORKERS;
+    struct dmpy_task_batch *batch;
+    PyObject *tasks, *seq, *results = NULL, *value;
+    DmTaskObject *task;
+    Py_ssize_t i, nr_tasks, nr_busy = 0;
+    int w;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i:run_tasks", kwlist,
+                                     &tasks, &workers))
+        return NULL;
 
-    if (metric < 0 || metric >= DM_STATS_NR_METRICS) {
-        PyErr_SetString(PyExc_AttributeError, "Invalid metric attribute.");
+    if ((workers < 1) || (workers > DMPY_RUN_TASKS_MAX_WORKERS)) {
+        PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d.",
+                     DMPY_RUN_TASKS_MAX_WORKERS);
         return NULL;
     }
 
-    if (!dm_stats_get_metric(dms, metric,
-                             self->da_region_id, self->da_area_id, &value)) {
-        PyErr_SetString(PyExc_OSError, "Failed to get metric data from "
-                        "device-mapper.");
+    if (!(seq = PySequence_Fast(tasks, "tasks must be a sequence of "
+                                "DmTask objects.")))
         return NULL;
+
+    nr_tasks = PySequence_Fast_GET_SIZE(seq);
+    for (i = 0; i < nr_tasks; i++) {
+        if (!DmTaskObject_Check(_dmpy_get_state(self),
+                                PySequence_Fast_GET_ITEM(seq, i))) {
+            PyErr_SetString(PyExc_TypeError, "tasks must be a sequence of "
+                            "DmTask objects.");
+            Py_DECREF(seq);
+            return NULL;
+        }
     }
 
-    return Py_BuildValue("d", value);
+    if (!(batch = _dmpy_task_batch_new(nr_tasks))) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+
+    /* Mark every task busy: a task that is already busy, including one
+     * that appears twice in the list, is rejected. No task is changed
+     * until all of them have been claimed. */
+    for (i = 0; i < nr_tasks; i++, nr_busy++) {
+        task = (DmTaskObject *) PySequence_Fast_GET_ITEM(seq, i);
+        if (_dmpy_busy_claim(&task->tk_busy, "DmTask"))
+            goto out;
+    }
+
+    for (i = 0; i < nr_tasks; i++) {
+        task = (DmTaskObject *) PySequence_Fast_GET_ITEM(seq, i);
+        /* DMT_DID_IOCTL does not imply success. */
+        task->tk_flags |= DMT_DID_IOCTL;
+        task->tk_sequence++;
+        batch->dmts[i] = task->tk_dmt;
+        batch->types[i] = task->tk_type;
+    }
+
+    if (workers > nr_tasks)
+        workers = (int) (nr_tasks ? nr_tasks : 1);
+
+    for (w = 1; w < workers; w++) {
+        PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+        batch->refs++;
+        batch->nr_running++;
+        PyThread_release_lock(batch->lock);
+        if (PyThread_start_new_thread(_dmpy_task_batch_thread, batch)
+            == PYTHREAD_INVALID_THREAD_ID) {
+            /* Run with the workers started so far. */
+            PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+            batch->refs--;
+            batch->nr_running--;
+            PyThread_release_lock(batch->lock);
+            break;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    _dmpy_task_batch_work(batch);
+    PyThread_acquire_lock(batch->done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+
+    if (!(results = PyList_New(nr_tasks)))
+        goto out;
+
+    for (i = 0; i < nr_tasks; i++) {
+        task = (DmTaskObject *) PySequence_Fast_GET_ITEM(seq, i);
+        /* set data flags from task type, as for DmTask.run() */
+        if (batch->errnos[i])
+            task->tk_flags |= DMT_DID_ERROR;
+        else {
+            task->tk_flags |= _DmTask_task_type_flags[task->tk_type];
+            _dmpy_dev_cache_task_done(task->tk_type);
+        }
+        _dmpy_ioctl_record(task->tk_type, batch->elapsed[i],
+                           !batch->errnos[i]);
+        if (!(value = PyLong_FromLong(batch->errnos[i]))) {
+            Py_CLEAR(results);
+            goto out;
+        }
+        PyList_SET_ITEM(results, i, value);
+    }
+
+out:
+    for (i = 0; i < nr_busy; i++)
+        ((DmTaskObject *) PySequence_Fast_GET_ITEM(seq, i))->tk_busy = 0;
+    _dmpy_task_batch_put(batch);
+    Py_DECREF(seq);
+    return results;
 }
 
-#define DMSTATSAREA_start_gets__doc__ \
-"The starting sector of this area, relative to the containing device."
+/*
+ * DmTree objects.
+ *
+ * A DmTree binds libdevmapper's dm_tree: add_dev() adds a device and,
+ * recursively, every device it depends on, reading the dependencies
+ * natively with DM_DEVICE_DEPS. The tree has a root node whose children
+ * are the top-level devices (those which no other device uses).
+ *
+ * deactivate() and activate() run the removes (top-down) or resumes
+ * (bottom-up) of a subtree on a small pool of native threads with the GIL
+ * released. Each device is a job that becomes runnable once the jobs it
+ * waits on have finished: the holders of a device before it is removed,
+ * and the devices it uses before it is resumed. Independent subtrees are
+ * therefore processed as soon as they are unblocked, and the run takes
+ * as many steps as the graph is deep rather than one per device.
+ *
+ * The remove and resume ioctls themselves modify the library's node state
+ * and are serialised by `_dmpy_node_lock` as for every other task. Every
+ * job shares one cookie, and the run waits for udev once at the end.
+ *
+ * The tree is not updated by deactivate() or activate(): build a new
+ * DmTree to see the result.
+ */
 
-#define DMSTATSAREA_offset_gets__doc__ \
-"The offset of this area, within the containing region, in sectors."
+#define DMPY_TREE_DEFAULT_WORKERS 4
 
-#define DMSTATSAREA_len_gets__doc__ \
-"The length of this area in sectors."
+typedef struct {
+    PyObject_HEAD
+    struct dm_tree *tr_tree;
+    int tr_busy; /* set while a method changes or runs the tree */
+    Py_ssize_t tr_nr_nodes; /* DmTreeNode objects pointing into tr_tree */
+} DmTreeObject;
 
-#define DMSTATSAREA_region_gets__doc__ \
-"The region that contains this area."
+typedef struct {
+    PyObject_HEAD
+    DmTreeObject *nd_tree;
+    struct dm_tree_node *nd_node;
+} DmTreeNodeObject;
 
-#define DMSTATSAREA_counter_gets__doc__ \
-"The value of the specified counter for this area. The available\n"      \
-"counter attributes are:\n\n"                                            \
-"READS_COUNT, READS_MERGED_COUNT, READ_SECTORS_COUNT, READ_NSECS,\n"     \
-"WRITES_COUNT, WRITES_MERGED_COUNT, WRITE_SECTORS_COUNT, WRITE_NSECS,\n" \
-"IO_IN_PROGRESS_COUNT, IO_NSECS, WEIGHTED_IO_NSECS, TOTAL_READ_NSECS."
+#define DmTreeNodeObject_Check(st, v) \
+    (Py_TYPE(v) == (st)->DmTreeNode_Type)
 
-#define DMSTATSAREA_metric_gets__doc__ \
-"The value of the specified metric for this area. The available\n"       \
-"metric attributes are:\n\n"                                             \
+/*
+ * Methods that change the tree, or run tasks on its devices, claim it
+ * with _DmTree_claim() and hold it until they return: the ioctls that
+ * they run release the GIL, and the critical section with it. Methods
+ * that only read the tree (and the getters of its nodes) read it inside
+ * a critical section on the tree, after _DmTree_check().
+ */
 
-#define COUNTER_AS_VOID(c) ((void *)(c))
-#define METRIC_AS_VOID(c) ((void *)(c))
-static PyGetSetDef DmStatsArea_getsets[] = {
-    {"start", (getter)DmStatsArea_start_getter, NULL,
-      PyDoc_STR(DMSTATSAREA_start_gets__doc__), NULL},
-    {"offset", (getter)DmStatsArea_offset_getter, NULL,
-      PyDoc_STR(DMSTATSAREA_offset_gets__doc__), NULL},
-    {"len", (getter)DmStatsArea_len_getter, NULL,
-      PyDoc_STR(DMSTATSAREA_len_gets__doc__), NULL},
-    {"region", (getter)DmStatsArea_region_getter, NULL,
-      PyDoc_STR(DMSTATSAREA_region_gets__doc__), NULL},
-    {"READS_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(0)},
-    {"READS_MERGED_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(1)},
-    {"READ_SECTORS_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(2)},
-    {"READ_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(3)},
-    {"WRITES_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(4)},
-    {"WRITES_MERGED_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(5)},
-    {"WRITE_SECTORS_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(6)},
-    {"WRITE_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(7)},
-    {"IO_IN_PROGRESS_COUNT", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(8)},
-    {"IO_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(9)},
-    {"WEIGHTED_IO_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(10)},
-    {"TOTAL_READ_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(11)},
-    {"TOTAL_WRITE_NSECS", (getter)DmStatsArea_counter_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_counter_gets__doc__), COUNTER_AS_VOID(12)},
-    {"RD_MERGES_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(0)},
-    {"WR_MERGES_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(1)},
-    {"READS_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(2)},
-    {"WRITES_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(3)},
-    {"READ_SECTORS_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(4)},
-    {"WRITE_SECTORS_PER_SEC", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(5)},
-    {"AVERAGE_REQUEST_SIZE", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(6)},
-    {"AVERAGE_QUEUE_SIZE", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(7)},
-    {"AVERAGE_WAIT_TIME", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(8)},
-    {"AVERAGE_RD_WAIT_TIME", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(9)},
-    {"AVERAGE_WR_WAIT_TIME", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(10)},
-    {"SERVICE_TIME", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(11)},
-    {"THROUGHPUT", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(12)},
-    {"UTILIZATION", (getter)DmStatsArea_metric_getter,
-      NULL, PyDoc_STR(DMSTATSAREA_metric_gets__doc__), METRIC_AS_VOID(13)},
-    {NULL, NULL}
-};
-#undef COUNTER_AS_VOID
-#undef METRIC_AS_VOID
+/*
+ * Return 0 if the tree may be read, or -1 with an exception set. Must be
+ * called in a critical section on self.
+ */
+static int
+_DmTree_check(DmTreeObject *self)
+{
+    if (self->tr_busy) {
+        PyErr_SetString(PyExc_RuntimeError, "DmTree object is in use by "
+                        "another thread.");
+        return -1;
+    }
+    if (!self->tr_tree) {
+        PyErr_SetString(PyExc_ValueError, "DmTree is not initialised.");
+        return -1;
+    }
+    return 0;
+}
 
-#define DMSTATSAREA___doc__ \
-""
+static int
+_DmTree_claim(DmTreeObject *self)
+{
+    int r;
 
-#define DMSTATSAREA__doc__ \
-"Base class representing one area of a device-mapper statistics handle,\n"  \
-"and the counter data contained within it."
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!(r = _DmTree_check(self)))
+        self->tr_busy = 1;
+    Py_END_CRITICAL_SECTION();
+    return r;
+}
 
-static PyMethodDef DmStatsArea_methods[] = {
-//    {"nr_areas", (PyCFunction)DmStatsArea_nr_areas, METH_NOARGS,
-//        PyDoc_STR(DMSTATSREG_nr_areas__doc__)},
-    {NULL, NULL}
-};
+static void
+_DmTree_release(DmTreeObject *self)
+{
+    __atomic_store_n(&self->tr_busy, 0, __ATOMIC_RELEASE);
+}
 
-static PyMemberDef DmStatsArea_members[] = {
-    {"area_id", T_LONG, offsetof(DmStatsAreaObject, da_area_id),
-     READONLY, PyDoc_STR("The area identifier of this area.")},
-    {NULL}
-};
+static struct dm_tree_node *
+_DmTree_root(DmTreeObject *self)
+{
+    return dm_tree_find_node(self->tr_tree, 0, 0);
+}
+
+static PyObject *
+_newDmTreeNodeObject(DmTreeObject *tree, struct dm_tree_node *node)
+{
+    DmTreeNodeObject *self;
+
+    if (!(self = PyObject_New(DmTreeNodeObject,
+                              DMPY_STATE(tree)->DmTreeNode_Type)))
+        return NULL;
+    Py_INCREF(tree);
+    self->nd_tree = tree;
+    self->nd_node = node;
+    __atomic_add_fetch(&tree->tr_nr_nodes, 1, __ATOMIC_RELAXED);
+    return (PyObject *) self;
+}
+
+static void
+DmTree_dealloc(DmTreeObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->tr_tree)
+        dm_tree_free(self->tr_tree);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
+}
+
+static int
+DmTree_init(DmTreeObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {NULL};
+    int r = -1;
 
-static PyTypeObject DmStatsArea_Type = {
-    /* The ob_type field must be initialized in the module init function
-     * to be portable to Windows without using C++. */
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "dmpy.DmStatsArea",             /*tp_name*/
-    sizeof(DmStatsAreaObject),      /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    /* methods */
-    (destructor)DmStatsArea_dealloc,
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_reserved*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash*/
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
-    DMSTATSAREA__doc__,         /*tp_doc*/
-    0,                          /*tp_traverse*/
-    0,                          /*tp_clear*/
-    0,                          /*tp_richcompare*/
-    offsetof(DmStatsAreaObject, da_weakreflist), /*tp_weaklistoffset*/
-    0,                          /*tp_iter*/
-    0,                          /*tp_iternext*/
-    DmStatsArea_methods,        /*tp_methods*/
-    DmStatsArea_members,        /*tp_members*/
-    DmStatsArea_getsets,        /*tp_getset*/
-    0,                          /*tp_base*/
-    0,                          /*tp_dict*/
-    0,                          /*tp_descr_get*/
-    0,                          /*tp_descr_set*/
-    0,                          /*tp_dictoffset*/
-    (initproc)DmStatsArea_init, /*tp_init*/
-    0,                          /*tp_alloc*/
-    0,                          /*tp_new*/
-    0,                          /*tp_free*/
-    0,                          /*tp_is_gc*/
-};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ":__init__", kwlist))
+        return -1;
 
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->tr_busy)
+        PyErr_SetString(PyExc_RuntimeError, "DmTree object is in use by "
+                        "another thread.");
+    /* Each DmTreeNode points into the tree: it cannot be replaced while
+     * any of them is alive. */
+    else if (__atomic_load_n(&self->tr_nr_nodes, __ATOMIC_RELAXED))
+        PyErr_SetString(PyExc_ValueError, "Cannot re-initialise a DmTree "
+                        "while its DmTreeNode objects exist.");
+    else {
+        if (self->tr_tree)
+            dm_tree_free(self->tr_tree);
+        if (!(self->tr_tree = dm_tree_create()))
+            PyErr_SetString(PyExc_OSError, "Failed to create DmTree.");
+        else
+            r = 0;
+    }
+    Py_END_CRITICAL_SECTION();
+    return r;
+}
 
 /*
- * dmpy module methods.
+ * Add the device major:minor and its dependencies to the tree, which the
+ * caller has claimed. Returns 0 on success, or -1 with an exception set.
  */
+static int
+_DmTree_add_dev(DmTreeObject *self, uint32_t major, uint32_t minor)
+{
+    int node_lock, r;
+
+    node_lock = _DmTask_needs_node_lock(DM_DEVICE_DEPS);
+
+    Py_BEGIN_ALLOW_THREADS
+    DMPY_NODE_LOCK(node_lock);
+    r = dm_tree_add_dev(self->tr_tree, major, minor);
+    DMPY_NODE_UNLOCK(node_lock);
+    Py_END_ALLOW_THREADS
+
+    if (!r) {
+        PyErr_Format(PyExc_OSError, "Failed to add device %u:%u to "
+                     "DmTree.", (unsigned) major, (unsigned) minor);
+        return -1;
+    }
+    _dmpy_control_ready = 1;
+    return 0;
+}
 
 static PyObject *
-_dmpy_get_lib_version(PyObject *self, PyObject *args)
+DmTree_add_dev(DmTreeObject *self, PyObject *args)
 {
-    char version[64];
-    if (!dm_get_library_version(version, sizeof(version))) {
-        PyErr_SetString(PyExc_OSError, "Failed to get device-mapper "
-                        "library version.");
+    struct dm_tree_node *node;
+    PyObject *ret = NULL;
+    unsigned major, minor;
+
+    if (!PyArg_ParseTuple(args, "II:add_dev", &major, &minor))
         return NULL;
-    } 
-    return Py_BuildValue("s", version);
+
+    if (_DmTree_claim(self))
+        return NULL;
+
+    if (_DmTree_add_dev(self, major, minor))
+        goto out;
+
+    if (!(node = dm_tree_find_node(self->tr_tree, major, minor)))
+        PyErr_Format(PyExc_KeyError, "No DmTree node for %u:%u.",
+                     major, minor);
+    else
+        ret = _newDmTreeNodeObject(self, node);
+out:
+    _DmTree_release(self);
+    return ret;
 }
 
 static PyObject *
-_dmpy_update_nodes(PyObject *self, PyObject *args)
+DmTree_add_all(DmTreeObject *self, PyObject *args)
 {
-    dm_task_update_nodes();
-    Py_INCREF(Py_True);
-    return Py_True;
+    struct dm_task *dmt;
+    struct dm_names *names;
+    long nr_devs = 0;
+    unsigned next = 0;
+    uint64_t start, elapsed;
+    PyObject *ret = NULL;
+    int node_lock, r;
+
+    if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+        return PyErr_NoMemory();
+
+    node_lock = _DmTask_needs_node_lock(DM_DEVICE_LIST);
+
+    if (_DmTree_claim(self)) {
+        dm_task_destroy(dmt);
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    DMPY_NODE_LOCK(node_lock);
+    start = _dmpy_ioctl_start();
+    r = dm_task_run(dmt);
+    elapsed = _dmpy_ioctl_elapsed(start);
+    DMPY_NODE_UNLOCK(node_lock);
+    Py_END_ALLOW_THREADS
+
+    _dmpy_ioctl_record(DM_DEVICE_LIST, elapsed, r);
+
+    if (!r || !(names = dm_task_get_names(dmt))) {
+        PyErr_SetString(PyExc_OSError, "Failed to list devices.");
+        goto out;
+    }
+    _dmpy_control_ready = 1;
+
+    if (names->dev) {
+        do {
+            names = (struct dm_names *)((char *) names + next);
+            if (_DmTree_add_dev(self, MAJOR(names->dev),
+                                MINOR(names->dev)))
+                goto out;
+            nr_devs++;
+            next = names->next;
+        } while (next);
+    }
+
+    ret = PyLong_FromLong(nr_devs);
+out:
+    _DmTree_release(self);
+    dm_task_destroy(dmt);
+    return ret;
 }
 
 static PyObject *
-_dmpy_set_name_mangling_mode(PyObject *self, PyObject *args)
+DmTree_find(DmTreeObject *self, PyObject *args)
 {
-    int mangle_mode;
+    struct dm_tree_node *node;
+    PyObject *ret = NULL;
+    unsigned major, minor;
 
-    if (!PyArg_ParseTuple(args, "i:set_name_mangling_mode", &mangle_mode))
+    if (!PyArg_ParseTuple(args, "II:find", &major, &minor))
         return NULL;
 
-    if ((mangle_mode < 0) || (mangle_mode > DM_STRING_MANGLING_HEX)) {
-        PyErr_SetString(PyExc_ValueError, "Name mangling mode value "
-                        "out of range.");
-        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTree_check(self)) {
+        if (!(node = dm_tree_find_node(self->tr_tree, major, minor))
+            || (node == _DmTree_root(self)))
+            PyErr_Format(PyExc_KeyError, "No DmTree node for %u:%u.",
+                         major, minor);
+        else
+            ret = _newDmTreeNodeObject(self, node);
     }
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
 
-    if (!dm_set_name_mangling_mode(mangle_mode)) {
-        PyErr_SetString(PyExc_OSError, "Failed to set device-mapper name "
-                        "mangling mode.");
+static PyObject *
+DmTree_find_uuid(DmTreeObject *self, PyObject *args)
+{
+    struct dm_tree_node *node;
+    PyObject *ret = NULL;
+    const char *uuid;
+
+    if (!PyArg_ParseTuple(args, "s:find_uuid", &uuid))
         return NULL;
-    }
 
-    Py_INCREF(Py_True);
-    return Py_True;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTree_check(self)) {
+        if (!*uuid
+            || !(node = dm_tree_find_node_by_uuid(self->tr_tree, uuid)))
+            PyErr_Format(PyExc_KeyError, "No DmTree node with uuid %s.",
+                         uuid);
+        else
+            ret = _newDmTreeNodeObject(self, node);
+    }
+    Py_END_CRITICAL_SECTION();
+    return ret;
 }
 
-static PyObject *
-_dmpy_get_name_mangling_mode(PyObject *self, PyObject *args)
+/*
+ * The set of tree nodes that a DmTree method operates on.
+ */
+struct dmpy_tree_set {
+    struct dm_tree_node **nodes;
+    Py_ssize_t nr_nodes;
+    Py_ssize_t nr_alloc;
+    PyObject *index; /* dict mapping node addresses to their index */
+};
+
+static void
+_dmpy_tree_set_free(struct dmpy_tree_set *set)
 {
-    return Py_BuildValue("i", dm_get_name_mangling_mode());
+    PyMem_Free(set->nodes);
+    Py_XDECREF(set->index);
 }
 
-static PyObject *
-_dmpy_set_dev_dir(PyObject *self, PyObject *args)
+/*
+ * Return the index of node in set, -1 if it is not a member, or -2 with
+ * an exception set.
+ */
+static Py_ssize_t
+_dmpy_tree_set_find(struct dmpy_tree_set *set,
+                    const struct dm_tree_node *node)
 {
-    char *dir;
+    PyObject *key, *value;
+
+    if (!(key = PyLong_FromVoidPtr((void *) node)))
+        return -2;
+    value = PyDict_GetItemWithError(set->index, key);
+    Py_DECREF(key);
+    if (!value)
+        return PyErr_Occurred() ? -2 : -1;
+    return PyLong_AsSsize_t(value);
+}
 
-    if (!PyArg_ParseTuple(args, "s:set_dev_dir", &dir))
-        goto fail;
+static int
+_dmpy_tree_set_add(struct dmpy_tree_set *set, struct dm_tree_node *node)
+{
+    struct dm_tree_node **nodes;
+    PyObject *key, *value;
+    int r;
 
-    if (dir[0] != '/') {
-        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
-                     "not an absolute name.", dir);
-        goto fail;
+    if (set->nr_nodes == set->nr_alloc) {
+        set->nr_alloc = set->nr_alloc ? set->nr_alloc * 2 : 16;
+        if (!(nodes = PyMem_Realloc(set->nodes, sizeof(*nodes)
+                                    * (size_t) set->nr_alloc))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        set->nodes = nodes;
     }
 
-    if (!dm_set_dev_dir(dir)) {
-        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
-                     "name too long.", dir);
-        goto fail;
+    if (!(key = PyLong_FromVoidPtr((void *) node)))
+        return -1;
+    if (!(value = PyLong_FromSsize_t(set->nr_nodes))) {
+        Py_DECREF(key);
+        return -1;
     }
+    r = PyDict_SetItem(set->index, key, value);
+    Py_DECREF(key);
+    Py_DECREF(value);
+    if (r)
+        return -1;
 
-    Py_INCREF(Py_True);
-    return Py_True;
-
-fail:
-    return NULL;
+    set->nodes[set->nr_nodes++] = node;
+    return 0;
 }
 
-static PyObject *
-_dmpy_get_dev_dir(PyObject *self, PyObject *args)
+/* Returns non-zero if node is a device-mapper device whose uuid matches. */
+static int
+_dmpy_tree_node_selected(const struct dm_tree_node *node,
+                         const char *uuid_prefix)
 {
-    return Py_BuildValue("s", dm_dir());
+    const struct dm_info *info = dm_tree_node_get_info(node);
+    const char *uuid = dm_tree_node_get_uuid(node);
+
+    if (!info || !info->exists)
+        return 0;
+    if (!uuid_prefix)
+        return 1;
+    return uuid && !strncmp(uuid, uuid_prefix, strlen(uuid_prefix));
 }
 
-static PyObject *
-_dmpy_set_sysfs_dir(PyObject *self, PyObject *args)
+/*
+ * Build the set of the device-mapper devices below start, and start
+ * itself unless it is the root. Devices whose uuid does not match
+ * uuid_prefix are left out, and are not descended into. With all set,
+ * the other devices (for e.g. the disks they are built on) are included.
+ *
+ * If prune is set, devices that are also used by a device outside the
+ * set are left out, together with the devices below them: they remain in
+ * use once the set has been deactivated.
+ *
+ * Returns 0 on success, or -1 with an exception set.
+ */
+static int
+_DmTree_collect(DmTreeObject *self, struct dm_tree_node *start,
+                const char *uuid_prefix, int all, int prune,
+                struct dmpy_tree_set *set)
 {
-    char *dir;
-
-    if (!PyArg_ParseTuple(args, "s:set_sysfs_dir", &dir))
-        goto fail;
+    struct dm_tree_node *root = _DmTree_root(self), *node, *child, *parent;
+    struct dmpy_tree_set found = {NULL, 0, 0, NULL};
+    Py_ssize_t i, cur = 0, idx;
+    char *keep = NULL;
+    int changed, r = -1;
+    void *handle;
+
+    memset(set, 0, sizeof(*set));
+    if (!(set->index = PyDict_New()) || !(found.index = PyDict_New()))
+        goto out;
+
+    if (_dmpy_tree_set_add(&found, start))
+        goto out;
+
+    /* Breadth-first walk of the devices used by start. */
+    for (cur = 0; cur < found.nr_nodes; cur++) {
+        handle = NULL;
+        while ((child = dm_tree_next_child(&handle, found.nodes[cur], 0))) {
+            if (child == root)
+                continue;
+            if (!all && !_dmpy_tree_node_selected(child, uuid_prefix))
+                continue;
+            if ((idx = _dmpy_tree_set_find(&found, child)) == -2)
+                goto out;
+            if ((idx < 0) && _dmpy_tree_set_add(&found, child))
+                goto out;
+        }
+    }
 
-    if (dir[0] != '/') {
-        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
-                     "not an absolute name.", dir);
-        goto fail;
+    if (!(keep = PyMem_Malloc((size_t) found.nr_nodes))) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    for (i = 0; i < found.nr_nodes; i++)
+        keep[i] = (found.nodes[i] != root);
+
+    /* Drop devices held by a device that is not being deactivated. */
+    for (changed = prune; changed; ) {
+        changed = 0;
+        for (i = 1; i < found.nr_nodes; i++) {
+            if (!keep[i])
+                continue;
+            handle = NULL;
+            while ((parent = dm_tree_next_child(&handle, found.nodes[i],
+                                                1))) {
+                if (parent == root)
+                    continue;
+                if ((idx = _dmpy_tree_set_find(&found, parent)) == -2)
+                    goto out;
+                if ((idx < 0) || !keep[idx]) {
+                    keep[i] = 0;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
     }
 
-    if (!dm_set_sysfs_dir(dir)) {
-        PyErr_Format(PyExc_ValueError, "Invalid directory value, %s: "
-                     "name too long.", dir);
-        goto fail;
+    for (i = 0; i < found.nr_nodes; i++) {
+        node = found.nodes[i];
+        if (keep[i] && _dmpy_tree_set_add(set, node))
+            goto out;
+    }
+    r = 0;
+
+out:
+    PyMem_Free(keep);
+    _dmpy_tree_set_free(&found);
+    if (r) {
+        _dmpy_tree_set_free(set);
+        memset(set, 0, sizeof(*set));
     }
+    return r;
+}
 
-    Py_INCREF(Py_True);
-    return Py_True;
+/*
+ * A device job run by deactivate() or activate().
+ */
+struct dmpy_tree_job {
+    char *name;
+    int type; /* DM_DEVICE_REMOVE, DM_DEVICE_RESUME, or -1 for no task */
+    int nr_waiting; /* unfinished jobs that this one waits on */
+    int blocked; /* a job that this one waits on failed or was blocked */
+    int err; /* 0 on success, or the errno of a failed task */
+    int ran;
+    uint64_t elapsed;
+    Py_ssize_t *next; /* jobs waiting on this one */
+    Py_ssize_t nr_next;
+};
 
-fail:
-    return NULL;
-}
+/*
+ * A run of jobs shared by the worker threads. As for a task batch, the
+ * run is freed by whichever thread drops the last reference to it, and
+ * workers never touch a Python object.
+ */
+struct dmpy_tree_run {
+    PyThread_type_lock lock; /* protects everything below */
+    PyThread_type_lock wake; /* held except to wake an idle worker */
+    PyThread_type_lock done; /* released when the last worker finishes */
+    struct dmpy_tree_job *jobs;
+    Py_ssize_t nr_jobs;
+    Py_ssize_t *edges; /* storage for the next arrays of the jobs */
+    Py_ssize_t *ready; /* stack of runnable jobs */
+    Py_ssize_t nr_ready;
+    Py_ssize_t nr_left; /* jobs that have not yet finished */
+    Py_ssize_t *finished; /* jobs in the order that they finished */
+    Py_ssize_t nr_finished;
+    uint32_t *cookie;
+    int nr_idle; /* workers waiting for a runnable job */
+    int woken; /* the wake lock has been released */
+    int nr_running;
+    int refs;
+};
 
-static PyObject *
-_dmpy_get_sysfs_dir(PyObject *self, PyObject *args)
+static void
+_dmpy_tree_run_free(struct dmpy_tree_run *run)
 {
-    return Py_BuildValue("s", dm_sysfs_dir());
+    Py_ssize_t i;
+
+    if (run->lock)
+        PyThread_free_lock(run->lock);
+    if (run->wake)
+        PyThread_free_lock(run->wake);
+    if (run->done)
+        PyThread_free_lock(run->done);
+    for (i = 0; run->jobs && (i < run->nr_jobs); i++)
+        PyMem_RawFree(run->jobs[i].name);
+    PyMem_RawFree(run->jobs);
+    PyMem_RawFree(run->edges);
+    PyMem_RawFree(run->ready);
+    PyMem_RawFree(run->finished);
+    PyMem_RawFree(run);
 }
 
-/* Taken from libdm/libdm-common.c */
-#define DM_MAX_UUID_PREFIX_LEN  15
+static void
+_dmpy_tree_run_put(struct dmpy_tree_run *run)
+{
+    int refs;
 
-static PyObject *
-_dmpy_set_uuid_prefix(PyObject *self, PyObject *args)
+    PyThread_acquire_lock(run->lock, WAIT_LOCK);
+    refs = --run->refs;
+    PyThread_release_lock(run->lock);
+
+    if (!refs)
+        _dmpy_tree_run_free(run);
+}
+
+/*
+ * Build a run of the jobs for every device in set. Each job waits on the
+ * holders of its device in the set if parents is set, or on the devices
+ * it uses otherwise. Returns NULL with an exception set on error.
+ */
+static struct dmpy_tree_run *
+_dmpy_tree_run_new(DmTreeObject *tree, struct dmpy_tree_set *set,
+                   int type, int parents)
 {
-    char *prefix;
+    struct dm_tree_node *root = _DmTree_root(tree), *node, *other;
+    const struct dm_info *info;
+    struct dmpy_tree_run *run;
+    struct dmpy_tree_job *job;
+    Py_ssize_t i, j, nr_edges = 0, *edge;
+    size_t nr_slots = (size_t) (set->nr_nodes ? set->nr_nodes : 1);
+    const char *name;
+    void *handle;
+
+    if (!(run = PyMem_RawCalloc(1, sizeof(*run))))
+        return (struct dmpy_tree_run *) PyErr_NoMemory();
+
+    run->refs = 1;
+    run->nr_running = 1;
+    run->nr_jobs = set->nr_nodes;
+    run->nr_left = set->nr_nodes;
+    run->jobs = PyMem_RawCalloc(nr_slots, sizeof(*run->jobs));
+    run->ready = PyMem_RawCalloc(nr_slots, sizeof(*run->ready));
+    run->finished = PyMem_RawCalloc(nr_slots, sizeof(*run->finished));
+    run->lock = PyThread_allocate_lock();
+    run->wake = PyThread_allocate_lock();
+    run->done = PyThread_allocate_lock();
+
+    if (!run->jobs || !run->ready || !run->finished || !run->lock
+        || !run->wake || !run->done)
+        goto nomem;
+
+    /* Count the edges between the jobs, and their dependencies. */
+    for (i = 0; i < set->nr_nodes; i++) {
+        node = set->nodes[i];
+        job = &run->jobs[i];
+        handle = NULL;
+        while ((other = dm_tree_next_child(&handle, node, parents))) {
+            if (other == root)
+                continue;
+            if ((j = _dmpy_tree_set_find(set, other)) == -2)
+                goto bad;
+            if (j < 0)
+                continue;
+            job->nr_waiting++;
+            run->jobs[j].nr_next++;
+            nr_edges++;
+        }
 
-    if (!PyArg_ParseTuple(args, "s:set_uuid_prefix", &prefix))
-        goto fail;
+        name = dm_tree_node_get_name(node);
+        if (!(job->name = PyMem_RawMalloc(strlen(name) + 1)))
+            goto nomem;
+        strcpy(job->name, name);
 
-    if (!prefix) {
-        PyErr_SetString(PyExc_ValueError, "New uuid prefix cannot be empty.");
-        goto fail;
+        info = dm_tree_node_get_info(node);
+        if (type == DM_DEVICE_RESUME)
+            job->type = (info->suspended || info->inactive_table)
+                        ? type : -1;
+        else
+            job->type = type;
     }
 
-    if (strlen(prefix) > DM_MAX_UUID_PREFIX_LEN) {
-        PyErr_Format(PyExc_ValueError, "New uuid prefix %s too long.", prefix);
-        goto fail;
+    if (!(run->edges = PyMem_RawCalloc((size_t) (nr_edges ? nr_edges : 1),
+                                       sizeof(*run->edges))))
+        goto nomem;
+
+    for (i = 0, edge = run->edges; i < set->nr_nodes; i++) {
+        run->jobs[i].next = edge;
+        edge += run->jobs[i].nr_next;
+        run->jobs[i].nr_next = 0;
+        if (!run->jobs[i].nr_waiting)
+            run->ready[run->nr_ready++] = i;
     }
 
-    if (!dm_set_uuid_prefix(prefix)) {
-        PyErr_SetString(PyExc_OSError, "Failed to set new uuid prefix.");
-        goto fail;
+    for (i = 0; i < set->nr_nodes; i++) {
+        handle = NULL;
+        while ((other = dm_tree_next_child(&handle, set->nodes[i],
+                                           parents))) {
+            if ((other == root)
+                || ((j = _dmpy_tree_set_find(set, other)) < 0))
+                continue;
+            run->jobs[j].next[run->jobs[j].nr_next++] = i;
+        }
     }
 
-    Py_INCREF(Py_True);
-    return Py_True;
+    /* Held until the last worker finishes, and until a worker is woken. */
+    PyThread_acquire_lock(run->done, WAIT_LOCK);
+    PyThread_acquire_lock(run->wake, WAIT_LOCK);
+    return run;
 
-fail:
+nomem:
+    PyErr_NoMemory();
+bad:
+    _dmpy_tree_run_free(run);
     return NULL;
 }
 
-static PyObject *
-_dmpy_get_uuid_prefix(PyObject *self, PyObject *args)
+/*
+ * Wake one idle worker if there is a job for it to run, or if no jobs are
+ * left and it should exit. Must be called holding run->lock.
+ */
+static void
+_dmpy_tree_run_wake(struct dmpy_tree_run *run)
 {
-    return Py_BuildValue("s", dm_uuid_prefix());
+    if (run->nr_idle && !run->woken && (run->nr_ready || !run->nr_left)) {
+        run->woken = 1;
+        PyThread_release_lock(run->wake);
+    }
 }
 
-static PyObject *
-_dmpy_is_dm_major(PyObject *self, PyObject *args)
+/* Run the task of job. Must be called with the GIL released. */
+static void
+_dmpy_tree_run_job(struct dmpy_tree_run *run, struct dmpy_tree_job *job)
 {
-    int major;
+    struct dm_task *dmt;
+    uint64_t start;
+    int node_lock, r;
+
+    if (!(dmt = dm_task_create(job->type))
+        || !dm_task_set_name(dmt, job->name)) {
+        job->err = ENOMEM;
+        goto out;
+    }
 
-    if (!PyArg_ParseTuple(args, "i:is_dm_major", &major))
-        return NULL;
+    node_lock = _DmTask_needs_node_lock(job->type);
+    DMPY_NODE_LOCK(node_lock);
+    if (!dm_task_set_cookie(dmt, run->cookie, 0)) {
+        DMPY_NODE_UNLOCK(node_lock);
+        job->err = EIO;
+        goto out;
+    }
+    start = _dmpy_ioctl_start();
+    r = dm_task_run(dmt);
+    job->elapsed = _dmpy_ioctl_elapsed(start);
+    if (r)
+        _dmpy_control_ready = 1;
+    DMPY_NODE_UNLOCK(node_lock);
+
+    job->ran = 1;
+    if (!r)
+        job->err = dm_task_get_errno(dmt) ? dm_task_get_errno(dmt) : EIO;
+out:
+    if (dmt)
+        dm_task_destroy(dmt);
+}
 
-    if (dm_is_dm_major(major)) {
-        Py_INCREF(Py_True);
-        return Py_True;
-    } else {
-        Py_INCREF(Py_False);
-        return Py_False;
+/*
+ * Run jobs from run until none are left. Must be called with the GIL
+ * released.
+ */
+static void
+_dmpy_tree_run_work(struct dmpy_tree_run *run)
+{
+    struct dmpy_tree_job *job, *next;
+    Py_ssize_t i;
+    int last;
+
+    PyThread_acquire_lock(run->lock, WAIT_LOCK);
+    for (;;) {
+        if (!run->nr_ready) {
+            if (!run->nr_left)
+                break;
+            run->nr_idle++;
+            PyThread_release_lock(run->lock);
+            PyThread_acquire_lock(run->wake, WAIT_LOCK);
+            PyThread_acquire_lock(run->lock, WAIT_LOCK);
+            run->nr_idle--;
+            run->woken = 0;
+            continue;
+        }
+
+        job = &run->jobs[run->ready[--run->nr_ready]];
+        _dmpy_tree_run_wake(run);
+        PyThread_release_lock(run->lock);
+
+        if (!job->blocked && (job->type >= 0))
+            _dmpy_tree_run_job(run, job);
+
+        PyThread_acquire_lock(run->lock, WAIT_LOCK);
+        if (job->ran || job->err)
+            run->finished[run->nr_finished++] = job - run->jobs;
+        for (i = 0; i < job->nr_next; i++) {
+            next = &run->jobs[job->next[i]];
+            if (job->err || job->blocked)
+                next->blocked = 1;
+            if (!--next->nr_waiting)
+                run->ready[run->nr_ready++] = job->next[i];
+        }
+        run->nr_left--;
     }
+
+    /* Let an idle worker see that no jobs are left. */
+    _dmpy_tree_run_wake(run);
+    last = !--run->nr_running;
+    PyThread_release_lock(run->lock);
+
+    if (last)
+        PyThread_release_lock(run->done);
 }
 
-static PyObject *
-_dmpy_lib_release(PyObject *self, PyObject *args)
+static void
+_dmpy_tree_run_thread(void *arg)
 {
-    dm_lib_release();
-    Py_INCREF(Py_None);
-    return Py_None;
+    struct dmpy_tree_run *run = arg;
+
+    _dmpy_tree_run_work(run);
+    _dmpy_tree_run_put(run);
 }
 
+/*
+ * Run a task of type for the devices selected by the node and uuid_prefix
+ * arguments on a pool of workers. Returns a list of the names of the
+ * devices that were removed or resumed, in order.
+ */
 static PyObject *
-_dmpy_hold_control_dev(PyObject *self, PyObject *args)
+_DmTree_run(DmTreeObject *self, PyObject *args, PyObject *kwds, int type,
+            const char *fmt)
 {
-    int hold_open;
-    PyObject *ret;
+    static char *kwlist[] = {"node", "uuid_prefix", "workers", NULL};
+    int workers = DMPY_TREE_DEFAULT_WORKERS, w, nr_ok = 0;
+    PyObject *node_arg = NULL, *ret = NULL, *name, *waited, *value;
+    struct dmpy_tree_job *job, *failed = NULL;
+    struct dmpy_tree_set set = {NULL, 0, 0, NULL};
+    struct dmpy_tree_run *run = NULL;
+    struct dm_tree_node *start;
+    const char *uuid_prefix = NULL;
+    DmCookieObject *cookie;
+    Py_ssize_t i;
 
-    if (!PyArg_ParseTuple(args, "i:hold_control_dev", &hold_open))
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, fmt, kwlist, &node_arg,
+                                     &uuid_prefix, &workers))
         return NULL;
 
-    dm_hold_control_dev(hold_open);
-
-    if (hold_open)
-        ret = Py_True;
-    else
-        ret = Py_False;
-    Py_INCREF(ret);
+    if ((workers < 1) || (workers > DMPY_RUN_TASKS_MAX_WORKERS)) {
+        PyErr_Format(PyExc_ValueError, "workers must be between 1 and %d.",
+                     DMPY_RUN_TASKS_MAX_WORKERS);
+        return NULL;
+    }
 
-    return ret;
-}
+    if (node_arg && (node_arg != Py_None)
+        && !(DmTreeNodeObject_Check(DMPY_STATE(self), node_arg)
+             && (((DmTreeNodeObject *) node_arg)->nd_tree == self))) {
+        PyErr_SetString(PyExc_TypeError, "node must be a DmTreeNode of "
+                        "this DmTree.");
+        return NULL;
+    }
 
-static PyObject *
-_dmpy_mknodes(PyObject *self, PyObject *args)
-{
-    char *name = NULL;
+    /* The tree is busy from collection until the results are built. */
+    if (_DmTree_claim(self))
+        return NULL;
 
-    if (!PyArg_ParseTuple(args, "z:mknodes", &name))
-        goto fail;
+    if (!node_arg || (node_arg == Py_None))
+        start = _DmTree_root(self);
+    else
+        start = ((DmTreeNodeObject *) node_arg)->nd_node;
+
+    if (_DmTree_collect(self, start, uuid_prefix, 0,
+                        type == DM_DEVICE_REMOVE, &set))
+        goto out;
+
+    if (!(run = _dmpy_tree_run_new(self, &set, type,
+                                   type == DM_DEVICE_REMOVE)))
+        goto out;
+
+    if (!(cookie = PyObject_New(DmCookieObject,
+                                DMPY_STATE(self)->DmCookie_Type)))
+        goto out;
+    cookie->ck_ready = NULL;
+    if (_DmCookie_init(cookie, 0)) {
+        Py_DECREF(cookie);
+        goto out;
+    }
+    run->cookie = &cookie->ck_cookie;
+
+    if (workers > run->nr_jobs)
+        workers = (int) (run->nr_jobs ? run->nr_jobs : 1);
+
+    for (w = 1; w < workers; w++) {
+        PyThread_acquire_lock(run->lock, WAIT_LOCK);
+        run->refs++;
+        run->nr_running++;
+        PyThread_release_lock(run->lock);
+        if (PyThread_start_new_thread(_dmpy_tree_run_thread, run)
+            == PYTHREAD_INVALID_THREAD_ID) {
+            /* Run with the workers started so far. */
+            PyThread_acquire_lock(run->lock, WAIT_LOCK);
+            run->refs--;
+            run->nr_running--;
+            PyThread_release_lock(run->lock);
+            break;
+        }
+    }
 
-    if (!dm_mknodes(name)) {
-        PyErr_SetFromErrno(PyExc_OSError);
-        goto fail;
+    cookie->ck_busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    _dmpy_tree_run_work(run);
+    PyThread_acquire_lock(run->done, WAIT_LOCK);
+    Py_END_ALLOW_THREADS
+    cookie->ck_busy = 0;
+
+    for (i = 0; i < run->nr_finished; i++) {
+        job = &run->jobs[run->finished[i]];
+        if (job->ran)
+            _dmpy_ioctl_record(job->type, job->elapsed, !job->err);
+        if (job->err)
+            failed = failed ? failed : job;
+        else
+            nr_ok++;
+    }
+    if (nr_ok)
+        _dmpy_dev_cache_task_done(type);
+
+    /* Wait for udev once for every task that used the cookie, before
+     * anything can fail, so that its semaphore is always released. */
+    waited = _DmCookie_udev_wait(cookie, 0);
+    Py_DECREF(cookie);
+    if (!waited)
+        goto out;
+    Py_DECREF(waited);
+
+    ret = PyList_New(0);
+    for (i = 0; ret && (i < run->nr_finished); i++) {
+        job = &run->jobs[run->finished[i]];
+        if (job->err)
+            continue;
+        if (!(name = PyUnicode_FromString(job->name))
+            || PyList_Append(ret, name))
+            Py_CLEAR(ret);
+        Py_XDECREF(name);
     }
 
-    Py_INCREF(Py_True);
-    return Py_True;
+    if (ret && failed) {
+        Py_CLEAR(ret);
+        value = Py_BuildValue("(iN)", failed->err, PyUnicode_FromFormat(
+                              "DmTree %s of %s failed: %s",
+                              (type == DM_DEVICE_REMOVE) ? "remove"
+                              : "resume", failed->name,
+                              strerror(failed->err)));
+        if (value) {
+            PyErr_SetObject(PyExc_OSError, value);
+            Py_DECREF(value);
+        }
+    }
 
-fail:
-    return NULL;
+out:
+    if (run)
+        _dmpy_tree_run_put(run);
+    _dmpy_tree_set_free(&set);
+    _DmTree_release(self);
+    return ret;
 }
 
 static PyObject *
-_dmpy_driver_version(PyObject *self, PyObject *args)
+DmTree_deactivate(DmTreeObject *self, PyObject *args, PyObject *kwds)
 {
-    char version[DMPY_VERSION_BUF_LEN];
-
-    if (!dm_driver_version(version, sizeof(version))) {
-        PyErr_SetFromErrno(PyExc_OSError);
-        return NULL;
-    }
-
-    return Py_BuildValue("s", version);
+    return _DmTree_run(self, args, kwds, DM_DEVICE_REMOVE,
+                       "|Ozi:deactivate");
 }
 
 static PyObject *
-_dmpy_dump_memory(PyObject *self, PyObject *args)
+DmTree_activate(DmTreeObject *self, PyObject *args, PyObject *kwds)
 {
-    dm_dump_memory();
-    Py_INCREF(Py_True);
-    return Py_True;
+    return _DmTree_run(self, args, kwds, DM_DEVICE_RESUME,
+                       "|Ozi:activate");
 }
 
+/*
+ * Return a new list of the DmTreeNode objects in set, ordered so that
+ * each node follows every node in the set that uses it.
+ */
 static PyObject *
-_dmpy_udev_set_sync_support(PyObject *self, PyObject *args)
+_DmTree_set_list(DmTreeObject *self, struct dmpy_tree_set *set)
 {
-    int sync_with_udev;
+    struct dmpy_tree_run *run;
+    struct dmpy_tree_job *job;
+    PyObject *list, *node;
+    Py_ssize_t i, j;
 
-    if (!PyArg_ParseTuple(args, "i:udev_set_sync_support", &sync_with_udev))
+    if (!(run = _dmpy_tree_run_new(self, set, -1, 1)))
         return NULL;
 
-    dm_udev_set_sync_support(sync_with_udev);
+    if (!(list = PyList_New(0)))
+        goto out;
+
+    while (run->nr_ready) {
+        j = run->ready[--run->nr_ready];
+        job = &run->jobs[j];
+        if (!(node = _newDmTreeNodeObject(self, set->nodes[j]))
+            || PyList_Append(list, node)) {
+            Py_XDECREF(node);
+            Py_CLEAR(list);
+            goto out;
+        }
+        Py_DECREF(node);
+        for (i = 0; i < job->nr_next; i++)
+            if (!--run->jobs[job->next[i]].nr_waiting)
+                run->ready[run->nr_ready++] = job->next[i];
+    }
 
-    Py_INCREF(Py_None);
-    return Py_None;
+out:
+    _dmpy_tree_run_put(run);
+    return list;
 }
 
 static PyObject *
-_dmpy_udev_get_sync_support(PyObject *self, PyObject *args)
+DmTree_nodes(DmTreeObject *self, PyObject *args)
 {
-    return Py_BuildValue("i", dm_udev_get_sync_support());
+    struct dmpy_tree_set set;
+    PyObject *list = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTree_check(self)
+        && !_DmTree_collect(self, _DmTree_root(self), NULL, 1, 0, &set)) {
+        list = _DmTree_set_list(self, &set);
+        _dmpy_tree_set_free(&set);
+    }
+    Py_END_CRITICAL_SECTION();
+    return list;
 }
 
-static PyObject *
-_dmpy_udev_set_checking(PyObject *self, PyObject *args)
+static Py_ssize_t
+DmTree_len(PyObject *o)
 {
-    int checking;
-
-    if (!PyArg_ParseTuple(args, "i:udev_set_checking", &checking))
-        return NULL;
-
-    dm_udev_set_checking(checking);
-
-    Py_INCREF(Py_None);
-    return Py_None;
+    DmTreeObject *self = (DmTreeObject *) o;
+    struct dmpy_tree_set set;
+    Py_ssize_t len = -1;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTree_check(self)
+        && !_DmTree_collect(self, _DmTree_root(self), NULL, 1, 0, &set)) {
+        len = set.nr_nodes;
+        _dmpy_tree_set_free(&set);
+    }
+    Py_END_CRITICAL_SECTION();
+    return len;
 }
 
 static PyObject *
-_dmpy_udev_get_checking(PyObject *self, PyObject *args)
+DmTree_root_getter(DmTreeObject *self, void *arg)
 {
-    return Py_BuildValue("i", dm_udev_get_checking());
-}
+    PyObject *ret = NULL;
 
-static PyObject *
-_dmpy_cookie_supported(PyObject *self, PyObject *args)
-{
-    PyObject *ret = Py_True;
-    int cookie_supported = dm_cookie_supported();
-    if (!cookie_supported)
-        ret = Py_False;
-    Py_INCREF(ret);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (!_DmTree_check(self))
+        ret = _newDmTreeNodeObject(self, _DmTree_root(self));
+    Py_END_CRITICAL_SECTION();
     return ret;
 }
 
-static PyObject *
-_dmpy_udev_create_cookie(PyObject *self, PyObject *args)
-{
-    DmCookieObject *cookie;
-    uint32_t cookie_val;
+#define DMTREE_add_dev__doc__ \
+"Add the device major:minor, and every device that it depends on, to\n" \
+"the tree. Returns the DmTreeNode of the device."
+
+#define DMTREE_add_all__doc__ \
+"Add every device-mapper device, and the devices that they depend on,\n" \
+"to the tree. Returns the number of devices listed."
+
+#define DMTREE_find__doc__ \
+"Return the DmTreeNode of the device major:minor. Raises KeyError if\n" \
+"the device is not in the tree."
+
+#define DMTREE_find_uuid__doc__ \
+"Return the DmTreeNode of the device with the given uuid. Raises\n" \
+"KeyError if the device is not in the tree."
+
+#define DMTREE_nodes__doc__ \
+"Return a list of the DmTreeNode objects of the tree, excluding the\n" \
+"root, ordered top-down: each node follows the nodes that use it."
+
+#define DMTREE_deactivate__doc__ \
+"Remove node, or every device in the tree if node is None, together\n"    \
+"with the devices below it, top-down. Devices whose uuid does not start\n" \
+"with uuid_prefix are left active, as are the devices they use, and\n"    \
+"devices that are also used by a device outside the subtree.\n\n"        \
+"Independent subtrees are processed concurrently by up to workers\n"      \
+"native threads, and every remove shares one DmCookie: udev is waited\n"  \
+"on once, at the end.\n\n"                                                \
+"Returns a list of the names of the removed devices in the order that\n"  \
+"they were removed. If a remove fails the devices below it are left\n"    \
+"active, the remaining subtrees are still processed, and OSError is\n"    \
+"raised."
+
+#define DMTREE_activate__doc__ \
+"Resume node, or every device in the tree if node is None, together\n"   \
+"with the devices below it, bottom-up. Only devices that were suspended\n" \
+"or had an inactive table when they were added to the tree are\n"        \
+"resumed, and devices whose uuid does not start with uuid_prefix are\n"  \
+"skipped. Arguments, concurrency and errors are as for deactivate();\n"  \
+"returns a list of the names of the resumed devices."
+
+#define DMTREE_root__doc__ \
+"The root DmTreeNode of the tree: its children are the top-level\n" \
+"devices."
+
+static PyMethodDef DmTree_methods[] = {
+    {"add_dev", (PyCFunction)DmTree_add_dev, METH_VARARGS,
+        PyDoc_STR(DMTREE_add_dev__doc__)},
+    {"add_all", (PyCFunction)DmTree_add_all, METH_NOARGS,
+        PyDoc_STR(DMTREE_add_all__doc__)},
+    {"find", (PyCFunction)DmTree_find, METH_VARARGS,
+        PyDoc_STR(DMTREE_find__doc__)},
+    {"find_uuid", (PyCFunction)DmTree_find_uuid, METH_VARARGS,
+        PyDoc_STR(DMTREE_find_uuid__doc__)},
+    {"nodes", (PyCFunction)DmTree_nodes, METH_NOARGS,
+        PyDoc_STR(DMTREE_nodes__doc__)},
+    {"deactivate", (PyCFunction)DmTree_deactivate,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMTREE_deactivate__doc__)},
+    {"activate", (PyCFunction)DmTree_activate,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMTREE_activate__doc__)},
+    {NULL, NULL}
+};
 
-    if (!dm_udev_create_cookie(&cookie_val)) {
-        PyErr_SetFromErrno(PyExc_OSError);
-        return NULL;
-    }
+static PyGetSetDef DmTree_getsets[] = {
+    {"root", (getter)DmTree_root_getter, NULL, DMTREE_root__doc__, NULL},
+    {NULL}
+};
 
-    cookie = PyObject_New(DmCookieObject, &DmCookie_Type);
-    if (!cookie)
-        return NULL;
 
-    if (_DmCookie_init(cookie, cookie_val))
-        return NULL;
+#define DMTREE__doc__ \
+"A tree of device-mapper devices and the devices that they depend on,\n" \
+"built natively by libdevmapper. len() is the number of nodes in the\n"  \
+"tree, excluding the root.\n\n"                                          \
+"A DmTree cannot be re-initialised while any of its DmTreeNode objects\n" \
+"exist."
+
+static PyType_Slot DmTree_slots[] = {
+    {Py_tp_dealloc, DmTree_dealloc},
+    {Py_tp_doc, DMTREE__doc__},
+    {Py_sq_length, DmTree_len},
+    {Py_tp_methods, DmTree_methods},
+    {Py_tp_getset, DmTree_getsets},
+    {Py_tp_init, DmTree_init},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}
+};
 
-    cookie->ck_cookie = cookie_val;
-    _dmpy_set_cookie_values(cookie);
-    return (PyObject *) cookie;
+static PyType_Spec DmTree_spec = {
+    "dmpy.DmTree",              /*name*/
+    sizeof(DmTreeObject),       /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT,         /*flags*/
+    DmTree_slots,               /*slots*/
+};
+
+/*
+ * DmTreeNode objects.
+ */
+
+static void
+DmTreeNode_dealloc(DmTreeNodeObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    if (self->nd_tree)
+        __atomic_sub_fetch(&self->nd_tree->tr_nr_nodes, 1,
+                           __ATOMIC_RELAXED);
+    Py_XDECREF(self->nd_tree);
+    tp->tp_free((PyObject *) self);
+    Py_DECREF(tp);
 }
 
+/*
+ * Return a new list of the nodes that node uses (the holders of node if
+ * inverted is set), excluding the root.
+ */
 static PyObject *
-_dmpy_udev_complete(PyObject *self, PyObject *args)
+_DmTreeNode_links(DmTreeNodeObject *self, uint32_t inverted)
 {
-    DmCookieObject *cookie;
-
-    if (!PyArg_ParseTuple(args, "O!", &DmCookie_Type, &cookie))
-        return NULL;
-
-    return DmCookie_udev_complete(cookie, NULL);
+    struct dm_tree_node *root, *other;
+    PyObject *list = NULL, *node;
+    void *handle = NULL;
+
+    /* Nodes read the tree that they belong to. */
+    Py_BEGIN_CRITICAL_SECTION(self->nd_tree);
+    if (!_DmTree_check(self->nd_tree) && (list = PyList_New(0))) {
+        root = _DmTree_root(self->nd_tree);
+        while ((other = dm_tree_next_child(&handle, self->nd_node,
+                                           inverted))) {
+            if (other == root)
+                continue;
+            if (!(node = _newDmTreeNodeObject(self->nd_tree, other))
+                || PyList_Append(list, node)) {
+                Py_XDECREF(node);
+                Py_CLEAR(list);
+                break;
+            }
+            Py_DECREF(node);
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return list;
 }
 
 static PyObject *
-_dmpy_udev_wait(PyObject *self, PyObject *args, PyObject *kwds)
+DmTreeNode_children_getter(DmTreeNodeObject *self, void *arg)
 {
-    static char * kwlist[] = {"immediate", NULL};
-    DmCookieObject *cookie;
-    int immediate = 0;
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|i", kwlist,
-                                     &DmCookie_Type, &cookie, &immediate))
-        return NULL;
-
-    return _DmCookie_udev_wait(cookie, immediate);
+    return _DmTreeNode_links(self, 0);
 }
 
 static PyObject *
-_dmpy_message_supports_precise_timestamps(PyObject *self, PyObject *args)
+DmTreeNode_parents_getter(DmTreeNodeObject *self, void *arg)
 {
-    int precise = dm_message_supports_precise_timestamps();
-    PyObject *ret;
-
-    if (precise)
-        ret = Py_True;
-    else
-        ret = Py_False;
-
-    Py_INCREF(ret);
-    return ret;
+    return _DmTreeNode_links(self, 1);
 }
 
 static PyObject *
-_dmpy_stats_driver_supports_precise(PyObject *self, PyObject *args)
+DmTreeNode_name_getter(DmTreeNodeObject *self, void *arg)
 {
-    int precise = dm_stats_driver_supports_precise();
-    PyObject *ret;
-
-    if (precise)
-        ret = Py_True;
-    else
-        ret = Py_False;
+    PyObject *ret = NULL;
+    const char *name;
 
-    Py_INCREF(ret);
+    Py_BEGIN_CRITICAL_SECTION(self->nd_tree);
+    if (!_DmTree_check(self->nd_tree)) {
+        name = dm_tree_node_get_name(self->nd_node);
+        ret = PyUnicode_FromString(name ? name : "");
+    }
+    Py_END_CRITICAL_SECTION();
     return ret;
 }
 
 static PyObject *
-_dmpy_stats_driver_supports_histogram(PyObject *self, PyObject *args)
+DmTreeNode_uuid_getter(DmTreeNodeObject *self, void *arg)
 {
-    int histogram = dm_stats_driver_supports_histogram();
-    PyObject *ret;
-
-    if (histogram)
-        ret = Py_True;
-    else
-        ret = Py_False;
+    PyObject *ret = NULL;
+    const char *uuid;
 
-    Py_INCREF(ret);
+    Py_BEGIN_CRITICAL_SECTION(self->nd_tree);
+    if (!_DmTree_check(self->nd_tree)) {
+        uuid = dm_tree_node_get_uuid(self->nd_node);
+        ret = PyUnicode_FromString(uuid ? uuid : "");
+    }
+    Py_END_CRITICAL_SECTION();
     return ret;
 }
 
+#define DMTREENODE_INFO_GETTER(field, builder)                          \
+static PyObject *                                                       \
+DmTreeNode_ ## field ## _getter(DmTreeNodeObject *self, void *arg)      \
+{                                                                       \
+    const struct dm_info *info;                                         \
+    PyObject *ret = NULL;                                               \
+                                                                        \
+    Py_BEGIN_CRITICAL_SECTION(self->nd_tree);                           \
+    if (!_DmTree_check(self->nd_tree)) {                                \
+        info = dm_tree_node_get_info(self->nd_node);                    \
+        ret = builder(info ? info->field : 0);                          \
+    }                                                                   \
+    Py_END_CRITICAL_SECTION();                                          \
+    return ret;                                                         \
+}
+
+DMTREENODE_INFO_GETTER(exists, PyBool_FromLong)
+DMTREENODE_INFO_GETTER(suspended, PyBool_FromLong)
+DMTREENODE_INFO_GETTER(inactive_table, PyBool_FromLong)
+DMTREENODE_INFO_GETTER(open_count, PyLong_FromLong)
+DMTREENODE_INFO_GETTER(major, PyLong_FromLong)
+DMTREENODE_INFO_GETTER(minor, PyLong_FromLong)
+
+#define DMTREENODE_name__doc__ \
+"The name of the device, or an empty string for the root and for\n" \
+"devices that are not device-mapper devices."
+
+#define DMTREENODE_uuid__doc__ \
+"The uuid of the device, or an empty string."
+
+#define DMTREENODE_exists__doc__ \
+"True if the node is a device-mapper device."
+
+#define DMTREENODE_suspended__doc__ \
+"True if the device was suspended when it was added to the tree."
+
+#define DMTREENODE_inactive_table__doc__ \
+"True if the device had an inactive table when it was added to the tree."
+
+#define DMTREENODE_open_count__doc__ \
+"The open count of the device when it was added to the tree."
+
+#define DMTREENODE_major__doc__ \
+"The major number of the device."
+
+#define DMTREENODE_minor__doc__ \
+"The minor number of the device."
+
+#define DMTREENODE_children__doc__ \
+"A list of the DmTreeNode objects of the devices that this device uses."
+
+#define DMTREENODE_parents__doc__ \
+"A list of the DmTreeNode objects of the devices that use this device."
+
+static PyGetSetDef DmTreeNode_getsets[] = {
+    {"name", (getter)DmTreeNode_name_getter, NULL,
+        DMTREENODE_name__doc__, NULL},
+    {"uuid", (getter)DmTreeNode_uuid_getter, NULL,
+        DMTREENODE_uuid__doc__, NULL},
+    {"exists", (getter)DmTreeNode_exists_getter, NULL,
+        DMTREENODE_exists__doc__, NULL},
+    {"suspended", (getter)DmTreeNode_suspended_getter, NULL,
+        DMTREENODE_suspended__doc__, NULL},
+    {"inactive_table", (getter)DmTreeNode_inactive_table_getter, NULL,
+        DMTREENODE_inactive_table__doc__, NULL},
+    {"open_count", (getter)DmTreeNode_open_count_getter, NULL,
+        DMTREENODE_open_count__doc__, NULL},
+    {"major", (getter)DmTreeNode_major_getter, NULL,
+        DMTREENODE_major__doc__, NULL},
+    {"minor", (getter)DmTreeNode_minor_getter, NULL,
+        DMTREENODE_minor__doc__, NULL},
+    {"children", (getter)DmTreeNode_children_getter, NULL,
+        DMTREENODE_children__doc__, NULL},
+    {"parents", (getter)DmTreeNode_parents_getter, NULL,
+        DMTREENODE_parents__doc__, NULL},
+    {NULL}
+};
+
+#define DMTREENODE__doc__ \
+"A device in a DmTree."
+
+static PyType_Slot DmTreeNode_slots[] = {
+    {Py_tp_dealloc, DmTreeNode_dealloc},
+    {Py_tp_doc, DMTREENODE__doc__},
+    {Py_tp_getset, DmTreeNode_getsets},
+    {0, NULL}
+};
+
+static PyType_Spec DmTreeNode_spec = {
+    "dmpy.DmTreeNode",          /*name*/
+    sizeof(DmTreeNodeObject),   /*basicsize*/
+    0,                          /*itemsize*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION, /*flags*/
+    DmTreeNode_slots,           /*slots*/
+};
+
 /* List of functions defined in the module */
 
 #define DMPY_get_library_version__doc__ "Get the version of the device-mapper" \
@@ -3940,6 +16533,67 @@ _dmpy_stats_driver_supports_histogram(PyObject *self, PyObject *args)
 "Returns True if the running kernel supports the feature, or False\n"    \
 "otherwise."
 
+#define DMPY_list_devices__doc__ \
+"Return a DmDeviceList snapshot of all device-mapper devices, giving\n"  \
+"the name, uuid, major, minor and event_nr of each device from a single\n" \
+"DM_DEVICE_LIST ioctl."
+
+#define DMPY_resolve_device__doc__ \
+"Return the (name, uuid, major, minor, event_nr) row of the device with\n" \
+"the given name=, uuid=, or major= and minor=, or raise KeyError if no\n" \
+"such device exists.\n\n"                                                 \
+"Lookups are answered from a module-level DmDeviceList snapshot that is\n" \
+"refreshed with a single DM_DEVICE_LIST when any device event has\n"     \
+"occurred since it was taken, so repeated resolution of unchanged\n"     \
+"devices needs no ioctl."
+
+#define DMPY_enable_ioctl_stats__doc__ \
+"Enable (the default) or disable the collection of ioctl statistics.\n" \
+"Returns the previous setting. Collection is disabled at import."
+
+#define DMPY_reset_ioctl_stats__doc__ \
+"Discard all collected ioctl statistics."
+
+#define DMPY_ioctl_stats__doc__ \
+"Return a dictionary of the ioctl statistics collected while enabled by\n" \
+"enable_ioctl_stats(). Keys are DmTask types (\"DM_DEVICE_INFO\", ...)\n" \
+"and the DmStats calls \"stats_list\", \"stats_populate\",\n"           \
+"\"stats_create_region\" and \"stats_delete_region\". Each value is a\n"  \
+"dictionary giving the number of \"calls\" and \"errors\", the\n"        \
+"\"total_ns\" spent in the library call, and a \"histogram\" tuple of\n"  \
+"latency counts: bin i counts calls taking from 2**i to 2**(i+1) ns,\n" \
+"and the last bin also counts slower calls. Types with no recorded\n"   \
+"calls are omitted."
+
+#define DMPY_profile_enable__doc__ \
+"Enable (the default) or disable call-site profiling and return the\n"      \
+"previous setting. Profiling is disabled at import, and raises\n"           \
+"NotImplementedError unless dmpy was built with DMPY_PROFILE defined."
+
+#define DMPY_profile_reset__doc__ \
+"Discard all collected call-site profile counts."
+
+#define DMPY_profile_snapshot__doc__ \
+"Return a dictionary of the call-site counts collected while enabled by\n"  \
+"profile_enable(). Keys name a call site (\"DmStats.__getitem__\") or\n"    \
+"an event at one (\"DmStats.__getitem__.miss\"), and each value is a\n"     \
+"dictionary of the number of \"calls\" and the \"cycles\" spent in the\n"   \
+"call, in units of dmpy.PROFILE_CLOCK: \"tsc\" (CPU timestamp counter\n"    \
+"ticks) or \"ns\". Events have no cycles, and sites that have not been\n"   \
+"reached are omitted."
+
+#define DMPY_run_tasks__doc__ \
+"Run a list of prepared DmTask objects and return a list of the result\n" \
+"of each task: 0 if the task succeeded, or the errno value of the\n"      \
+"failure (EIO if the library did not report one).\n\n"                   \
+"tasks   - A sequence of DmTask objects, each ready to run().\n"          \
+"workers - The number of threads used to issue ioctls (default 4).\n\n"  \
+"The GIL is released while the tasks run. Tasks are started in list\n"   \
+"order but may complete in any order; tasks that modify device nodes\n"  \
+"are serialised as for DmTask.run(). Following run_tasks() the result\n" \
+"methods of each successful task (get_info(), get_deps(), ...) may be\n" \
+"used exactly as after a call to run()."
+
 #define DMPY___doc__ \
 ""
 
@@ -4002,6 +16656,24 @@ static PyMethodDef dmpy_methods[] = {
     {"stats_driver_supports_histogram",
         (PyCFunction)_dmpy_stats_driver_supports_histogram,
         METH_NOARGS, PyDoc_STR(DMPY_stats_driver_supports_histogram__doc__)},
+    {"list_devices", (PyCFunction)_dmpy_list_devices, METH_NOARGS,
+        PyDoc_STR(DMPY_list_devices__doc__)},
+    {"resolve_device", (PyCFunction)_dmpy_resolve_device,
+        METH_VARARGS | METH_KEYWORDS, PyDoc_STR(DMPY_resolve_device__doc__)},
+    {"enable_ioctl_stats", (PyCFunction)_dmpy_enable_ioctl_stats,
+        METH_VARARGS, PyDoc_STR(DMPY_enable_ioctl_stats__doc__)},
+    {"reset_ioctl_stats", (PyCFunction)_dmpy_reset_ioctl_stats, METH_NOARGS,
+        PyDoc_STR(DMPY_reset_ioctl_stats__doc__)},
+    {"ioctl_stats", (PyCFunction)_dmpy_get_ioctl_stats, METH_NOARGS,
+        PyDoc_STR(DMPY_ioctl_stats__doc__)},
+    {"profile_enable", (PyCFunction)_dmpy_profile_enable, METH_VARARGS,
+        PyDoc_STR(DMPY_profile_enable__doc__)},
+    {"profile_reset", (PyCFunction)_dmpy_profile_reset, METH_NOARGS,
+        PyDoc_STR(DMPY_profile_reset__doc__)},
+    {"profile_snapshot", (PyCFunction)_dmpy_profile_snapshot, METH_NOARGS,
+        PyDoc_STR(DMPY_profile_snapshot__doc__)},
+    {"run_tasks", (PyCFunction)_dmpy_run_tasks, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR(DMPY_run_tasks__doc__)},
     {NULL, NULL}           /* sentinel */
 };
 
@@ -4050,10 +16722,36 @@ static const char *_dmpy_udev_flag_names[] = {
  */
 static int _dmpy_add_stats_constants(PyObject *m)
 {
+    int i;
+
     PyModule_AddObject(m, "STATS_ALL_PROGRAMS",
                        Py_BuildValue("s", DM_STATS_ALL_PROGRAMS));
     PyModule_AddObject(m, "STATS_REGIONS_ALL",
                        Py_BuildValue("l", DM_STATS_REGIONS_ALL));
+
+    /* Counter indices, as used by DmStatsCounters arrays. */
+    for (i = 0; _dmpy_stats_counter_names[i]; i++)
+        if (PyModule_AddIntConstant(m, _dmpy_stats_counter_names[i], i) < 0)
+            return -1;
+    if (PyModule_AddIntConstant(m, "STATS_NR_COUNTERS",
+                                DM_STATS_NR_COUNTERS) < 0)
+        return -1;
+
+    /* Units of profile_snapshot() cycle counts, or None if not built. */
+#ifdef DMPY_PROFILE
+    if (PyModule_AddStringConstant(m, "PROFILE_CLOCK", DMPY_PROFILE_CLOCK) < 0)
+        return -1;
+#else
+    if (PyModule_AddObjectRef(m, "PROFILE_CLOCK", Py_None) < 0)
+        return -1;
+#endif
+
+    /* Column indices of DmHistogram arrays. */
+    if ((PyModule_AddIntConstant(m, "HISTOGRAM_LOWER", DMHIST_LOWER) < 0)
+        || (PyModule_AddIntConstant(m, "HISTOGRAM_UPPER", DMHIST_UPPER) < 0)
+        || (PyModule_AddIntConstant(m, "HISTOGRAM_COUNT", DMHIST_COUNT) < 0))
+        return -1;
+
     return 0;
 }
 
@@ -4194,102 +16892,189 @@ _dmpy_add_task_types(PyObject *m)
     	return -1;    
 }
 
-static int
-dmpy_exec(PyObject *m)
+/*
+ * The dmpy types, in creation order. Exported types are added to the
+ * module under the name following the "dmpy." prefix of the spec.
+ */
+#define DMPY_STATE_TYPE(name) offsetof(dmpy_state, name##_Type)
+
+static const struct dmpy_type_def {
+    PyType_Spec *spec;
+    size_t offset;
+    int export;
+} _dmpy_type_defs[] = {
+    {&DmTimestamp_spec, DMPY_STATE_TYPE(DmTimestamp), 1},
+    {&DmCookie_spec, DMPY_STATE_TYPE(DmCookie), 1},
+    {&DmInfo_spec, DMPY_STATE_TYPE(DmInfo), 0},
+    {&DmTask_spec, DMPY_STATE_TYPE(DmTask), 1},
+    {&DmTaskTargetIterator_spec, DMPY_STATE_TYPE(DmTaskTargetIterator), 0},
+    {&DmStats_spec, DMPY_STATE_TYPE(DmStats), 1},
+    {&DmStatsRegion_spec, DMPY_STATE_TYPE(DmStatsRegion), 0},
+    {&DmStatsArea_spec, DMPY_STATE_TYPE(DmStatsArea), 0},
+    {&DmStatsIterator_spec, DMPY_STATE_TYPE(DmStatsIterator), 0},
+    {&DmStatsCounters_spec, DMPY_STATE_TYPE(DmStatsCounters), 1},
+    {&DmStatsMetrics_spec, DMPY_STATE_TYPE(DmStatsMetrics), 1},
+    {&DmStatsGroup_spec, DMPY_STATE_TYPE(DmStatsGroup), 0},
+    {&DmHistogram_spec, DMPY_STATE_TYPE(DmHistogram), 1},
+    {&DmEventMonitor_spec, DMPY_STATE_TYPE(DmEventMonitor), 1},
+    {&DmDeviceList_spec, DMPY_STATE_TYPE(DmDeviceList), 1},
+    {&DmStatsSampler_spec, DMPY_STATE_TYPE(DmStatsSampler), 1},
+    {&DmStatsRing_spec, DMPY_STATE_TYPE(DmStatsRing), 1},
+    {&DmStatsSnapshot_spec, DMPY_STATE_TYPE(DmStatsSnapshot), 1},
+    {&DmStatsSnapshotRegion_spec, DMPY_STATE_TYPE(DmStatsSnapshotRegion), 0},
+    {&DmStatsSnapshotArea_spec, DMPY_STATE_TYPE(DmStatsSnapshotArea), 0},
+    {&DmTransaction_spec, DMPY_STATE_TYPE(DmTransaction), 1},
+    {&DmTree_spec, DMPY_STATE_TYPE(DmTree), 1},
+    {&DmTreeNode_spec, DMPY_STATE_TYPE(DmTreeNode), 1},
+    {NULL, 0, 0}
+};
+
+#define DMPY_STATE_TYPE_PTR(st, def) \
+    ((PyTypeObject **) ((char *) (st) + (def)->offset))
+
+/*
+ * Initialise the process-wide library state shared by every interpreter
+ * that imports the module. Called exactly once, by pthread_once().
+ */
+static int _dmpy_process_init_failed = 0;
+
+static void
+_dmpy_process_init(void)
 {
     /* initialise dm globals */
     dm_lib_init();
 
+    if (!(_dmpy_node_lock = PyThread_allocate_lock())
+        || !(_dmpy_ioctl_stats_lock = PyThread_allocate_lock())
+        || !(_dmpy_dev_cache_gen_lock = PyThread_allocate_lock())
+        || !(_dmpy_udev_waiter_lock = PyThread_allocate_lock())
+        || !(_dmpy_udev_waiter_wake = PyThread_allocate_lock())) {
+        _dmpy_process_init_failed = 1;
+        return;
+    }
+    PyThread_acquire_lock(_dmpy_udev_waiter_wake, WAIT_LOCK);
+
     /* Register AtExit call to dm_lib_exit() */
     if (Py_AtExit(dm_lib_exit) < 0)
-        goto fail;
-
-    /* Due to cross platform compiler issues the slots must be filled
-     * here. It's required for portability to Windows without requiring
-     * C++. */
-    DmTimestamp_Type.tp_base = &PyBaseObject_Type;
-    DmTimestamp_Type.tp_new = &PyType_GenericNew;
-
-    DmCookie_Type.tp_base = &PyBaseObject_Type;
-    DmCookie_Type.tp_new = &PyType_GenericNew;
-
-    DmInfo_Type.tp_base = &PyBaseObject_Type;
-    DmInfo_Type.tp_new = PyType_GenericNew;
-
-    DmTask_Type.tp_base = &PyBaseObject_Type;
-    DmTask_Type.tp_new = PyType_GenericNew;
-
-    DmStats_Type.tp_base = &PyBaseObject_Type;
-    DmStats_Type.tp_new = PyType_GenericNew;
-
-    DmStatsRegion_Type.tp_base = &PyBaseObject_Type;
-    DmStatsRegion_Type.tp_new = PyType_GenericNew;
-
-    DmStatsArea_Type.tp_base = &PyBaseObject_Type;
-    DmStatsArea_Type.tp_new = PyType_GenericNew;
-
-    if (PyType_Ready(&DmTimestamp_Type) < 0)
-        goto fail;
-
-    if (PyType_Ready(&DmCookie_Type) < 0)
-        goto fail;
-
-    if (PyType_Ready(&DmInfo_Type) < 0)
-        goto fail;
-
-    if (PyType_Ready(&DmTask_Type) < 0)
-        goto fail;
+        _dmpy_process_init_failed = 1;
+}
 
-    if (PyType_Ready(&DmStats_Type) < 0)
-        goto fail;
+static int
+dmpy_exec(PyObject *m)
+{
+    static pthread_once_t process_init = PTHREAD_ONCE_INIT;
+    dmpy_state *st = _dmpy_get_state(m);
+    const struct dmpy_type_def *def;
+    PyTypeObject **type;
+
+    st->dev_cache_fd = -1;
+    if (!(st->dev_cache_lock = PyThread_allocate_lock())) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
-    if (PyType_Ready(&DmStatsRegion_Type) < 0)
-        goto fail;
+    pthread_once(&process_init, _dmpy_process_init);
+    if (_dmpy_process_init_failed) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to initialise dmpy.");
+        return -1;
+    }
 
-    if (PyType_Ready(&DmStatsArea_Type) < 0)
-        goto fail;
+    for (def = _dmpy_type_defs; def->spec; def++) {
+        type = DMPY_STATE_TYPE_PTR(st, def);
+        if (!(*type = (PyTypeObject *) PyType_FromModuleAndSpec(m, def->spec,
+                                                                 NULL)))
+            return -1;
+        if (def->export && PyModule_AddType(m, *type))
+            return -1;
+    }
 
-    PyModule_AddObject(m, "DmStats", (PyObject *) &DmStats_Type);
-    PyModule_AddObject(m, "DmTask", (PyObject *) &DmTask_Type);
-    PyModule_AddObject(m, "DmCookie", (PyObject *) &DmCookie_Type);
-    PyModule_AddObject(m, "DmTimestamp", (PyObject *) &DmTimestamp_Type);
+    /* Construct DmTask and DmStats without an argument tuple. */
+    st->DmTask_Type->tp_vectorcall = DmTask_vectorcall;
+    st->DmStats_Type->tp_vectorcall = DmStats_vectorcall;
 
     /* Add some symbolic constants to the module */
-    if (DmErrorObject == NULL) {
-        DmErrorObject = PyErr_NewException("dmpy.DmError", NULL, NULL);
-        if (DmErrorObject == NULL)
-            goto fail;
-    }
-    Py_INCREF(DmErrorObject);
-    PyModule_AddObject(m, "DmError", DmErrorObject);
+    if (!(st->DmError = PyErr_NewException("dmpy.DmError", NULL, NULL)))
+        return -1;
+    if (PyModule_AddObjectRef(m, "DmError", st->DmError))
+        return -1;
 
     if (_dmpy_add_string_mangling_types(m))
-        goto fail;
+        return -1;
 
     if (_dmpy_add_task_types(m))
-        goto fail;
+        return -1;
 
     if (_dmpy_add_add_node_types(m))
-        goto fail;
+        return -1;
 
     if (_dmpy_add_read_ahead_types(m))
-        goto fail;
+        return -1;
 
     if (_dmpy_add_udev_flags(m))
-        goto fail;
+        return -1;
 
     if (_dmpy_add_stats_constants(m))
-        goto fail;
+        return -1;
 
     return 0;
- fail:
-    Py_XDECREF(m);
-    return -1;
 }
 
-#if PY_MAJOR_VERSION >= 3
+static int
+dmpy_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    dmpy_state *st = _dmpy_get_state(m);
+    const struct dmpy_type_def *def;
+
+    for (def = _dmpy_type_defs; def->spec; def++)
+        Py_VISIT(*DMPY_STATE_TYPE_PTR(st, def));
+    Py_VISIT(st->DmError);
+    Py_VISIT(st->dev_cache);
+    Py_VISIT(st->udev_loops);
+    return 0;
+}
+
+static int
+dmpy_clear(PyObject *m)
+{
+    dmpy_state *st = _dmpy_get_state(m);
+    const struct dmpy_type_def *def;
+
+    for (def = _dmpy_type_defs; def->spec; def++)
+        Py_CLEAR(*DMPY_STATE_TYPE_PTR(st, def));
+    Py_CLEAR(st->DmError);
+    Py_CLEAR(st->dev_cache);
+    Py_CLEAR(st->udev_loops);
+    return 0;
+}
+
+static void
+dmpy_free(void *m)
+{
+    dmpy_state *st = _dmpy_get_state((PyObject *) m);
+
+    dmpy_clear((PyObject *) m);
+    /* The descriptor is only valid once dmpy_exec() has allocated the lock. */
+    if (st->dev_cache_lock) {
+        if (st->dev_cache_fd >= 0)
+            close(st->dev_cache_fd);
+        PyThread_free_lock(st->dev_cache_lock);
+        st->dev_cache_lock = NULL;
+    }
+}
+
+/*
+ * All shared state is either per-interpreter module state or protected
+ * by a lock of its own, so the module supports interpreters with their
+ * own GIL and free-threaded builds.
+ */
 static struct PyModuleDef_Slot dmpy_slots[] = {
     {Py_mod_exec, dmpy_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
     {0, NULL},
 };
 
@@ -4297,30 +17082,18 @@ static struct PyModuleDef dmpymodule = {
     PyModuleDef_HEAD_INIT,
     "dmpy",
     dmpy__doc__,
-    0,
+    sizeof(dmpy_state),
     dmpy_methods,
     dmpy_slots,
-    NULL,
-    NULL,
-    NULL
+    dmpy_traverse,
+    dmpy_clear,
+    dmpy_free
 };
-#endif /* PY_MAJOR_VERSION >= 3 */
 
-#if PY_MAJOR_VERSION >= 3
-/* Export function for the py3 module (*must* be called PyInit_dmpy) */
+/* Export function for the module (*must* be called PyInit_dmpy) */
 PyMODINIT_FUNC
 PyInit_dmpy(void)
 {
     return PyModuleDef_Init(&dmpymodule);
 }
-#else
-/* Export function for the py2 module (*must* be called initdmpy) */
-PyMODINIT_FUNC
-initdmpy(void)
-{
-    PyObject *m;
-    m = Py_InitModule3("dmpy", dmpy_methods, dmpy__doc__);
-    return (void) dmpy_exec(m);
-}
-#endif /* PY_MAJOR_VERSION >= 3 */
 /* # vim: set et ts=4 sw=4 : */
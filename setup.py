@@ -1,10 +1,53 @@
 #!/usr/bin/env python
-from setuptools import setup, Extension
+import os
+import subprocess
+import sys
+from os.path import abspath, dirname, join
+from setuptools import setup, Extension, Command
+
+# DMPY_PROFILE=1 compiles in the dmpy.profile_snapshot() call-site counters.
+dmpy_macros = [('DMPY_PROFILE', '1')] if os.environ.get('DMPY_PROFILE') else []
 
 dmpy_module = Extension('dmpy',
                         libraries=['devmapper'],
+                        define_macros=dmpy_macros,
                         sources=['dmpy/dmpymodule.c'])
 
+
+class BenchCommand(Command):
+    """ Build the module in place and run the benchmark suite in
+        tests/bench/suite.py, writing JSON results to stdout or --output.
+    """
+    description = "run the dmpy benchmark suite (requires root)"
+    user_options = [
+        ('regions=', None, "number of statistics regions to create"),
+        ('areas=', None, "number of areas in each region"),
+        ('iterations=', None, "number of iterations of each benchmark"),
+        ('output=', 'o', "write JSON results to this file"),
+    ]
+
+    def initialize_options(self):
+        self.regions = None
+        self.areas = None
+        self.iterations = None
+        self.output = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        self.reinitialize_command('build_ext', inplace=1)
+        self.run_command('build_ext')
+        argv = [sys.executable, join('tests', 'bench', 'suite.py')]
+        for option in ('regions', 'areas', 'iterations', 'output'):
+            value = getattr(self, option)
+            if value is not None:
+                argv += ['--%s' % option, str(value)]
+        # The in-place build leaves the module in the top-level directory.
+        env = dict(os.environ, PYTHONPATH=abspath(dirname(__file__)))
+        subprocess.check_call(argv, env=env)
+
+
 setup(name='dmpy',
       version="0.1",
       description=("""Python bindings for device-mapper."""),
@@ -14,7 +57,8 @@ setup(name='dmpy',
       license="GPLv2",
       test_suite="tests",
       #packages=['dmpy'],
-      ext_modules=[dmpy_module]
+      ext_modules=[dmpy_module],
+      cmdclass={'bench': BenchCommand}
      )
 
 
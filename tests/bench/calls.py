@@ -0,0 +1,100 @@
+# Copyright (C) 2016 Red Hat, Inc. Bryn M. Reeves <bmr@redhat.com>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2, as
+# published by the Free Software Foundation.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+# 02110-1301, USA
+
+""" Measure the per-call overhead of DmTask and DmStats methods.
+
+    Times the construction of DmTask and DmStats objects and calls to
+    methods that do no ioctl, so that the result is dominated by the
+    cost of the call and its argument parsing. No device is needed, but
+    creating a DmStats handle still requires root:
+
+        # python tests/bench/calls.py [iterations]
+
+    Prints the mean time per call in nanoseconds for each method.
+"""
+import sys
+from time import perf_counter
+
+import dmpy as dm
+
+
+def _time(fn, iterations):
+    start = perf_counter()
+    fn(iterations)
+    return (perf_counter() - start) / iterations * 1e9
+
+
+def main(argv):
+    iterations = int(argv[1]) if len(argv) > 1 else 200000
+    dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+    dms = dm.DmStats("dmpybench")
+
+    def task_new(n):
+        for i in range(n):
+            dm.DmTask(dm.DM_DEVICE_INFO)
+
+    def stats_new(n):
+        for i in range(n):
+            dm.DmStats("dmpybench", name="dmpybench0")
+
+    def set_name(n):
+        for i in range(n):
+            dmt.set_name("dmpybench0")
+
+    def set_uuid(n):
+        for i in range(n):
+            dmt.set_uuid("DMPYBENCH-0")
+
+    def set_major_minor(n):
+        for i in range(n):
+            dmt.set_major_minor(253, 0, allow_fallback=1)
+
+    def add_target(n):
+        for i in range(n):
+            dm.DmTask(dm.DM_DEVICE_RELOAD).add_target(0, 8, "zero", "")
+
+    def region_present(n):
+        for i in range(n):
+            dms.region_present(0)
+
+    def set_sampling_interval(n):
+        for i in range(n):
+            dms.set_sampling_interval(1.0)
+
+    def set_program_id(n):
+        for i in range(n):
+            dms.set_program_id("dmpybench", allow_empty=0)
+
+    benchmarks = [
+        ("DmTask()", task_new),
+        ("DmStats()", stats_new),
+        ("DmTask.set_name()", set_name),
+        ("DmTask.set_uuid()", set_uuid),
+        ("DmTask.set_major_minor()", set_major_minor),
+        ("DmTask() + add_target()", add_target),
+        ("DmStats.region_present()", region_present),
+        ("DmStats.set_sampling_interval()", set_sampling_interval),
+        ("DmStats.set_program_id()", set_program_id)
+    ]
+    for name, fn in benchmarks:
+        print("%-34s %8.1f ns" % (name, _time(fn, iterations)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
+
+# vim: set et ts=4 sw=4 :
@@ -0,0 +1,260 @@
+# Copyright (C) 2016 Red Hat, Inc. Bryn M. Reeves <bmr@redhat.com>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2, as
+# published by the Free Software Foundation.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+# 02110-1301, USA
+
+""" Benchmark the dmpy hot paths and report the results as JSON.
+
+    Creates a dm-zero device named dmpybench0 and a dm-linear device
+    named dmpybench1 stacked on it, creates a number of statistics
+    regions with a number of areas each on the linear device, and times:
+
+      - DmTask.run() for DM_DEVICE_INFO, DM_DEVICE_LIST and
+        DM_DEVICE_TABLE tasks
+      - DmStats.list() and DmStats.populate()
+      - region and area indexing (dms[i], dms[i][j])
+      - area counter and metric getters
+      - udev cookie round trips, with and without a device resume
+
+    Each result gives the number of operations, the total time and the
+    mean time per operation. Must be run as root:
+
+        # python tests/bench/suite.py [--regions N] [--areas N]
+              [--iterations N] [--output FILE]
+
+    or, from the top-level directory:
+
+        # python setup.py bench [--regions=N] [--areas=N] ...
+
+"""
+import argparse
+import json
+import sys
+from time import perf_counter, time
+from os.path import join
+
+import dmpy as dm
+
+_bench_prefix = "dmpybench"
+_program_id = "dmpybench"
+_sectors = 2 ** 20
+
+
+def _run_task(task_type, name=None, table=None, cookie=None):
+    dmt = dm.DmTask(task_type)
+    if name:
+        dmt.set_name(name)
+    if table:
+        dmt.add_target(*table)
+    if cookie:
+        dmt.set_cookie(cookie)
+    dmt.run()
+    return dmt
+
+
+def _create_device(name, target_type, params):
+    cookie = dm.udev_create_cookie()
+    _run_task(dm.DM_DEVICE_CREATE, name, (0, _sectors, target_type, params),
+              cookie)
+    cookie.udev_wait()
+
+
+def _remove_device(name):
+    cookie = dm.udev_create_cookie()
+    _run_task(dm.DM_DEVICE_REMOVE, name, cookie=cookie)
+    cookie.udev_wait()
+
+
+def _create_regions(name, nr_regions, nr_areas):
+    dms = dm.DmStats(_program_id, name=name)
+    region_len = _sectors // nr_regions
+    for i in range(nr_regions):
+        dms.create_region(i * region_len, region_len, -nr_areas,
+                          program_id=_program_id)
+
+
+def _time(fn, nr_ops):
+    """ Call fn() and return a result dictionary for nr_ops operations.
+    """
+    start = perf_counter()
+    fn()
+    total = perf_counter() - start
+    return {
+        "ops": nr_ops,
+        "total_s": total,
+        "per_op_us": (total / nr_ops) * 1e6 if nr_ops else 0.0
+    }
+
+
+def _bench_tasks(results, names, iterations):
+    def _run(task_type, name):
+        def fn():
+            for i in range(iterations):
+                _run_task(task_type, name)
+        return fn
+
+    results["task_run_info"] = _time(_run(dm.DM_DEVICE_INFO, names[1]),
+                                     iterations)
+    results["task_run_list"] = _time(_run(dm.DM_DEVICE_LIST, None),
+                                     iterations)
+    results["task_run_table"] = _time(_run(dm.DM_DEVICE_TABLE, names[1]),
+                                      iterations)
+
+
+def _bench_stats(results, name, iterations):
+    dms = dm.DmStats(_program_id, name=name)
+
+    def list_fn():
+        for i in range(iterations):
+            dms.list()
+
+    def populate_fn():
+        for i in range(iterations):
+            dms.populate()
+
+    results["stats_list"] = _time(list_fn, iterations)
+    results["stats_populate"] = _time(populate_fn, iterations)
+
+    nr_regions = len(dms)
+    nr_areas = dms[0].nr_areas
+
+    def region_fn():
+        for i in range(iterations):
+            for region_id in range(nr_regions):
+                dms[region_id]
+
+    def area_fn():
+        for i in range(iterations):
+            for region_id in range(nr_regions):
+                region = dms[region_id]
+                for area_id in range(nr_areas):
+                    region[area_id]
+
+    def counter_fn():
+        for i in range(iterations):
+            for region in dms:
+                for area in region:
+                    area.READS_COUNT
+                    area.WRITES_COUNT
+
+    def metric_fn():
+        for i in range(iterations):
+            for region in dms:
+                for area in region:
+                    area.READS_PER_SEC
+                    area.UTILIZATION
+
+    def counters_fn():
+        for i in range(iterations):
+            memoryview(dms.counters())
+
+    total_areas = nr_regions * nr_areas
+    results["stats_get_region"] = _time(region_fn, iterations * nr_regions)
+    results["stats_get_area"] = _time(area_fn, iterations * total_areas)
+    dms.set_sampling_interval(1.0)
+    results["area_counter_get"] = _time(counter_fn,
+                                        iterations * total_areas * 2)
+    results["area_metric_get"] = _time(metric_fn,
+                                       iterations * total_areas * 2)
+    results["stats_counters_snapshot"] = _time(counters_fn, iterations)
+
+
+def _bench_cookies(results, name, iterations):
+    def cookie_fn():
+        for i in range(iterations):
+            cookie = dm.udev_create_cookie()
+            cookie.udev_complete()
+            cookie.udev_wait()
+
+    def resume_fn():
+        for i in range(iterations):
+            cookie = dm.udev_create_cookie()
+            _run_task(dm.DM_DEVICE_RESUME, name, cookie=cookie)
+            cookie.udev_wait()
+
+    results["cookie_round_trip"] = _time(cookie_fn, iterations)
+    results["resume_udev_round_trip"] = _time(resume_fn, iterations)
+
+
+def _positive_int(value):
+    try:
+        n = int(value)
+    except ValueError:
+        n = 0
+    if n < 1:
+        raise argparse.ArgumentTypeError("%r is not a positive integer" %
+                                         value)
+    return n
+
+
+def _parse_args(argv):
+    parser = argparse.ArgumentParser(description="Benchmark dmpy.")
+    parser.add_argument("--regions", type=_positive_int, default=16,
+                        help="Number of statistics regions to create")
+    parser.add_argument("--areas", type=_positive_int, default=16,
+                        help="Number of areas in each region")
+    parser.add_argument("--iterations", type=_positive_int, default=1000,
+                        help="Number of iterations of each benchmark")
+    parser.add_argument("--output", default=None,
+                        help="Write JSON results to this file")
+    args = parser.parse_args(argv)
+    if args.regions * args.areas > _sectors:
+        parser.error("--regions * --areas must not exceed %d" % _sectors)
+    return args
+
+
+def main(argv):
+    args = _parse_args(argv[1:])
+    names = ["%s%d" % (_bench_prefix, i) for i in range(2)]
+    results = {}
+
+    _create_device(names[0], "zero", "")
+    try:
+        _create_device(names[1], "linear",
+                       "%s 0" % join(dm.get_dev_dir(), names[0]))
+        try:
+            _create_regions(names[1], args.regions, args.areas)
+            _bench_tasks(results, names, args.iterations)
+            _bench_stats(results, names[1], args.iterations)
+            _bench_cookies(results, names[1], args.iterations)
+        finally:
+            _remove_device(names[1])
+    finally:
+        _remove_device(names[0])
+
+    report = {
+        "library_version": dm.get_library_version(),
+        "driver_version": dm.driver_version(),
+        "timestamp": time(),
+        "parameters": {
+            "regions": args.regions,
+            "areas": args.areas,
+            "iterations": args.iterations
+        },
+        "results": results
+    }
+
+    output = json.dumps(report, indent=4, sort_keys=True)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(output + "\n")
+    else:
+        print(output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
+
+# vim: set et ts=4 sw=4 :
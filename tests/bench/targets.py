@@ -0,0 +1,108 @@
+# Copyright (C) 2016 Red Hat, Inc. Bryn M. Reeves <bmr@redhat.com>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2, as
+# published by the Free Software Foundation.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+# 02110-1301, USA
+
+""" Compare DmTask.targets() with parsing 'dmsetup status' output.
+
+    Creates a set of dm-zero devices named dmpybench<N>, then reads the
+    status of every device once with DM_DEVICE_STATUS tasks iterated via
+    DmTask.targets(), and once by running and parsing 'dmsetup status'.
+    Prints the time taken by each method. Must be run as root:
+
+        # python tests/bench/targets.py [nr_devices]
+
+"""
+import sys
+from subprocess import check_output
+from time import time
+
+import dmpy as dm
+
+_bench_prefix = "dmpybench"
+
+
+def _create_zero_device(name, sectors=2048):
+    dmt = dm.DmTask(dm.DM_DEVICE_CREATE)
+    dmt.set_name(name)
+    dmt.add_target(0, sectors, "zero", "")
+    cookie = dm.udev_create_cookie()
+    dmt.set_cookie(cookie)
+    dmt.run()
+    cookie.udev_wait()
+
+
+def _remove_device(name):
+    dmt = dm.DmTask(dm.DM_DEVICE_REMOVE)
+    dmt.set_name(name)
+    cookie = dm.udev_create_cookie()
+    dmt.set_cookie(cookie)
+    dmt.run()
+    cookie.udev_wait()
+
+
+def _status_targets(names):
+    status = {}
+    for name in names:
+        dmt = dm.DmTask(dm.DM_DEVICE_STATUS)
+        dmt.set_name(name)
+        dmt.run()
+        status[name] = list(dmt.targets())
+    return status
+
+
+def _status_dmsetup(names):
+    status = {}
+    wanted = set(names)
+    output = check_output(["dmsetup", "status"]).decode("utf8")
+    for line in output.splitlines():
+        (name, fields) = line.split(": ", 1)
+        if name not in wanted:
+            continue
+        fields = fields.split(None, 3)
+        params = fields[3] if len(fields) > 3 else ""
+        target = (int(fields[0]), int(fields[1]), fields[2], params)
+        status.setdefault(name, []).append(target)
+    return status
+
+
+def _time(fn, names):
+    start = time()
+    status = fn(names)
+    return (time() - start, status)
+
+
+def main(argv):
+    nr_devices = int(argv[1]) if len(argv) > 1 else 1000
+    names = ["%s%d" % (_bench_prefix, i) for i in range(nr_devices)]
+
+    for name in names:
+        _create_zero_device(name)
+    try:
+        (t_targets, s_targets) = _time(_status_targets, names)
+        (t_dmsetup, s_dmsetup) = _time(_status_dmsetup, names)
+        if s_targets != s_dmsetup:
+            print("warning: status results differ")
+        print("devices=%d targets()=%.3fs dmsetup=%.3fs ratio=%.2f" %
+              (nr_devices, t_targets, t_dmsetup, t_dmsetup / t_targets))
+    finally:
+        for name in names:
+            _remove_device(name)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
+
+# vim: set et ts=4 sw=4 :
@@ -0,0 +1,100 @@
+# Copyright (C) 2016 Red Hat, Inc. Bryn M. Reeves <bmr@redhat.com>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License, version 2, as
+# published by the Free Software Foundation.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+# 02110-1301, USA
+
+""" Measure DM_DEVICE_INFO throughput from 1, 2, 4 and 8 threads.
+
+    Creates a set of dm-zero devices named dmpybench<N>, issues a fixed
+    number of INFO tasks against them from each thread count and prints
+    the resulting tasks/s. Must be run as root:
+
+        # python tests/bench/threaded_run.py [nr_devices] [nr_tasks]
+
+"""
+import sys
+import threading
+from time import time
+
+import dmpy as dm
+
+_bench_prefix = "dmpybench"
+_thread_counts = [1, 2, 4, 8]
+
+
+def _create_zero_device(name, sectors=2048):
+    dmt = dm.DmTask(dm.DM_DEVICE_CREATE)
+    dmt.set_name(name)
+    dmt.add_target(0, sectors, "zero", "")
+    cookie = dm.udev_create_cookie()
+    dmt.set_cookie(cookie)
+    dmt.run()
+    cookie.udev_wait()
+
+
+def _remove_device(name):
+    dmt = dm.DmTask(dm.DM_DEVICE_REMOVE)
+    dmt.set_name(name)
+    cookie = dm.udev_create_cookie()
+    dmt.set_cookie(cookie)
+    dmt.run()
+    cookie.udev_wait()
+
+
+def _info_worker(names, nr_tasks):
+    for i in range(nr_tasks):
+        dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+        dmt.set_name(names[i % len(names)])
+        dmt.run()
+
+
+def _run(names, nr_threads, nr_tasks):
+    per_thread = nr_tasks // nr_threads
+    threads = [threading.Thread(target=_info_worker,
+                                args=(names, per_thread))
+               for i in range(nr_threads)]
+    start = time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return (per_thread * nr_threads) / (time() - start)
+
+
+def main(argv):
+    nr_devices = int(argv[1]) if len(argv) > 1 else 8
+    nr_tasks = int(argv[2]) if len(argv) > 2 else 8192
+    names = ["%s%d" % (_bench_prefix, i) for i in range(nr_devices)]
+
+    for name in names:
+        _create_zero_device(name)
+    try:
+        # Warm up: open the control device before timing.
+        _run(names, 1, nr_devices)
+        base = None
+        for nr_threads in _thread_counts:
+            rate = _run(names, nr_threads, nr_tasks)
+            base = base or rate
+            print("threads=%d tasks/s=%.0f speedup=%.2f" %
+                  (nr_threads, rate, rate / base))
+    finally:
+        for name in names:
+            _remove_device(name)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
+
+# vim: set et ts=4 sw=4 :
@@ -799,6 +799,78 @@ class DmpyTests(unittest.TestCase):
         dmt.run()
         self.assertEqual(dmt.get_name(), self.dmpytest0)
 
+    def test_task_table_digest_apply_if_changed(self):
+        # Assert that a prepared reload digests the same as the live table
+        # it matches, and that apply_if_changed() only loads a changed one.
+        import dmpy as dm
+
+        def reload_task(targets, uuid=False):
+            dmt = dm.DmTask(dm.DM_DEVICE_RELOAD)
+            if uuid:
+                dmt.set_uuid(self.dmpytest0_uuid)
+            else:
+                dmt.set_name(self.dmpytest0)
+            dmt.add_targets(targets)
+            return dmt
+
+        dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+        with self.assertRaises(TypeError):
+            dmt.table_digest()
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        live = list(dmt.targets())
+        digest = dmt.table_digest()
+        self.assertEqual(len(digest), 16)
+
+        self.assertEqual(reload_task(live).table_digest(), digest)
+        spaced = [(s, l, t, "  %s  " % p.replace(" ", "   "))
+                  for (s, l, t, p) in live]
+        self.assertEqual(reload_task(spaced).table_digest(), digest)
+        self.assertFalse(reload_task(live).apply_if_changed())
+
+        cache = {}
+        self.assertFalse(reload_task(spaced, uuid=True).apply_if_changed(
+            cache=cache))
+        self.assertEqual(cache[self.dmpytest0_uuid][1], digest)
+        self.assertFalse(reload_task(live, uuid=True).apply_if_changed(cache))
+
+        zero = [(0, self.test_dev_size_sectors, "zero", "")]
+        self.assertNotEqual(reload_task(zero).table_digest(), digest)
+        self.assertTrue(reload_task(zero, uuid=True).apply_if_changed(cache))
+        self.assertNotIn(self.dmpytest0_uuid, cache)
+        # The new table is inactive until it is resumed.
+        self.assertFalse(reload_task(live).apply_if_changed())
+
+        with self.assertRaises(TypeError):
+            dm.DmTask(dm.DM_DEVICE_INFO).apply_if_changed()
+        with self.assertRaises(ValueError):
+            dm.DmTask(dm.DM_DEVICE_RELOAD).apply_if_changed()
+        with self.assertRaises(TypeError):
+            reload_task(live).apply_if_changed(cache=[])
+
+    def test_task_method_argument_errors(self):
+        # Assert that the METH_FASTCALL argument parsing rejects bad
+        # argument counts, keywords and types as PyArg_Parse*() would.
+        import dmpy as dm
+        dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+        dmt.set_major_minor(minor=0, major=253, allow_fallback=1)
+        with self.assertRaises(TypeError):
+            dmt.set_major_minor(253)
+        with self.assertRaises(TypeError):
+            dmt.set_major_minor(253, 0, 1, 1)
+        with self.assertRaises(TypeError):
+            dmt.set_major_minor(253, 0, nosuch=1)
+        with self.assertRaises(TypeError):
+            dmt.set_major_minor(253, 0, major=253)
+        with self.assertRaises(TypeError):
+            dmt.set_name(1)
+        with self.assertRaises(ValueError):
+            dmt.set_name("dmpy\0test")
+        with self.assertRaises(TypeError):
+            dm.DmTask()
+        with self.assertRaises(TypeError):
+            dm.DmTask(type=dm.DM_DEVICE_INFO)
+
     def test_task_set_uid(self):
         # Setting UIDs should be handled by udev rules now.
         pass
@@ -973,6 +1045,486 @@ class DmpyTests(unittest.TestCase):
         self.assertFalse(exists(join(_dev_mapper, dmpytest1)))
         dm.udev_set_sync_support(1)
 
+    def test_dmtask_run_threads(self):
+        # Assert that DM_DEVICE_INFO tasks issued concurrently from several
+        # threads all succeed and return the expected device.
+        import dmpy as dm
+        import threading
+        results = []
+
+        def _info():
+            for i in range(16):
+                dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+                dmt.set_name(self.dmpytest0)
+                dmt.run()
+                results.append(dmt.get_name())
+
+        threads = [threading.Thread(target=_info) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(len(results), 64)
+        self.assertEqual(set(results), set([self.dmpytest0]))
+
+    def test_dmtask_create_remove_threads(self):
+        # Assert that node-changing CREATE and REMOVE tasks with cookies
+        # can be run concurrently from several threads.
+        import dmpy as dm
+        import threading
+        names = ["dmpytest%d" % i for i in range(1, 5)]
+
+        def _run_task(task_type, name):
+            dmt = dm.DmTask(task_type)
+            dmt.set_name(name)
+            if task_type == dm.DM_DEVICE_CREATE:
+                dmt.add_target(0, self.test_dev_size_sectors, "zero", "")
+            cookie = dm.udev_create_cookie()
+            dmt.set_cookie(cookie)
+            dmt.run()
+            cookie.udev_wait()
+
+        def _run_all(task_type):
+            threads = [threading.Thread(target=_run_task,
+                                        args=(task_type, name))
+                       for name in names]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+
+        _run_all(dm.DM_DEVICE_CREATE)
+        for name in names:
+            self.assertTrue(exists(join(_dev_mapper, name)))
+        _run_all(dm.DM_DEVICE_REMOVE)
+        for name in names:
+            self.assertFalse(exists(join(_dev_mapper, name)))
+
+    def test_run_tasks(self):
+        # Assert that a batch of INFO tasks run by run_tasks() succeeds and
+        # leaves each task's result data available, and that a failing
+        # TABLE task reports ENXIO.
+        import dmpy as dm
+        tasks = []
+        for i in range(32):
+            dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+            dmt.set_name(self.dmpytest0)
+            tasks.append(dmt)
+        dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+        dmt.set_name(self.nodev)
+        tasks.append(dmt)
+        results = dm.run_tasks(tasks, workers=4)
+        self.assertEqual(results, [0] * 32 + [6])  # ENXIO
+        for dmt in tasks[:32]:
+            self.assertEqual(dmt.get_name(), self.dmpytest0)
+            self.assertTrue(dmt.get_info().exists)
+        self.assertEqual(dm.run_tasks([]), [])
+        with self.assertRaises(RuntimeError):
+            dm.run_tasks([tasks[0], tasks[0]])
+        # A rejected batch leaves the tasks before the duplicate unrun.
+        fresh = dm.DmTask(dm.DM_DEVICE_INFO)
+        fresh.set_name(self.dmpytest0)
+        with self.assertRaises(RuntimeError):
+            dm.run_tasks([fresh, tasks[0], tasks[0]])
+        with self.assertRaises(TypeError):
+            fresh.get_info()
+        with self.assertRaises(TypeError):
+            dm.run_tasks([None])
+        with self.assertRaises(ValueError):
+            dm.run_tasks(tasks, workers=0)
+
+    def test_ioctl_stats(self):
+        # Assert that enabled ioctl statistics count task runs, errors and
+        # stats calls, that the histogram accounts for every call, and that
+        # nothing is recorded while collection is disabled.
+        import dmpy as dm
+        for i in range(2):
+            _create_stats(self.dmpytest0, program_id=self.program_id)
+        dm.reset_ioctl_stats()
+        self.assertFalse(dm.enable_ioctl_stats())
+        try:
+            for i in range(4):
+                dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+                dmt.set_name(self.dmpytest0)
+                dmt.run()
+            dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+            dmt.set_name(self.nodev)
+            with self.assertRaises(OSError):
+                dmt.run()
+            dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+            dms.populate()
+            # One call is recorded for each region read by region_ids=.
+            dms.populate(region_ids=[0, 1])
+            stats = dm.ioctl_stats()
+            info = stats["DM_DEVICE_INFO"]
+            self.assertEqual(info["calls"], 4)
+            self.assertEqual(info["errors"], 0)
+            self.assertEqual(len(info["histogram"]), 40)
+            self.assertEqual(sum(info["histogram"]), 4)
+            self.assertTrue(info["total_ns"] > 0)
+            self.assertEqual(stats["DM_DEVICE_TABLE"]["errors"], 1)
+            self.assertEqual(stats["stats_populate"]["calls"], 3)
+        finally:
+            self.assertTrue(dm.enable_ioctl_stats(False))
+        dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        self.assertEqual(dm.ioctl_stats()["DM_DEVICE_INFO"]["calls"], 4)
+        dm.reset_ioctl_stats()
+        self.assertEqual(dm.ioctl_stats(), {})
+
+    def test_profile(self):
+        # Assert that the profiled call sites count cache hits, misses and
+        # expiries, area cache allocation and sequence check failures, and
+        # that nothing is recorded while profiling is disabled.
+        import dmpy as dm
+        if dm.PROFILE_CLOCK is None:
+            with self.assertRaises(NotImplementedError):
+                dm.profile_enable()
+            self.assertEqual(dm.profile_snapshot(), {})
+            self.skipTest("dmpy was built without DMPY_PROFILE")
+        _create_stats(self.dmpytest0, nr_areas=4, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate()
+        dm.profile_reset()
+        self.assertFalse(dm.profile_enable())
+        try:
+            region = dms[0]
+            self.assertTrue(dms[0] is region)
+            area = region[1]
+            area.READS_COUNT
+            area.start
+            del area
+            region[1]
+            dms.delete_region(0)
+            with self.assertRaises(LookupError):
+                region.start
+            snap = dm.profile_snapshot()
+        finally:
+            self.assertTrue(dm.profile_enable(False))
+        self.assertEqual(snap["DmStats.__getitem__"]["calls"], 2)
+        self.assertEqual(snap["DmStats.__getitem__.miss"]["calls"], 1)
+        self.assertEqual(snap["DmStats.__getitem__.hit"]["calls"], 1)
+        self.assertEqual(snap["DmStatsRegion.set_area_cache"]["calls"], 1)
+        self.assertEqual(snap["DmStatsRegion.__getitem__.miss"]["calls"], 2)
+        self.assertTrue(snap["weakref.expired"]["calls"] >= 1)
+        self.assertEqual(snap["DmStatsArea.counter"]["calls"], 1)
+        self.assertEqual(snap["DmStatsArea.start"]["calls"], 1)
+        self.assertEqual(snap["DmStatsRegion.sequence_check.fail"]["calls"], 1)
+        self.assertTrue(snap["DmStats.__getitem__"]["cycles"] > 0)
+        self.assertEqual(snap["weakref.expired"]["cycles"], 0)
+        dms[0]
+        self.assertEqual(dm.profile_snapshot(), snap)
+        dm.profile_reset()
+        self.assertEqual(dm.profile_snapshot(), {})
+
+    def test_task_targets(self):
+        # Assert that targets() iterates the table and status of a device
+        # in str and raw modes, and that re-running the task invalidates
+        # an outstanding iterator.
+        import dmpy as dm
+        dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        targets = list(dmt.targets())
+        self.assertEqual(len(targets), 1)
+        (start, length, target_type, params) = targets[0]
+        self.assertEqual((start, length, target_type),
+                         (0, self.test_dev_size_sectors, "linear"))
+        self.assertTrue(params.endswith(" 0"))
+        raw = list(dmt.targets(raw=True))
+        self.assertEqual(raw[0][3], params.encode())
+
+        it = dmt.targets()
+        dmt.run()
+        with self.assertRaises(LookupError):
+            next(it)
+
+        dmt = dm.DmTask(dm.DM_DEVICE_STATUS)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        self.assertEqual([t[2] for t in dmt.targets()], ["linear"])
+
+        dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        with self.assertRaises(TypeError):
+            dmt.targets()
+
+    def test_task_add_targets(self):
+        # Assert that add_targets() and add_targets_packed() load a table
+        # of many segments, substituting the per-segment params argument,
+        # and that out of range sector values raise OverflowError.
+        import dmpy as dm
+        from array import array
+        nr = 8
+        seg_len = self.test_dev_size_sectors // nr
+        segs = array("Q")
+        offsets = array("Q")
+        for i in range(nr):
+            segs.extend([i * seg_len, seg_len])
+            offsets.append((nr - i - 1) * seg_len)
+
+        dmt = dm.DmTask(dm.DM_DEVICE_RELOAD)
+        dmt.set_name(self.dmpytest0)
+        self.assertEqual(dmt.add_targets_packed(segs, "linear",
+                                                "%s {}" % self.loop0[0],
+                                                args=offsets), nr)
+        dmt.run()
+
+        dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+        dmt.set_name(self.dmpytest0)
+        dmt.query_inactive_table()
+        dmt.run()
+        targets = list(dmt.targets())
+        self.assertEqual(len(targets), nr)
+        for (i, target) in enumerate(targets):
+            self.assertEqual(target[:3], (i * seg_len, seg_len, "linear"))
+            self.assertTrue(target[3].endswith(" %d" % offsets[i]))
+
+        dmt = dm.DmTask(dm.DM_DEVICE_CLEAR)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+
+        dmt = dm.DmTask(dm.DM_DEVICE_RELOAD)
+        self.assertEqual(dmt.add_targets(t for t in targets), nr)
+        self.assertEqual(dmt.add_targets([]), 0)
+        with self.assertRaises(OverflowError):
+            dmt.add_target(-1, 1, "zero", "")
+        with self.assertRaises(OverflowError):
+            dmt.add_targets([(0, 2 ** 64, "zero", "")])
+        with self.assertRaises(TypeError):
+            dmt.add_targets([(0, 1, "zero")])
+        with self.assertRaises(ValueError):
+            dmt.add_targets_packed(segs.tobytes()[:-8], "zero", "")
+        with self.assertRaises(ValueError):
+            dmt.add_targets_packed(segs, "linear", "%s {}" % self.loop0[0])
+        with self.assertRaises(ValueError):
+            dmt.add_targets_packed(segs, "zero", "", args=offsets)
+        with self.assertRaises(TypeError):
+            dmt.add_targets_packed(array("i", [0, 1]), "zero", "")
+        self.assertEqual(dmt.add_targets_packed(segs.tobytes(), "zero", ""),
+                         nr)
+
+    def test_transaction_commit(self):
+        # Assert that a DmTransaction runs its loads before suspends and
+        # resumes under one cookie, that a failed step rolls back the
+        # loaded tables, and that a missing device fails before any change.
+        import dmpy as dm
+        zero = [(0, self.test_dev_size_sectors, "zero", "")]
+
+        def table(name):
+            dmt = dm.DmTask(dm.DM_DEVICE_TABLE)
+            dmt.set_name(name)
+            dmt.run()
+            return [t[2] for t in dmt.targets()]
+
+        tx = dm.DmTransaction()
+        tx.suspend(self.dmpytest0)
+        tx.resume(self.dmpytest0)
+        tx.load(self.dmpytest0, zero)
+        self.assertEqual(len(tx), 3)
+        with self.assertRaises(ValueError):
+            tx.resume(self.dmpytest0)
+        self.assertIsNone(tx.cookie)
+        self.assertTrue(tx.commit())
+        self.assertEqual(tx.log, [("load", self.dmpytest0, 0),
+                                  ("suspend", self.dmpytest0, 0),
+                                  ("resume", self.dmpytest0, 0)])
+        self.assertTrue(tx.cookie.ready)
+        self.assertFalse(tx.rolled_back)
+        self.assertEqual(table(self.dmpytest0), ["zero"])
+        with self.assertRaises(ValueError):
+            tx.commit()
+
+        # A load that fails to queue does not add its device.
+        tx = dm.DmTransaction()
+        tx.suspend(self.dmpytest0)
+        tx.resume(self.dmpytest0)
+        with self.assertRaises(ValueError):
+            tx.load(self.nodev, [])
+        self.assertEqual(len(tx), 2)
+        self.assertTrue(tx.commit())
+
+        dmpytx1 = "dmpytx1"
+        r = _get_cmd_output("dmsetup create %s --table='0 %d zero'" %
+                            (dmpytx1, self.test_dev_size_sectors))
+        self.assertEqual(r[0], 0)
+        try:
+            tx = dm.DmTransaction()
+            tx.load(self.dmpytest0, [(0, self.test_dev_size_sectors,
+                                      "linear", "%s 0" % self.loop0[0])])
+            tx.suspend(self.dmpytest0)
+            tx.resume(self.dmpytest0)
+            tx.load(dmpytx1, [(0, self.test_dev_size_sectors,
+                                 "dmpy_no_such", "")])
+            with self.assertRaises(OSError):
+                tx.commit()
+            self.assertTrue(tx.rolled_back)
+            self.assertEqual([e[:2] for e in tx.log],
+                             [("load", self.dmpytest0),
+                              ("load", dmpytx1),
+                              ("clear", self.dmpytest0)])
+            self.assertNotEqual(tx.log[1][2], 0)
+            self.assertEqual(table(self.dmpytest0), ["zero"])
+        finally:
+            self.udev_settle()
+            _remove_dm_device(dmpytx1)
+
+        tx = dm.DmTransaction()
+        tx.resume(self.dmpytest0)
+        tx.suspend(self.nodev)
+        with self.assertRaises(OSError):
+            tx.commit()
+        self.assertEqual(tx.log, [])
+
+    def test_tree_deactivate(self):
+        # Stack devices on the test device, build a DmTree of them and
+        # assert that it reflects the stack, and that deactivate() and
+        # activate() remove and resume the selected subtrees in order.
+        import dmpy as dm
+        names = ["dmpytree%d" % i for i in range(3)]
+        lowers = [self.dmpytest0, self.dmpytest0, names[0]]
+        try:
+            for name, lower in zip(names, lowers):
+                r = _get_cmd_output("dmsetup create %s -u DMPYTREE-%s "
+                                    "--table='0 %d linear %s 0'" %
+                                    (name, name, self.test_dev_size_sectors,
+                                     join(dm.get_dev_dir(), lower)))
+                self.assertEqual(r[0], 0)
+
+            tree = dm.DmTree()
+            tree.add_all()
+            nodes = tree.nodes()
+            self.assertEqual(len(nodes), len(tree))
+            order = [n.name for n in nodes]
+            for node in nodes:
+                for child in node.children:
+                    self.assertTrue(order.index(node.name) <
+                                    order.index(child.name))
+            by_name = dict((n.name, n) for n in nodes)
+            top = tree.find(by_name[names[2]].major, by_name[names[2]].minor)
+            self.assertEqual([c.name for c in top.children], [names[0]])
+            self.assertEqual(top.parents, [])
+            self.assertEqual(sorted(p.name for p
+                                    in by_name[self.dmpytest0].parents),
+                             names[:2])
+            self.assertEqual(tree.find_uuid("DMPYTREE-" + names[1]).name,
+                             names[1])
+            with self.assertRaises(KeyError):
+                tree.find_uuid("DMPYTREE-" + self.nodev)
+            with self.assertRaises(ValueError):
+                tree.__init__()
+
+            # dmpytest0 is still used by dmpytree1, and does not match.
+            self.assertEqual(tree.deactivate(top, uuid_prefix="DMPYTREE-",
+                                             workers=2), names[2::-2])
+
+            r = _get_cmd_output("dmsetup suspend %s" % names[1])
+            self.assertEqual(r[0], 0)
+            tree = dm.DmTree()
+            tree.add_all()
+            self.assertEqual(tree.activate(), [names[1]])
+            self.assertEqual(tree.deactivate(uuid_prefix="DMPYTREE-"),
+                             [names[1]])
+        finally:
+            self.udev_settle()
+            for name in names:
+                _get_cmd_output("dmsetup remove %s" % name)
+
+    def test_list_devices(self):
+        # Assert that list_devices() returns a snapshot whose columns and
+        # lookups agree with an INFO task for the test device.
+        import dmpy as dm
+        dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+        dmt.set_name(self.dmpytest0)
+        dmt.run()
+        info = dmt.get_info()
+        devices = dm.list_devices()
+        self.assertTrue(isinstance(devices, dm.DmDeviceList))
+        self.assertTrue(self.dmpytest0 in devices)
+        self.assertFalse(self.nodev in devices)
+        self.assertEqual(len(devices.names), len(devices))
+        row = devices.by_name(self.dmpytest0)
+        self.assertEqual(devices[devices.names.index(self.dmpytest0)], row)
+        self.assertEqual(row[2:4], (info.major, info.minor))
+        self.assertEqual(devices.by_devno(info.major, info.minor), row)
+        if row[1] is not None:
+            self.assertEqual(devices.by_uuid(row[1]), row)
+        with self.assertRaises(KeyError):
+            devices.by_name(self.nodev)
+        with self.assertRaises(IndexError):
+            devices[len(devices)]
+
+    def test_resolve_device(self):
+        # Assert that resolve_device() finds the test device by name, uuid
+        # and devno, that DmStats records the resolved device, and that the
+        # cache follows devices created and removed outside of dmpy.
+        import dmpy as dm
+        dmpytest1 = "dmpytest1"
+        row = dm.resolve_device(name=self.dmpytest0)
+        self.assertEqual(row[0], self.dmpytest0)
+        self.assertEqual(dm.resolve_device(major=row[2], minor=row[3]), row)
+        if row[1] is not None:
+            self.assertEqual(dm.resolve_device(uuid=row[1]), row)
+        with self.assertRaises(KeyError):
+            dm.resolve_device(name=self.nodev)
+        with self.assertRaises(TypeError):
+            dm.resolve_device(name=self.dmpytest0, major=row[2])
+
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        self.assertEqual(dms.device, row)
+        dms.bind_name(self.nodev)
+        self.assertEqual(dms.device, None)
+        self.assertEqual(dm.DmStats(self.program_id).device, None)
+
+        # The device is resolved when it is read, not when it is bound.
+        dms.bind_name(dmpytest1)
+        self.assertEqual(dms.device, None)
+        _get_cmd_output("dmsetup create %s --table='0 %d zero'" %
+                        (dmpytest1, self.test_dev_size_sectors))
+        try:
+            self.assertEqual(dm.resolve_device(name=dmpytest1)[0], dmpytest1)
+            self.assertEqual(dms.device[0], dmpytest1)
+        finally:
+            _remove_dm_device(dmpytest1)
+        with self.assertRaises(KeyError):
+            dm.resolve_device(name=dmpytest1)
+        self.assertEqual(dms.device, None)
+
+    def test_busy_cookie_raises(self):
+        # Assert that udev_wait() releases the GIL, and that using a DmCookie
+        # from a second thread while a wait is in flight raises RuntimeError.
+        import dmpy as dm
+        import threading
+        if not dm.udev_get_sync_support():
+            self.skipTest("udev synchronisation is not available.")
+        # Setting the cookie on a task that is never run raises the cookie's
+        # semaphore: the wait then blocks until udevcomplete is called.
+        dmt = dm.DmTask(dm.DM_DEVICE_RESUME)
+        dmt.set_name(self.dmpytest0)
+        cookie = dm.udev_create_cookie()
+        dmt.set_cookie(cookie)
+        thread = threading.Thread(target=cookie.udev_wait)
+        thread.start()
+        raised = False
+        for i in range(50):
+            try:
+                cookie.udev_wait(immediate=True)
+            except RuntimeError:
+                raised = True
+                break
+            sleep(_udev_wait_delay)
+        self.assertTrue(raised)
+        other = dm.DmTask(dm.DM_DEVICE_RESUME)
+        with self.assertRaises(RuntimeError):
+            other.set_cookie(cookie)
+        value = cookie.value & 0xffffffff
+        _get_cmd_output("dmsetup udevcomplete %d" % value)
+        thread.join(10)
+        self.assertFalse(thread.is_alive())
+        self.assertTrue(cookie.ready)
+
     #
     # Cookie tests
     #
@@ -1005,6 +1557,25 @@ class DmpyTests(unittest.TestCase):
         with self.assertRaises(ValueError) as cm:
             cookie.udev_wait()
 
+    def test_cookie_wait_async(self):
+        # Create and complete a number of cookies, await them together from
+        # an asyncio event loop and assert that they all become ready.
+        import asyncio
+        import dmpy as dm
+        cookies = [dm.udev_create_cookie() for i in range(8)]
+
+        async def wait_all():
+            for cookie in cookies:
+                cookie.udev_complete()
+            futures = [cookie.wait_async() for cookie in cookies]
+            return await asyncio.gather(*futures)
+
+        self.assertEqual(asyncio.run(wait_all()), [True] * len(cookies))
+        for cookie in cookies:
+            self.assertTrue(cookie.ready)
+        with self.assertRaises(ValueError) as cm:
+            cookies[0].wait_async(loop=asyncio.new_event_loop())
+
     def test_cookie_wait_immediate(self):
         # Create a new cookie, wait on it, and assert that it becomes ready.
         import dmpy as dm
@@ -1220,6 +1791,35 @@ class DmpyTests(unittest.TestCase):
         self.assertTrue(dms.list())
         self.assertEqual(len(dms), 1)
 
+    def test_event_monitor(self):
+        # Assert that a DmEventMonitor wakes on device creation and removal
+        # and reports them as changes against its event_nr index.
+        import dmpy as dm
+        dmpytest1 = "dmpytest1"
+        monitor = dm.DmEventMonitor()
+        self.assertTrue(monitor.fileno() >= 0)
+        self.assertTrue(self.dmpytest0 in monitor.event_nrs())
+        self.assertFalse(monitor.wait(0))
+        self.assertEqual(monitor.changes(), [])
+
+        _get_cmd_output("dmsetup create %s --table='0 %d zero'" %
+                        (dmpytest1, self.test_dev_size_sectors))
+        try:
+            self.assertTrue(monitor.wait(5))
+            changes = monitor.changes()
+            self.assertEqual([c[:2] for c in changes], [(dmpytest1, None)])
+            event_nr = changes[0][2]
+            self.assertEqual(monitor.event_nrs()[dmpytest1], event_nr)
+            self.assertFalse(monitor.wait(0))
+        finally:
+            _remove_dm_device(dmpytest1)
+        self.assertTrue(monitor.wait(5))
+        self.assertEqual(monitor.changes(), [(dmpytest1, event_nr, None)])
+
+        monitor.close()
+        with self.assertRaises(ValueError):
+            monitor.fileno()
+
     def test_stats_populate_empty(self):
         # Assert that populating an empty device yields an empty
         # DmStats object, and that the correct number of regions is
@@ -1314,11 +1914,46 @@ class DmpyTests(unittest.TestCase):
         self.assertTrue(len(dms[0]))
         # Take a reference on a DmStatsRegion
         region = dms[0]
-        # Invalidate the whole DmStats
+        # Delete the region outside of the handle and re-read the table
+        _get_cmd_output("dmstats delete --programid %s --regionid 0 %s" %
+                        (self.program_id, self.dmpytest0))
         dms.list()
         with self.assertRaises(LookupError) as cm:
             region.nr_areas
 
+    def test_region_cache_survives_populate(self):
+        # Assert that populate() and list() keep region and area objects
+        # valid when their region is unchanged, and invalidate only the
+        # regions that were deleted or created.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate()
+        region0 = dms[0]
+        region1 = dms[1]
+        area = region0[1]
+        dms.populate()
+        dms.list()
+        self.assertIs(dms[0], region0)
+        self.assertIs(region0[1], area)
+        self.assertEqual(area.area_id, 1)
+        self.assertEqual(region1.nr_areas, 2)
+
+        _get_cmd_output("dmstats delete --programid %s --regionid 1 %s" %
+                        (self.program_id, self.dmpytest0))
+        _create_stats(self.dmpytest0, nr_areas=1, program_id=self.program_id)
+        dms.populate()
+        self.assertEqual(area.area_id, 1)
+        self.assertEqual(region0.nr_areas, 2)
+        with self.assertRaises(LookupError):
+            region1.nr_areas
+        self.assertEqual(dms[1].nr_areas, 1)
+
+        dms.bind_name(self.dmpytest0)
+        with self.assertRaises(LookupError):
+            region0.nr_areas
+
     def test_dmstatsregion_precise_attr(self):
         # Assert that region precise_timestamps attributes have the expected
         # value following a list() or populate() operation.
@@ -1463,6 +2098,31 @@ class DmpyTests(unittest.TestCase):
         gc.collect()
         self.assertNotEqual(reg_str, str(dms[0]))
 
+    def test_dmstats_iter_regions(self):
+        import dmpy as dm
+        _create_stats(self.dmpytest0, program_id=self.program_id)
+        _create_stats(self.dmpytest0, program_id=self.program_id, nr_areas=4)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        regions = list(dms)
+        self.assertEqual(len(regions), 2)
+        self.assertIs(regions[1], dms[1])
+
+    def test_dmstatsregion_iter_areas(self):
+        import dmpy as dm
+        _create_stats(self.dmpytest0, program_id=self.program_id, nr_areas=8)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        self.assertEqual([area.area_id for area in dms[0]], list(range(8)))
+        # Areas that are retained are not re-used by the iterator.
+        areas = list(dms[0])
+        self.assertEqual([area.area_id for area in areas], list(range(8)))
+        it = iter(dms[0])
+        next(it)
+        dms.delete_region(0)
+        with self.assertRaises(LookupError):
+            next(it)
+
     #
     # Counter tests
     #
@@ -1486,4 +2146,694 @@ class DmpyTests(unittest.TestCase):
         self.assertEqual(type(dms[0][0].TOTAL_READ_NSECS), int)
         self.assertEqual(type(dms[0][0].TOTAL_WRITE_NSECS), int)
 
+
+    def test_dmstats_counters_buffer(self):
+        # Assert that DmStats.counters() exports a regions x areas x counters
+        # array of uint64 values that matches the per-area attributes.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=4, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate(self.program_id, dm.STATS_REGIONS_ALL)
+        view = memoryview(dms.counters())
+        self.assertEqual(view.format, "Q")
+        self.assertTrue(view.readonly)
+        self.assertEqual(view.shape, (1, 4, dm.STATS_NR_COUNTERS))
+        self.assertEqual(view[0, 3, dm.STATS_READS_COUNT],
+                         dms[0][3].READS_COUNT)
+        self.assertEqual(view[0, 0, dm.STATS_WRITE_SECTORS_COUNT],
+                         dms[0][0].WRITE_SECTORS_COUNT)
+
+    def test_dmstats_region_counters_buffer(self):
+        # Assert that DmStatsRegion.counters() exports an areas x counters
+        # array, and that counters() raises ValueError before populate().
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        with self.assertRaises(ValueError):
+            dms.counters()
+        dms.populate(self.program_id, dm.STATS_REGIONS_ALL)
+        counters = dms[0].counters()
+        self.assertEqual(counters.shape, (2, dm.STATS_NR_COUNTERS))
+        self.assertEqual(counters.region_ids, (0,))
+        self.assertEqual(counters.nr_areas, (2,))
+        self.assertEqual(memoryview(counters).tolist()[1][dm.STATS_IO_NSECS],
+                         dms[0][1].IO_NSECS)
+
+    def test_dmstats_counters_buffer_padded(self):
+        # Assert that regions with different numbers of areas are exported
+        # in one array padded to the largest area count with zeros.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=4, program_id=self.program_id)
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id,
+                      start=0, length=self.test_dev_size_sectors // 2)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate(self.program_id, dm.STATS_REGIONS_ALL)
+        counters = dms.counters()
+        self.assertEqual(counters.shape, (2, 4, dm.STATS_NR_COUNTERS))
+        self.assertEqual(counters.region_ids, (0, 1))
+        self.assertEqual(counters.nr_areas, (4, 2))
+        values = memoryview(counters).tolist()
+        self.assertEqual(values[1][1][dm.STATS_READ_NSECS],
+                         dms[1][1].READ_NSECS)
+        self.assertEqual(values[1][2], [0] * dm.STATS_NR_COUNTERS)
+        self.assertEqual(values[1][3], [0] * dm.STATS_NR_COUNTERS)
+
+    def test_dmstats_counters_single_region_populate(self):
+        # Assert that after populating a single region only that region's
+        # counters can be exported.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=1, program_id=self.program_id)
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        dms.populate(self.program_id, 1)
+        with self.assertRaises(ValueError):
+            dms.counters()
+        with self.assertRaises(ValueError):
+            dms[0].counters()
+        self.assertEqual(dms[1].counters().shape, (2, dm.STATS_NR_COUNTERS))
+
+    def test_dmstats_counters_region_id_hole(self):
+        # Assert that deleting region 0 of three does not drop the regions
+        # above the hole from the counter and metric exports.
+        import dmpy as dm
+        for i in range(3):
+            _create_stats(self.dmpytest0, nr_areas=2,
+                          program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        dms.delete_region(0)
+        dms.populate()
+        dms.set_sampling_interval(0.5)
+        self.assertEqual(dms.counters().region_ids, (1, 2))
+        self.assertEqual(dms.metrics(["UTILIZATION"]).shape, (2, 2, 1))
+        self.assertEqual(memoryview(dms.counters()).tolist()[1][1]
+                         [dm.STATS_READS_COUNT], dms[2][1].READS_COUNT)
+
+    def test_dmstats_metrics_buffer(self):
+        # Assert that metric snapshots match the per-area metric attributes.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate(self.program_id, dm.STATS_REGIONS_ALL)
+        dms.set_sampling_interval(0.5)
+        names = ["UTILIZATION", "THROUGHPUT", "AVERAGE_WAIT_TIME"]
+        metrics = dms.metrics(names)
+        self.assertEqual(metrics.shape, (1, 2, 3))
+        self.assertEqual(metrics.names, tuple(names))
+        self.assertEqual(memoryview(metrics).format, "d")
+        values = memoryview(metrics).tolist()
+        for area_id in range(2):
+            for i, name in enumerate(names):
+                self.assertEqual(values[0][area_id][i],
+                                 getattr(dms[0][area_id], name))
+        self.assertEqual(len(dms[0].metrics().names), 14)
+        with self.assertRaises(ValueError):
+            dms.metrics(["NO_SUCH_METRIC"])
+        with self.assertRaises(TypeError):
+            dms.metrics("UTILIZATION")
+
+    def test_dmstats_reduce_and_top_areas(self):
+        # Assert that region reductions and top_areas() agree with the
+        # values of the per-area counter and metric attributes.
+        import dmpy as dm
+        for i in range(2):
+            _create_stats(self.dmpytest0, nr_areas=4,
+                          program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        with self.assertRaises(ValueError):
+            dms.top_areas("READS_COUNT", 1)
+        dms.populate()
+        dms.set_sampling_interval(0.5)
+
+        region = dms[1]
+        reads = [area.READS_COUNT for area in region]
+        self.assertEqual(region.reduce("READS_COUNT"), sum(reads))
+        self.assertEqual(region.reduce(dm.STATS_READS_COUNT, "max")[1:],
+                         (reads.index(max(reads)), max(reads)))
+        self.assertEqual(region.reduce("READS_COUNT", op="min")[0], 1)
+        self.assertEqual(region.reduce("READS_COUNT", "min")[2], min(reads))
+        self.assertAlmostEqual(region.reduce("READS_PER_SEC"),
+                               sum(area.READS_PER_SEC for area in region))
+
+        values = sorted(((-area.WRITE_SECTORS_COUNT, r.region_id, area_id)
+                         for r in dms for area_id, area in enumerate(r)))
+        expected = [(r, a, -v) for (v, r, a) in values]
+        self.assertEqual(dms.top_areas("WRITE_SECTORS_COUNT", 3),
+                         expected[:3])
+        self.assertEqual(dms.top_areas("WRITE_SECTORS_COUNT", 100), expected)
+        self.assertEqual(dms.top_areas("WRITE_SECTORS_COUNT", 0), [])
+        top = dms.top_areas("UTILIZATION", 2)
+        self.assertEqual(len(top), 2)
+        self.assertEqual(top[0][2], getattr(dms[top[0][0]][top[0][1]],
+                                            "UTILIZATION"))
+        self.assertTrue(top[0][2] >= top[1][2])
+
+        with self.assertRaises(ValueError):
+            region.reduce("NO_SUCH_COUNTER")
+        with self.assertRaises(ValueError):
+            region.reduce("READS_COUNT", "avg")
+        with self.assertRaises(ValueError):
+            dms.top_areas("READS_COUNT", -1)
+        with self.assertRaises(TypeError):
+            dms.top_areas(None, 1)
+
+    def test_dmstats_heatmap(self):
+        # Assert that heat map buckets agree with the per-area values, and
+        # that parallel and serial heat maps of several regions match.
+        import dmpy as dm
+        for i in range(2):
+            _create_stats(self.dmpytest0, nr_areas=4,
+                          program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        with self.assertRaises(ValueError):
+            dms.heatmap(0, "READS_COUNT", 2)
+        dms.populate()
+
+        region = dms[1]
+        writes = [area.WRITE_SECTORS_COUNT for area in region]
+        hm = region.heatmap("WRITE_SECTORS_COUNT", 1)
+        self.assertEqual(hm.shape, (1, 1))
+        self.assertEqual(hm.names, ("WRITE_SECTORS_COUNT",))
+        self.assertEqual(memoryview(hm)[0, 0], sum(writes))
+        hm = region.heatmap(dm.STATS_WRITE_SECTORS_COUNT, 1, op="max")
+        self.assertEqual(hm.names, ("WRITE_SECTORS_COUNT",))
+        self.assertEqual(memoryview(hm)[0, 0], max(writes))
+        view = memoryview(region.heatmap("WRITE_SECTORS_COUNT", 3))
+        self.assertAlmostEqual(sum(view[b, 0] for b in range(3)),
+                               sum(writes))
+        view = memoryview(region.heatmap("WRITE_SECTORS_COUNT", 2, "mean"))
+        self.assertTrue(min(writes) <= view[0, 0] <= max(writes))
+
+        hm = dms.heatmap(None, "READS_COUNT", 16, workers=2)
+        self.assertEqual(hm.shape, (2, 16, 1))
+        self.assertEqual(hm.region_ids, (0, 1))
+        self.assertEqual(hm.nr_areas, (16, 16))
+        self.assertEqual(memoryview(hm).tolist(),
+                         memoryview(dms.heatmap([0, 1], "READS_COUNT",
+                                                16)).tolist())
+        self.assertEqual(memoryview(hm).tolist()[1],
+                         memoryview(dms.heatmap(1, "READS_COUNT",
+                                                16)).tolist())
+
+        with self.assertRaises(ValueError):
+            dms.heatmap(0, "READS_COUNT", 0)
+        with self.assertRaises(ValueError):
+            dms.heatmap(0, "READS_COUNT", 2, op="avg")
+        with self.assertRaises(ValueError):
+            dms.heatmap(0, "READS_COUNT", 2, workers=0)
+        with self.assertRaises(IndexError):
+            dms.heatmap([0, 7], "READS_COUNT", 2)
+
+    def test_dmstats_sampler_ring(self):
+        # Assert that a DmStatsSampler publishes counter snapshots that a
+        # DmStatsRing can read, that the sampled DmStats is busy while the
+        # sampler runs, and that it holds the last sample when stopped.
+        import dmpy as dm
+        from os import close
+        from tempfile import mkstemp
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        with self.assertRaises(ValueError):
+            dm.DmStatsSampler(dms, "/dev/null")
+        dms.set_sampling_interval(0.01)
+
+        (fd, path) = mkstemp(prefix="dmpyring")
+        close(fd)
+        try:
+            sampler = dm.DmStatsSampler(dms, path, nr_slots=4)
+            ring = dm.DmStatsRing(path)
+            self.assertEqual(ring.region_ids, (0,))
+            self.assertEqual(ring.nr_areas, (2,))
+            self.assertEqual(ring.nr_slots, 4)
+            self.assertIsNone(ring.latest())
+            self.assertFalse(ring.running)
+
+            sampler.start()
+            self.assertTrue(ring.running)
+            with self.assertRaises(RuntimeError):
+                dms.populate()
+            with self.assertRaises(RuntimeError):
+                sampler.start()
+            while ring.nr_samples < 6:
+                sleep(0.01)
+            sampler.stop()
+            self.assertFalse(ring.running)
+
+            nr_samples = ring.nr_samples
+            self.assertEqual(sampler.nr_samples, nr_samples)
+            (number, timestamp, interval, counters) = ring.latest()
+            self.assertEqual(number, nr_samples - 1)
+            self.assertTrue(interval > 0)
+            self.assertEqual(counters.shape, (1, 2, dm.STATS_NR_COUNTERS))
+            self.assertEqual(memoryview(counters).tolist(),
+                             memoryview(dms.counters()).tolist())
+            self.assertEqual(ring.read(number - 3)[0], number - 3)
+            with self.assertRaises(IndexError):
+                ring.read(number - 4)
+            with self.assertRaises(IndexError):
+                ring.read(number + 1)
+
+            # A new sampler on the path leaves the mapped ring intact.
+            resampler = dm.DmStatsSampler(dms, path, nr_slots=2)
+            self.assertEqual(ring.latest()[0], number)
+            self.assertEqual(dm.DmStatsRing(path).nr_slots, 2)
+            resampler.close()
+
+            sampler.close()
+            ring.close()
+            with self.assertRaises(ValueError):
+                ring.latest()
+            with self.assertRaises(ValueError):
+                dm.DmStatsRing("/dev/null")
+        finally:
+            unlink(path)
+
+    def test_dmstats_snapshot_bytes(self):
+        # Assert that a DmStatsSnapshot read from DmStats.to_bytes() has
+        # the layout, strings and counters of the live object, and that
+        # snapshots appended to a history file can be mapped in turn.
+        import dmpy as dm
+        from os import close, write
+        from tempfile import mkstemp
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id,
+                      aux_data="snapaux")
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        with self.assertRaises(ValueError):
+            dms.to_bytes()
+        dms.set_sampling_interval(1.0)
+        dms.populate()
+
+        data = dms.to_bytes()
+        snap = dm.DmStatsSnapshot.from_bytes(data)
+        self.assertEqual(snap.size, len(data))
+        self.assertEqual(snap.interval, 1.0)
+        self.assertEqual(len(snap), len(dms))
+        self.assertEqual(snap.nr_regions, 1)
+        self.assertEqual(snap.nr_areas, 2)
+        self.assertEqual(snap.to_bytes(), data)
+        self.assertEqual(memoryview(snap.counters()).tolist(),
+                         memoryview(dms.counters()).tolist())
+
+        (region, live) = (snap[0], dms[0])
+        self.assertEqual(region.region_id, 0)
+        for attr in ["nr_areas", "start", "len", "area_len", "program_id",
+                     "aux_data", "precise_timestamps"]:
+            self.assertEqual(getattr(region, attr), getattr(live, attr))
+        self.assertIsNone(region.group_id)
+        self.assertEqual(memoryview(region.counters()).tolist(),
+                         memoryview(live.counters()).tolist())
+        for area_id in range(region.nr_areas):
+            (area, live_area) = (region[area_id], live[area_id])
+            self.assertEqual(area.area_id, area_id)
+            self.assertEqual(area.start, live_area.start)
+            self.assertEqual(area.offset, live_area.offset)
+            self.assertEqual(area.READS_COUNT, live_area.READS_COUNT)
+            self.assertEqual(area.UTILIZATION, live_area.UTILIZATION)
+            for name in live.metrics().names:
+                self.assertEqual(getattr(area, name),
+                                 getattr(live_area, name))
+            self.assertEqual(area.region.region_id, 0)
+        with self.assertRaises(IndexError):
+            region[2]
+
+        # An unaligned buffer is copied before it is read.
+        snap = dm.DmStatsSnapshot.from_bytes(memoryview(b"x" + data)[1:])
+        self.assertEqual(snap[0].aux_data, "snapaux")
+
+        for bad in [b"", data[:-8], b"\0" * 8 + data[8:]]:
+            with self.assertRaises(ValueError):
+                dm.DmStatsSnapshot.from_bytes(bad)
+        with self.assertRaises(ValueError):
+            len(dm.DmStatsSnapshot())
+
+        (fd, path) = mkstemp(prefix="dmpysnap")
+        try:
+            write(fd, data)
+            dms.populate()
+            write(fd, dms.to_bytes())
+            close(fd)
+            offset = 0
+            snaps = []
+            while offset < stat(path).st_size:
+                snaps.append(dm.DmStatsSnapshot.from_mmap(path, offset))
+                offset += snaps[-1].size
+            self.assertEqual(len(snaps), 2)
+            self.assertEqual(snaps[0].to_bytes(), data)
+            self.assertTrue(snaps[1].timestamp_ns >= snaps[0].timestamp_ns)
+            with self.assertRaises(ValueError):
+                dm.DmStatsSnapshot.from_mmap(path, 4)
+        finally:
+            unlink(path)
+
+    def test_dmstats_snapshot_bytes_region_id_hole(self):
+        # Assert that a snapshot of a table with a deleted region keeps the
+        # region_ids above the hole.
+        import dmpy as dm
+        for i in range(3):
+            _create_stats(self.dmpytest0, nr_areas=2,
+                          program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        dms.delete_region(0)
+        dms.set_sampling_interval(1.0)
+        dms.populate()
+
+        data = dms.to_bytes()
+        snap = dm.DmStatsSnapshot.from_bytes(data)
+        self.assertEqual(snap.to_bytes(), data)
+        self.assertEqual(snap.nr_regions, 2)
+        self.assertEqual(len(snap), 3)
+        self.assertIsNone(snap[0])
+        self.assertEqual(snap[2].region_id, 2)
+        self.assertEqual(memoryview(snap[2].counters()).tolist(),
+                         memoryview(dms[2].counters()).tolist())
+
+        # nr_region_ids must be one more than the last region_id present.
+        from struct import pack
+        for nr_region_ids in [2, 4, 1 << 63]:
+            with self.assertRaises(ValueError):
+                dm.DmStatsSnapshot.from_bytes(
+                    data[:48] + pack("=Q", nr_region_ids) + data[56:])
+
+    def test_dmstats_render_openmetrics(self):
+        # Assert that render_openmetrics() writes one family per selected
+        # value with escaped labels, and that per_region sums the areas.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        with self.assertRaises(ValueError):
+            dms.render_openmetrics()
+        dms.populate()
+
+        text = dms.render_openmetrics().decode("utf8")
+        lines = text.splitlines()
+        self.assertEqual(lines[-1], "# EOF")
+        self.assertEqual(lines[0], "# TYPE dmstats_reads_count counter")
+        families = [l for l in lines if l.startswith("# TYPE")]
+        self.assertEqual(len(families), dm.STATS_NR_COUNTERS)
+        self.assertTrue("# TYPE dmstats_io_in_progress_count gauge" in lines)
+        self.assertEqual(lines[1], 'dmstats_reads_count_total{program_id="%s"'
+                         ',region_id="0",area_id="0"} %d'
+                         % (self.program_id, dms[0][0].READS_COUNT))
+
+        dms.set_sampling_interval(1.0)
+        text = dms.render_openmetrics(
+            prefix="dm_", labels={"dev": 'a"b\\c\nd'},
+            include_metrics=["WRITES_COUNT", dm.STATS_READS_COUNT,
+                             "UTILIZATION"],
+            per_region=True).decode("utf8")
+        lines = text.splitlines()
+        self.assertEqual(len(lines), 7)
+        self.assertEqual(lines[0], "# TYPE dm_writes_count counter")
+        writes = sum(area.WRITES_COUNT for area in dms[0])
+        self.assertEqual(lines[1], 'dm_writes_count_total{dev="a\\"b\\\\c'
+                         '\\nd",program_id="%s",region_id="0"} %d'
+                         % (self.program_id, writes))
+        self.assertEqual(lines[4], "# TYPE dm_utilization gauge")
+        self.assertTrue(lines[5].startswith("dm_utilization{"))
+        float(lines[5].split()[-1])
+
+        with self.assertRaises(ValueError):
+            dms.render_openmetrics(include_metrics=["NOT_A_COUNTER"])
+        with self.assertRaises(ValueError):
+            dms.render_openmetrics(labels={"bad-name": "x"})
+        with self.assertRaises(TypeError):
+            dms.render_openmetrics(labels={"dev": 1})
+        with self.assertRaises(ValueError):
+            dms.render_openmetrics(prefix="9bad")
+
+    def test_stats_populate_region_ids(self):
+        # Assert that populate(region_ids=) and populate(group_id=) read
+        # only the selected regions and report the number of regions read.
+        import dmpy as dm
+        for i in range(3):
+            _create_stats(self.dmpytest0, nr_areas=2,
+                          program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.populate()
+        self.assertEqual(dms.populate_nr_regions, 3)
+        self.assertTrue(dms.populate_time >= 0)
+        region0 = dms[0]
+
+        dms.populate(region_ids=[0, 2])
+        self.assertEqual(dms.populate_nr_regions, 2)
+        self.assertIs(dms[0], region0)
+        self.assertTrue(region0[1].READS_COUNT >= 0)
+        self.assertTrue(dms[2][0].READS_COUNT >= 0)
+        with self.assertRaises(ValueError):
+            dms[1][0].READS_COUNT
+        with self.assertRaises(IndexError):
+            dms.populate(region_ids=[0, 3])
+        with self.assertRaises(TypeError):
+            dms.populate(region_id=0, region_ids=[0])
+
+        group_id = dms.create_group([1, 2])
+        dms.populate(group_id=group_id)
+        self.assertEqual(dms.populate_nr_regions, 2)
+        reads = sum(area.READS_COUNT for r in (1, 2) for area in dms[r])
+        counters = memoryview(dms.group(group_id).counters()).tolist()
+        self.assertEqual(counters[0][dm.STATS_READS_COUNT], reads)
+        with self.assertRaises(ValueError):
+            dms[0][0].READS_COUNT
+        with self.assertRaises(IndexError):
+            dms.populate(group_id=0)
+
+    def test_dmstats_group_counters(self):
+        # Assert that group counters are the sum of the member regions.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        _create_stats(self.dmpytest0, nr_areas=3, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list(self.program_id)
+        group_id = dms.create_group([0, 1], alias="dmpygroup0")
+        self.assertEqual(group_id, 0)
+        self.assertTrue(dms.group_present(group_id))
+        group = dms.group(group_id)
+        self.assertEqual(group.members, (0, 1))
+        self.assertEqual(group.alias, "dmpygroup0")
+        self.assertEqual(len(group), 2)
+        self.assertEqual(group[1].region_id, 1)
+        self.assertEqual([g.group_id for g in dms.groups()], [group_id])
+
+        dms.populate(self.program_id)
+        group = dms.group(group_id)
+        totals = [0] * dm.STATS_NR_COUNTERS
+        for region in memoryview(dms.counters()).tolist():
+            for area in region:
+                for c, value in enumerate(area):
+                    totals[c] += value
+        counters = group.counters()
+        self.assertEqual(counters.shape, (1, dm.STATS_NR_COUNTERS))
+        self.assertEqual(memoryview(counters).tolist(), [totals])
+        with self.assertRaises(ValueError):
+            group.metrics()
+        dms.set_sampling_interval(1.0)
+        metrics = group.metrics(["READS_PER_SEC"])
+        self.assertEqual(memoryview(metrics).tolist(),
+                         [[float(totals[dm.STATS_READS_COUNT])]])
+
+        group.alias = "dmpygroup1"
+        self.assertEqual(dms.group(group_id).alias, "dmpygroup1")
+        group.ungroup()
+        self.assertFalse(dms.group_present(group_id))
+        self.assertFalse(group.present)
+        with self.assertRaises(LookupError):
+            group.counters()
+        with self.assertRaises(IndexError):
+            dms.group(group_id)
+
+    def test_dmhistogram_bounds(self):
+        import dmpy as dm
+        hist = dm.DmHistogram("1ms,10ms")
+        self.assertEqual(hist.bounds, (1000000, 10000000))
+        self.assertEqual(len(hist), 3)
+        self.assertEqual(memoryview(hist).tolist()[2][dm.HISTOGRAM_LOWER],
+                         10000000)
+        self.assertEqual(dm.DmHistogram([1000, 2000]).bounds, (1000, 2000))
+        self.assertEqual(dm.DmHistogram(hist).bounds, hist.bounds)
+        self.assertEqual(hist.sum, 0)
+        self.assertEqual(hist.percentile(99), 0.0)
+        with self.assertRaises(ValueError):
+            dm.DmHistogram([2000, 1000])
+        with self.assertRaises(ValueError):
+            dm.DmHistogram("quux")
+        with self.assertRaises(ValueError):
+            hist.percentile(101)
+
+    def test_dmstats_create_region_histogram(self):
+        import dmpy as dm
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.create_region(0, 0, -2, bounds="1ms,10ms,100ms",
+                          program_id=self.program_id)
+        dms.create_region(0, 0, -1, bounds=None, program_id=self.program_id)
+        _get_cmd_output("dd if=/dev/mapper/%s of=/dev/null bs=4k count=8 "
+                        "iflag=direct" % self.dmpytest0)
+        dms.populate(self.program_id, dm.STATS_REGIONS_ALL)
+        self.assertIsNone(dms[1].histogram)
+        region = dms[0].histogram
+        self.assertEqual(region.bounds, (1000000, 10000000, 100000000))
+        areas = [dms[0][0].histogram, dms[0][1].histogram]
+        self.assertEqual(region.counts,
+                         tuple(a + b for a, b in zip(areas[0].counts,
+                                                     areas[1].counts)))
+        p = region.percentiles((50, 99, 99.9))
+        self.assertEqual(len(p), 3)
+        self.assertTrue(p[0] <= p[1] <= p[2])
+
+    def test_dmstats_group_histogram_metrics(self):
+        # Assert that group histograms are the sum of the member region
+        # histograms, and that group metrics use the library definitions.
+        import dmpy as dm
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        half = self.test_dev_size_sectors // 2
+        for i in range(2):
+            dms.create_region(i * half, half, -1, bounds="1ms,10ms",
+                              program_id=self.program_id)
+        dms.list(self.program_id)
+        group_id = dms.create_group([0, 1])
+        _get_cmd_output("dd if=/dev/mapper/%s of=/dev/null bs=4k count=8 "
+                        "iflag=direct" % self.dmpytest0)
+        dms.populate(self.program_id)
+        hists = [dms[0].histogram, dms[1].histogram]
+        group = dms.group(group_id)
+        self.assertEqual(group.histogram.bounds, hists[0].bounds)
+        self.assertEqual(group.histogram.counts,
+                         tuple(a + b for a, b in zip(hists[0].counts,
+                                                     hists[1].counts)))
+        self.assertEqual(group.histogram.sum, hists[0].sum + hists[1].sum)
+
+        group.ungroup()
+        group_id = dms.create_group([1])
+        dms.populate(self.program_id)
+        dms.set_sampling_interval(0.5)
+        metrics = dms.group(group_id).metrics()
+        values = memoryview(metrics).tolist()[0]
+        for i, name in enumerate(metrics.names):
+            self.assertEqual(values[i], getattr(dms[1][0], name))
+
+    def test_dmstats_create_delete_regions(self):
+        # Assert that bulk creates and deletes report a result for each
+        # region, and that the region table is read back for the creates.
+        import dmpy as dm
+        from array import array
+        from errno import ENOENT
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        self.assertEqual(dms.create_regions([(0, 8), (8, 8, 4)],
+                                            program_id=self.program_id),
+                         [(0, 0), (0, 1)])
+        packed = array("Q", [16, 8, 24, 8])
+        self.assertEqual(dms.create_regions(packed, step=2,
+                                            program_id=self.program_id),
+                         [(0, 2), (0, 3)])
+        self.assertEqual([r.nr_areas for r in dms], [1, 2, 4, 4])
+        self.assertEqual(dms.create_regions([]), [])
+
+        # The table is read back for the program_id of the new regions.
+        other = dm.DmStats(self.program_id + "x", name=self.dmpytest0)
+        self.assertEqual(other.create_regions([(32, 8)],
+                                              program_id=self.program_id),
+                         [(0, 4)])
+        self.assertEqual(other[4].program_id, self.program_id)
+
+        region = dms[0]
+        self.assertEqual(dms.delete_regions([0, 2, 7]), [0, 0, ENOENT])
+        self.assertEqual(dms.delete_regions(array("Q", [1])), [0])
+        self.assertFalse(dms.region_present(0))
+        self.assertTrue(dms.region_present(3))
+        with self.assertRaises(LookupError):
+            region.nr_areas
+
+        with self.assertRaises(TypeError):
+            dms.create_regions([(0,)])
+        with self.assertRaises(ValueError):
+            dms.create_regions(b"\0" * 8)
+        with self.assertRaises(TypeError):
+            dms.delete_regions(None)
+
+    def test_dmstats_sample_deltas(self):
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        first = dms.sample()
+        self.assertEqual(first.interval, 0.0)
+        with self.assertRaises(ValueError):
+            first.rates()
+        before = memoryview(first).tolist()
+        _get_cmd_output("dd if=/dev/mapper/%s of=/dev/null bs=4k count=8 "
+                        "iflag=direct" % self.dmpytest0)
+        second = dms.sample()
+        self.assertTrue(second.interval > 0.0)
+        after = memoryview(dms.counters()).tolist()
+        deltas = memoryview(second).tolist()
+        reads = dm.STATS_READS_COUNT
+        for area_id in range(2):
+            self.assertEqual(deltas[0][area_id][reads],
+                             after[0][area_id][reads]
+                             - before[0][area_id][reads])
+        rates = second.rates()
+        self.assertEqual(rates.names[reads], "READS_COUNT")
+        self.assertEqual(memoryview(rates).tolist()[0][0][reads],
+                         deltas[0][0][reads] / second.interval)
+
+    def test_dmstats_sample_recreated_region(self):
+        # Assert that a re-created region is reported from zero.
+        import dmpy as dm
+        _create_stats(self.dmpytest0, nr_areas=2, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.sample()
+        _remove_all_stats(self.dmpytest0)
+        _create_stats(self.dmpytest0, nr_areas=4, program_id=self.program_id)
+        deltas = dms.sample()
+        self.assertEqual(deltas.shape, (1, 4, dm.STATS_NR_COUNTERS))
+        self.assertEqual(memoryview(deltas).tolist(),
+                         memoryview(dms.counters()).tolist())
+
+    def test_dmstats_cache_threads(self):
+        # Assert that regions and areas indexed concurrently from several
+        # threads are the cached objects, while INFO tasks run alongside.
+        import dmpy as dm
+        import threading
+        _create_stats(self.dmpytest0, nr_areas=4, program_id=self.program_id)
+        dms = dm.DmStats(self.program_id, name=self.dmpytest0)
+        dms.list()
+        errors = []
+        seen = []
+
+        def _index():
+            try:
+                for i in range(64):
+                    region = dms[0]
+                    seen.append((region, region[i % 4]))
+                    dmt = dm.DmTask(dm.DM_DEVICE_INFO)
+                    dmt.set_name(self.dmpytest0)
+                    dmt.run()
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=_index) for i in range(8)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(len(seen), 512)
+        self.assertEqual(set(id(r) for r, a in seen), set([id(dms[0])]))
+        for region, area in seen:
+            self.assertTrue(area is region[area.area_id])
+
+    def test_subinterpreter_import(self):
+        # Assert that dmpy can be imported by a sub-interpreter.
+        import dmpy as dm
+        try:
+            from _testcapi import run_in_subinterp
+        except ImportError:
+            self.skipTest("run_in_subinterp() is not available.")
+        from os.path import dirname
+        code = ("import sys; sys.path.insert(0, %r); import dmpy; "
+                "dmpy.DmTimestamp(); dmpy.DmTask(dmpy.DM_DEVICE_VERSION)"
+                % dirname(dm.__file__))
+        self.assertEqual(run_in_subinterp(code), 0)
+
 # vim: set et ts=4 sw=4 :